@@ -14,6 +14,9 @@ else
 		linux* | Linux*)
 			HOST_OS=Linux
 			echo "#define USE_EPOLL_HANDLER" > ./src/configure.h
+			if grep -q IORING_RECV_MULTISHOT /usr/include/linux/io_uring.h 2>/dev/null; then
+				echo "#define USE_URING_HANDLER" >> ./src/configure.h
+			fi
 			echo "LINUX_BUILD = 1" > ./modules/platform.mk;;
 		Darwin*)
 			HOST_OS=Darwin
@@ -33,5 +36,21 @@ else
 	fi
 	#echo "STAGING_DEBUG=1" > build.mk
 	echo "STAGING_RELEASE=1" > build.mk
+	
+	if [ -e "/usr/include/openssl/ssl.h" ]
+	then
+		echo "HAS_SSL = 1" >> build.mk
+		echo "#define _USE_SSL 1" >> ./src/configure.h
+	else
+		echo "#undef _USE_SSL" >> ./src/configure.h
+	fi
+
+	if [ -e "/usr/include/zlib.h" ]
+	then
+		echo "HAS_ZLIB = 1" >> build.mk
+		echo "#define _USE_ZLIB 1" >> ./src/configure.h
+	else
+		echo "#undef _USE_ZLIB" >> ./src/configure.h
+	fi
 	make
 fi
\ No newline at end of file
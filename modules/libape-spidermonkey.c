@@ -374,6 +374,9 @@ APE_JS_NATIVE(apesocket_write)
 	
 	JS_free(cx, cstring);
 	
+	/* false : the peer is slow, wait for onDrain */
+	JS_SET_RVAL(cx, vpn, (sock_writable(client->fd, g_ape) ? JSVAL_TRUE : JSVAL_FALSE));
+	
 	return JS_TRUE;
 }
 
@@ -385,6 +388,7 @@ APE_JS_NATIVE(apesocket_write)
  * @public
  *
  * @param {string} data The data to write.
+ * @returns {boolean} false if the data has been queued over the high watermark (wait for onDrain before writing again)
  *
  * @example
  * var socket = new Ape.sockClient('21', 'example.com', {flushlf: true} );
@@ -423,6 +427,9 @@ APE_JS_NATIVE(apesocketclient_write)
 	
 	JS_free(cx, cstring);
 	
+	/* false : the peer is slow, wait for onDrain */
+	JS_SET_RVAL(cx, vpn, (sock_writable(client->fd, g_ape) ? JSVAL_TRUE : JSVAL_FALSE));
+	
 	return JS_TRUE;
 }
 
@@ -1038,24 +1045,30 @@ static JSBool sm_send_raw(JSContext *cx, transpipe *to_pipe, int chl, uintN argc
 		transpipe *from_pipe = JS_GetPrivate(cx, js_pipe);
 		
 		if (from_pipe != NULL && from_pipe->type == USER_PIPE) {
-			json_set_property_objN(jstr, "from", 4, get_json_object_pipe(from_pipe));
+			json_set_property_objN(jstr, "from", 4, get_json_object_pipe_cache(from_pipe));
 			
 			if (to_pipe->type == USER_PIPE) {
-				json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe(from_pipe));
+				json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe_cache(from_pipe));
 			} else if (to_pipe->type == CHANNEL_PIPE) {
 				json_item *jcopy = json_item_copy(jstr, NULL);
-				if (((CHANNEL*)to_pipe->pipe)->head != NULL && ((CHANNEL*)to_pipe->pipe)->head->next != NULL) {
+				if ((((CHANNEL*)to_pipe->pipe)->head != NULL && ((CHANNEL*)to_pipe->pipe)->head->next != NULL) || cluster_subscribed(to_pipe->pipe, g_ape)) {
 					
-					json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe(to_pipe));
+					json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe_cache(to_pipe));
 				
 					newraw = forge_raw(craw, jstr);
+
+					/* Held : the members may all be on other nodes */
+					newraw->refcount = 1;
 					post_raw_channel_restricted(newraw, to_pipe->pipe, from_pipe->pipe, g_ape);
+					free_raw(newraw);
+				} else {
+					free_json_item(jstr);
 				}
 				if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &subuser_class, 0) == JS_TRUE) {
 					JSObject *subjs = JSVAL_TO_OBJECT(vp);
 					subuser *sub = JS_GetPrivate(cx, subjs);
 					if (sub != NULL && ((USERS *)from_pipe->pipe)->nsub > 1) {
-						json_set_property_objN(jcopy, "pipe", 4, get_json_object_pipe(to_pipe));
+						json_set_property_objN(jcopy, "pipe", 4, get_json_object_pipe_cache(to_pipe));
 						newraw = forge_raw(craw, jcopy);
 						post_raw_restricted(newraw, from_pipe->pipe, sub, g_ape);
 					} else {
@@ -1070,7 +1083,7 @@ static JSBool sm_send_raw(JSContext *cx, transpipe *to_pipe, int chl, uintN argc
 				return JS_TRUE;
 			}
 		} else if (from_pipe != NULL && from_pipe->type == CUSTOM_PIPE) {
-			json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe(from_pipe));
+			json_set_property_objN(jstr, "pipe", 4, get_json_object_pipe_cache(from_pipe));
 		}
 	}
 
@@ -1080,7 +1093,7 @@ static JSBool sm_send_raw(JSContext *cx, transpipe *to_pipe, int chl, uintN argc
 		json_set_property_intN(jstr, "chl", 3, chl);
 	}
 	
-	if (to_pipe->type == CHANNEL_PIPE && ((struct CHANNEL *)to_pipe->pipe)->head != NULL) {
+	if (to_pipe->type == CHANNEL_PIPE && (((struct CHANNEL *)to_pipe->pipe)->head != NULL || cluster_subscribed(to_pipe->pipe, g_ape))) {
 		if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &user_class, 0) == JS_TRUE) {
 			JSObject *userjs = JSVAL_TO_OBJECT(vp);
 			USERS *user = JS_GetPrivate(cx, userjs);
@@ -1091,13 +1104,21 @@ static JSBool sm_send_raw(JSContext *cx, transpipe *to_pipe, int chl, uintN argc
 				JS_free(cx, craw);
 				return JS_TRUE;
 			}
+			newraw = forge_raw(craw, jstr);
 
-			post_raw_channel_restricted(forge_raw(craw, jstr), to_pipe->pipe, user, g_ape);
+			/* Held : the members may all be on other nodes */
+			newraw->refcount = 1;
+			post_raw_channel_restricted(newraw, to_pipe->pipe, user, g_ape);
+			free_raw(newraw);
 			
 			JS_free(cx, craw);
 			return JS_TRUE;
 		}
-		post_raw_channel(forge_raw(craw, jstr), to_pipe->pipe, g_ape);
+		newraw = forge_raw(craw, jstr);
+
+		newraw->refcount = 1;
+		post_raw_channel(newraw, to_pipe->pipe, g_ape);
+		free_raw(newraw);
 	} else if (to_pipe->type != CHANNEL_PIPE) {
 		if (options != NULL && JS_GetProperty(cx, options, "restrict", &vp) && JSVAL_IS_OBJECT(vp) && JS_InstanceOf(cx, JSVAL_TO_OBJECT(vp), &subuser_class, 0) == JS_TRUE) {
 			JSObject *subjs = JSVAL_TO_OBJECT(vp);
@@ -2414,6 +2435,65 @@ static void sm_sock_onconnect(ape_socket *client, acetables *g_ape)
 	}
 }
 
+/**
+ * Trigger a event when the data queued for a slow peer went back under the low watermark.
+ * Writing can be resumed once write() returned false.
+ *
+ * @name Ape.sockClient.onDrain
+ * @event
+ * @public
+ *
+ * @returns {void}
+ *
+ * @example
+ * socket.onDrain = function() {
+ * 	while (this.write(next_chunk()));
+ * }
+ *
+ * @see Ape.sockClient
+ * @see Ape.sockClient.write
+ */
+
+/**
+ * Trigger a event when the data queued for a slow client went back under the low watermark.
+ *
+ * @name Ape.sockServer.onDrain
+ * @event
+ * @public
+ *
+ * @param {sockClient} [client] The client that can be written again
+ * @returns {void}
+ *
+ * @example
+ * socket.onDrain = function(client) {
+ * 	Ape.log('Client ready for more data');
+ * }
+ *
+ * @see Ape.sockClient
+ * @see Ape.sockServer
+ */
+static void sm_sock_ondrain(ape_socket *client, acetables *g_ape)
+{
+	jsval rval;
+	
+	if (client->attach != NULL) {
+		struct _ape_sock_callbacks *cb = ((struct _ape_sock_callbacks *)client->attach);
+		JSObject *client_obj = ((struct _ape_sock_js_obj *)cb->private)->client_obj;
+		
+		if (!cb->state) {
+			return;
+		}
+		if (client_obj != NULL) {
+			jsval params[1];
+			params[0] = OBJECT_TO_JSVAL(client_obj);
+			
+			JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onDrain", 1, params, &rval);
+		} else {
+			JS_CallFunctionName(cb->asc->cx, cb->server_obj, "onDrain", 0, NULL, &rval);
+		}
+	}
+}
+
 static void sm_sock_onread(ape_socket *client, ape_buffer *buf, size_t offset, acetables *g_ape)
 {
 	jsval rval;
@@ -3550,12 +3630,12 @@ APE_JS_NATIVE(ape_sm_adduser)
 	if (u->cmdqueue != NULL) {
 		unsigned int ret;
 		json_item *queue;
-		struct _cmd_process pc = {NULL, u, u->subuser, u->subuser->client, NULL, NULL, 0};
+		struct _cmd_process pc = {NULL, u, u->subuser, sock_from_handle(u->subuser->client, g_ape), NULL, NULL, 0};
 		
 		for (queue = u->cmdqueue; queue != NULL; queue = queue->next) {
 			if ((ret = process_cmd(queue, &pc, NULL, g_ape)) != -1) {
-				if (ret == CONNECT_SHUTDOWN) {
-					shutdown(u->subuser->client->fd, 2);
+				if (ret == CONNECT_SHUTDOWN && pc.client != NULL) {
+					shutdown(pc.client->fd, 2);
 				}
 				break;
 			}
@@ -3742,6 +3822,58 @@ APE_JS_NATIVE(ape_sm_get_channel_by_pubid)
 	return JS_TRUE;
 }
 
+/**
+ * Send a raw to a pipe by its pubid, even if it lives on another node (cluster mode).
+ *
+ * @name Ape.sendRaw
+ * @function
+ * @public
+ *
+ * @param {string} pubid The pubid of an user or a channel
+ * @param {string} raw The raw name
+ * @param {object} data The raw data
+ * @returns {boolean} false if the pipe is unknown
+ *
+ * @example
+ * Ape.registerCmd('foocmd', true, function(params, info) {
+ * 	Ape.sendRaw(params.pubid, 'CUSTOM_RAW', {'foo': 'bar'});
+ * });
+ *
+ * @see Ape.pipe.sendRaw
+ * @see Ape.getPipe
+ */
+APE_JS_NATIVE(ape_sm_send_raw)
+//{
+	JSString *pubid, *raw;
+	JSObject *json_obj = NULL;
+	char *cpubid, *craw;
+	RAW *newraw;
+	
+	JS_SET_RVAL(cx, vpn, JSVAL_FALSE);
+	
+	if (!JS_ConvertArguments(cx, 3, JS_ARGV(cx, vpn), "SSo", &pubid, &raw, &json_obj) || json_obj == NULL) {
+		return JS_TRUE;
+	}
+	
+	cpubid = JS_EncodeString(cx, pubid);
+	craw = JS_EncodeString(cx, raw);
+	
+	newraw = forge_raw(craw, jsobj_to_ape_json(cx, json_obj));
+	
+	/* Held until every recipient has its reference */
+	newraw->refcount = 1;
+	
+	if (post_raw_pipe(newraw, cpubid, g_ape)) {
+		JS_SET_RVAL(cx, vpn, JSVAL_TRUE);
+	}
+	free_raw(newraw);
+	
+	JS_free(cx, craw);
+	JS_free(cx, cpubid);
+	
+	return JS_TRUE;
+}
+
 /**
  * Get a pipe object.
  *
@@ -4340,10 +4472,36 @@ APE_JS_NATIVE(ape_sm_echo)
  * @returns {object} status Object with status information,
  * @returns {integer} status.connected nr of connected users
  * @returns {boolean} status.daemon Running in deamon mode
+ * @returns {object} status.alloc Pooled allocations ({used, free, mallocs} for users, subusers, pipes, raws, buffers and hash)
+ * @returns {object} status.loop Event loop iterations and their processing time ({iterations, avg_us, max_us, last_us, pending})
  *
  * @example:var status = Ape.status();
  * 			Ape.log(JSON.stringify(status));
  */
+static void sm_pool_status(JSContext *cx, JSObject *alloc, ape_pool *pools, int npools)
+{
+	JSObject *elem = JS_NewObject(cx, NULL, NULL, NULL);
+	jsval val = OBJECT_TO_JSVAL(elem);
+	unsigned int used = 0, nfree = 0, nalloc = 0;
+	int i;
+	
+	/* Attached first, so that it's rooted */
+	JS_SetProperty(cx, alloc, pools[0].name, &val);
+	
+	for (i = 0; i < npools; i++) {
+		used += pools[i].nused;
+		nfree += pools[i].nfree;
+		nalloc += pools[i].nalloc;
+	}
+	
+	val = INT_TO_JSVAL(used);
+	JS_SetProperty(cx, elem, "used", &val);
+	val = INT_TO_JSVAL(nfree);
+	JS_SetProperty(cx, elem, "free", &val);
+	val = INT_TO_JSVAL(nalloc);
+	JS_SetProperty(cx, elem, "mallocs", &val);
+}
+
 APE_JS_NATIVE(ape_sm_status)
 //{
 	JSObject *elem = JS_NewObject(cx, NULL, NULL, NULL);
@@ -4352,8 +4510,35 @@ APE_JS_NATIVE(ape_sm_status)
 	jsval isDaemon = g_ape->is_daemon == 0 ? JSVAL_TRUE : JSVAL_FALSE;
 	JS_SetProperty(cx, elem, "connected", &connected);
 	JS_SetProperty(cx, elem, "isDaemon", &isDaemon);
+	
+	JSObject *alloc = JS_NewObject(cx, NULL, NULL, NULL);
+	jsval allocval = OBJECT_TO_JSVAL(alloc);
+	JS_SetProperty(cx, elem, "alloc", &allocval);
+	sm_pool_status(cx, alloc, &g_ape->pools->users, 1);
+	sm_pool_status(cx, alloc, &g_ape->pools->subusers, 1);
+	sm_pool_status(cx, alloc, &g_ape->pools->pipes, 1);
+	sm_pool_status(cx, alloc, g_ape->pools->raws, POOL_RAW_CLASSES);
+	sm_pool_status(cx, alloc, g_ape->pools->buffers, POOL_BUFFER_CLASSES);
+	sm_pool_status(cx, alloc, hashtbl_pool(), 1);
+	
+	JSObject *loop = JS_NewObject(cx, NULL, NULL, NULL);
+	jsval val = OBJECT_TO_JSVAL(loop);
+	JS_SetProperty(cx, elem, "loop", &val);
+	
+	JS_NewNumberValue(cx, (jsdouble)g_ape->loop.iterations, &val);
+	JS_SetProperty(cx, loop, "iterations", &val);
+	JS_NewNumberValue(cx, (g_ape->loop.iterations ? (jsdouble)g_ape->loop.total_us / g_ape->loop.iterations : 0), &val);
+	JS_SetProperty(cx, loop, "avg_us", &val);
+	JS_NewNumberValue(cx, (jsdouble)g_ape->loop.max_us, &val);
+	JS_SetProperty(cx, loop, "max_us", &val);
+	JS_NewNumberValue(cx, (jsdouble)g_ape->loop.last_us, &val);
+	JS_SetProperty(cx, loop, "last_us", &val);
+	val = INT_TO_JSVAL(g_ape->read.nfds);
+	JS_SetProperty(cx, loop, "pending", &val);
+	
 	jsval currentval = OBJECT_TO_JSVAL(elem);
 	JS_SET_RVAL(cx, vpn, currentval);
+	JS_RemoveObjectRoot(cx, &elem);
 	return JS_TRUE;
 }
 
@@ -4557,6 +4742,7 @@ APE_JS_NATIVE(ape_sm_sockclient_constructor)
 	pattern->callbacks.on_connect = sm_sock_onconnect;
 	pattern->callbacks.on_disconnect = sm_sock_ondisconnect;
 	pattern->callbacks.on_data_completly_sent = NULL;
+	pattern->callbacks.on_drain = sm_sock_ondrain;
 
 	if (options != NULL && JS_GetProperty(cx, options, "flushlf", &vp) && JSVAL_IS_BOOLEAN(vp) && JSVAL_TO_BOOLEAN(vp)) {
 		pattern->callbacks.on_read_lf = sm_sock_onread_lf;
@@ -5116,6 +5302,7 @@ APE_JS_NATIVE(ape_sm_sockserver_constructor)
 
 	server->callbacks.on_accept = sm_sock_onaccept;
 	server->callbacks.on_disconnect = sm_sock_ondisconnect;
+	server->callbacks.on_drain = sm_sock_ondrain;
 
 	/* store the ape_socket server in the js object */
 	JS_SetPrivate(cx, obj, server);
@@ -5187,6 +5374,7 @@ static JSFunctionSpec ape_funcs[] = {
 	JS_FS("registerHookCmd", ape_sm_hook_cmd, 2, 0),
 	JS_FS("log",  		ape_sm_echo,  		1, 0),/* Ape.echo('stdout\n'); */
 	JS_FS("getPipe", ape_sm_get_pipe, 1, 0),
+	JS_FS("sendRaw", ape_sm_send_raw, 3, 0),
 	JS_FS("getChannelByName", ape_sm_get_channel_by_name, 1, 0),
 	JS_FS("getUserByPubid", ape_sm_get_user_by_pubid, 1, 0),
 	JS_FS("getChannelByPubid", ape_sm_get_channel_by_pubid, 1, 0),
@@ -42,6 +42,8 @@
 #include "../src/log.h"
 #include "../src/dns.h"
 #include "../src/config.h"
+#include "../src/pool.h"
+#include "../src/cluster.h"
 
 #include <stdarg.h>
 
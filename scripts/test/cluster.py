@@ -0,0 +1,323 @@
+#!/usr/bin/env python3
+#
+# Cluster test (Cluster section, see src/cluster.c)
+#
+# Starts three aped nodes on one machine. The test itself plays a fourth
+# node ("probe") : it records everything the nodes send it and subscribes to
+# the test channel on each of them. Checks that :
+#
+#   - a node subscribes (CLUSTER_SUB) to a channel once, when it gets its
+#     first local member, and unsubscribes once the last one has left
+#   - a raw posted to a channel is sent once to each subscribed node, whatever
+#     its number of members, and every member receives it exactly once
+#   - channel pubids are the same on every node, user pubids and sessids start
+#     with the index of their node : raws for a user go to its node only
+#   - a session used on the wrong node is refused with the name of its node
+#
+#   scripts/test/cluster.py [--aped bin/aped] [--port 17000] [--backend io_uring]
+#
+# Exit status : 0 if everything was delivered as expected, 1 otherwise.
+
+import argparse
+import json
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from handoff import WebSocketClient, raw_data, request, wait_port
+
+NODES = "abc"
+CHANNEL = "room"
+PASSWORD = "cluster-test"
+MESSAGES = 20
+
+# cluster_msg_t
+CLUSTER_HELLO, CLUSTER_SUB, CLUSTER_UNSUB, CLUSTER_CHANNEL, CLUSTER_PIPE = range(5)
+
+CONFIG = """
+uid {
+	user = daemon
+	group = daemon
+}
+
+Server {
+	port = %(port)d
+	daemon = no
+	event_backend = %(backend)s
+	ip_listen = 127.0.0.1
+	domain = auto
+	rlimit_nofile = 10000
+	pid_file = %(dir)s/aped-%(node)s.pid
+}
+
+Cluster {
+	node = %(node)s
+	nodes = %(nodes)s
+	password = %(password)s
+}
+
+Log {
+	debug = 0
+	use_syslog = 0
+	syslog_facility = local2
+	logfile = %(dir)s/ape-%(node)s.log
+}
+
+JSONP {
+	eval_func = Ape.transport.read
+	allowed = 1
+}
+
+Config {
+	modules = %(dir)s/modules/
+	modules_conf = %(dir)s/modules/
+}
+"""
+
+
+def cluster_message(type, name, data=b""):
+	name = name.encode()
+	return struct.pack("!IBH", 3 + len(name) + len(data), type, len(name)) + name + data
+
+
+class Member(WebSocketClient):
+	"""WebSocket client keeping the DATA raws it receives"""
+	def __init__(self, node, port, name):
+		WebSocketClient.__init__(self, port, name, CHANNEL)
+		self.node = node
+		self.lock = threading.Lock()
+		self.data = []
+
+	def got(self, raws):
+		with self.lock:
+			self.errors += raw_data(raws, "ERR")
+			self.data += raw_data(raws, "DATA")
+
+	def messages(self, prefix):
+		with self.lock:
+			return [data["msg"] for data in self.data if data["msg"].startswith(prefix)]
+
+	def clear(self):
+		with self.lock:
+			self.data = []
+			self.errors = []
+
+
+class Probe(object):
+	"""Fake node : records the messages sent by the nodes, subscribes to channels on them"""
+	def __init__(self, port):
+		self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		self.server.bind(("127.0.0.1", port))
+		self.server.listen(16)
+		self.lock = threading.Lock()
+		self.received = [] # (node, type, name, msg)
+		self.out = []
+		thread = threading.Thread(target=self.accept)
+		thread.daemon = True
+		thread.start()
+
+	def accept(self):
+		while True:
+			sock = self.server.accept()[0]
+			thread = threading.Thread(target=self.read, args=(sock,))
+			thread.daemon = True
+			thread.start()
+
+	def read(self, sock):
+		node, buf = None, b""
+		while True:
+			chunk = sock.recv(65536)
+			if not chunk:
+				return
+			buf += chunk
+			while len(buf) >= 4 and len(buf) >= 4 + struct.unpack("!I", buf[:4])[0]:
+				size = struct.unpack("!I", buf[:4])[0]
+				msg, buf = buf[4:4 + size], buf[4 + size:]
+				type, name_len = struct.unpack("!BH", msg[:3])
+				name, data = msg[3:3 + name_len].decode(), msg[3 + name_len:]
+				if node is None and type == CLUSTER_HELLO:
+					node = name
+				if type in (CLUSTER_CHANNEL, CLUSTER_PIPE):
+					data = json.loads(data.decode())["data"].get("msg", "")
+				with self.lock:
+					self.received.append((node, type, name, data))
+
+	def subscribe(self, port, channel):
+		sock = socket.create_connection(("127.0.0.1", port), timeout=10)
+		sock.sendall(cluster_message(CLUSTER_HELLO, "probe", PASSWORD.encode()) + cluster_message(CLUSTER_SUB, channel))
+		self.out.append(sock)
+
+	def count(self, node, type, name=None, prefix=None):
+		with self.lock:
+			return len([1 for n, t, nm, data in self.received if n == node and t == type and
+				(name is None or nm == name) and (prefix is None or data.startswith(prefix))])
+
+
+def wait_for(cond, timeout=10):
+	end = time.time() + timeout
+	while time.time() < end:
+		if cond():
+			return True
+		time.sleep(0.05)
+	return cond()
+
+
+def main():
+	root = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+	parser = argparse.ArgumentParser(description="aped cluster test : three nodes on one machine")
+	parser.add_argument("--aped", default=os.path.join(root, "bin", "aped"))
+	parser.add_argument("--port", type=int, default=17000, help="first HTTP port, the nodes listen on port + 100 and up")
+	parser.add_argument("--backend", default="epoll", help="Server.event_backend")
+	args = parser.parse_args()
+
+	ports = dict((node, args.port + i) for i, node in enumerate(NODES))
+	cluster_ports = dict((node, args.port + 100 + i) for i, node in enumerate(NODES + "p"))
+	nodes = ", ".join("%s@127.0.0.1:%d" % (node, cluster_ports[node]) for node in NODES)
+	nodes += ", probe@127.0.0.1:%d" % cluster_ports["p"]
+
+	tmp = tempfile.mkdtemp(prefix="ape-cluster-")
+	os.chmod(tmp, 0o777)
+	os.mkdir(os.path.join(tmp, "modules"))
+
+	probe = Probe(cluster_ports["p"])
+	procs = {}
+	failures = []
+
+	def check(ok, failure):
+		if not ok:
+			failures.append(failure)
+		return ok
+
+	try:
+		for node in NODES:
+			conf = os.path.join(tmp, "ape-%s.conf" % node)
+			with open(conf, "w") as f:
+				f.write(CONFIG % {"port": ports[node], "dir": tmp, "backend": args.backend, "node": node, "nodes": nodes, "password": PASSWORD})
+			procs[node] = subprocess.Popen([args.aped, "--cfg", conf], stdout=open(os.path.join(tmp, "aped-%s.out" % node), "w"), stderr=subprocess.STDOUT)
+		for node in NODES:
+			if not wait_port(ports[node], procs[node]):
+				print("node %s did not start, see %s" % (node, tmp))
+				return 1
+		if not wait_for(lambda: all(probe.count(node, CLUSTER_HELLO) for node in NODES)):
+			print("the nodes did not connect to the probe, see %s" % tmp)
+			return 1
+		for node in NODES:
+			probe.subscribe(cluster_ports[node], CHANNEL)
+
+		# One member on a, three on b, two on c
+		members = [Member("a", ports["a"], "a1")]
+		members += [Member("b", ports["b"], "b%d" % i) for i in range(1, 4)]
+		members += [Member("c", ports["c"], "c%d" % i) for i in range(1, 3)]
+		for member in members:
+			thread = threading.Thread(target=member.run)
+			thread.daemon = True
+			thread.start()
+		a1, b1, b2, b3, c1, c2 = members
+
+		# Until every node is connected to the two others
+		def mesh():
+			for member in (a1, b1, c1):
+				member.send("SEND", {"pipe": member.pubid, "msg": "ready %s" % member.node})
+			time.sleep(0.2)
+			return all(member.messages("ready " + node) for member in (a1, b1, c1) for node in NODES if node != member.node)
+		if not wait_for(mesh, 15):
+			print("the nodes did not connect to each other, see %s" % tmp)
+			return 1
+		time.sleep(0.5)
+		for member in members:
+			member.clear()
+
+		# Subscriptions
+		for node in NODES:
+			check(probe.count(node, CLUSTER_SUB, CHANNEL) == 1, "node %s : %d CLUSTER_SUB for %s" % (node, probe.count(node, CLUSTER_SUB, CHANNEL), CHANNEL))
+
+		# Pubids
+		check(len(set(member.pubid for member in members)) == 1 and a1.pubid.startswith("ff"), "channel pubids differ : %s" % [member.pubid for member in members])
+		for i, node in enumerate(NODES):
+			for member in members:
+				if member.node == node:
+					check(member.user.startswith("%02x" % i) and member.sessid.startswith("%02x" % i), "%s : pubid %s, sessid %s" % (member.name, member.user, member.sessid))
+
+		# Channel fan-out : once per node, once per member
+		for i in range(MESSAGES):
+			a1.send("SEND", {"pipe": a1.pubid, "msg": "fanout a %d" % i})
+			b1.send("SEND", {"pipe": b1.pubid, "msg": "fanout b %d" % i})
+		expected = {"a1": ["b"], "b1": ["a"], "b2": ["a", "b"], "b3": ["a", "b"], "c1": ["a", "b"], "c2": ["a", "b"]}
+		wait_for(lambda: all(len(member.messages("fanout")) >= MESSAGES * len(expected[member.name]) for member in members))
+		time.sleep(0.3)
+		for member in members:
+			for node in NODES:
+				got = member.messages("fanout %s " % node)
+				want = (MESSAGES if node in expected[member.name] else 0)
+				check(len(got) == want and len(set(got)) == len(got), "%s : %d messages from %s (%d distinct), expected %d" % (member.name, len(got), node, len(set(got)), want))
+		for node in NODES:
+			for origin in NODES:
+				got = probe.count(node, CLUSTER_CHANNEL, CHANNEL, "fanout %s " % origin)
+				want = (MESSAGES if node == origin and node != "c" else 0)
+				check(got == want, "node %s sent %d messages from %s to the probe, expected %d" % (node, got, origin, want))
+
+		# Pubid routing
+		b1.send("SEND", {"pipe": a1.user, "msg": "private"})
+		c1.send("SEND", {"pipe": "%02x" % len(NODES) + "0" * 30, "msg": "to probe"})
+		b1.send("SEND", {"pipe": "fe" + "0" * 30, "msg": "nobody"})
+		wait_for(lambda: a1.messages("private") and probe.count("c", CLUSTER_PIPE) and b1.errors, 5)
+		time.sleep(0.3)
+		for member in members:
+			got = len(member.messages("private"))
+			check(got == (member is a1), "%s : %d private messages" % (member.name, got))
+		for node in NODES:
+			got = probe.count(node, CLUSTER_PIPE)
+			check(got == (node == "c"), "node %s : %d CLUSTER_PIPE to the probe" % (node, got))
+		check([error.get("value") for error in b1.errors] == ["UNKNOWN_PIPE"], "pubid of no node : %s" % b1.errors)
+
+		# Session affinity
+		errors = raw_data(request(ports["b"], [{"cmd": "CHECK", "chl": 1, "sessid": a1.sessid}]), "ERR")
+		check([(error.get("value"), error.get("node")) for error in errors] == [("BAD_SESSID", "a")], "a session of a used on b : %s" % errors)
+
+		# Unsubscription, once the last member of b has left
+		b1.send("LEFT", {"channel": CHANNEL})
+		b2.send("LEFT", {"channel": CHANNEL})
+		time.sleep(0.5)
+		check(probe.count("b", CLUSTER_UNSUB, CHANNEL) == 0, "node b unsubscribed with members left")
+		b3.send("LEFT", {"channel": CHANNEL})
+		wait_for(lambda: probe.count("b", CLUSTER_UNSUB, CHANNEL), 5)
+		a1.send("SEND", {"pipe": a1.pubid, "msg": "after"})
+		wait_for(lambda: c1.messages("after") and c2.messages("after"), 5)
+		time.sleep(0.3)
+		check(probe.count("b", CLUSTER_UNSUB, CHANNEL) == 1, "node b : %d CLUSTER_UNSUB" % probe.count("b", CLUSTER_UNSUB, CHANNEL))
+		for member in members:
+			got = len(member.messages("after"))
+			check(got == (member.node == "c"), "%s : %d messages after b left" % (member.name, got))
+		for node in "ac":
+			check(probe.count(node, CLUSTER_UNSUB) == 0, "node %s unsubscribed" % node)
+
+		for member in members:
+			if member.error is not None:
+				failures.append("%s : %s" % (member.name, member.error))
+		print("%d members on %d nodes, %d messages per publisher" % (len(members), len(NODES), MESSAGES))
+	finally:
+		for proc in procs.values():
+			if proc.poll() is None:
+				proc.terminate()
+				proc.wait()
+
+	for failure in failures:
+		print("FAIL " + failure)
+	if failures:
+		print("logs kept in %s" % tmp)
+		return 1
+
+	shutil.rmtree(tmp)
+	print("OK")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
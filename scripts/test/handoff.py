@@ -0,0 +1,371 @@
+#!/usr/bin/env python3
+#
+# Zero-downtime restart test (Server.handoff_socket, see src/handoff.c)
+#
+# Starts aped, connects long polling and WebSocket clients to a channel and
+# keeps publishing numbered messages while new instances take over with
+# "aped --handoff". Every client must receive every message exactly once.
+# Before the first restart, a new instance that cannot take over (too few
+# file descriptors to receive the connections) must leave the running one
+# in charge : same pid file, same Server.handoff_socket.
+#
+#   scripts/test/handoff.py [--aped bin/aped] [--restarts 3] [--duration 6] [--backend io_uring]
+#
+# Exit status : 0 if nothing was lost or duplicated, 1 otherwise.
+
+import argparse
+import base64
+import json
+import os
+import resource
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+
+CHANNEL = "handoff"
+END = "end"
+
+CONFIG = """
+uid {
+	user = daemon
+	group = daemon
+}
+
+Server {
+	port = %(port)d
+	daemon = no
+	event_backend = %(backend)s
+	ip_listen = 127.0.0.1
+	domain = auto
+	rlimit_nofile = %(nofile)d
+	pid_file = %(dir)s/aped.pid
+	handoff_socket = %(dir)s/handoff.sock
+}
+
+Log {
+	debug = 0
+	use_syslog = 0
+	syslog_facility = local2
+	logfile = %(dir)s/ape.log
+}
+
+JSONP {
+	eval_func = Ape.transport.read
+	allowed = 1
+}
+
+Config {
+	modules = %(dir)s/modules/
+	modules_conf = %(dir)s/modules/
+}
+"""
+
+
+def request(port, cmds, transport=0, timeout=30):
+	"""One HTTP request, the server closes the connection after the response"""
+	query = urllib.parse.quote(json.dumps(cmds))
+	sock = socket.create_connection(("127.0.0.1", port), timeout=timeout)
+	sock.sendall(("GET /%d/?%s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n" % (transport, query)).encode())
+	data = b""
+	while True:
+		chunk = sock.recv(65536)
+		if not chunk:
+			break
+		data += chunk
+	sock.close()
+	body = data.split(b"\r\n\r\n", 1)[1] if b"\r\n\r\n" in data else b""
+	return json.loads(body) if body.strip() else []
+
+
+def raw_data(raws, name):
+	return [raw["data"] for raw in raws if raw["raw"] == name]
+
+
+class Client(object):
+	def __init__(self, name):
+		self.name = name
+		self.received = []
+		self.errors = []
+		self.done = threading.Event()
+		self.error = None
+
+	def got(self, raws):
+		self.errors += raw_data(raws, "ERR")
+		for data in raw_data(raws, "DATA"):
+			if data.get("msg") == END:
+				self.done.set()
+			else:
+				self.received.append(int(data["msg"]))
+
+
+class LongPollClient(Client):
+	def __init__(self, port, name):
+		Client.__init__(self, name)
+		self.port = port
+		raws = request(port, [{"cmd": "CONNECT", "chl": 1}])
+		self.sessid = raw_data(raws, "LOGIN")[0]["sessid"]
+		self.chl = 2
+		self.send("JOIN", {"channels": [CHANNEL]})
+
+	def send(self, cmd, params):
+		self.chl += 1
+		return request(self.port, [{"cmd": cmd, "chl": self.chl, "sessid": self.sessid, "params": params}])
+
+	def run(self):
+		try:
+			while not self.done.is_set():
+				self.chl += 1
+				self.got(request(self.port, [{"cmd": "CHECK", "chl": self.chl, "sessid": self.sessid}]))
+		except Exception as e:
+			self.error = e
+			self.done.set()
+
+
+class WebSocketClient(Client):
+	def __init__(self, port, name, channel=CHANNEL):
+		Client.__init__(self, name)
+		self.sock = socket.create_connection(("127.0.0.1", port), timeout=30)
+		key = base64.b64encode(os.urandom(16)).decode()
+		self.sock.sendall(("GET /6/ HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+			"Origin: http://127.0.0.1\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n" % key).encode())
+		self.buf = b""
+		while b"\r\n\r\n" not in self.buf:
+			self.buf += self.sock.recv(4096)
+		self.buf = self.buf.split(b"\r\n\r\n", 1)[1]
+		self.write(json.dumps([{"cmd": "CONNECT", "chl": 1}]))
+		self.sessid = None
+		self.user = None
+		while self.sessid is None or self.user is None:
+			for raws in self.frames():
+				for data in raw_data(raws, "LOGIN"):
+					self.sessid = data["sessid"]
+				for data in raw_data(raws, "IDENT"):
+					self.user = data["user"]["pubid"]
+		self.chl = 2
+		self.send("JOIN", {"channels": [channel]})
+		self.pubid = None
+		while self.pubid is None:
+			for raws in self.frames():
+				for data in raw_data(raws, "CHANNEL"):
+					self.pubid = data["pipe"]["pubid"]
+
+	def send(self, cmd, params):
+		self.chl += 1
+		self.write(json.dumps([{"cmd": cmd, "chl": self.chl, "sessid": self.sessid, "params": params}]))
+
+	def write(self, text, opcode=0x1):
+		payload = text.encode() if isinstance(text, str) else text
+		mask = os.urandom(4)
+		if len(payload) < 126:
+			head = struct.pack("!BB", 0x80 | opcode, 0x80 | len(payload))
+		else:
+			head = struct.pack("!BBH", 0x80 | opcode, 0x80 | 126, len(payload))
+		self.sock.sendall(head + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(payload)))
+
+	def frames(self):
+		"""Read the socket once, return the complete text frames as lists of raws"""
+		chunk = self.sock.recv(65536)
+		if not chunk:
+			raise IOError("connection closed")
+		self.buf += chunk
+		out = []
+		while len(self.buf) >= 2:
+			opcode, length, offset = self.buf[0] & 0x0F, self.buf[1] & 0x7F, 2
+			if length == 126:
+				length, offset = struct.unpack("!H", self.buf[2:4])[0], 4
+			elif length == 127:
+				length, offset = struct.unpack("!Q", self.buf[2:10])[0], 10
+			if len(self.buf) < offset + length:
+				break
+			payload, self.buf = self.buf[offset:offset + length], self.buf[offset + length:]
+			if opcode == 0x9:
+				self.write(payload, 0xA)
+			elif opcode == 0x1:
+				out.append(json.loads(payload))
+		return out
+
+	def run(self):
+		try:
+			while not self.done.is_set():
+				for raws in self.frames():
+					self.got(raws)
+		except Exception as e:
+			self.error = e
+			self.done.set()
+
+
+def read_pid(path):
+	try:
+		with open(path) as f:
+			return int(f.read().strip() or 0)
+	except (IOError, ValueError):
+		return 0
+
+
+def wait_port(port, proc, timeout=10):
+	end = time.time() + timeout
+	while time.time() < end and proc.poll() is None:
+		try:
+			socket.create_connection(("127.0.0.1", port), timeout=1).close()
+			return True
+		except socket.error:
+			time.sleep(0.05)
+	return False
+
+
+def main():
+	root = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+	parser = argparse.ArgumentParser(description="aped handoff test : no message lost or duplicated across restarts")
+	parser.add_argument("--aped", default=os.path.join(root, "bin", "aped"))
+	parser.add_argument("--port", type=int, default=16980)
+	parser.add_argument("--backend", default="epoll", help="Server.event_backend")
+	parser.add_argument("--longpoll", type=int, default=4, help="long polling clients")
+	parser.add_argument("--websocket", type=int, default=4, help="WebSocket clients")
+	parser.add_argument("--restarts", type=int, default=3)
+	parser.add_argument("--duration", type=float, default=6, help="publishing time (seconds)")
+	parser.add_argument("--interval", type=float, default=0.002, help="delay between two messages (seconds)")
+	args = parser.parse_args()
+
+	tmp = tempfile.mkdtemp(prefix="ape-handoff-")
+	os.chmod(tmp, 0o777)
+	os.mkdir(os.path.join(tmp, "modules"))
+	conf = os.path.join(tmp, "ape.conf")
+	with open(conf, "w") as f:
+		f.write(CONFIG % {"port": args.port, "dir": tmp, "backend": args.backend, "nofile": 10000})
+	# Not enough file descriptors to receive the connections (set by aped when run as root, by us otherwise)
+	conf_starved = os.path.join(tmp, "ape-starved.conf")
+	with open(conf_starved, "w") as f:
+		f.write(CONFIG % {"port": args.port, "dir": tmp, "backend": args.backend, "nofile": 12})
+	pidfile = os.path.join(tmp, "aped.pid")
+	handoff_socket = os.path.join(tmp, "handoff.sock")
+
+	def start(*extra):
+		return subprocess.Popen([args.aped, "--cfg", conf] + list(extra), stdout=open(os.path.join(tmp, "aped.out"), "a"), stderr=subprocess.STDOUT)
+
+	def start_starved():
+		def limit():
+			resource.setrlimit(resource.RLIMIT_NOFILE, (12, 12))
+		return subprocess.Popen([args.aped, "--cfg", conf_starved, "--handoff"], stdout=open(os.path.join(tmp, "aped.out"), "a"), stderr=subprocess.STDOUT, preexec_fn=limit)
+
+	def wait_pid(pid, timeout=5):
+		end = time.time() + timeout
+		while read_pid(pidfile) != pid and time.time() < end:
+			time.sleep(0.05)
+		return read_pid(pidfile) == pid
+
+	procs = [start()]
+	failures = []
+	try:
+		if not wait_port(args.port, procs[0]):
+			print("aped did not start, see %s" % tmp)
+			return 1
+
+		clients = [LongPollClient(args.port, "longpoll %d" % i) for i in range(args.longpoll)]
+		clients += [WebSocketClient(args.port, "websocket %d" % i) for i in range(args.websocket)]
+		# Frames already written by the publisher are handed over with its socket
+		publisher = WebSocketClient(args.port, "publisher")
+
+		threads = [threading.Thread(target=client.run) for client in clients + [publisher]]
+		for thread in threads:
+			thread.daemon = True
+			thread.start()
+
+		sent = []
+		stop = threading.Event()
+
+		def publish():
+			try:
+				while not stop.is_set():
+					publisher.send("SEND", {"pipe": publisher.pubid, "msg": str(len(sent))})
+					sent.append(len(sent))
+					time.sleep(args.interval)
+			except Exception as e:
+				failures.append("publisher : %s" % e)
+
+		publishing = threading.Thread(target=publish)
+		publishing.start()
+
+		if not wait_pid(procs[0].pid):
+			failures.append("start : pid file not written")
+
+		# Failed takeover : the running instance carries on
+		time.sleep(args.duration / (args.restarts + 2))
+		starved = start_starved()
+		try:
+			if starved.wait(15) == 0:
+				failures.append("failed takeover : the new instance did not fail")
+		except subprocess.TimeoutExpired:
+			starved.kill()
+			failures.append("failed takeover : the new instance is still running")
+		if procs[-1].poll() is not None:
+			failures.append("failed takeover : the running instance exited")
+		if read_pid(pidfile) != procs[-1].pid:
+			failures.append("failed takeover : pid file now holds %d" % read_pid(pidfile))
+		if not os.path.exists(handoff_socket):
+			failures.append("failed takeover : %s is gone" % handoff_socket)
+		print("failed takeover : pid %d exited (%s), pid %d still running" % (starved.pid, starved.returncode, procs[-1].pid))
+
+		for i in range(args.restarts):
+			time.sleep(args.duration / (args.restarts + 2))
+			old = procs[-1]
+			procs.append(start("--handoff"))
+			try:
+				old.wait(10)
+			except subprocess.TimeoutExpired:
+				failures.append("restart %d : the old instance is still running" % (i + 1))
+				break
+			if procs[-1].poll() is not None:
+				failures.append("restart %d : the new instance exited (%d)" % (i + 1, procs[-1].returncode))
+				break
+			if not wait_pid(procs[-1].pid):
+				failures.append("restart %d : pid file holds %d" % (i + 1, read_pid(pidfile)))
+			print("restart %d : pid %d took over from pid %d" % (i + 1, procs[-1].pid, old.pid))
+		time.sleep(args.duration / (args.restarts + 2))
+
+		stop.set()
+		publishing.join()
+		publisher.send("SEND", {"pipe": publisher.pubid, "msg": END})
+
+		for client in clients:
+			if not client.done.wait(15):
+				failures.append("%s : the last message never arrived" % client.name)
+
+		if not sent:
+			failures.append("nothing was published")
+		if publisher.errors:
+			failures.append("publisher : %d errors, first %s" % (len(publisher.errors), publisher.errors[0]))
+		expected = set(sent)
+		for client in clients:
+			if client.error is not None:
+				failures.append("%s : %s" % (client.name, client.error))
+			got = sorted(client.received)
+			lost = expected - set(got)
+			dups = len(got) - len(set(got))
+			if lost or dups:
+				failures.append("%s : %d lost, %d duplicated" % (client.name, len(lost), dups))
+		print("%d messages published to %d clients across %d restarts" % (len(sent), len(clients), len(procs) - 1))
+	finally:
+		for proc in procs:
+			if proc.poll() is None:
+				proc.terminate()
+				proc.wait()
+
+	for failure in failures:
+		print("FAIL " + failure)
+	if failures:
+		print("logs kept in %s" % tmp)
+		return 1
+
+	shutil.rmtree(tmp)
+	print("OK")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
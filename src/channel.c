@@ -26,6 +26,7 @@
 #include "json.h"
 #include "raw.h"
 #include "plugins.h"
+#include "cluster.h"
 
 unsigned int isvalidchan(char *name) 
 {
@@ -63,11 +64,17 @@ CHANNEL *mkchan(char *chan, int flags, acetables *g_ape)
 	new_chan->head = NULL;
 	new_chan->banned = NULL;
 	new_chan->properties = NULL;
+	new_chan->nusers = 0;
+	new_chan->lastseq = 0;
+	new_chan->members = NULL;
+	new_chan->nmembers = 0;
+	new_chan->msize = 0;
 	new_chan->flags = flags | (*new_chan->name == '*' ? CHANNEL_NONINTERACTIVE : 0);
 
 	//memcpy(new_chan->topic, topic, strlen(topic)+1);
 
 	new_chan->pipe = init_pipe(new_chan, CHANNEL_PIPE, g_ape);
+	cluster_pubid(new_chan->pipe, new_chan->name, g_ape);
 	
 	hashtbl_append(g_ape->hLusers, chan, (void *)new_chan);
 	
@@ -124,13 +131,95 @@ void rmchan(CHANNEL *chan, acetables *g_ape)
 	
 	destroy_pipe(chan->pipe, g_ape);
 	
+	free(chan->members);
 	free(chan);
 	chan = NULL;
 }
 
+/* First slot of the members index whose seq is >= "seq" */
+static unsigned int members_seek(CHANNEL *chan, unsigned long seq)
+{
+	unsigned int low = 0, high = chan->nmembers;
+	
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+		
+		if (chan->members[mid].seq < seq) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	
+	return low;
+}
+
+/* New members have the highest seq, they are appended */
+static void members_add(CHANNEL *chan, userslist *list)
+{
+	if (chan->nmembers == chan->msize) {
+		chan->msize = (chan->msize ? chan->msize * 2 : 16);
+		chan->members = xrealloc(chan->members, sizeof(*chan->members) * chan->msize);
+	}
+	chan->members[chan->nmembers].seq = list->seq;
+	chan->members[chan->nmembers].ulist = list;
+	chan->nmembers++;
+}
+
+/* Drop the slots of the users who left */
+static void members_compact(CHANNEL *chan)
+{
+	unsigned int i, n = 0;
+	
+	for (i = 0; i < chan->nmembers; i++) {
+		if (chan->members[i].ulist != NULL) {
+			chan->members[n++] = chan->members[i];
+		}
+	}
+	chan->nmembers = n;
+}
+
+/*
+	The slot is only cleared (a page skips it). The index is compacted
+	once there are more cleared slots than members, so that a page never
+	costs more than O(page + members) and O(page) amortized.
+*/
+static void members_del(CHANNEL *chan, userslist *list)
+{
+	unsigned int i = members_seek(chan, list->seq);
+	
+	if (i < chan->nmembers && chan->members[i].ulist == list) {
+		chan->members[i].ulist = NULL;
+	}
+	if (chan->nmembers - chan->nusers > 32 && chan->nmembers - chan->nusers > chan->nusers) {
+		members_compact(chan);
+	} else if (chan->nusers == 0) {
+		chan->nmembers = 0;
+	}
+}
+
+/* Index the members of chan->head (sorted by decreasing seq, see snapshot_restore_channel()) */
+void members_rebuild(CHANNEL *chan)
+{
+	userslist *list;
+	unsigned int i;
+	
+	chan->nmembers = 0;
+	
+	for (list = chan->head; list != NULL; list = list->next) {
+		members_add(chan, list);
+	}
+	for (i = 0; i < chan->nmembers / 2; i++) {
+		struct _members_index tmp = chan->members[i];
+		
+		chan->members[i] = chan->members[chan->nmembers - i - 1];
+		chan->members[chan->nmembers - i - 1] = tmp;
+	}
+}
+
 void join(USERS *user, CHANNEL *chan, acetables *g_ape)
 {
-	userslist *list, *ulist;
+	userslist *list;
 	RAW *newraw;
 	json_item *jlist;
 	CHANLIST *chanl;
@@ -146,9 +235,12 @@ void join(USERS *user, CHANNEL *chan, acetables *g_ape)
 	list = xmalloc(sizeof(*list)); // TODO is it free ?
 	list->userinfo = user;
 	list->level = 1;
+	list->seq = ++chan->lastseq;
 	list->next = chan->head;
 	
 	chan->head = list;
+	chan->nusers++;
+	members_add(chan, list);
 	
 	chanl = xmalloc(sizeof(*chanl)); // TODO is it free ?
 	chanl->chaninfo = chan;
@@ -156,43 +248,34 @@ void join(USERS *user, CHANNEL *chan, acetables *g_ape)
 	
 	user->chan_foot = chanl;
 
+	/* First local member, the other nodes send us the channel raws */
+	if (list->next == NULL) {
+		cluster_channel(chan, 1, g_ape);
+	}
+
 	if (!(chan->flags & CHANNEL_NONINTERACTIVE)) {
 		
-		json_item *user_list;
 		json_item *uinfo;
 		
-		user_list = json_new_array();
-		
-		if (list->next != NULL) {
+		if (list->next != NULL || cluster_subscribed(chan, g_ape)) {
 			
 			uinfo = json_new_object();
 		
-			json_set_property_objN(uinfo, "user", 4, get_json_object_user(user));
-			json_set_property_objN(uinfo, "pipe", 4, get_json_object_channel(chan));
+			json_set_property_objN(uinfo, "user", 4, get_json_object_user_cache(user));
+			json_set_property_objN(uinfo, "pipe", 4, get_json_object_channel_cache(chan));
 
 			newraw = forge_raw(RAW_JOIN, uinfo);
+
+			/* No local recipient if it is only for the other nodes */
+			newraw->refcount = 1;
 			post_raw_channel_restricted(newraw, chan, user, g_ape);
+			free_raw(newraw);
 		}
 		
-		ulist = chan->head;
-		while (ulist != NULL) {
-		
-			json_item *juser = get_json_object_user(ulist->userinfo);
-			
-			if (ulist->userinfo != user) {
-				//make_link(user, ulist->userinfo);
-			}
-			
-			json_set_property_intN(juser, "level", 5, ulist->level);
-		
-			json_set_element_obj(user_list, juser);
-
-			ulist = ulist->next;
-		}
-		json_set_property_objN(jlist, "users", 5, user_list);
+		set_members_page(jlist, chan, 0, g_ape);
 	}
 	
-	json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+	json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 
 	newraw = forge_raw(RAW_CHANNEL, jlist);
 	post_raw(newraw, user, g_ape);
@@ -262,8 +345,8 @@ void left(USERS *user, CHANNEL *chan, acetables *g_ape) // Vider la liste chain
 		if (list->userinfo == user) {
 			jlist = json_new_object();
 			
-			json_set_property_objN(jlist, "user", 4, get_json_object_user(user));
-			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+			json_set_property_objN(jlist, "user", 4, get_json_object_user_cache(user));
+			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 			
 			newraw = forge_raw(RAW_LEFT, jlist);
 			post_raw(newraw, user, g_ape);
@@ -273,17 +356,26 @@ void left(USERS *user, CHANNEL *chan, acetables *g_ape) // Vider la liste chain
 			} else {
 				chan->head = list->next;
 			}
+			chan->nusers--;
+			members_del(chan, list);
 			free(list);
 			list = NULL;
-			if (chan->head != NULL && !(chan->flags & CHANNEL_NONINTERACTIVE)) {
+			if (chan->head == NULL) {
+				cluster_channel(chan, 0, g_ape);
+			}
+			if ((chan->head != NULL || cluster_subscribed(chan, g_ape)) && !(chan->flags & CHANNEL_NONINTERACTIVE)) {
 				jlist = json_new_object();
 				
-				json_set_property_objN(jlist, "user", 4, get_json_object_user(user));
-				json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+				json_set_property_objN(jlist, "user", 4, get_json_object_user_cache(user));
+				json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 				
 				newraw = forge_raw(RAW_LEFT, jlist);
+
+				newraw->refcount = 1;
 				post_raw_channel(newraw, chan, g_ape);
-			} else if (chan->head == NULL && chan->flags & CHANNEL_AUTODESTROY) {
+				free_raw(newraw);
+			}
+			if (chan->head == NULL && chan->flags & CHANNEL_AUTODESTROY) {
 				rmchan(chan, g_ape);
 			}
 			break;
@@ -349,9 +441,9 @@ unsigned int setlevel(USERS *user_actif, USERS *user_passif, CHANNEL *chan, unsi
 		if (!(chan->flags & CHANNEL_NONINTERACTIVE)) {
 			jlist = json_new_object();
 			
-			json_set_property_objN(jlist, "ope", 3, get_json_object_user(user_passif));
-			json_set_property_objN(jlist, "oper", 4, get_json_object_user(user_actif));
-			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+			json_set_property_objN(jlist, "ope", 3, get_json_object_user_cache(user_passif));
+			json_set_property_objN(jlist, "oper", 4, get_json_object_user_cache(user_actif));
+			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 			json_set_property_intN(jlist, "level", 5, lvl);
 		
 			newraw = forge_raw(RAW_SETLEVEL, jlist);
@@ -364,9 +456,9 @@ unsigned int setlevel(USERS *user_actif, USERS *user_passif, CHANNEL *chan, unsi
 		if (!(chan->flags & CHANNEL_NONINTERACTIVE)) {
 			jlist = json_new_object();
 
-			json_set_property_objN(jlist, "ope", 3, get_json_object_user(user_passif));
+			json_set_property_objN(jlist, "ope", 3, get_json_object_user_cache(user_passif));
 			json_set_property_objN(jlist, "oper", 4, get_json_object_user(NULL));
-			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 			json_set_property_intN(jlist, "level", 5, lvl);
 
 			newraw = forge_raw(RAW_SETLEVEL, jlist);
@@ -394,8 +486,8 @@ unsigned int setlevel(USERS *user_actif, USERS *user_passif, CHANNEL *chan, unsi
 		memcpy(chan->topic, topic, strlen(topic)+1);
 		
 		jlist = json_new_object();
-		json_set_property_objN(jlist, "user", 4, get_json_object_user(user));
-		json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+		json_set_property_objN(jlist, "user", 4, get_json_object_user_cache(user));
+		json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 		
 		newraw = forge_raw(RAW_SETTOPIC, jlist);
 		post_raw_channel(newraw, chan, g_ape);
@@ -429,8 +521,8 @@ void ban(CHANNEL *chan, USERS *banner, const char *ip, char *reason, unsigned in
 			jlist = json_new_object();
 			
 			json_set_property_strZ(jlist, "reason", reason);
-			json_set_property_objN(jlist, "banner", 6, get_json_object_user(banner));
-			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+			json_set_property_objN(jlist, "banner", 6, get_json_object_user_cache(banner));
+			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 			
 			newraw = forge_raw(RAW_BAN, jlist);
 			
@@ -557,3 +649,57 @@ json_item *get_json_object_channel(CHANNEL *chan)
 	return jstr;
 }
 
+json_item *get_json_object_channel_cache(CHANNEL *chan)
+{
+	return get_json_object_pipe_cache(chan->pipe);
+}
+
+/* Cached user object with the "level" of the user on the channel appended */
+json_item *get_json_object_userslist(struct userslist *ulist)
+{
+	json_item *juser = get_json_object_user_cache(ulist->userinfo);
+	char level[32];
+	int len;
+	
+	len = sprintf(level, ",\"level\":%u}", ulist->level);
+	
+	/* Replace the closing brace of the cached object */
+	juser->jval.vu.str.value = xrealloc(juser->jval.vu.str.value, sizeof(char) * (juser->jval.vu.str.length + len));
+	memcpy(juser->jval.vu.str.value + juser->jval.vu.str.length - 1, level, len + 1);
+	juser->jval.vu.str.length += len - 1;
+	
+	return juser;
+}
+
+/*
+	Add a page of the channel members to jlist :
+	"users" (at most Server.members_page users, 0 means everything), "total"
+	and, when the list is truncated, a "cursor" to be given back to MEMBERS.
+	Users are sent by decreasing seq (join order), the cursor (seq of the last
+	user sent) stays valid whoever joins or lefts and is found in O(log n) in
+	chan->members.
+*/
+void set_members_page(json_item *jlist, CHANNEL *chan, unsigned long cursor, acetables *g_ape)
+{
+	userslist *ulist;
+	json_item *user_list = json_new_array();
+	unsigned int i = (cursor ? members_seek(chan, cursor) : chan->nmembers);
+	int nusers = 0;
+	
+	while (i-- > 0) {
+		if ((ulist = chan->members[i].ulist) == NULL) {
+			continue;
+		}
+		if (nusers == g_ape->members_page && nusers) {
+			json_set_property_intN(jlist, "cursor", 6, (JSON_int_t)cursor);
+			break;
+		}
+		json_set_element_obj(user_list, get_json_object_userslist(ulist));
+		
+		cursor = ulist->seq;
+		nusers++;
+	}
+	
+	json_set_property_objN(jlist, "users", 5, user_list);
+	json_set_property_intN(jlist, "total", 5, chan->nusers);
+}
@@ -34,6 +34,13 @@
 #define CHANNEL_NONINTERACTIVE 		0x01
 #define CHANNEL_AUTODESTROY 		0x02
 
+/* A channel member by join order, "ulist" is NULL once the user left (until the index is compacted) */
+struct _members_index
+{
+	unsigned long seq;
+	struct userslist *ulist;
+};
+
 typedef struct CHANNEL
 {
 	//char topic[MAX_TOPIC_LEN+1];
@@ -46,6 +53,14 @@ typedef struct CHANNEL
 	extend *properties;
 
 	int flags;
+	unsigned int nusers;
+	unsigned long lastseq;
+	
+	/* Members sorted by increasing seq, a MEMBERS cursor is found by a binary search */
+	struct _members_index *members;
+	unsigned int nmembers; /* slots in use, including the ones of the users who left */
+	unsigned int msize;
+	
 	char name[MAX_CHAN_LEN+1];
 
 } CHANNEL;
@@ -85,6 +100,10 @@ unsigned int setlevel(struct USERS *user_actif, struct USERS *user_passif, CHANN
 unsigned int isvalidchan(char *name);
 
 json_item *get_json_object_channel(CHANNEL *chan);
+json_item *get_json_object_channel_cache(CHANNEL *chan);
+json_item *get_json_object_userslist(struct userslist *ulist);
+void set_members_page(json_item *jlist, CHANNEL *chan, unsigned long cursor, acetables *g_ape);
+void members_rebuild(CHANNEL *chan);
 
 #endif
 
@@ -0,0 +1,608 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* cluster.c */
+
+/*
+	Cluster mode (Cluster section) : channels span several aped processes.
+	Every node listens on its own Cluster.nodes address and connects to all
+	the others. A node only sends on the connections it opened and only
+	receives on the ones it accepted, so each pair of nodes is linked by two
+	connections.
+
+	Each message is a length (32 bits) followed by :
+
+		type (8 bits, cluster_msg_t)
+		name length (16 bits), name : node, channel or pubid
+		data : password or raw (the rest of the message)
+
+	The first message of a connection is CLUSTER_HELLO, then the node
+	subscribes (CLUSTER_SUB) to the channels having local members : raws
+	posted to a channel are sent once to each node subscribed to it
+	(post_raw_channel()), which posts them to its own members only.
+
+	Pubids and sessids generated by a node start with its index in
+	Cluster.nodes (two hex digits, see cluster_id()) : raws for an unknown
+	user pubid are sent to the node owning it, a client sent to the wrong
+	node is told where its session lives. Channel pubids are derived from
+	their name (and start with CLUSTER_CHANNEL_ID) so that they are the
+	same on every node, raws for a channel pubid unknown here are sent to
+	the nodes subscribed to it.
+*/
+
+#include "cluster.h"
+#include "sock.h"
+#include "channel.h"
+#include "pipe.h"
+#include "md5.h"
+#include "ticks.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+#define CLUSTER_NAME_MAX 64 // Node names and message names (channels, pubids)
+
+struct _cluster_state {
+	cluster_peer *peer; /* NULL until CLUSTER_HELLO */
+	int error;
+};
+
+static unsigned int cluster_get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int cluster_get32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int cluster_send(cluster_peer *peer, cluster_msg_t type, const char *name, const char *data, unsigned int len, acetables *g_ape)
+{
+	ape_socket *co = sock_from_handle(peer->out, g_ape);
+	unsigned int name_len = strlen(name), size = 3 + name_len + len;
+	unsigned char head[7] = {size >> 24, size >> 16, size >> 8, size, type, name_len >> 8, name_len};
+	struct iovec iov[3];
+
+	if (co == NULL || co->state != STREAM_ONLINE) {
+		return 0;
+	}
+	iov[0].iov_base = head;
+	iov[0].iov_len = 7;
+	iov[1].iov_base = (char *)name;
+	iov[1].iov_len = name_len;
+	iov[2].iov_base = (char *)data;
+	iov[2].iov_len = len;
+
+	sendbinv(co->fd, iov, 3, g_ape);
+
+	return 1;
+}
+
+static void cluster_forget(cluster_peer *peer)
+{
+	hashtbl_free(peer->channels);
+	hashtbl_free(peer->pubids);
+	peer->channels = hashtbl_init();
+	peer->pubids = hashtbl_init();
+}
+
+/* Same pubid for the channel on every node */
+static void cluster_channel_pubid(const char *name, char *pubid, acetables *g_ape)
+{
+	md5_context ctx;
+	unsigned char digest[16];
+	int i;
+
+	md5_starts(&ctx);
+	md5_update(&ctx, (uint8 *)g_ape->cluster.password, strlen(g_ape->cluster.password));
+	md5_update(&ctx, (uint8 *)name, strlen(name));
+	md5_finish(&ctx, digest);
+
+	digest[0] = CLUSTER_CHANNEL_ID;
+
+	for (i = 0; i < 16; i++) {
+		sprintf(&pubid[i * 2], "%02x", digest[i]);
+	}
+}
+
+/* Node owning a pubid or a sessid (may be g_ape->cluster.self), NULL if none */
+static cluster_peer *cluster_owner(const char *id, acetables *g_ape)
+{
+	cluster_peer *peer;
+	int node;
+
+	if (g_ape->cluster.node == NULL || strlen(id) != 32 || sscanf(id, "%2x", &node) != 1) {
+		return NULL;
+	}
+	if (node == g_ape->cluster.self->id) {
+		return g_ape->cluster.self;
+	}
+	for (peer = g_ape->cluster.peers; peer != NULL; peer = peer->next) {
+		if (peer->id == node) {
+			return peer;
+		}
+	}
+
+	return NULL;
+}
+
+static cluster_peer *cluster_peer_get(const char *name, acetables *g_ape)
+{
+	cluster_peer *peer;
+
+	for (peer = g_ape->cluster.peers; peer != NULL; peer = peer->next) {
+		if (strcmp(peer->name, name) == 0) {
+			return peer;
+		}
+	}
+
+	return NULL;
+}
+
+/* Raw received from another node, for the local members only */
+static void cluster_post_local(RAW *raw, CHANNEL *chan, acetables *g_ape)
+{
+	userslist *list;
+
+	for (list = chan->head; list != NULL; list = list->next) {
+		post_raw(raw, list->userinfo, g_ape);
+	}
+}
+
+static void cluster_deliver(cluster_msg_t type, const char *name, const char *data, unsigned int len, acetables *g_ape)
+{
+	CHANNEL *chan = NULL;
+	USERS *user = NULL;
+	transpipe *pipe;
+	RAW *raw;
+
+	if (type == CLUSTER_CHANNEL) {
+		chan = getchan(name, g_ape);
+	} else if ((pipe = get_pipe(name, g_ape)) != NULL) {
+		if (pipe->type == CHANNEL_PIPE) {
+			chan = pipe->pipe;
+		} else if (pipe->type == USER_PIPE) {
+			user = pipe->pipe;
+		}
+	}
+	if (chan == NULL && user == NULL) {
+		return;
+	}
+
+	raw = copy_raw_data(data, len);
+
+	/* Held until every recipient has its reference */
+	raw->refcount = 1;
+
+	if (chan != NULL) {
+		cluster_post_local(raw, chan, g_ape);
+	} else {
+		post_raw(raw, user, g_ape);
+	}
+	free_raw(raw);
+}
+
+static void cluster_close(ape_socket *co, const char *why, acetables *g_ape)
+{
+	struct _cluster_state *state = co->parser.data;
+
+	ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "Cluster : %s (%s), closing the connection", why, co->ip_client);
+
+	state->error = 1;
+	shutdown(co->fd, 2);
+}
+
+/* Return 0 if the connection must be closed */
+static int cluster_message(ape_socket *co, const unsigned char *msg, unsigned int len, acetables *g_ape)
+{
+	struct _cluster_state *state = co->parser.data;
+	char name[CLUSTER_NAME_MAX + 1], pubid[33];
+	unsigned int name_len;
+	cluster_msg_t type;
+
+	if (len < 3 || (name_len = cluster_get16(&msg[1])) > CLUSTER_NAME_MAX || len - 3 < name_len) {
+		cluster_close(co, "malformed message", g_ape);
+		return 0;
+	}
+	type = msg[0];
+	memcpy(name, &msg[3], name_len);
+	name[name_len] = '\0';
+
+	msg += 3 + name_len;
+	len -= 3 + name_len;
+
+	if (state->peer == NULL) {
+		if (type != CLUSTER_HELLO || !secret_equal(g_ape->cluster.password, (const char *)msg, len) ||
+			(state->peer = cluster_peer_get(name, g_ape)) == NULL) {
+
+			cluster_close(co, "unknown node or wrong password", g_ape);
+			return 0;
+		}
+		/* Subscriptions of its previous connection are sent again */
+		cluster_forget(state->peer);
+		state->peer->in = sock_handle(co);
+
+		return 1;
+	}
+
+	switch(type) {
+		case CLUSTER_SUB:
+			cluster_channel_pubid(name, pubid, g_ape);
+			hashtbl_append(state->peer->channels, name, state->peer);
+			hashtbl_append(state->peer->pubids, pubid, state->peer);
+			break;
+		case CLUSTER_UNSUB:
+			cluster_channel_pubid(name, pubid, g_ape);
+			hashtbl_erase(state->peer->channels, name);
+			hashtbl_erase(state->peer->pubids, pubid);
+			break;
+		case CLUSTER_CHANNEL:
+		case CLUSTER_PIPE:
+			cluster_deliver(type, name, (const char *)msg, len, g_ape);
+			break;
+		default:
+			cluster_close(co, "unknown message", g_ape);
+			return 0;
+	}
+
+	return 1;
+}
+
+static void cluster_read(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
+{
+	struct _cluster_state *state = co->parser.data;
+	unsigned char *data = (unsigned char *)buffer->data;
+	unsigned int pos = 0, len;
+
+	while (!state->error && buffer->length - pos >= 4) {
+		if ((len = cluster_get32(&data[pos])) > CLUSTER_MAX_MSG) {
+			cluster_close(co, "message too big", g_ape);
+			break;
+		}
+		if (buffer->length - pos - 4 < len) {
+			break;
+		}
+		pos += 4;
+
+		if (!cluster_message(co, &data[pos], len, g_ape)) {
+			break;
+		}
+		pos += len;
+	}
+
+	if (state->error) {
+		buffer->length = 0;
+	} else if (pos) {
+		memmove(buffer->data, &buffer->data[pos], buffer->length - pos);
+		buffer->length -= pos;
+	}
+}
+
+static void cluster_in_closed(ape_socket *co, acetables *g_ape)
+{
+	struct _cluster_state *state = co->parser.data;
+
+	if (state != NULL && state->peer != NULL && SOCK_HANDLE_IS(state->peer->in, co)) {
+		cluster_forget(state->peer);
+	}
+}
+
+static void cluster_destroy(ape_parser *parser)
+{
+	free(parser->data);
+
+	parser->data = NULL;
+	parser->destroy = NULL;
+	parser->socket = NULL;
+}
+
+static void cluster_accept(ape_socket *co, acetables *g_ape)
+{
+	struct _cluster_state *state = xmalloc(sizeof(*state));
+
+	state->peer = NULL;
+	state->error = 0;
+
+	co->parser.parser_func = NULL;
+	co->parser.onready = NULL;
+	co->parser.destroy = cluster_destroy;
+	co->parser.data = state;
+	co->parser.socket = co;
+	co->parser.ready = 0;
+}
+
+/* Nothing is received on our connections */
+static void cluster_out_read(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
+{
+	buffer->length = 0;
+}
+
+static void cluster_out_connected(ape_socket *co, acetables *g_ape)
+{
+	cluster_peer *peer = co->data;
+	HTBL_ITEM *item;
+	int keepalive = 1;
+
+	setsockopt(co->fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(int));
+
+	ape_log(APE_INFO, __FILE__, __LINE__, g_ape, "Cluster : connected to node %s", peer->name);
+
+	cluster_send(peer, CLUSTER_HELLO, g_ape->cluster.node, g_ape->cluster.password, strlen(g_ape->cluster.password), g_ape);
+
+	for (item = g_ape->hLusers->first; item != NULL; item = item->lnext) {
+		if (((CHANNEL *)item->addrs)->head != NULL) {
+			cluster_send(peer, CLUSTER_SUB, item->key, NULL, 0, g_ape);
+		}
+	}
+}
+
+static void cluster_out_closed(ape_socket *co, acetables *g_ape)
+{
+	cluster_peer *peer = co->data;
+
+	if (co->state == STREAM_ONLINE) {
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "Cluster : lost the connection to node %s", peer->name);
+	}
+}
+
+static void cluster_connect(acetables *g_ape, int *last)
+{
+	cluster_peer *peer;
+
+	for (peer = g_ape->cluster.peers; peer != NULL; peer = peer->next) {
+		ape_socket *co;
+
+		if (sock_from_handle(peer->out, g_ape) != NULL || (co = ape_connect(peer->ip, peer->port, g_ape)) == NULL) {
+			continue;
+		}
+		co->callbacks.on_connect = cluster_out_connected;
+		co->callbacks.on_disconnect = cluster_out_closed;
+		co->callbacks.on_read = cluster_out_read;
+		co->data = peer;
+
+		peer->out = sock_handle(co);
+	}
+}
+
+/* "name@ip:port", NULL if malformed */
+static cluster_peer *cluster_node(char *node, int id)
+{
+	cluster_peer *peer;
+	char *ip, *port;
+
+	if ((ip = strchr(node, '@')) == NULL || (port = strrchr(ip, ':')) == NULL || ip == node || ip - node > CLUSTER_NAME_MAX) {
+		return NULL;
+	}
+	*ip++ = '\0';
+	*port++ = '\0';
+
+	peer = xmalloc(sizeof(*peer));
+	peer->name = xstrdup(node);
+	peer->ip = xstrdup(ip);
+	peer->port = atoi(port);
+	peer->id = id;
+	peer->out.fd = 0;
+	peer->out.gen = 0;
+	peer->in = peer->out;
+	peer->channels = hashtbl_init();
+	peer->pubids = hashtbl_init();
+	peer->next = NULL;
+
+	return peer;
+}
+
+void cluster_config(acetables *g_ape)
+{
+	char *nodes, *node, *saveptr;
+	cluster_peer *peer, **tail = &g_ape->cluster.peers;
+	int id = 0;
+
+	g_ape->cluster.node = NULL;
+	g_ape->cluster.server = 0;
+	g_ape->cluster.peers = NULL;
+	g_ape->cluster.self = NULL;
+	g_ape->cluster.header = NULL;
+	g_ape->cluster.password = CONFIG_VAL(Cluster, password, g_ape->srv);
+
+	if (*CONFIG_VAL(Cluster, node, g_ape->srv) == '\0') {
+		return;
+	}
+	if (*g_ape->cluster.password == '\0') {
+		if (!g_ape->is_daemon) {
+			printf("[WARN] Cluster.password is empty, cluster mode disabled\n");
+		}
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] Cluster.password is empty, cluster mode disabled");
+		return;
+	}
+	g_ape->cluster.node = CONFIG_VAL(Cluster, node, g_ape->srv);
+
+	nodes = xstrdup(CONFIG_VAL(Cluster, nodes, g_ape->srv));
+
+	for (node = strtok_r(nodes, ", ", &saveptr); node != NULL; node = strtok_r(NULL, ", ", &saveptr)) {
+		if (id == CLUSTER_CHANNEL_ID) {
+			if (!g_ape->is_daemon) {
+				printf("[WARN] Cluster.nodes : more than %d nodes, \"%s\" ignored\n", CLUSTER_CHANNEL_ID, node);
+			}
+			ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] Cluster.nodes : more than %d nodes, \"%s\" ignored", CLUSTER_CHANNEL_ID, node);
+		} else if ((peer = cluster_node(node, id++)) == NULL) {
+			if (!g_ape->is_daemon) {
+				printf("[WARN] Cluster.nodes : \"%s\" is not name@ip:port, ignored\n", node);
+			}
+			ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] Cluster.nodes : \"%s\" is not name@ip:port, ignored", node);
+		} else if (strcmp(peer->name, g_ape->cluster.node) == 0) {
+			g_ape->cluster.self = peer;
+		} else {
+			*tail = peer;
+			tail = &peer->next;
+		}
+	}
+	free(nodes);
+
+	if (g_ape->cluster.self == NULL) {
+		if (!g_ape->is_daemon) {
+			printf("[WARN] Cluster.node \"%s\" is not in Cluster.nodes, cluster mode disabled\n", g_ape->cluster.node);
+		}
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] Cluster.node \"%s\" is not in Cluster.nodes, cluster mode disabled", g_ape->cluster.node);
+		g_ape->cluster.node = NULL;
+		return;
+	}
+	/* Session affinity hint for the load balancers (see http_send_headers()) */
+	g_ape->cluster.header = xmalloc(sizeof(CLUSTER_NODE_HEADER) + strlen(g_ape->cluster.node) + 4);
+	sprintf(g_ape->cluster.header, "%s: %s\r\n", CLUSTER_NODE_HEADER, g_ape->cluster.node);
+}
+
+static int cluster_setup(ape_socket *server, acetables *g_ape)
+{
+	server->callbacks.on_accept = cluster_accept;
+	server->callbacks.on_read = cluster_read;
+	server->callbacks.on_disconnect = cluster_in_closed;
+
+	g_ape->cluster.server = server->fd;
+
+	return server->fd;
+}
+
+/* Listener for the other nodes, unless inherited from a previous instance */
+int cluster_init(acetables *g_ape)
+{
+	ape_socket *server;
+
+	if (g_ape->cluster.node == NULL || g_ape->cluster.server) {
+		return 0;
+	}
+	if ((server = ape_listen_tcp(g_ape->cluster.self->port, g_ape->cluster.self->ip, LISTEN_BACKLOG, g_ape)) == NULL) {
+		return 0;
+	}
+
+	return cluster_setup(server, g_ape);
+}
+
+/* Listener inherited from a previous instance (see handoff.c) */
+int cluster_init_fd(int fd, acetables *g_ape)
+{
+	return cluster_setup(ape_listen_fd(fd, g_ape), g_ape);
+}
+
+/* Connections to the other nodes, retried until they are up */
+void cluster_start(acetables *g_ape)
+{
+	if (g_ape->cluster.node == NULL) {
+		return;
+	}
+	cluster_connect(g_ape, NULL);
+	add_periodical(CLUSTER_RECONNECT, 0, cluster_connect, g_ape, g_ape);
+}
+
+/* Same pubid for the channel on every node */
+void cluster_pubid(transpipe *pipe, const char *name, acetables *g_ape)
+{
+	char pubid[33];
+
+	if (g_ape->cluster.node == NULL) {
+		return;
+	}
+	cluster_channel_pubid(name, pubid, g_ape);
+
+	if (get_pipe(pubid, g_ape) != NULL) {
+		return;
+	}
+	hashtbl_erase(g_ape->hPubid, pipe->pubid);
+	memcpy(pipe->pubid, pubid, 33);
+	hashtbl_append(g_ape->hPubid, pipe->pubid, (void *)pipe);
+}
+
+/* The channel got its first local member (members = 1) or lost the last one */
+void cluster_channel(CHANNEL *chan, int members, acetables *g_ape)
+{
+	cluster_peer *peer;
+
+	for (peer = g_ape->cluster.peers; peer != NULL; peer = peer->next) {
+		cluster_send(peer, (members ? CLUSTER_SUB : CLUSTER_UNSUB), chan->name, NULL, 0, g_ape);
+	}
+}
+
+/* Has the channel members on other nodes ? */
+int cluster_subscribed(CHANNEL *chan, acetables *g_ape)
+{
+	cluster_peer *peer;
+
+	for (peer = g_ape->cluster.peers; peer != NULL; peer = peer->next) {
+		if (hashtbl_seek(peer->channels, chan->name) != NULL) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Send the raw once to each node having members of the channel, return their number */
+int cluster_post_channel(RAW *raw, const char *name, acetables *g_ape)
+{
+	cluster_peer *peer;
+	int n = 0;
+
+	for (peer = g_ape->cluster.peers; peer != NULL; peer = peer->next) {
+		if (hashtbl_seek(peer->channels, name) != NULL) {
+			n += cluster_send(peer, CLUSTER_CHANNEL, name, raw->data, raw->len, g_ape);
+		}
+	}
+
+	return n;
+}
+
+/* Pubid unknown here : send the raw to the node owning it (or to the nodes subscribed to this channel), return their number */
+int cluster_post_pipe(RAW *raw, const char *pubid, acetables *g_ape)
+{
+	cluster_peer *peer;
+	int n = 0;
+
+	if ((peer = cluster_owner(pubid, g_ape)) != NULL) {
+		return (peer != g_ape->cluster.self ? cluster_send(peer, CLUSTER_PIPE, pubid, raw->data, raw->len, g_ape) : 0);
+	}
+	if (strlen(pubid) != 32) {
+		return 0;
+	}
+	for (peer = g_ape->cluster.peers; peer != NULL; peer = peer->next) {
+		if (hashtbl_seek(peer->pubids, pubid) != NULL) {
+			n += cluster_send(peer, CLUSTER_PIPE, pubid, raw->data, raw->len, g_ape);
+		}
+	}
+
+	return n;
+}
+
+/* First two hex digits of the pubids and sessids generated here (see gen_sessid_new()) */
+void cluster_id(char *id, acetables *g_ape)
+{
+	static const char hex[16] = "0123456789abcdef";
+
+	if (g_ape->cluster.node != NULL) {
+		id[0] = hex[g_ape->cluster.self->id >> 4];
+		id[1] = hex[g_ape->cluster.self->id & 0x0f];
+	}
+}
+
+/* Name of the node holding this session if it is not this one, NULL otherwise */
+const char *cluster_session_node(const char *sessid, acetables *g_ape)
+{
+	cluster_peer *peer = cluster_owner(sessid, g_ape);
+
+	return (peer != NULL && peer != g_ape->cluster.self ? peer->name : NULL);
+}
@@ -0,0 +1,70 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* cluster.h */
+
+#ifndef _CLUSTER_H
+#define _CLUSTER_H
+
+#include "main.h"
+#include "raw.h"
+
+#define CLUSTER_MAX_MSG 16777216 // Bigger messages close the connection (bytes)
+#define CLUSTER_RECONNECT 1000 // Period (ms) of the connection attempts to the missing nodes
+#define CLUSTER_CHANNEL_ID 0xff // First byte of the channel pubids, the nodes are numbered below
+#define CLUSTER_NODE_HEADER "X-APE-Node" // Added to the HTTP responses (session affinity)
+
+typedef enum {
+	CLUSTER_HELLO, /* node name, Cluster.password */
+	CLUSTER_SUB, /* channel name : it has members on the sending node */
+	CLUSTER_UNSUB, /* channel name : no more members */
+	CLUSTER_CHANNEL, /* channel name, raw for its local members */
+	CLUSTER_PIPE /* pubid, raw for this user (or the local members of this channel) */
+} cluster_msg_t;
+
+typedef struct _cluster_peer cluster_peer;
+struct _cluster_peer {
+	char *name;
+	char *ip;
+	int port;
+	int id; /* index in Cluster.nodes, prefix of the pubids and sessids it generates */
+
+	ape_sock_handle out; /* our connection to the node, everything we send */
+	ape_sock_handle in; /* its connection to us, everything we receive */
+
+	HTBL *channels; /* channels having members on this node */
+	HTBL *pubids; /* and their pubids */
+
+	cluster_peer *next;
+};
+
+void cluster_config(acetables *g_ape);
+int cluster_init(acetables *g_ape);
+int cluster_init_fd(int fd, acetables *g_ape);
+void cluster_start(acetables *g_ape);
+
+void cluster_pubid(struct _transpipe *pipe, const char *name, acetables *g_ape);
+void cluster_channel(struct CHANNEL *chan, int members, acetables *g_ape);
+int cluster_subscribed(struct CHANNEL *chan, acetables *g_ape);
+int cluster_post_channel(RAW *raw, const char *name, acetables *g_ape);
+int cluster_post_pipe(RAW *raw, const char *pubid, acetables *g_ape);
+void cluster_id(char *id, acetables *g_ape);
+const char *cluster_session_node(const char *sessid, acetables *g_ape);
+
+#endif
@@ -21,11 +21,14 @@
 
 #include "cmd.h"
 #include "json.h"
+#include "msgpack.h"
 #include "config.h"
 #include "utils.h"
 #include "proxy.h"
 #include "raw.h"
 #include "transports.h"
+#include "ticks.h"
+#include "cluster.h"
 
 void do_register(acetables *g_ape)
 {
@@ -38,6 +41,7 @@ void do_register(acetables *g_ape)
 	register_cmd("QUIT", 		cmd_quit, 		NEED_SESSID, g_ape);
 	register_cmd("JOIN", 		cmd_join, 		NEED_SESSID, g_ape);
 	register_cmd("LEFT", 		cmd_left, 		NEED_SESSID, g_ape);
+	register_cmd("MEMBERS", 	cmd_members, 	NEED_SESSID, g_ape);
 	register_cmd("SESSION",     cmd_session,	NEED_SESSID, g_ape);
 }
 
@@ -168,10 +172,16 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 				
 				RAW *newraw;
 				json_item *jlist = json_new_object();
+				const char *node;
 
 				json_set_property_strZ(jlist, "code", "004");
 				json_set_property_strZ(jlist, "value", "BAD_SESSID");
 
+				/* Sent to the wrong node (session affinity hint) */
+				if (jsid != NULL && jsid->jval.vu.str.value != NULL && (node = cluster_session_node(jsid->jval.vu.str.value, g_ape)) != NULL) {
+					json_set_property_strZ(jlist, "node", node);
+				}
+
 				newraw = forge_raw(RAW_ERR, jlist);
 				
 				send_raw_inline(pc->client, pc->transport, newraw, g_ape);
@@ -180,9 +190,9 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 			} else if (sub == NULL) {
 				
 				sub = getsubuser(pc->guser, pc->host);
-				if (sub != NULL && sub->client->fd != pc->client->fd && sub->state == ALIVE) {
+				if (sub != NULL && sub->client.fd != pc->client->fd && sub->state == ALIVE && sock_from_handle(sub->client, g_ape) != NULL) {
 					/* The user open a new connection while he already has one openned */
-					struct _transport_open_same_host_p retval = transport_open_same_host(sub, pc->client, pc->guser->transport);
+					struct _transport_open_same_host_p retval = transport_open_same_host(sub, pc->client, pc->guser->transport, g_ape);
 			
 					if (retval.client_close != NULL) {
 						// Send CLOSE if no response has been sent yet
@@ -194,12 +204,11 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 
 							newraw = forge_raw("CLOSE", jlist);
 
-							send_raw_inline((retval.client_close->fd == pc->client->fd ? pc->client : sub->client), pc->transport, newraw, g_ape);
+							send_raw_inline(retval.client_close, pc->transport, newraw, g_ape);
 						}
 						
-						// It's not safe to leave the subuser pointer in co->attach anymore
-						// since subuser could subsequently be deleted, leaving a pointer into free heap.
-						// So, let this socket finish up on its own and pretend its already finished.
+						// This socket doesn't belong to the subuser anymore,
+						// let it finish up on its own and pretend its already finished.
 
 						sub->state = ADIED;
 						sub->headers.sent = 0;
@@ -210,7 +219,8 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 						g_ape->co[retval.client_close->fd]->attach = NULL;
 						safe_shutdown(retval.client_close->fd, g_ape);
 					}
-					sub->client = cp.client = retval.client_listener;
+					cp.client = retval.client_listener;
+					sub->client = sock_handle(cp.client);
 					sub->state = retval.substate;
 					attach = retval.attach;
 			
@@ -220,9 +230,9 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 						subuser_restor(sub, g_ape);
 					}
 				} else if (sub != NULL) {
-					sub->client = pc->client;
+					sub->client = sock_handle(pc->client);
 				}
-				pc->guser->idle = (long int)time(NULL); // update user idle
+				pc->guser->idle = (long int)ape_clock.sec; // update user idle
 
 				sub->idle = pc->guser->idle; // Update subuser idle
 				
@@ -323,6 +333,10 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 			/* If tmpfd is set, we do not have any reasons to change its state */
 			sub->state = ALIVE;
 			
+			if (transport_mux(sock_from_handle(sub->client, g_ape)) != NULL) {
+				sub->tag = pc->tag;
+			}
+			
 			if ((flag & RETURN_HANG) || (flag & RETURN_BAD_PARAMS)) {
 				return (CONNECT_KEEPALIVE);
 			}
@@ -358,13 +372,13 @@ int process_cmd(json_item *ijson, struct _cmd_process *pc, subuser **iuser, acet
 
 unsigned int checkcmd(clientget *cget, transport_t transport, subuser **iuser, acetables *g_ape)
 {
-	struct _cmd_process pc = {cget->hlines, NULL, NULL, cget->client, cget->host, cget->ip_get, transport};
+	struct _cmd_process pc = {cget->hlines, NULL, NULL, cget->client, cget->host, cget->ip_get, transport, cget->tag};
 	
 	json_item *ijson, *ojson;
 	
 	unsigned int ret;
 
-	ijson = ojson = init_json_parser(cget->get);
+	ijson = ojson = (cget->msgpack ? init_msgpack_parser(cget->get, cget->get_len) : init_json_parser(cget->get));
 	if (ijson == NULL || ijson->jchild.child == NULL) {
 		RAW *newraw;
 		json_item *jlist = json_new_object();
@@ -410,7 +424,7 @@ unsigned int cmd_connect(callbackp *callbacki)
 	callbacki->call_user = nuser;
 
 	jstr = json_new_object();
-	json_set_property_objN(jstr, "user", 4, get_json_object_user(callbacki->call_user));
+	json_set_property_objN(jstr, "user", 4, get_json_object_user_cache(callbacki->call_user));
 	
 	newraw = forge_raw("IDENT", jstr);
 	newraw->priority = RAW_PRI_HI;
@@ -605,6 +619,43 @@ unsigned int cmd_left(callbackp *callbacki)
 	return (RETURN_BAD_PARAMS);
 }
 
+/* Next page of a channel users list (see set_members_page) */
+unsigned int cmd_members(callbackp *callbacki)
+{
+	CHANNEL *chan;
+	RAW *newraw;
+	json_item *jlist;
+	char *chan_name;
+	JSON_int_t cursor;
+	
+	APE_PARAMS_INIT();
+	
+	if ((chan_name = JSTR(channel)) != NULL) {
+	
+		if ((chan = getchan(chan_name, callbacki->g_ape)) == NULL) {
+			send_error(callbacki->call_user, "UNKNOWN_CHANNEL", "103", callbacki->g_ape);
+		
+		} else if (!isonchannel(callbacki->call_user, chan)) {
+			send_error(callbacki->call_user, "NOT_IN_CHANNEL", "104", callbacki->g_ape);
+	
+		} else {
+			jlist = json_new_object();
+			
+			/* Join sequences are unsigned long, an int would wrap on long-lived channels */
+			cursor = JLONG(cursor);
+			set_members_page(jlist, chan, (cursor > 0 ? (unsigned long)cursor : 0), callbacki->g_ape);
+			json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
+			
+			newraw = forge_raw(RAW_MEMBERS, jlist);
+			post_raw_sub(newraw, callbacki->call_subuser, callbacki->g_ape);
+		}
+		
+		return (RETURN_NOTHING);
+	}
+	
+	return (RETURN_BAD_PARAMS);
+}
+
 unsigned int cmd_session(callbackp *callbacki)
 {
 	char *key, *val, *action;
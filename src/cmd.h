@@ -116,6 +116,7 @@ struct _cmd_process {
 	const char *host;
 	const char *ip;
 	transport_t transport;
+	unsigned int tag; /* "ape.mux" tag of the session on "client" */
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
@@ -127,6 +128,7 @@ unsigned int cmd_setlevel(struct _callbackp *);
 unsigned int cmd_settopic(struct _callbackp *);
 unsigned int cmd_join(struct _callbackp *);
 unsigned int cmd_left(struct _callbackp *);
+unsigned int cmd_members(struct _callbackp *);
 unsigned int cmd_kick(struct _callbackp *);
 unsigned int cmd_ban(struct _callbackp *);
 unsigned int cmd_session(struct _callbackp *);
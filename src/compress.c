@@ -0,0 +1,534 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* compress.c */
+
+/*
+	permessage-deflate (RFC 7692) for the IETF WebSockets and gzip for the
+	HTTP transports (zlib).
+	Compression.websocket = shared : the server doesn't keep its compression
+	context between messages, a single z_stream per window size is reset
+	for each message and a RAW broadcasted to a channel is compressed once
+	for all its recipients (see send_raws()).
+	Compression.websocket = context : each connection keeps its own z_stream
+	(~256KB), messages reference the previous ones.
+	Clients are always asked not to keep their context : one inflater
+	is shared by all the connections.
+	gzip'ed HTTP bodies are made of independent segments (sync flush) : the
+	segment of a broadcasted RAW is computed once and kept with the RAW.
+	Streaming transports never end their gzip body.
+*/
+
+#include "compress.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+#ifdef _USE_ZLIB
+#include <zlib.h>
+
+void compress_init(acetables *g_ape)
+{
+	char *mode = CONFIG_VAL(Compression, websocket, g_ape->srv);
+	char *level = CONFIG_VAL(Compression, level, g_ape->srv);
+	char *min_size = CONFIG_VAL(Compression, min_size, g_ape->srv);
+	int i;
+
+	if (strcmp(mode, "shared") == 0) {
+		g_ape->compress.websocket = WS_DEFLATE_SHARED;
+	} else if (strcmp(mode, "context") == 0) {
+		g_ape->compress.websocket = WS_DEFLATE_CONTEXT;
+	} else {
+		g_ape->compress.websocket = WS_DEFLATE_OFF;
+	}
+
+	g_ape->compress.level = (*level != '\0' ? atoi(level) : WS_DEFLATE_LEVEL);
+	if (g_ape->compress.level < 0 || g_ape->compress.level > 9) {
+		g_ape->compress.level = WS_DEFLATE_LEVEL;
+	}
+	g_ape->compress.min_size = (*min_size != '\0' ? atoi(min_size) : WS_DEFLATE_MIN_SIZE);
+	g_ape->compress.http = (strcmp(CONFIG_VAL(Compression, http, g_ape->srv), "yes") == 0);
+
+	for (i = 0; i < 16; i++) {
+		g_ape->compress.deflate[i] = NULL;
+	}
+	g_ape->compress.inflate = NULL;
+
+	g_ape->compress.out.data = NULL;
+	g_ape->compress.out.size = 0;
+	g_ape->compress.out.length = 0;
+	g_ape->compress.in = g_ape->compress.out;
+}
+
+void compress_free(acetables *g_ape)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if (g_ape->compress.deflate[i] != NULL) {
+			deflateEnd(g_ape->compress.deflate[i]);
+			free(g_ape->compress.deflate[i]);
+			g_ape->compress.deflate[i] = NULL;
+		}
+	}
+	if (g_ape->compress.inflate != NULL) {
+		inflateEnd(g_ape->compress.inflate);
+		free(g_ape->compress.inflate);
+		g_ape->compress.inflate = NULL;
+	}
+	free(g_ape->compress.out.data);
+	free(g_ape->compress.in.data);
+	g_ape->compress.out.data = NULL;
+	g_ape->compress.in.data = NULL;
+}
+
+static char *compress_trim(char *str)
+{
+	char *end;
+
+	while (*str == ' ' || *str == '\t' || *str == '"') {
+		str++;
+	}
+	end = str + strlen(str);
+
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '"')) {
+		*--end = '\0';
+	}
+
+	return str;
+}
+
+/* Window size parameter, -1 if invalid */
+static int compress_window_bits(const char *value)
+{
+	if (value == NULL || strlen(value) > 2 || strspn(value, "0123456789") != strlen(value)) {
+		return -1;
+	}
+	if (atoi(value) < 8 || atoi(value) > 15) {
+		return -1;
+	}
+	return atoi(value);
+}
+
+/*
+	Pick the first acceptable offer of Sec-WebSocket-Extensions
+	e.g. "permessage-deflate; client_max_window_bits, permessage-deflate"
+	Write the Sec-WebSocket-Extensions response to "reply" and return its length (0 : declined)
+*/
+int ws_deflate_accept(websocket_state *websocket, const char *offers, char *reply, size_t size, acetables *g_ape)
+{
+	char buf[1024], *offer, *nextoffer;
+
+	if (g_ape->compress.websocket == WS_DEFLATE_OFF || offers == NULL) {
+		return 0;
+	}
+	snprintf(buf, sizeof(buf), "%s", offers);
+
+	for (offer = strtok_r(buf, ",", &nextoffer); offer != NULL; offer = strtok_r(NULL, ",", &nextoffer)) {
+		char *param, *nextparam;
+		int bits = 15, takeover = (g_ape->compress.websocket == WS_DEFLATE_CONTEXT);
+		int valid = 1, seen = 0, i;
+
+		for (i = 0, param = strtok_r(offer, ";", &nextparam); param != NULL && valid; i++, param = strtok_r(NULL, ";", &nextparam)) {
+			char *value = strchr(param, '=');
+			int flag = 0;
+
+			if (value != NULL) {
+				*value++ = '\0';
+				value = compress_trim(value);
+			}
+			param = compress_trim(param);
+
+			if (i == 0) {
+				valid = (strcasecmp(param, "permessage-deflate") == 0 && value == NULL);
+				continue;
+			}
+
+			if (strcasecmp(param, "server_no_context_takeover") == 0 && value == NULL) {
+				flag = 1;
+				takeover = 0;
+			} else if (strcasecmp(param, "client_no_context_takeover") == 0 && value == NULL) {
+				flag = 2;
+			} else if (strcasecmp(param, "server_max_window_bits") == 0) {
+				flag = 4;
+				/* zlib doesn't produce raw deflate streams with a 256 bytes window */
+				if ((bits = compress_window_bits(value)) < 9) {
+					valid = 0;
+				}
+			} else if (strcasecmp(param, "client_max_window_bits") == 0) {
+				flag = 8;
+				/* We don't limit the client, its window stays at 15 */
+				if (value != NULL && compress_window_bits(value) == -1) {
+					valid = 0;
+				}
+			} else {
+				valid = 0;
+			}
+
+			/* Each parameter at most once */
+			if (seen & flag) {
+				valid = 0;
+			}
+			seen |= flag;
+		}
+
+		if (valid) {
+			websocket->deflate.bits = bits;
+			websocket->deflate.takeover = takeover;
+
+			if (bits != 15) {
+				return snprintf(reply, size, "permessage-deflate; client_no_context_takeover%s; server_max_window_bits=%i",
+								(takeover ? "" : "; server_no_context_takeover"), bits);
+			}
+			return snprintf(reply, size, "permessage-deflate; client_no_context_takeover%s",
+							(takeover ? "" : "; server_no_context_takeover"));
+		}
+	}
+
+	return 0;
+}
+
+void ws_deflate_free(websocket_state *websocket)
+{
+	if (websocket->deflate.stream != NULL) {
+		deflateEnd(websocket->deflate.stream);
+		free(websocket->deflate.stream);
+		websocket->deflate.stream = NULL;
+	}
+}
+
+static z_stream *compress_deflate_new(int bits, acetables *g_ape)
+{
+	z_stream *z = xmalloc(sizeof(*z));
+
+	z->zalloc = Z_NULL;
+	z->zfree = Z_NULL;
+	z->opaque = Z_NULL;
+
+	/* Negative window : raw deflate data, no zlib header */
+	if (deflateInit2(z, g_ape->compress.level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "deflateInit2() failed");
+		free(z);
+		return NULL;
+	}
+
+	return z;
+}
+
+/* Compressor without context takeover */
+static z_stream *compress_deflate_shared(int bits, acetables *g_ape)
+{
+	z_stream *z;
+
+	if ((z = g_ape->compress.deflate[bits]) == NULL) {
+		z = g_ape->compress.deflate[bits] = compress_deflate_new(bits, g_ape);
+	} else {
+		deflateReset(z);
+	}
+
+	return z;
+}
+
+/* Compressor of the next message, its output is built by ws_deflate_write() and returned by ws_deflate_end() */
+void *ws_deflate_start(websocket_state *websocket, acetables *g_ape)
+{
+	g_ape->compress.out.length = 0;
+
+	if (websocket->deflate.takeover) {
+		if (websocket->deflate.stream == NULL) {
+			websocket->deflate.stream = compress_deflate_new(websocket->deflate.bits, g_ape);
+		}
+		return websocket->deflate.stream;
+	}
+
+	return compress_deflate_shared(websocket->deflate.bits, g_ape);
+}
+
+static void compress_deflate(z_stream *z, const char *data, int len, int flush, acetables *g_ape)
+{
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+
+	do {
+		if (g_ape->compress.out.size - g_ape->compress.out.length < 256) {
+			g_ape->compress.out.size = g_ape->compress.out.size * 2 + 4096;
+			g_ape->compress.out.data = xrealloc(g_ape->compress.out.data, g_ape->compress.out.size);
+		}
+		z->next_out = (Bytef *)&g_ape->compress.out.data[g_ape->compress.out.length];
+		z->avail_out = g_ape->compress.out.size - g_ape->compress.out.length;
+
+		deflate(z, flush);
+
+		g_ape->compress.out.length = g_ape->compress.out.size - z->avail_out;
+	} while (z->avail_in != 0 || z->avail_out == 0);
+}
+
+void ws_deflate_write(void *stream, const char *data, int len, acetables *g_ape)
+{
+	compress_deflate(stream, data, len, Z_NO_FLUSH, g_ape);
+}
+
+/* Valid until the next ws_deflate_start() */
+char *ws_deflate_end(void *stream, int *len, acetables *g_ape)
+{
+	compress_deflate(stream, NULL, 0, Z_SYNC_FLUSH, g_ape);
+
+	/* The empty stored block ending the sync flush (00 00 ff ff) is implied */
+	if (g_ape->compress.out.length >= 4) {
+		g_ape->compress.out.length -= 4;
+	}
+	*len = g_ape->compress.out.length;
+
+	return g_ape->compress.out.data;
+}
+
+static int compress_inflate(z_stream *z, const char *data, int len, acetables *g_ape)
+{
+	int ret;
+
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+
+	do {
+		if (g_ape->compress.in.size - g_ape->compress.in.length < 1024) {
+			if (g_ape->compress.in.size > WS_INFLATE_MAX) {
+				return -1;
+			}
+			g_ape->compress.in.size = g_ape->compress.in.size * 2 + 4096;
+			g_ape->compress.in.data = xrealloc(g_ape->compress.in.data, g_ape->compress.in.size);
+		}
+		z->next_out = (Bytef *)&g_ape->compress.in.data[g_ape->compress.in.length];
+		z->avail_out = g_ape->compress.in.size - g_ape->compress.in.length - 1; /* '\0' */
+
+		ret = inflate(z, Z_SYNC_FLUSH);
+
+		g_ape->compress.in.length = g_ape->compress.in.size - 1 - z->avail_out;
+
+		if (ret == Z_STREAM_END) {
+			/* Final block set by the client, the rest is ignored */
+			return 0;
+		} else if (ret == Z_BUF_ERROR && z->avail_in == 0) {
+			return 0;
+		} else if (ret != Z_OK) {
+			return -1;
+		}
+	} while (z->avail_in != 0 || z->avail_out == 0);
+
+	return 0;
+}
+
+/* NULL on error, valid until the next call */
+char *ws_inflate(const char *data, int len, int *outlen, acetables *g_ape)
+{
+	static const char tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	z_stream *z = g_ape->compress.inflate;
+
+	if (z == NULL) {
+		z = xmalloc(sizeof(*z));
+		z->zalloc = Z_NULL;
+		z->zfree = Z_NULL;
+		z->opaque = Z_NULL;
+		z->next_in = Z_NULL;
+		z->avail_in = 0;
+
+		if (inflateInit2(z, -15) != Z_OK) {
+			free(z);
+			return NULL;
+		}
+		g_ape->compress.inflate = z;
+	} else {
+		inflateReset(z);
+	}
+
+	g_ape->compress.in.length = 0;
+
+	if (compress_inflate(z, data, len, g_ape) == -1 || compress_inflate(z, tail, 4, g_ape) == -1) {
+		return NULL;
+	}
+	g_ape->compress.in.data[g_ape->compress.in.length] = '\0';
+	*outlen = g_ape->compress.in.length;
+
+	return g_ape->compress.in.data;
+}
+
+/*
+	Independent piece of a raw deflate stream (15 bits window) : complete
+	blocks ending on a byte boundary. Pieces smaller than Compression.min_size
+	are stored as is. Valid until the next call.
+*/
+char *deflate_segment(const char *data, int len, int *outlen, acetables *g_ape)
+{
+	z_stream *z;
+
+	g_ape->compress.out.length = 0;
+
+	if (len < g_ape->compress.min_size && len <= 0xFFFF) {
+		unsigned char *out;
+
+		if (g_ape->compress.out.size < len + 5) {
+			g_ape->compress.out.size = len + 4096;
+			g_ape->compress.out.data = xrealloc(g_ape->compress.out.data, g_ape->compress.out.size);
+		}
+		out = (unsigned char *)g_ape->compress.out.data;
+
+		out[0] = 0x00;
+		out[1] = len & 0xFF;
+		out[2] = (len >> 8) & 0xFF;
+		out[3] = ~len & 0xFF;
+		out[4] = (~len >> 8) & 0xFF;
+		memcpy(&out[5], data, len);
+
+		*outlen = len + 5;
+
+		return g_ape->compress.out.data;
+	}
+
+	if ((z = compress_deflate_shared(15, g_ape)) == NULL) {
+		return NULL;
+	}
+	/* Ends with an empty stored block (00 00 ff ff) */
+	compress_deflate(z, data, len, Z_SYNC_FLUSH, g_ape);
+
+	*outlen = g_ape->compress.out.length;
+
+	return g_ape->compress.out.data;
+}
+
+/* "gzip" in Accept-Encoding, and not refused by "q=0" */
+int gzip_accepted(const char *accept_encoding)
+{
+	char buf[512], *coding, *next;
+	int star = 0;
+
+	if (accept_encoding == NULL) {
+		return 0;
+	}
+	snprintf(buf, sizeof(buf), "%s", accept_encoding);
+
+	for (coding = strtok_r(buf, ",", &next); coding != NULL; coding = strtok_r(NULL, ",", &next)) {
+		char *q = strchr(coding, ';');
+		int accepted = 1;
+
+		if (q != NULL) {
+			*q++ = '\0';
+			q = compress_trim(q);
+
+			if (strncasecmp(q, "q=", 2) == 0 && atof(&q[2]) == 0) {
+				accepted = 0;
+			}
+		}
+		coding = compress_trim(coding);
+
+		if (strcasecmp(coding, "gzip") == 0 || strcasecmp(coding, "x-gzip") == 0) {
+			return accepted;
+		} else if (strcmp(coding, "*") == 0) {
+			star = accepted;
+		}
+	}
+
+	return star;
+}
+
+unsigned long gzip_crc(unsigned long crc, const char *data, int len)
+{
+	return crc32(crc, (const Bytef *)data, len);
+}
+
+/* CRC32 and size of the uncompressed body, little-endian */
+void gzip_trailer(char *trailer, unsigned long crc, unsigned int size)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		trailer[i] = (crc >> (i * 8)) & 0xFF;
+		trailer[i + 4] = (size >> (i * 8)) & 0xFF;
+	}
+}
+
+#else
+void compress_init(acetables *g_ape)
+{
+	char *mode = CONFIG_VAL(Compression, websocket, g_ape->srv);
+
+	g_ape->compress.websocket = WS_DEFLATE_OFF;
+	g_ape->compress.http = 0;
+
+	if ((*mode != '\0' && strcmp(mode, "no") != 0) || strcmp(CONFIG_VAL(Compression, http, g_ape->srv), "yes") == 0) {
+		if (!g_ape->is_daemon) {
+			printf("[WARN] APE compiled without zlib, compression disabled\n");
+		}
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] APE compiled without zlib, compression disabled");
+	}
+}
+
+void compress_free(acetables *g_ape)
+{
+
+}
+
+int ws_deflate_accept(websocket_state *websocket, const char *offers, char *reply, size_t size, acetables *g_ape)
+{
+	return 0;
+}
+
+void ws_deflate_free(websocket_state *websocket)
+{
+
+}
+
+void *ws_deflate_start(websocket_state *websocket, acetables *g_ape)
+{
+	return NULL;
+}
+
+void ws_deflate_write(void *stream, const char *data, int len, acetables *g_ape)
+{
+
+}
+
+char *ws_deflate_end(void *stream, int *len, acetables *g_ape)
+{
+	return NULL;
+}
+
+char *ws_inflate(const char *data, int len, int *outlen, acetables *g_ape)
+{
+	return NULL;
+}
+
+char *deflate_segment(const char *data, int len, int *outlen, acetables *g_ape)
+{
+	return NULL;
+}
+
+int gzip_accepted(const char *accept_encoding)
+{
+	return 0;
+}
+
+unsigned long gzip_crc(unsigned long crc, const char *data, int len)
+{
+	return 0;
+}
+
+void gzip_trailer(char *trailer, unsigned long crc, unsigned int size)
+{
+
+}
+#endif
@@ -0,0 +1,66 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* compress.h */
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include "main.h"
+#include "configure.h"
+
+#define WS_DEFLATE_OFF 0 // Compression.websocket = no
+#define WS_DEFLATE_SHARED 1 // Compression.websocket = shared : no context takeover, broadcasts are compressed once
+#define WS_DEFLATE_CONTEXT 2 // Compression.websocket = context : better ratio, one z_stream per connection
+
+#define WS_DEFLATE_LEVEL 6 // Default Compression.level
+#define WS_DEFLATE_MIN_SIZE 128 // Default Compression.min_size
+#define WS_INFLATE_MAX 1048576 // Max size of a decompressed message
+
+/*
+	Pieces of raw deflate streams built by deflate_segment() can be concatenated.
+	Constant pieces are stored blocks (00 LEN NLEN data).
+*/
+#define DEFLATE_OPEN "\x00\x01\x00\xfe\xff["
+#define DEFLATE_CLOSE "\x00\x01\x00\xfe\xff]"
+#define DEFLATE_SYNC "\x00" // WebSocket message end : empty stored block, its "00 00 ff ff" is implied
+#define DEFLATE_FINAL "\x03\x00" // gzip body end : empty final block
+
+#define GZIP_HEADER "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03"
+#define GZIP_CONTENT_ENCODING "Content-Encoding: gzip\r\n"
+
+void compress_init(acetables *g_ape);
+void compress_free(acetables *g_ape);
+
+int ws_deflate_accept(websocket_state *websocket, const char *offers, char *reply, size_t size, acetables *g_ape);
+void ws_deflate_free(websocket_state *websocket);
+
+void *ws_deflate_start(websocket_state *websocket, acetables *g_ape);
+void ws_deflate_write(void *stream, const char *data, int len, acetables *g_ape);
+char *ws_deflate_end(void *stream, int *len, acetables *g_ape);
+
+char *ws_inflate(const char *data, int len, int *outlen, acetables *g_ape);
+
+char *deflate_segment(const char *data, int len, int *outlen, acetables *g_ape);
+
+int gzip_accepted(const char *accept_encoding);
+unsigned long gzip_crc(unsigned long crc, const char *data, int len);
+void gzip_trailer(char *trailer, unsigned long crc, unsigned int size);
+
+#endif
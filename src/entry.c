@@ -40,6 +40,13 @@
 #include "servers.h"
 #include "dns.h"
 #include "log.h"
+#include "pool.h"
+#include "handoff.h"
+#include "push.h"
+#include "cluster.h"
+#include "snapshot.h"
+#include "tls.h"
+#include "compress.h"
 
 #include <grp.h>
 #include <pwd.h>
@@ -61,18 +68,20 @@ static int inc_rlimit(int nofile)
 	return setrlimit(RLIMIT_NOFILE, &rl);
 }
 
+/* The file is only truncated now : it keeps the pid of the running instance until we took over */
 static void write_pid_file(int pidfile, int pid)
 {
 	if (pidfile > 0) {
 		char pidstring[32];
 		int len;
 		len = sprintf(pidstring, "%i", pid);
+		ftruncate(pidfile, 0);
 		write(pidfile, pidstring, len);
 		close(pidfile);
 	}
 }
 
-static void ape_daemon(int pidfile, acetables *g_ape)
+static void ape_daemon(acetables *g_ape)
 {
 
 	if (0 != fork()) {
@@ -88,14 +97,13 @@ static void ape_daemon(int pidfile, acetables *g_ape)
 	}
 
 	g_ape->is_daemon = 1;
-	write_pid_file(pidfile, (int) getpid());
 }
 
 int main(int argc, char **argv)
 {
 	apeconfig *srv;
 
-	int random, im_r00t = 0, pidfd = 0, serverfd;
+	int random, im_r00t = 0, pidfd = 0, serverfd, tlsfd = 0, nrestored;
 	unsigned int getrandom = 0;
 	const char *pidfile = NULL;
 	char *confs_path = NULL;
@@ -105,8 +113,10 @@ int main(int argc, char **argv)
 	char cfgfile[513] = APE_CONFIG_FILE;
 
 	acetables *g_ape;
+	ape_listener *listener;
 	int argi = 0;
 	int overrule_daemon = -1; //nothing fancy, -1: no, just the configuration, 0: yes overrule config, but do no daemon, 1: yes overrule config, but daemonize
+	int need_handoff = 0;
 	if (argc > 1 ) {
 		for (argi = 1; argi < argc; argi++ ) {
 			if (strcmp(argv[argi], "--version") == 0) {
@@ -115,7 +125,7 @@ int main(int argc, char **argv)
 			} else if (strcmp(argv[argi], "--help") == 0) {
 				printf("\n   AJAX Push Engine Server %s - (C) Anthony Catel <a.catel@weelya.com>\n   http://www.ape-project.org/\n", _VERSION);
 				printf("\n   usage: aped [options]\n\n");
-				printf("   Options:\n     --help             : Display this help\n     --version          : Show version number\n     --daemon yes|no    : Overrule the daemon settings in Server section of the config file\n     --cfg    FILE      : Load a specific config file (default is %s)\n\n", cfgfile);
+				printf("   Options:\n     --help             : Display this help\n     --version          : Show version number\n     --daemon yes|no    : Overrule the daemon settings in Server section of the config file\n     --cfg    FILE      : Load a specific config file (default is %s)\n     --handoff          : Take over from the instance running on Server.handoff_socket, fail if there is none\n\n", cfgfile);
 				return 0;
 			} else if (argc > argi + 1 && strcmp(argv[argi], "--cfg") == 0) {
 				memset(cfgfile, 0, 513);
@@ -125,6 +135,8 @@ int main(int argc, char **argv)
 			} else if (argc > argi + 1 && strcmp(argv[argi], "--daemon") == 0) {
 				overrule_daemon = (strcmp(argv[argi + 1], "yes") == 0 );
 				argi++;
+			} else if (strcmp(argv[argi], "--handoff") == 0) {
+				need_handoff = 1;
 			} else {
 				printf("\n   AJAX Push Engine Server %s - (C) Anthony Catel <a.catel@weelya.com>\n   http://www.ape-project.org/\n\n", _VERSION);
 				printf("   Unknown parameters - check \"aped --help\"\n\n");
@@ -144,8 +156,9 @@ int main(int argc, char **argv)
 	signal(SIGINT, &signal_handler);
 	signal(SIGTERM, &signal_handler);
 
+	update_clock();
+
 	g_ape = xmalloc(sizeof(*g_ape));
-	g_ape->basemem = 1; // set 1 for testing if growup works
 	g_ape->srv = srv;
 	g_ape->confs_path = confs_path;
 	if (overrule_daemon == 0) {
@@ -154,15 +167,33 @@ int main(int argc, char **argv)
 		ape_config_set_key(ape_config_get_section(g_ape->srv, "Server"), "daemon", "yes");
 	}
 	g_ape->is_daemon = (strcmp(CONFIG_VAL(Server, daemon, srv), "yes") == 0 )? 1 :0;
+	g_ape->members_page = atoi(CONFIG_VAL(Server, members_page, srv));
 	ape_log_init(g_ape);
 
-	if (VTICKS_RATE < 1) {
-		if (!g_ape->is_daemon) {
-			printf("[ERR] TICKS_RATE cannot be less than 1... exiting\n");
-		}
-		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "[ERR] TICKS_RATE cannot be less than 1... exiting");
-		exit(1);
+	if ((g_ape->timers.rate = atoi(CONFIG_VAL(Server, ticks_rate, srv))) < 1) {
+		g_ape->timers.rate = VTICKS_RATE;
 	}
+	
+	g_ape->read.budget = atoi(CONFIG_VAL(Server, read_budget, srv));
+	g_ape->read.accept_budget = atoi(CONFIG_VAL(Server, accept_budget, srv));
+	g_ape->read.fds = NULL;
+	g_ape->read.nfds = 0;
+	g_ape->read.size = 0;
+	
+	memset(&g_ape->loop, 0, sizeof(g_ape->loop));
+	
+	g_ape->write.high_watermark = atoi(CONFIG_VAL(Server, send_high_watermark, srv));
+	if ((g_ape->write.low_watermark = atoi(CONFIG_VAL(Server, send_low_watermark, srv))) >= g_ape->write.high_watermark) {
+		g_ape->write.low_watermark = g_ape->write.high_watermark / 4;
+	}
+	g_ape->write.notsent_lowat = atoi(CONFIG_VAL(Server, tcp_notsent_lowat, srv));
+	g_ape->write.congested_timeout = atoi(CONFIG_VAL(Server, send_congested_timeout, srv));
+	g_ape->write.fds = NULL;
+	g_ape->write.nfds = 0;
+	g_ape->write.size = 0;
+	g_ape->write.congested = NULL;
+	g_ape->write.ncongested = 0;
+	g_ape->write.congested_size = 0;
 
 	random = open("/dev/urandom", O_RDONLY);
 	if (!random) {
@@ -176,6 +207,13 @@ int main(int argc, char **argv)
 	srand(getrandom);
 	close(random);
 
+	/* Pre-size connection tables so that growup() isn't called during the first connections */
+	if ((g_ape->basemem = atoi(CONFIG_VAL(Server, rlimit_nofile, srv))) < 64) {
+		g_ape->basemem = 64;
+	} else if (g_ape->basemem > PRESIZE_MAX_FDS) {
+		g_ape->basemem = PRESIZE_MAX_FDS;
+	}
+
 	fdev.handler = EVENT_UNKNOWN;
 	#ifdef USE_EPOLL_HANDLER
 	fdev.handler = EVENT_EPOLL;
@@ -186,14 +224,18 @@ int main(int argc, char **argv)
 	#ifdef USE_SELECT_HANDLER
 	fdev.handler = EVENT_SELECT;
 	#endif
+	#ifdef USE_URING_HANDLER
+	if (strcmp(CONFIG_VAL(Server, event_backend, srv), "io_uring") == 0) {
+		fdev.handler = EVENT_URING;
+	}
+	#endif
 
-	g_ape->co = xmalloc(sizeof(*g_ape->co) * g_ape->basemem);
-	memset(g_ape->co, 0, sizeof(*g_ape->co) * g_ape->basemem);
+	sockets_init(g_ape);
 
 	g_ape->bad_cmd_callbacks = NULL;
-	g_ape->bufout = xmalloc(sizeof(struct _socks_bufout) * g_ape->basemem);
 	g_ape->timers.timers = NULL;
 	g_ape->timers.ntimers = 0;
+	pools_init(g_ape);
 	g_ape->events = &fdev;
 	if (events_init(g_ape, &g_ape->basemem) == -1) {
 		if (!g_ape->is_daemon) {
@@ -203,12 +245,49 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	serverfd = servers_init(g_ape);
+	g_ape->handoff.fd = -1;
+	g_ape->handoff.server = 0;
+	g_ape->handoff.done = 0;
+	g_ape->handoff.listener = -1;
+
+	g_ape->snapshot.file = CONFIG_VAL(Server, snapshot_file, srv);
+	if (g_ape->snapshot.file != NULL && *g_ape->snapshot.file == '\0') {
+		g_ape->snapshot.file = NULL;
+	}
+	g_ape->snapshot.child = 0;
+
+	/* Certificate and key may only be readable by root */
+	if (tls_init(g_ape) == -1) {
+		exit(1);
+	}
+
+	push_config(g_ape);
+	cluster_config(g_ape);
+	servers_config_listeners(g_ape);
+
+	/* A running instance hands its listeners over (see handoff_takeover()) */
+	if (!handoff_connect(g_ape)) {
+		if (need_handoff) {
+			printf("[ERR] --handoff : no running instance on Server.handoff_socket\n");
+			exit(1);
+		}
+		serverfd = servers_init(g_ape);
+		tlsfd = servers_init_tls(g_ape);
+		push_init(g_ape);
+		servers_init_listeners(g_ape);
+		cluster_init(g_ape);
+	} else {
+		serverfd = 0;
+	}
+	/* Before switching to the uid user, as the listener (handed over by the running instance otherwise) */
+	if (g_ape->handoff.fd == -1) {
+		handoff_listen(g_ape);
+	}
 	//printf("APE starting up %s:%i\n", CONFIG_VAL(Server, ip_listen, g_ape->srv), atoi(CONFIG_VAL(Server, port, srv)));
 	//ape_log(APE_INFO, __FILE__, __LINE__, g_ape, "APE starting up %s:%i\n", CONFIG_VAL(Server, ip_listen, g_ape->srv), atoi(CONFIG_VAL(Server, port, srv)));
 
 	if ((pidfile = CONFIG_VAL(Server, pid_file, srv)) != NULL) {
-		if ((pidfd = open(pidfile, O_TRUNC | O_WRONLY | O_CREAT, 0655)) == -1) {
+		if ((pidfd = open(pidfile, O_WRONLY | O_CREAT, 0655)) == -1) {
 			if (!g_ape->is_daemon) {
 				printf("[WARN] Cannot open pid file : %s\n", CONFIG_VAL(Server, pid_file, srv));
 			}
@@ -277,21 +356,46 @@ int main(int argc, char **argv)
 
 	if (g_ape->is_daemon) {
 		ape_log(APE_INFO, __FILE__, __LINE__, g_ape, "Starting daemon on %s:%i, pid: %i", CONFIG_VAL(Server, ip_listen, g_ape->srv), atoi(CONFIG_VAL(Server, port, srv)), getpid());
-		ape_daemon(pidfd, g_ape);
+		ape_daemon(g_ape);
 		printf("Started daemon on %s:%i, pid: %i\n", CONFIG_VAL(Server, ip_listen, g_ape->srv), atoi(CONFIG_VAL(Server, port, srv)), getpid());
 		events_reload(g_ape->events);
-		events_add(g_ape->events, serverfd, EVENT_READ);
+		if (serverfd) {
+			events_add(g_ape->events, serverfd, EVENT_READ|EVENT_ACCEPT);
+		}
+		if (tlsfd) {
+			events_add(g_ape->events, tlsfd, EVENT_READ|EVENT_ACCEPT);
+		}
+		if (g_ape->push.server) {
+			events_add(g_ape->events, g_ape->push.server, EVENT_READ|EVENT_ACCEPT);
+		}
+		if (g_ape->push.unix_server) {
+			events_add(g_ape->events, g_ape->push.unix_server, EVENT_READ|EVENT_ACCEPT);
+		}
+		if (g_ape->cluster.server) {
+			events_add(g_ape->events, g_ape->cluster.server, EVENT_READ|EVENT_ACCEPT);
+		}
+		for (listener = g_ape->listeners; listener != NULL; listener = listener->next) {
+			if (listener->fd > 0) {
+				events_add(g_ape->events, listener->fd, EVENT_READ|EVENT_ACCEPT);
+			}
+		}
+		if (g_ape->handoff.listener != -1) {
+			events_add(g_ape->events, g_ape->handoff.listener, EVENT_READ);
+		}
 	} else {
 		printf("   _   ___ ___ \n");
 		printf("  /_\\ | _ \\ __|\n");
 		printf(" / _ \\|  _/ _| \n");
 		printf("/_/ \\_\\_| |___|\nAJAX Push Engine\n\n");
-		printf("Bind on : %s:%i\nPid     : %i\n", CONFIG_VAL(Server, ip_listen, g_ape->srv), atoi(CONFIG_VAL(Server, port, srv)), getpid());
+		printf("Bind on : %s:%i\n", CONFIG_VAL(Server, ip_listen, g_ape->srv), atoi(CONFIG_VAL(Server, port, srv)));
+		for (listener = g_ape->listeners; listener != NULL; listener = listener->next) {
+			printf("Bind on : %s (%s)\n", listener->name, (listener->protocol == LISTENER_PUSH ? "push" : "http"));
+		}
+		printf("Pid     : %i\n", getpid());
 		printf("Version : %s\n", _VERSION);
 		printf("Build   : %s %s\n", __DATE__, __TIME__);
 		printf("Author  : Weelya (contact@weelya.com)\n\n");
 		ape_log(APE_INFO, __FILE__, __LINE__, g_ape, "Started on %s:%i, pid: %i\n\n", CONFIG_VAL(Server, ip_listen, g_ape->srv), atoi(CONFIG_VAL(Server, port, srv)), getpid());
-		write_pid_file(pidfd, (int) getpid());
 	}
 	signal(SIGPIPE, SIG_IGN);
 
@@ -324,17 +428,56 @@ int main(int argc, char **argv)
 
 	transport_start(g_ape);
 
+	compress_init(g_ape);
+
 	findandloadplugin(g_ape);
 
+	if (g_ape->handoff.fd != -1) {
+		if (handoff_takeover(g_ape) == -1) {
+			if (!g_ape->is_daemon) {
+				printf("[ERR] Fatal error: cannot take over the running instance... exiting\n");
+			}
+			ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "[ERR] Fatal error: cannot take over the running instance... exiting");
+			exit(1);
+		}
+		/* The previous instance had no TLS listener */
+		if (g_ape->tls.ctx != NULL && !g_ape->tls.server) {
+			servers_init_tls(g_ape);
+		}
+		push_init(g_ape);
+		servers_init_listeners(g_ape);
+		cluster_init(g_ape);
+		/* Server.handoff_socket has changed */
+		if (g_ape->handoff.listener == -1) {
+			handoff_listen(g_ape);
+		}
+	} else if ((nrestored = snapshot_load(g_ape)) > 0) {
+		if (!g_ape->is_daemon) {
+			printf("Warm start : %i users restored from %s\n", nrestored, g_ape->snapshot.file);
+		}
+		ape_log(APE_INFO, __FILE__, __LINE__, g_ape, "Warm start : %i users restored from %s", nrestored, g_ape->snapshot.file);
+	}
+	/* Not before : a failed takeover leaves the running instance in charge */
+	write_pid_file(pidfd, (int) getpid());
+
+	snapshot_start(g_ape);
+	cluster_start(g_ape);
+
 	server_is_running = 1;
 
 	/* Starting Up */
 	sockroutine(g_ape); /* loop */
 	/* Shutdown */
 
-	if (pidfile != NULL) {
+	/* The new instance has already written its own */
+	if (pidfile != NULL && !g_ape->handoff.done) {
 		unlink(pidfile);
 	}
+	handoff_free(g_ape);
+
+	if (!g_ape->handoff.done) {
+		snapshot_save(g_ape);
+	}
 	//fixme: unregister commands, register_bad_cmd and register_hook_cmd
 
 	free(confs_path);
@@ -345,6 +488,10 @@ int main(int argc, char **argv)
 
 	transport_free(g_ape);
 
+	compress_free(g_ape);
+
+	tls_free(g_ape);
+
 	hashtbl_free(g_ape->hLogin);
 	hashtbl_free(g_ape->hSessid);
 	hashtbl_free(g_ape->hLusers);
@@ -352,20 +499,24 @@ int main(int argc, char **argv)
 
 	hashtbl_free(g_ape->hCallback);
 
-	free(g_ape->bufout);
+	sockets_free(g_ape);
 
 	ape_config_free(srv);
-
-	int i;
-	for (i = 0; i < g_ape->basemem; i++) {
-		if (g_ape->co[i] != NULL) {
-			free(g_ape->co[i]);
-		}
+	
+	if (g_ape->read.fds != NULL) {
+		free(g_ape->read.fds);
+	}
+	if (g_ape->write.fds != NULL) {
+		free(g_ape->write.fds);
+	}
+	if (g_ape->write.congested != NULL) {
+		free(g_ape->write.congested);
 	}
-	free(g_ape->co);
 
 	free_all_plugins(g_ape);
 
+	pools_free(g_ape);
+
 	free(g_ape);
 
 	return 0;
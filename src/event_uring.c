@@ -0,0 +1,759 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* event_uring.c */
+
+/*
+	io_uring (Linux >= 6.1) completion backend.
+	Sockets registered with EVENT_ACCEPT or EVENT_RECV aren't polled, the
+	kernel does the I/O : a multishot IORING_OP_ACCEPT per listener, a
+	multishot IORING_OP_RECV per client picking its buffers from a provided
+	buffer ring, and one IORING_OP_SEND per socket and loop iteration (see
+	flush_sockets()). Like write(), a send completes with what the socket
+	buffer took, except the ones linked to an IORING_OP_SHUTDOWN (connection
+	closed once sent) which wait for everything (MSG_WAITALL).
+	Other sockets (TLS, outgoing, delegates) get a multishot IORING_OP_POLL_ADD.
+	Requests are submitted along with the wait : one io_uring_enter() per
+	loop iteration. user_data holds the fd, a per-fd generation (completions
+	posted for a closed and reused fd are dropped) and the operation.
+*/
+
+#include "events.h"
+#include <sys/time.h>
+#include <time.h>
+
+#ifdef USE_URING_HANDLER
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <poll.h>
+#include <errno.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 1024 /* power of 2 */
+#define URING_BUFFER_SIZE 4096
+#define URING_BGID 0
+
+#define URING_OP_POLL 1
+#define URING_OP_RECV 2
+#define URING_OP_ACCEPT 3
+#define URING_OP_SHUTDOWN 4
+#define URING_OP_SEND 5 /* user_data is the struct _uring_send */
+#define URING_OP_CANCEL 6
+
+#define URING_DATA(fd, gen, op) (((unsigned long long)(gen) << 32) | ((unsigned long long)(fd) << 3) | (op))
+#define URING_OP(data) ((int)((data) & 0x07))
+#define URING_FD(data) ((int)(((data) & 0xffffffff) >> 3))
+#define URING_GEN(data) ((unsigned int)((data) >> 32))
+
+/* SQEs not consumed by the kernel yet */
+#define URING_UNSUBMITTED(ring) (*(ring)->sq_tail - __atomic_load_n((ring)->sq_head, __ATOMIC_ACQUIRE))
+
+struct _uring_send {
+	int fd;
+	unsigned int gen;
+	char *buf;
+	unsigned int len;
+	unsigned int done;
+	int shut;
+};
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/* Push the queued SQEs to the kernel */
+static int uring_submit(struct _uring *ring)
+{
+	int ret;
+
+	if (!ring->to_submit) {
+		return 0;
+	}
+	ret = uring_enter(ring->fd, ring->to_submit, 0, 0, NULL, 0);
+	ring->to_submit = URING_UNSUBMITTED(ring);
+
+	return ret;
+}
+
+/* Make room for "n" SQEs that must be part of the same submission (links) */
+static int uring_reserve(struct _uring *ring, unsigned int n)
+{
+	if (ring->sq_entries - URING_UNSUBMITTED(ring) < n && uring_submit(ring) <= 0) {
+		return 0;
+	}
+	return 1;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct _uring *ring)
+{
+	unsigned int tail = *ring->sq_tail, index;
+	struct io_uring_sqe *sqe;
+
+	/* SQ is full, flush it */
+	if (!uring_reserve(ring, 1)) {
+		return NULL;
+	}
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	return sqe;
+}
+
+/* Give the buffers consumed by the previous iteration back to the kernel */
+static void uring_recycle(struct _uring *ring)
+{
+	unsigned short tail = ring->br->tail;
+	int i;
+
+	if (!ring->nused) {
+		return;
+	}
+
+	for (i = 0; i < ring->nused; i++) {
+		struct io_uring_buf *buf = &ring->br->bufs[(tail + i) & (URING_BUFFERS - 1)];
+
+		/* Don't touch resv, the tail lives in bufs[0] */
+		buf->addr = (unsigned long long)(uintptr_t)(ring->bufs + ring->used[i] * URING_BUFFER_SIZE);
+		buf->len = URING_BUFFER_SIZE;
+		buf->bid = ring->used[i];
+	}
+
+	__atomic_store_n(&ring->br->tail, (unsigned short)(tail + ring->nused), __ATOMIC_RELEASE);
+	ring->nused = 0;
+}
+
+/* (Re)submit the multishot request of "fd", it's done by events_resume() while quiescing */
+static void uring_arm(struct _fdevent *ev, int fd)
+{
+	struct _uring *ring = ev->uring;
+	struct io_uring_sqe *sqe;
+
+	if (ring->quiescing || (sqe = uring_get_sqe(ring)) == NULL) {
+		return;
+	}
+
+	sqe->fd = fd;
+	sqe->user_data = URING_DATA(fd, ring->gen[fd], ring->mode[fd]);
+
+	switch(ring->mode[fd]) {
+		case URING_OP_ACCEPT:
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			break;
+		case URING_OP_RECV:
+			sqe->opcode = IORING_OP_RECV;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = URING_BGID;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			break;
+		default:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = ring->mask[fd];
+			sqe->len = IORING_POLL_ADD_MULTI;
+			break;
+	}
+
+	ring->armed[fd] = 1;
+	ring->inflight++;
+}
+
+/* A fd has been released, the listeners which ran out of fds can accept again */
+static void uring_unstall(struct _fdevent *ev)
+{
+	struct _uring *ring = ev->uring;
+	int fd;
+
+	ring->stalled = 0;
+
+	for (fd = 0; fd < ring->size; fd++) {
+		if (ring->mode[fd] == URING_OP_ACCEPT && !ring->armed[fd]) {
+			uring_arm(ev, fd);
+		}
+	}
+}
+
+static int event_uring_add(struct _fdevent *ev, int fd, int bitadd)
+{
+	struct _uring *ring = ev->uring;
+	unsigned int mask = POLLPRI;
+
+	if (bitadd & EVENT_ACCEPT) {
+		ring->mode[fd] = URING_OP_ACCEPT;
+	} else if (bitadd & EVENT_RECV) {
+		ring->mode[fd] = URING_OP_RECV;
+	} else {
+		if (bitadd & EVENT_READ) {
+			mask |= POLLIN;
+		}
+		if (bitadd & EVENT_WRITE) {
+			mask |= POLLOUT;
+		}
+		ring->mode[fd] = URING_OP_POLL;
+		ring->mask[fd] = mask;
+	}
+
+	uring_arm(ev, fd);
+
+	return 1;
+}
+
+static int event_uring_remove(struct _fdevent *ev, int fd)
+{
+	struct _uring *ring = ev->uring;
+	struct io_uring_sqe *sqe;
+
+	ring->gen[fd]++;
+	ring->mode[fd] = 0;
+
+	if ((ring->armed[fd] || ring->sending[fd]) && (sqe = uring_get_sqe(ring)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = URING_OP_CANCEL;
+		ring->inflight++;
+
+		/* The requests hold a reference on the file, it must be dropped before close() */
+		uring_enter(ring->fd, ring->to_submit, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+		ring->to_submit = URING_UNSUBMITTED(ring);
+	}
+
+	ring->armed[fd] = 0;
+	ring->sending[fd] = 0;
+
+	if (ring->stalled) {
+		uring_unstall(ev);
+	}
+
+	return 1;
+}
+
+static int uring_send_submit(struct _fdevent *ev, struct _uring_send *send)
+{
+	struct _uring *ring = ev->uring;
+	struct io_uring_sqe *sqe;
+
+	/* A link can't span two submissions */
+	if (!uring_reserve(ring, 2) || (sqe = uring_get_sqe(ring)) == NULL) {
+		return 0;
+	}
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = send->fd;
+	sqe->addr = (unsigned long long)(uintptr_t)(send->buf + send->done);
+	sqe->len = send->len - send->done;
+	sqe->msg_flags = MSG_NOSIGNAL | (send->shut ? MSG_WAITALL : 0);
+	sqe->user_data = (unsigned long long)(uintptr_t)send | URING_OP_SEND;
+
+	ring->inflight++;
+	ring->sending[send->fd]++;
+
+	if (send->shut) {
+		sqe->flags = IOSQE_IO_LINK;
+
+		sqe = uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_SHUTDOWN;
+		sqe->fd = send->fd;
+		sqe->len = SHUT_RDWR;
+		sqe->user_data = URING_DATA(send->fd, send->gen, URING_OP_SHUTDOWN);
+
+		ring->inflight++;
+		ring->sending[send->fd]++;
+	}
+
+	return 1;
+}
+
+static int event_uring_send(struct _fdevent *ev, int fd, char *buf, unsigned int len, int shut)
+{
+	struct _uring_send *send;
+
+	if (ev->uring->quiescing) {
+		return 0;
+	}
+
+	send = xmalloc(sizeof(*send));
+
+	send->fd = fd;
+	send->gen = ev->uring->gen[fd];
+	send->buf = buf;
+	send->len = len;
+	send->done = 0;
+	send->shut = shut;
+
+	if (!uring_send_submit(ev, send)) {
+		free(send);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int uring_event(struct _uring *ring, int nfds, int fd, int revents, int res, void *data)
+{
+	ring->events[nfds].fd = fd;
+	ring->events[nfds].revents = revents;
+	ring->events[nfds].res = res;
+	ring->events[nfds].gen = ring->gen[fd];
+	ring->events[nfds].data = data;
+
+	return nfds + 1;
+}
+
+static int uring_send_complete(struct _fdevent *ev, struct _uring_send *send, int res, int nfds)
+{
+	struct _uring *ring = ev->uring;
+	char *buf = send->buf;
+
+	if (res > 0) {
+		send->done += res;
+	}
+
+	/* The socket has been closed */
+	if (send->gen != ring->gen[send->fd]) {
+		free(buf);
+		free(send);
+		return nfds;
+	}
+
+	ring->sending[send->fd]--;
+
+	/* Interrupted, the linked shutdown has been cancelled : send the rest (and shutdown) again */
+	if (send->shut && res > 0 && send->done < send->len && !ring->quiescing && uring_send_submit(ev, send)) {
+		return nfds;
+	}
+
+	/* Short or cancelled (quiescing) : what has been sent so far */
+	if (res >= 0 || res == -ECANCELED) {
+		res = send->done;
+	}
+
+	nfds = uring_event(ring, nfds, send->fd, EVENT_SEND, res, buf);
+
+	free(send);
+
+	return nfds;
+}
+
+/* Turn a completion into an event, returns the new number of events */
+static int uring_complete(struct _fdevent *ev, struct io_uring_cqe *cqe, int nfds)
+{
+	struct _uring *ring = ev->uring;
+	unsigned long long data = cqe->user_data;
+	int op = URING_OP(data), fd = URING_FD(data), res = cqe->res, more = (cqe->flags & IORING_CQE_F_MORE), bitret = 0;
+	char *buf = NULL;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		ring->used[ring->nused++] = bid;
+		buf = ring->bufs + bid * URING_BUFFER_SIZE;
+	}
+
+	if (!more) {
+		ring->inflight--;
+	}
+
+	if (op == URING_OP_CANCEL) {
+		return nfds;
+	}
+	if (op == URING_OP_SEND) {
+		return uring_send_complete(ev, (struct _uring_send *)(uintptr_t)(data & ~0x07ULL), res, nfds);
+	}
+
+	if (fd >= ring->size || URING_GEN(data) != ring->gen[fd]) {
+		/* Nobody will close it */
+		if (op == URING_OP_ACCEPT && res >= 0) {
+			close(res);
+		}
+		return nfds;
+	}
+
+	if (op == URING_OP_SHUTDOWN) {
+		ring->sending[fd]--;
+		return nfds;
+	}
+
+	if (!more) {
+		ring->armed[fd] = 0;
+	}
+
+	switch(op) {
+		case URING_OP_ACCEPT:
+			if (res == -EMFILE || res == -ENFILE) {
+				/* Accept again once a fd is released (see event_uring_remove()) */
+				ring->stalled = 1;
+				return nfds;
+			}
+			if (!more && res != -ECANCELED) {
+				uring_arm(ev, fd);
+			}
+			if (res < 0) {
+				return nfds;
+			}
+			return uring_event(ring, nfds, fd, EVENT_ACCEPT, res, NULL);
+		case URING_OP_RECV:
+			/* Out of buffers (they are given back on the next poll) or terminated by the kernel */
+			if (res == -ENOBUFS || (res > 0 && !more)) {
+				uring_arm(ev, fd);
+			}
+			if (res == -ENOBUFS || res == -ECANCELED) {
+				return nfds;
+			}
+			return uring_event(ring, nfds, fd, EVENT_RECV, res, buf);
+		default:
+			if (!more && res != -ECANCELED) {
+				uring_arm(ev, fd);
+			}
+			if (res < 0) {
+				return nfds;
+			}
+			if (res & (POLLIN | POLLPRI | POLLHUP | POLLERR)) {
+				bitret = EVENT_READ;
+			}
+			if (res & POLLOUT) {
+				bitret |= EVENT_WRITE;
+			}
+
+			/* Several completions for the same fd are merged */
+			if (ring->slot[fd]) {
+				ring->events[ring->slot[fd] - 1].revents |= bitret;
+				return nfds;
+			}
+			ring->slot[fd] = nfds + 1;
+
+			return uring_event(ring, nfds, fd, bitret, 0, NULL);
+	}
+}
+
+static int event_uring_poll(struct _fdevent *ev, int timeout_ms)
+{
+	struct _uring *ring = ev->uring;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int head;
+	int nfds = 0, i;
+
+	uring_recycle(ring);
+
+	memset(&arg, 0, sizeof(arg));
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		arg.ts = (unsigned long long)&ts;
+	}
+
+	/* Submit and wait in a single syscall */
+	if (uring_enter(ring->fd, ring->to_submit, (timeout_ms == 0 ? 0 : 1),
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1 && errno != ETIME && errno != EINTR) {
+		return -1;
+	}
+	ring->to_submit = URING_UNSUBMITTED(ring);
+
+	head = *ring->cq_head;
+
+	/* An event per completion at most, the others wait for the next poll */
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) && nfds < ring->size) {
+		nfds = uring_complete(ev, &ring->cqes[head & *ring->cq_mask], nfds);
+		head++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	for (i = 0; i < nfds; i++) {
+		ring->slot[ring->events[i].fd] = 0;
+	}
+
+	return nfds;
+}
+
+/* -1 if the socket has been closed by a previous event of this poll */
+static int event_uring_get_fd(struct _fdevent *ev, int i)
+{
+	int fd = ev->uring->events[i].fd;
+
+	return (ev->uring->events[i].gen == ev->uring->gen[fd] ? fd : -1);
+}
+
+static int event_uring_revent(struct _fdevent *ev, int i)
+{
+	return ev->uring->events[i].revents;
+}
+
+static int event_uring_result(struct _fdevent *ev, int i)
+{
+	return ev->uring->events[i].res;
+}
+
+static void *event_uring_data(struct _fdevent *ev, int i)
+{
+	return ev->uring->events[i].data;
+}
+
+/* Cancel everything, nothing is submitted until event_uring_resume() */
+static int event_uring_quiesce(struct _fdevent *ev)
+{
+	struct _uring *ring = ev->uring;
+	struct io_uring_sqe *sqe;
+
+	if (!ring->quiescing && (sqe = uring_get_sqe(ring)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = URING_OP_CANCEL;
+
+		ring->inflight++;
+		ring->quiescing = 1;
+	}
+
+	return (ring->inflight == 0);
+}
+
+static void event_uring_resume(struct _fdevent *ev)
+{
+	struct _uring *ring = ev->uring;
+	int fd;
+
+	ring->quiescing = 0;
+
+	for (fd = 0; fd < ring->size; fd++) {
+		if (ring->mode[fd] && !ring->armed[fd]) {
+			uring_arm(ev, fd);
+		}
+	}
+}
+
+static void event_uring_growup(struct _fdevent *ev)
+{
+	struct _uring *ring = ev->uring;
+	int old = ring->size;
+
+	ring->size = *ev->basemem;
+
+	ring->events = xrealloc(ring->events, sizeof(*ring->events) * ring->size);
+	ring->gen = xrealloc(ring->gen, sizeof(*ring->gen) * ring->size);
+	ring->mask = xrealloc(ring->mask, sizeof(*ring->mask) * ring->size);
+	ring->mode = xrealloc(ring->mode, sizeof(*ring->mode) * ring->size);
+	ring->armed = xrealloc(ring->armed, sizeof(*ring->armed) * ring->size);
+	ring->sending = xrealloc(ring->sending, sizeof(*ring->sending) * ring->size);
+	ring->slot = xrealloc(ring->slot, sizeof(*ring->slot) * ring->size);
+
+	memset(&ring->gen[old], 0, sizeof(*ring->gen) * (ring->size - old));
+	memset(&ring->mode[old], 0, sizeof(*ring->mode) * (ring->size - old));
+	memset(&ring->armed[old], 0, sizeof(*ring->armed) * (ring->size - old));
+	memset(&ring->sending[old], 0, sizeof(*ring->sending) * (ring->size - old));
+	memset(&ring->slot[old], 0, sizeof(*ring->slot) * (ring->size - old));
+}
+
+/* URING_BUFFERS buffers of URING_BUFFER_SIZE bytes in group URING_BGID */
+static int uring_setup_buffers(struct _uring *ring)
+{
+	struct io_uring_buf_reg reg;
+	int i;
+
+	if ((ring->br = mmap(NULL, sizeof(struct io_uring_buf) * URING_BUFFERS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		return 0;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long long)(uintptr_t)ring->br;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		munmap(ring->br, sizeof(struct io_uring_buf) * URING_BUFFERS);
+		return 0;
+	}
+
+	ring->bufs = xmalloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	ring->used = xmalloc(sizeof(*ring->used) * URING_BUFFERS);
+
+	for (i = 0; i < URING_BUFFERS; i++) {
+		ring->used[i] = i;
+	}
+	ring->nused = URING_BUFFERS;
+
+	uring_recycle(ring);
+
+	return 1;
+}
+
+static int uring_setup(struct _uring *ring)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+
+	/* Completions are only posted when we wait for them (a single thread drives the ring) */
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = URING_ENTRIES * 4;
+
+	if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1) {
+		return 0;
+	}
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+		!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_POLL_32BITS)) {
+		close(ring->fd);
+		return 0;
+	}
+
+	ring->ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->ring_sz) {
+		ring->ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if ((ring->ring = mmap(NULL, ring->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		close(ring->fd);
+		return 0;
+	}
+	if ((ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		munmap(ring->ring, ring->ring_sz);
+		close(ring->fd);
+		return 0;
+	}
+
+	ring->sq_head = (void *)((char *)ring->ring + params.sq_off.head);
+	ring->sq_tail = (void *)((char *)ring->ring + params.sq_off.tail);
+	ring->sq_mask = (void *)((char *)ring->ring + params.sq_off.ring_mask);
+	ring->sq_array = (void *)((char *)ring->ring + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+
+	ring->cq_head = (void *)((char *)ring->ring + params.cq_off.head);
+	ring->cq_tail = (void *)((char *)ring->ring + params.cq_off.tail);
+	ring->cq_mask = (void *)((char *)ring->ring + params.cq_off.ring_mask);
+	ring->cqes = (void *)((char *)ring->ring + params.cq_off.cqes);
+
+	ring->to_submit = 0;
+	ring->inflight = 0;
+	ring->quiescing = 0;
+	ring->stalled = 0;
+
+	/* Provided buffer rings need a 5.19+ kernel */
+	if (!uring_setup_buffers(ring)) {
+		munmap(ring->sqes, ring->sqes_sz);
+		munmap(ring->ring, ring->ring_sz);
+		close(ring->fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void uring_close(struct _uring *ring)
+{
+	munmap(ring->br, sizeof(struct io_uring_buf) * URING_BUFFERS);
+	free(ring->bufs);
+	free(ring->used);
+
+	munmap(ring->sqes, ring->sqes_sz);
+	munmap(ring->ring, ring->ring_sz);
+	close(ring->fd);
+}
+
+/* The ring can't be shared with the parent after a fork() : rebuild it */
+static int event_uring_reload(struct _fdevent *ev)
+{
+	struct _uring *ring = ev->uring;
+
+	uring_close(ring);
+
+	memset(ring->gen, 0, sizeof(*ring->gen) * ring->size);
+	memset(ring->mode, 0, sizeof(*ring->mode) * ring->size);
+	memset(ring->armed, 0, sizeof(*ring->armed) * ring->size);
+	memset(ring->sending, 0, sizeof(*ring->sending) * ring->size);
+
+	return uring_setup(ring);
+}
+
+void event_uring_free(struct _fdevent *ev)
+{
+	uring_close(ev->uring);
+
+	free(ev->uring->events);
+	free(ev->uring->gen);
+	free(ev->uring->mask);
+	free(ev->uring->mode);
+	free(ev->uring->armed);
+	free(ev->uring->sending);
+	free(ev->uring->slot);
+	free(ev->uring);
+}
+
+int event_uring_init(struct _fdevent *ev)
+{
+	ev->uring = xmalloc(sizeof(*ev->uring));
+
+	if (!uring_setup(ev->uring)) {
+		free(ev->uring);
+		ev->uring = NULL;
+		return 0;
+	}
+
+	ev->uring->size = 0;
+	ev->uring->events = NULL;
+	ev->uring->gen = NULL;
+	ev->uring->mask = NULL;
+	ev->uring->mode = NULL;
+	ev->uring->armed = NULL;
+	ev->uring->sending = NULL;
+	ev->uring->slot = NULL;
+
+	event_uring_growup(ev);
+
+	ev->add = event_uring_add;
+	ev->remove = event_uring_remove;
+	ev->poll = event_uring_poll;
+	ev->get_current_fd = event_uring_get_fd;
+	ev->growup = event_uring_growup;
+	ev->revent = event_uring_revent;
+	ev->reload = event_uring_reload;
+	ev->result = event_uring_result;
+	ev->data = event_uring_data;
+	ev->send = event_uring_send;
+	ev->quiesce = event_uring_quiesce;
+	ev->resume = event_uring_resume;
+
+	return 1;
+}
+
+#else
+int event_uring_init(struct _fdevent *ev)
+{
+	return 0;
+}
+
+void event_uring_free(struct _fdevent *ev)
+{
+
+}
+#endif
+
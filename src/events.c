@@ -21,12 +21,33 @@
 
 #include "events.h"
 #include "main.h"
+#include "log.h"
+
+#ifdef USE_EPOLL_HANDLER
+#include <sys/timerfd.h>
+#endif
 
 int events_init(acetables *g_ape, int *basemem)
 {
 	g_ape->events->basemem = basemem;
+	g_ape->events->timer_fd = -1;
+	g_ape->events->timer_deadline = -1;
+	
+	g_ape->events->result = NULL;
+	g_ape->events->data = NULL;
+	g_ape->events->send = NULL;
+	g_ape->events->quiesce = NULL;
+	g_ape->events->resume = NULL;
 
 	switch(g_ape->events->handler) {
+		case EVENT_URING:
+			if (event_uring_init(g_ape->events)) {
+				return 1;
+			}
+			ape_log(APE_WARN, __FILE__, __LINE__, g_ape, 
+				"io_uring is not available, falling back to epoll");
+			
+			g_ape->events->handler = EVENT_EPOLL;
 		case EVENT_EPOLL:
 			return event_epoll_init(g_ape->events);
 			break;
@@ -43,7 +64,9 @@ int events_init(acetables *g_ape, int *basemem)
 
 void events_free(acetables *g_ape)
 {
-	if (g_ape->events->handler != EVENT_UNKNOWN) {
+	if (g_ape->events->handler == EVENT_URING) {
+		event_uring_free(g_ape->events);
+	} else if (g_ape->events->handler != EVENT_UNKNOWN) {
 		free(g_ape->events->events);
 	}
 }
@@ -91,3 +114,103 @@ int events_reload(struct _fdevent *ev)
 {
 	return ev->reload(ev);
 }
+
+/* Does the backend accept, read and write the sockets registered with EVENT_ACCEPT/EVENT_RECV itself ? */
+int events_completion(struct _fdevent *ev)
+{
+	return (ev->send != NULL);
+}
+
+int events_result(struct _fdevent *ev, int i)
+{
+	return ev->result(ev, i);
+}
+
+void *events_data(struct _fdevent *ev, int i)
+{
+	return ev->data(ev, i);
+}
+
+/* 
+	Send "buf" (then shutdown() if "shut"), the EVENT_SEND event gives it back.
+	Returns 0 if it can't be submitted right now (buf is still ours)
+*/
+int events_send(struct _fdevent *ev, int fd, char *buf, unsigned int len, int shut)
+{
+	return ev->send(ev, fd, buf, len, shut);
+}
+
+/* Cancel the I/O in flight and don't submit more, 1 once everything has completed */
+int events_quiesce(struct _fdevent *ev)
+{
+	if (ev->quiesce == NULL) {
+		return 1;
+	}
+	return ev->quiesce(ev);
+}
+
+void events_resume(struct _fdevent *ev)
+{
+	if (ev->resume != NULL) {
+		ev->resume(ev);
+	}
+}
+
+/*
+	Linux provides a fd-driven timer system (timerfd, 2.6.25).
+	The returned fd has to be watched for EVENT_READ, it's readable when the
+	deadline given to events_timer_arm() is reached.
+*/
+int events_timer_init(struct _fdevent *ev)
+{
+	#ifdef USE_EPOLL_HANDLER
+	/* io_uring waits with a timeout, no extra fd to poll */
+	if (ev->handler != EVENT_URING) {
+		ev->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	}
+	#endif
+	
+	return ev->timer_fd;
+}
+
+/* 
+	Arm the tick source on an absolute CLOCK_MONOTONIC deadline (ms), -1 to disarm.
+	Returns 0 if there is no tick source (poll() timeout must be used instead)
+*/
+int events_timer_arm(struct _fdevent *ev, long long deadline_ms)
+{
+	#ifdef USE_EPOLL_HANDLER
+	struct itimerspec its;
+	
+	if (ev->timer_fd == -1) {
+		return 0;
+	}
+	
+	/* Don't re-arm (syscall) for the same deadline */
+	if (deadline_ms == ev->timer_deadline) {
+		return 1;
+	}
+	
+	memset(&its, 0, sizeof(its));
+	
+	if (deadline_ms != -1) {
+		its.it_value.tv_sec = deadline_ms / 1000;
+		its.it_value.tv_nsec = (deadline_ms % 1000) * 1000000L;
+		
+		/* A zero it_value disarms the timer */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+			its.it_value.tv_nsec = 1;
+		}
+	}
+	
+	if (timerfd_settime(ev->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		return 0;
+	}
+	
+	ev->timer_deadline = deadline_ms;
+	
+	return 1;
+	#else
+	return 0;
+	#endif
+}
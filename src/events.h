@@ -33,6 +33,9 @@
 #ifdef USE_EPOLL_HANDLER
 #include <sys/epoll.h>
 #endif
+#ifdef USE_URING_HANDLER
+#include <linux/io_uring.h>
+#endif
 #ifdef USE_SELECT_HANDLER
 #include <sys/time.h>
 #define MAX_SELECT_FDS	1024
@@ -42,6 +45,11 @@
 #define EVENT_READ 0x01
 #define EVENT_WRITE 0x02
 
+/* Completion flags (events_completion()) : the I/O has been done by the backend */
+#define EVENT_ACCEPT 0x04	/* events_result() : accepted fd */
+#define EVENT_RECV 0x08		/* events_result() : bytes read in events_data(), 0 on EOF, -errno */
+#define EVENT_SEND 0x10		/* events_result() : bytes sent from events_data() (given back), -errno */
+
 /* Events handler */
 typedef enum {
 	EVENT_UNKNOWN,
@@ -49,7 +57,8 @@ typedef enum {
 	EVENT_KQUEUE, 	/* BSD */
 	EVENT_DEVPOLL,	/* Solaris */
 	EVENT_POLL,	/* POSIX */
-	EVENT_SELECT	/* Generic */
+	EVENT_SELECT,	/* Generic */
+	EVENT_URING	/* Linux >= 6.1 (Server.event_backend = io_uring) */
 } fdevent_handler_t;
 
 #ifdef USE_SELECT_HANDLER
@@ -60,9 +69,59 @@ typedef struct {
 } select_fd_t;
 #endif
 
+#ifdef USE_URING_HANDLER
+struct _uring {
+	int fd;
+	
+	void *ring; /* SQ and CQ rings share the same mapping */
+	size_t ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	unsigned int to_submit;
+	
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	
+	/* Provided buffers (IORING_REGISTER_PBUF_RING) the multishot receives pick from */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned short *used; /* consumed, given back on the next poll */
+	int nused;
+	
+	/* Indexed by fd */
+	unsigned int *gen;
+	unsigned int *mask;
+	unsigned char *mode; /* multishot request to keep armed (URING_OP_*) */
+	unsigned char *armed;
+	int *sending; /* sends (and linked shutdowns) in flight */
+	unsigned int *slot;
+	int size;
+	
+	unsigned int inflight; /* requests that will still post a completion */
+	int quiescing;
+	int stalled; /* a listener hit EMFILE */
+	
+	struct {
+		int fd;
+		int revents;
+		int res;
+		unsigned int gen;
+		void *data;
+	} *events;
+};
+#endif
+
 struct _fdevent {
 	/* Common values */
 	int *basemem;
+	
+	/* Tick source (see events_timer_init()), -1 if not available */
+	int timer_fd;
+	long long timer_deadline;
+	
 	/* Interface */
 	int (*add)(struct _fdevent *, int, int);
 	int (*remove)(struct _fdevent *, int);
@@ -72,6 +131,13 @@ struct _fdevent {
 	int (*revent)(struct _fdevent *, int);
 	int (*reload)(struct _fdevent *);
 	
+	/* Completion backends only (NULL otherwise) */
+	int (*result)(struct _fdevent *, int);
+	void *(*data)(struct _fdevent *, int);
+	int (*send)(struct _fdevent *, int, char *, unsigned int, int);
+	int (*quiesce)(struct _fdevent *);
+	void (*resume)(struct _fdevent *);
+	
 	/* Specifics values */
 	#ifdef USE_KQUEUE_HANDLER
 	struct kevent *events;
@@ -81,6 +147,9 @@ struct _fdevent {
 	struct epoll_event *events;
 	int epoll_fd;
 	#endif
+	#ifdef USE_URING_HANDLER
+	struct _uring *uring;
+	#endif
         #ifdef USE_SELECT_HANDLER
         select_fd_t fds[MAX_SELECT_FDS];
         select_fd_t **events; /* Pointers into fds */
@@ -98,9 +167,19 @@ int events_get_current_fd(struct _fdevent *ev, int i);
 void events_growup(struct _fdevent *ev);
 int events_revent(struct _fdevent *ev, int i);
 int events_reload(struct _fdevent *ev);
+int events_completion(struct _fdevent *ev);
+int events_result(struct _fdevent *ev, int i);
+void *events_data(struct _fdevent *ev, int i);
+int events_send(struct _fdevent *ev, int fd, char *buf, unsigned int len, int shut);
+int events_quiesce(struct _fdevent *ev);
+void events_resume(struct _fdevent *ev);
+int events_timer_init(struct _fdevent *ev);
+int events_timer_arm(struct _fdevent *ev, long long deadline_ms);
 
 int event_kqueue_init(struct _fdevent *ev);
 int event_epoll_init(struct _fdevent *ev);
 int event_select_init(struct _fdevent *ev);
+int event_uring_init(struct _fdevent *ev);
+void event_uring_free(struct _fdevent *ev);
 
 #endif
@@ -25,6 +25,8 @@
 #include "utils.h"
 #include "json.h"
 
+static unsigned long extend_rev = 0;
+
 /*
 	Add a property to an object (user, channel, proxy, acetables)
 	
@@ -71,6 +73,7 @@ extend *add_property(extend **entry, const char *key, void *val, EXTEND_TYPE ety
 	new_property->next = eTmp;
 	new_property->type = etype;
 	new_property->visibility = visibility;
+	new_property->rev = (visibility == EXTEND_ISPUBLIC ? ++extend_rev : 0);
 	
 	*entry = new_property;
 	
@@ -154,6 +157,62 @@ void clear_properties(extend **entry)
 }
 
 
+static void extend_public_state(extend *entry, int *npublic, unsigned long *rev)
+{
+	*npublic = 0;
+	*rev = 0;
+	
+	while (entry != NULL) {
+		if (entry->visibility == EXTEND_ISPUBLIC) {
+			(*npublic)++;
+			if (entry->rev > *rev) {
+				*rev = entry->rev;
+			}
+		}
+		entry = entry->next;
+	}
+}
+
+/*
+	A cache is still valid as long as no public property has been added
+	(the highest stamp would have grown) or deleted (one less public property).
+	Walking the list is way cheaper than rebuilding and serializing the JSON tree.
+*/
+int extend_cache_isvalid(extend *entry, extend_cache *cache)
+{
+	int npublic;
+	unsigned long rev;
+	
+	if (cache->data == NULL) {
+		return 0;
+	}
+	
+	extend_public_state(entry, &npublic, &rev);
+	
+	return (npublic == cache->npublic && rev == cache->rev);
+}
+
+/* data must be malloc'ed, it's owned by the cache from now */
+void extend_cache_set(extend *entry, extend_cache *cache, char *data, int len)
+{
+	if (cache->data != NULL) {
+		free(cache->data);
+	}
+	cache->data = data;
+	cache->len = len;
+	
+	extend_public_state(entry, &cache->npublic, &cache->rev);
+}
+
+void extend_cache_free(extend_cache *cache)
+{
+	if (cache->data != NULL) {
+		free(cache->data);
+		cache->data = NULL;
+	}
+	cache->len = 0;
+}
+
 #if 0
 extend *add_property_str(extend **entry, char *key, char *val)
 {
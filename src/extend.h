@@ -44,13 +44,30 @@ struct _extend
 	EXTEND_TYPE type;
 	EXTEND_PUBLIC visibility;
 	
+	/* Stamp of the last add_property() on a public property (see extend_cache) */
+	unsigned long rev;
+	
 	struct _extend *next;
 	char key[EXTEND_KEY_LENGTH+1];
 };
 
+/* Serialized public properties of an object, rebuilt when they change */
+typedef struct _extend_cache
+{
+	char *data;
+	int len;
+	
+	int npublic;
+	unsigned long rev;
+} extend_cache;
+
 extend *get_property(extend *entry, const char *key);
 void clear_properties(extend **entry);
 void del_property(extend **entry, const char *key);
 //extend *add_property_str(extend **entry, char *key, char *val);
 extend *add_property(extend **entry, const char *key, void *val, EXTEND_TYPE etype, EXTEND_PUBLIC visibility);
+
+int extend_cache_isvalid(extend *entry, extend_cache *cache);
+void extend_cache_set(extend *entry, extend_cache *cache, char *data, int len);
+void extend_cache_free(extend_cache *cache);
 #endif
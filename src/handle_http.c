@@ -32,6 +32,10 @@
 #include "md5.h"
 #include "sha1.h"
 #include "base64.h"
+#include "compress.h"
+#include "raw.h"
+#include "msgpack.h"
+#include "transports.h"
 
 /* Websocket GUID as defined by -07 (since -06) */
 /* http://tools.ietf.org/html/draft-ietf-hybi-thewebsocketprotocol-07 */
@@ -41,13 +45,30 @@ static int gettransport(char *input)
 {
 	char *start = strchr(input, '/');
 
-	if (start != NULL && start[1] >= 48 && start[1] <= 54 && start[2] == '/') {
+	if (start != NULL && ((start[1] >= 48 && start[1] <= 54) || start[1] == 48+TRANSPORT_EVENTSOURCE || start[1] == 48+TRANSPORT_CHUNKED) && start[2] == '/') {
 		return start[1]-48;
 	}
 	
 	return 0;
 }
 
+/* "<tag>:" heading the text messages of an "ape.mux" connection */
+static int ws_mux_text_tag(const char *data, unsigned int *tag)
+{
+	const char *p;
+	unsigned long long val = 0;
+
+	for (p = data; *p >= '0' && *p <= '9' && p - data < 10; p++) {
+		val = (val * 10) + (*p - '0');
+	}
+	if (p == data || *p != ':' || val > 0xFFFFFFFFULL) {
+		return 0;
+	}
+	*tag = val;
+
+	return p - data + 1;
+}
+
 subuser *checkrecv_websocket(ape_socket *co, acetables *g_ape)
 {
 	unsigned int op;
@@ -58,8 +79,20 @@ subuser *checkrecv_websocket(ape_socket *co, acetables *g_ape)
 	cget.client = co;
 	cget.ip_get = co->ip_client;
 	cget.get    = websocket->data;
+	cget.get_len = websocket->data_len;
+	cget.msgpack = (websocket->msgpack && (websocket->frame_payload.start & 0x0F) == 0x02);
 	cget.host   = websocket->http->host;
 	cget.hlines = websocket->http->hlines;
+	cget.tag = 0;
+
+	if (websocket->mux.enabled) {
+		/* Commands are routed by their sessid, the tag identifies the session on this connection */
+		int skip = (cget.msgpack ? msgpack_get_tag(cget.get, cget.get_len, &cget.tag) : ws_mux_text_tag(cget.get, &cget.tag));
+
+		cget.get += skip;
+		cget.get_len -= skip;
+		websocket->mux.tag = cget.tag;
+	}
 
 	op = checkcmd(&cget, (websocket->version == WS_IETF_06 || 
 	                    websocket->version == WS_IETF_07 ? 
@@ -72,7 +105,8 @@ subuser *checkrecv_websocket(ape_socket *co, acetables *g_ape)
 			break;
 	}	
 	
-	return user;
+	/* Nobody owns a shared connection (co->attach) */
+	return (websocket->mux.enabled ? NULL : user);
 }
 
 /* 
@@ -123,19 +157,79 @@ static char *ws_compute_key(const char *key, unsigned int key_len)
     return b64; /* must be released */
 }
 
+/* Subprotocols of the server, by order of preference */
+static const struct {
+	const char *name;
+	int msgpack;
+	int mux;
+} ws_subprotocols[] = {
+	{WS_PROTOCOL_MUX_MSGPACK, 1, 1},
+	{WS_PROTOCOL_MUX, 0, 1},
+	{WS_PROTOCOL_MSGPACK, 1, 0},
+	{NULL, 0, 0}
+};
+
+/* "name" is one of the comma separated tokens of "protocols" */
+static int ws_protocol_offered(const char *protocols, const char *name)
+{
+	int len = strlen(name);
+	const char *p = protocols;
+
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',') {
+			p++;
+		}
+		if (strncmp(p, name, len) == 0 && (p[len] == '\0' || p[len] == ',' || p[len] == ' ' || p[len] == '\t')) {
+			return 1;
+		}
+		while (*p != '\0' && *p != ',') {
+			p++;
+		}
+	}
+	return 0;
+}
+
+/* Pick one of our subprotocols from Sec-WebSocket-Protocol, NULL if the client doesn't know them */
+static const char *ws_subprotocol(websocket_state *websocket, const char *protocols)
+{
+	int i;
+
+	if (protocols == NULL) {
+		return NULL;
+	}
+	for (i = 0; ws_subprotocols[i].name != NULL; i++) {
+		if (ws_protocol_offered(protocols, ws_subprotocols[i].name)) {
+			websocket->msgpack = ws_subprotocols[i].msgpack;
+			websocket->mux.enabled = ws_subprotocols[i].mux;
+
+			return ws_subprotocols[i].name;
+		}
+	}
+	return NULL;
+}
+
 subuser *checkrecv(ape_socket *co, acetables *g_ape)
 {
 	unsigned int op;
 	http_state *http = co->parser.data;
 	subuser *user = NULL;
+	transport_t transport;
 	clientget cget;
 	
 	if (http->host == NULL) {
 		shutdown(co->fd, 2);
 		return NULL;
 	}
+	transport = gettransport(http->uri);
+
+	/* Listener.transports */
+	if (co->listener != NULL && !(co->listener->transports & (1U << transport))) {
+		sendbin(co->fd, CONST_STR_LEN(HEADER_FORBIDDEN), 0, g_ape);
+		safe_shutdown(co->fd, g_ape);
+		return NULL;
+	}
 	
-	if (gettransport(http->uri) == TRANSPORT_WEBSOCKET) {
+	if (transport == TRANSPORT_WEBSOCKET) {
 		ws_version version = WS_OLD;
 
 		websocket_state *websocket;
@@ -148,6 +242,10 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 		char *keybase = get_header_line(http->hlines, "Sec-WebSocket-Key");
 		char *ws_version = get_header_line(http->hlines, "Sec-WebSocket-Version");
 		char *ws_protocol = get_header_line(http->hlines, "Sec-WebSocket-Protocol");
+		char *ws_extensions = get_header_line(http->hlines, "Sec-WebSocket-Extensions");
+		const char *subprotocol = NULL;
+		char deflate[128];
+		int deflate_len = 0;
 
 		if (origin == NULL && (origin = get_header_line(http->hlines, "Sec-WebSocket-Origin")) == NULL) {
 			shutdown(co->fd, 2);
@@ -193,7 +291,19 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 	        return NULL;
 		}
 
-		PACK_TCP(co->fd);
+		co->parser = parser_init_stream(co);
+		websocket = co->parser.data;
+		websocket->http = http; /* keep http data */
+		websocket->version = version;
+		transport_websocket_watch(co, g_ape);
+
+		/* permessage-deflate (RFC 7692) and our subprotocols, not for the -06 framing */
+		if (version == WS_IETF_07) {
+			deflate_len = ws_deflate_accept(websocket, ws_extensions, deflate, sizeof(deflate), g_ape);
+			subprotocol = ws_subprotocol(websocket, ws_protocol);
+		}
+
+		PACK_TCP(co);
 		
 		switch(version) {
 		    case WS_OLD:
@@ -217,10 +327,17 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 			    sendbin(co->fd, CONST_STR_LEN(WEBSOCKET_HARDCODED_HEADERS_IETF), 0, g_ape);
                 sendbin(co->fd, CONST_STR_LEN("Sec-WebSocket-Accept: "), 0, g_ape);
                 sendbin(co->fd, wsaccept, strlen(wsaccept), 0, g_ape);
-                if (ws_protocol != NULL) {
+                if (subprotocol != NULL) {
+                    sendbin(co->fd, CONST_STR_LEN("\r\nSec-WebSocket-Protocol: "), 0, g_ape);
+                    sendbin(co->fd, subprotocol, strlen(subprotocol), 0, g_ape);
+                } else if (ws_protocol != NULL) {
                     sendbin(co->fd, CONST_STR_LEN("\r\nSec-WebSocket-Protocol: "), 0, g_ape);
                     sendbin(co->fd, ws_protocol, strlen(ws_protocol), 0, g_ape);
                 }
+                if (deflate_len > 0) {
+                    sendbin(co->fd, CONST_STR_LEN("\r\nSec-WebSocket-Extensions: "), 0, g_ape);
+                    sendbin(co->fd, deflate, deflate_len, 0, g_ape);
+                }
                 free(wsaccept);
 		        break;
 		}
@@ -229,12 +346,8 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 		if (version == WS_76) {
 			sendbin(co->fd, (char *)md5sum, 16, 0, g_ape);
 		}
-		FLUSH_TCP(co->fd);
+		FLUSH_TCP(co);
 		
-		co->parser = parser_init_stream(co);
-		websocket = co->parser.data;
-		websocket->http = http; /* keep http data */
-		websocket->version = version;
 		switch(version) {
 		    case WS_IETF_06:
 		        websocket->step = WS_STEP_KEY;
@@ -259,16 +372,23 @@ subuser *checkrecv(ape_socket *co, acetables *g_ape)
 	cget.client = co;
 	cget.ip_get = co->ip_client;
 	cget.get    = http->data;
+	cget.get_len = 0;
+	cget.msgpack = 0;
+	cget.tag = 0;
 	cget.host   = http->host;
 	cget.hlines = http->hlines;
 	
-	op = checkcmd(&cget, gettransport(http->uri), &user, g_ape);
+	op = checkcmd(&cget, transport, &user, g_ape);
 
 	switch (op) {
 		case CONNECT_SHUTDOWN:
 			safe_shutdown(co->fd, g_ape);			
 			break;
 		case CONNECT_KEEPALIVE:
+			/* The stream is open right away, missed events first */
+			if (user != NULL && transport == TRANSPORT_EVENTSOURCE && user->user->transport == TRANSPORT_EVENTSOURCE) {
+				send_raws_resume(user, get_header_line(http->hlines, "Last-Event-ID"), g_ape);
+			}
 			break;
 	}
 	
@@ -34,6 +34,9 @@ typedef struct clientget
 	ape_socket *client;
 	const char *ip_get;
 	const char *get;
+	int get_len;
+	int msgpack; /* "get" is a MessagePack command (binary frame) of "get_len" bytes */
+	unsigned int tag; /* "ape.mux" tag of the message */
 	const char *host;
 } clientget ;
 
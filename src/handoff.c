@@ -0,0 +1,996 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* handoff.c */
+
+/*
+	Zero-downtime restart (Server.handoff_socket).
+	A new instance connects to the UNIX socket of the running one, which
+	sends (SCM_RIGHTS) its listening sockets (Server.handoff_socket too, so
+	that its path stays bound whatever happens) and its clients connections,
+	followed by a snapshot of the users, channels, queued raws and of the
+	connections state (parser, unsent data).
+	The running instance doesn't process anything until the new one has
+	restored everything and acknowledged, then it exits without touching
+	the sockets : no connection is dropped and no message is lost.
+	With a completion backend (io_uring), the reads and writes in flight are
+	cancelled first, so that their data are part of the snapshot.
+*/
+
+#include "handoff.h"
+#include "snapshot.h"
+#include "sock.h"
+#include "servers.h"
+#include "push.h"
+#include "cluster.h"
+#include "users.h"
+#include "transports.h"
+#include "http.h"
+#include "parser.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+#include "events.h"
+#include "pool.h"
+#include "ticks.h"
+
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+enum {
+	HANDOFF_FDS,
+	HANDOFF_STATE
+};
+
+enum {
+	HANDOFF_PARSER_HTTP,
+	HANDOFF_PARSER_WEBSOCKET
+};
+
+struct _handoff_frame
+{
+	int type;
+	int nfds; /* sent as SCM_RIGHTS, their number in the sender follows the frame */
+	unsigned int len;
+};
+
+static int handoff_addr(struct sockaddr_un *addr, acetables *g_ape)
+{
+	const char *path = CONFIG_VAL(Server, handoff_socket, g_ape->srv);
+
+	if (path == NULL || *path == '\0' || strlen(path) >= sizeof(addr->sun_path)) {
+		return 0;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	return 1;
+}
+
+/* The transfer is done with blocking I/O, both instances have nothing else to do */
+static void handoff_blocking(int fd)
+{
+	struct timeval tv = {HANDOFF_TIMEOUT, 0};
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int handoff_write(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int handoff_read(int fd, char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = read(fd, buf, len);
+
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int handoff_send(int fd, int type, int *fds, int nfds, const char *data, unsigned int len)
+{
+	struct _handoff_frame frame;
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+
+	frame.type = type;
+	frame.nfds = nfds;
+	frame.len = len;
+
+	memset(&msg, 0, sizeof(msg));
+
+	iov.iov_base = &frame;
+	iov.iov_len = sizeof(frame);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds) {
+		struct cmsghdr *cmsg;
+
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	if (sendmsg(fd, &msg, 0) != sizeof(frame)) {
+		return -1;
+	}
+
+	return handoff_write(fd, data, len);
+}
+
+/* Return the number of file descriptors received, -1 on error */
+static int handoff_recv(int fd, struct _handoff_frame *frame, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+	int nfds = 0;
+
+	memset(&msg, 0, sizeof(msg));
+
+	iov.iov_base = frame;
+	iov.iov_len = sizeof(*frame);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(*frame)) {
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+		}
+	}
+
+	if (nfds != frame->nfds || (msg.msg_flags & MSG_CTRUNC)) {
+		while (nfds) {
+			close(fds[--nfds]);
+		}
+		return -1;
+	}
+
+	return nfds;
+}
+
+/* Client connections of the main listener, in a state we know how to rebuild */
+static int handoff_keep(ape_socket *co, int fd, acetables *g_ape)
+{
+	if (fd <= 0 || co->fd != fd || co->stream_type != STREAM_IN || co->state != STREAM_ONLINE || co->tls != NULL ||
+		co->callbacks.on_read != g_ape->co[g_ape->handoff.server]->callbacks.on_read || co->parser.data == NULL) {
+		return 0;
+	}
+
+	if (co->parser.parser_func == process_http) {
+		return !((http_state *)co->parser.data)->error;
+	}
+
+	return (co->parser.parser_func == process_websocket && !((websocket_state *)co->parser.data)->error);
+}
+
+static void handoff_dump_socket(snapshot *snap, ape_socket *co, acetables *g_ape)
+{
+	struct _socks_bufout *bufout = &g_ape->bufout[co->fd];
+	subuser *sub = co->attach;
+
+	snapshot_put_int(snap, co->fd);
+	snapshot_put_str(snap, co->ip_client, strlen(co->ip_client));
+	if (co->listener != NULL) {
+		snapshot_put_str(snap, co->listener->name, strlen(co->listener->name));
+	} else {
+		snapshot_put_str(snap, NULL, 0);
+	}
+	snapshot_put_int(snap, co->idle);
+	snapshot_put_int(snap, co->burn_after_writing);
+	snapshot_put_str(snap, bufout->buf, bufout->buflen);
+
+	if (co->parser.parser_func == process_websocket) {
+		websocket_state *websocket = co->parser.data;
+		struct _http_header_line *hl;
+		size_t mark;
+		int n;
+
+		snapshot_put_int(snap, HANDOFF_PARSER_WEBSOCKET);
+		snapshot_put_int(snap, websocket->version);
+		snapshot_put_int(snap, websocket->step);
+		snapshot_put_int(snap, websocket->offset);
+		snapshot_put_str(snap, (char *)websocket->key.val, 4);
+		snapshot_put_int(snap, websocket->key.pos);
+		snapshot_put_int(snap, websocket->frame_payload.start);
+		snapshot_put_int(snap, websocket->frame_payload.length);
+		snapshot_put_int(snap, websocket->frame_payload.extended_length);
+		snapshot_put_int(snap, websocket->data_pos);
+		snapshot_put_int(snap, websocket->data_inkey);
+		snapshot_put_int(snap, websocket->frame_pos);
+		/* A "takeover" compression context is restarted, the client's window still holds our previous output */
+		snapshot_put_int(snap, websocket->deflate.bits);
+		snapshot_put_int(snap, websocket->deflate.takeover);
+		snapshot_put_int(snap, websocket->msgpack);
+		snapshot_put_int(snap, websocket->mux.enabled);
+
+		/* Handshake headers (Host, Origin...) are still used by checkrecv_websocket() */
+		mark = snapshot_mark(snap);
+		for (n = 0, hl = websocket->http->hlines; hl != NULL; hl = hl->next, n++) {
+			snapshot_put_str(snap, hl->key.val, hl->key.len);
+			snapshot_put_str(snap, hl->value.val, hl->value.len);
+		}
+		snapshot_set_int(snap, mark, n);
+
+		snapshot_put_str(snap, co->buffer_in.data, co->buffer_in.length);
+	} else {
+		http_state *http = co->parser.data;
+		char *request = NULL;
+
+		snapshot_put_int(snap, HANDOFF_PARSER_HTTP);
+
+		/*
+			A partial request is parsed again from the start by the new instance,
+			but process_http() has cut the request line after the URI : put the space back.
+		*/
+		if (co->buffer_in.length && http->step && http->uri != NULL && http->buffer_addr != NULL) {
+			size_t end = (http->uri - (char *)http->buffer_addr);
+
+			request = xmalloc(co->buffer_in.length + 1);
+			memcpy(request, co->buffer_in.data, co->buffer_in.length);
+			request[co->buffer_in.length] = '\0';
+
+			if (end < co->buffer_in.length) {
+				end += strlen(&request[end]);
+
+				if (end < co->buffer_in.length) {
+					request[end] = ' ';
+				}
+			}
+		}
+		snapshot_put_str(snap, (request != NULL ? request : co->buffer_in.data), co->buffer_in.length);
+
+		if (request != NULL) {
+			free(request);
+		}
+	}
+
+	/* The subuser is found back by the sessid of its user */
+	if (sub == NULL || sub->user == NULL || sub->user->istmp || sub->user->type != HUMAN) {
+		snapshot_put_str(snap, NULL, 0);
+		return;
+	}
+	snapshot_put_str(snap, sub->user->sessid, strlen(sub->user->sessid));
+	snapshot_put_str(snap, sub->channel, strlen(sub->channel));
+	snapshot_put_int(snap, SOCK_HANDLE_IS(sub->client, co));
+	snapshot_put_int(snap, sub->state);
+	snapshot_put_int(snap, sub->burn_after_writing);
+	snapshot_put_int(snap, sub->headers.sent);
+	snapshot_put_int(snap, sub->headers.gzip);
+	snapshot_put_int(snap, sub->stream.length);
+	snapshot_put_int(snap, sub->stream.crc);
+	snapshot_put_int(snap, sub->stream.size);
+
+	if (sub->headers.content == NULL) {
+		snapshot_put_int(snap, -1);
+	} else {
+		struct _http_headers_fields *fields;
+		size_t mark;
+		int n;
+
+		snapshot_put_int(snap, sub->headers.content->code);
+		snapshot_put_str(snap, sub->headers.content->detail.val, sub->headers.content->detail.len);
+
+		mark = snapshot_mark(snap);
+		for (n = 0, fields = sub->headers.content->fields; fields != NULL; fields = fields->next, n++) {
+			snapshot_put_str(snap, fields->key.val, fields->key.len);
+			snapshot_put_str(snap, fields->value.val, fields->value.len);
+		}
+		snapshot_set_int(snap, mark, n);
+	}
+}
+
+static void handoff_restore_socket(snapshot *snap, int *fdmap, int maxfd, acetables *g_ape)
+{
+	int oldfd = snapshot_get_int(snap), fd, len, inlen = 0, n;
+	char *ip = snapshot_get_str(snap, NULL);
+	char *listener = snapshot_get_str(snap, NULL);
+	long int idle = snapshot_get_int(snap);
+	int burn_after_writing = snapshot_get_int(snap);
+	char *out = snapshot_get_str(snap, &len), *in = NULL, *sessid, *channel;
+	int type = snapshot_get_int(snap);
+
+	websocket_state ws;
+	struct _http_header_line *hlines = NULL, **hl_tail = &hlines;
+	http_headers_response *headers = NULL;
+	int is_client = 0, state = ADIED, sub_burn = 0, sent = 0, gzip = 0, code;
+	unsigned int length = 0, crc = 0, size = 0;
+
+	ape_socket *co;
+	USERS *user;
+	subuser *sub = NULL;
+
+	memset(&ws, 0, sizeof(ws));
+
+	/* Read the whole record first */
+	if (type == HANDOFF_PARSER_WEBSOCKET) {
+		char *key;
+		int keylen;
+
+		ws.version = snapshot_get_int(snap);
+		ws.step = snapshot_get_int(snap);
+		ws.offset = snapshot_get_int(snap);
+		if ((key = snapshot_get_str(snap, &keylen)) != NULL && keylen == 4) {
+			memcpy(ws.key.val, key, 4);
+		}
+		ws.key.pos = snapshot_get_int(snap);
+		ws.frame_payload.start = snapshot_get_int(snap);
+		ws.frame_payload.length = snapshot_get_int(snap);
+		ws.frame_payload.extended_length = snapshot_get_int(snap);
+		ws.data_pos = snapshot_get_int(snap);
+		ws.data_inkey = snapshot_get_int(snap);
+		ws.frame_pos = snapshot_get_int(snap);
+		ws.deflate.bits = snapshot_get_int(snap);
+		ws.deflate.takeover = snapshot_get_int(snap);
+		ws.msgpack = snapshot_get_int(snap);
+		ws.mux.enabled = snapshot_get_int(snap);
+
+		n = snapshot_get_count(snap);
+		while (n-- > 0 && !snap->error) {
+			char *hkey = snapshot_get_str(snap, NULL), *hval = snapshot_get_str(snap, NULL);
+			struct _http_header_line *hl;
+
+			if (hkey == NULL || hval == NULL) {
+				continue;
+			}
+			hl = xmalloc(sizeof(*hl));
+			hl->key.len = snprintf(hl->key.val, sizeof(hl->key.val), "%s", hkey);
+			hl->value.len = snprintf(hl->value.val, sizeof(hl->value.val), "%s", hval);
+			hl->next = NULL;
+
+			*hl_tail = hl;
+			hl_tail = &hl->next;
+		}
+	}
+	in = snapshot_get_str(snap, &inlen);
+
+	if ((sessid = snapshot_get_str(snap, NULL)) != NULL) {
+		channel = snapshot_get_str(snap, NULL);
+		is_client = snapshot_get_int(snap);
+		state = snapshot_get_int(snap);
+		sub_burn = snapshot_get_int(snap);
+		sent = snapshot_get_int(snap);
+		gzip = snapshot_get_int(snap);
+		length = snapshot_get_int(snap);
+		crc = snapshot_get_int(snap);
+		size = snapshot_get_int(snap);
+
+		if ((code = snapshot_get_int(snap)) != -1) {
+			char *detail = snapshot_get_str(snap, &len);
+
+			headers = http_headers_init(code, (detail != NULL ? detail : ""), len);
+
+			n = snapshot_get_count(snap);
+			while (n-- > 0 && !snap->error) {
+				int klen, vlen;
+				char *hkey = snapshot_get_str(snap, &klen), *hval = snapshot_get_str(snap, &vlen);
+
+				if (headers != NULL && hkey != NULL && hval != NULL) {
+					http_headers_set_field(headers, hkey, klen, hval, vlen);
+				}
+			}
+		}
+		if (channel != NULL && (user = seek_user_id(sessid, g_ape)) != NULL) {
+			sub = getsubuser(user, channel);
+		}
+	}
+
+	if (snap->error || oldfd < 0 || oldfd > maxfd || (fd = fdmap[oldfd]) == -1) {
+		free_header_line(hlines);
+		http_headers_free(headers);
+		return;
+	}
+	fdmap[oldfd] = -1;
+
+	/* Main listener if its Listener section is gone */
+	co = servers_adopt(fd, (listener != NULL ? servers_listener(listener, g_ape) : NULL), g_ape);
+	co->idle = idle;
+
+	if (ip != NULL) {
+		strncpy(co->ip_client, ip, sizeof(co->ip_client) - 1);
+	}
+
+	if (type == HANDOFF_PARSER_WEBSOCKET) {
+		websocket_state *websocket;
+		http_state *http = co->parser.data;
+
+		/* Same as checkrecv() : the http data are kept */
+		co->parser = parser_init_stream(co);
+		websocket = co->parser.data;
+
+		http->hlines = hlines;
+		http->host = get_header_line(hlines, "Host");
+		websocket->http = http;
+
+		websocket->version = ws.version;
+		websocket->step = ws.step;
+		websocket->offset = ws.offset;
+		memcpy(websocket->key.val, ws.key.val, 4);
+		websocket->key.pos = ws.key.pos;
+		websocket->frame_payload = ws.frame_payload;
+		websocket->data_pos = ws.data_pos;
+		websocket->data_inkey = ws.data_inkey;
+		websocket->frame_pos = ws.frame_pos;
+		websocket->deflate.bits = ws.deflate.bits;
+		websocket->deflate.takeover = ws.deflate.takeover;
+		websocket->msgpack = ws.msgpack;
+		websocket->mux.enabled = ws.mux.enabled;
+		transport_websocket_watch(co, g_ape);
+	}
+
+	if (inlen) {
+		while (co->buffer_in.size <= inlen && buffer_grow(&co->buffer_in, g_ape));
+
+		if (co->buffer_in.size > inlen) {
+			memcpy(co->buffer_in.data, in, inlen);
+			co->buffer_in.length = inlen;
+		}
+	}
+
+	if (sub != NULL) {
+		co->attach = sub;
+
+		if (is_client) {
+			sub->client = sock_handle(co);
+			sub->state = state;
+			sub->burn_after_writing = sub_burn;
+			sub->headers.sent = sent;
+			sub->headers.gzip = gzip;
+			sub->stream.length = length;
+			sub->stream.crc = crc;
+			sub->stream.size = size;
+			sub->headers.content = headers;
+			headers = NULL;
+		}
+	}
+	http_headers_free(headers);
+
+	if (out != NULL) {
+		sendbin(fd, out, len, burn_after_writing, g_ape);
+	}
+
+	/* The rest of the request may already be there */
+	if (type == HANDOFF_PARSER_HTTP && co->buffer_in.length) {
+		co->parser.parser_func(co, g_ape);
+	}
+}
+
+/* The sessions of the shared WebSockets ("ape.mux"), these connections have no subuser attached */
+static void handoff_dump_mux(snapshot *snap, acetables *g_ape)
+{
+	USERS *user;
+	subuser *sub;
+	ape_socket *co;
+	size_t mark = snapshot_mark(snap);
+	int n = 0;
+
+	for (user = g_ape->uHead; user != NULL; user = user->next) {
+		if (user->istmp || user->type != HUMAN) {
+			continue;
+		}
+		for (sub = user->subuser; sub != NULL; sub = sub->next) {
+			if ((co = sock_from_handle(sub->client, g_ape)) == NULL || transport_mux(co) == NULL || !handoff_keep(co, co->fd, g_ape)) {
+				continue;
+			}
+			snapshot_put_int(snap, co->fd);
+			snapshot_put_str(snap, user->sessid, strlen(user->sessid));
+			snapshot_put_str(snap, sub->channel, strlen(sub->channel));
+			snapshot_put_int(snap, sub->state);
+			snapshot_put_int(snap, sub->tag);
+			n++;
+		}
+	}
+	snapshot_set_int(snap, mark, n);
+}
+
+/* "clients" : the new file descriptors of the connections, before they were adopted */
+static void handoff_restore_mux(snapshot *snap, int *clients, int *fdmap, int maxfd, acetables *g_ape)
+{
+	int n = snapshot_get_count(snap);
+
+	while (n-- > 0 && !snap->error) {
+		int oldfd = snapshot_get_int(snap);
+		char *sessid = snapshot_get_str(snap, NULL), *channel = snapshot_get_str(snap, NULL);
+		int state = snapshot_get_int(snap);
+		unsigned int tag = snapshot_get_int(snap);
+		ape_socket *co;
+		USERS *user;
+		subuser *sub;
+
+		if (snap->error || oldfd < 0 || oldfd > maxfd || clients[oldfd] == -1 || fdmap[oldfd] != -1 ||
+			sessid == NULL || channel == NULL || (user = seek_user_id(sessid, g_ape)) == NULL || (sub = getsubuser(user, channel)) == NULL) {
+			continue;
+		}
+		if (transport_mux((co = g_ape->co[clients[oldfd]])) == NULL) {
+			continue;
+		}
+		sub->client = sock_handle(co);
+		sub->state = state;
+		sub->tag = tag;
+	}
+}
+
+/* Send everything to the new instance and wait for it to be restored */
+static int handoff_send_state(int fd, acetables *g_ape)
+{
+	snapshot snap;
+	size_t mark;
+	int *fds, nfds = 0, nlisteners, n, i, ret = -1;
+	char ack;
+	ape_listener *listener;
+
+	handoff_blocking(fd);
+
+	snapshot_init(&snap);
+	snapshot_dump(&snap, g_ape);
+
+	fds = xmalloc(sizeof(int) * (g_ape->basemem + 1));
+	fds[nfds++] = g_ape->handoff.server;
+
+	snapshot_put_int(&snap, g_ape->handoff.server);
+
+	/* The TLS listener is handed over, not its clients (their state is held by OpenSSL) */
+	snapshot_put_int(&snap, (g_ape->tls.server ? g_ape->tls.server : -1));
+	if (g_ape->tls.server) {
+		fds[nfds++] = g_ape->tls.server;
+	}
+
+	/* Push listeners (TCP and UNIX socket), their clients reconnect */
+	snapshot_put_int(&snap, (g_ape->push.server ? g_ape->push.server : -1));
+	if (g_ape->push.server) {
+		fds[nfds++] = g_ape->push.server;
+	}
+	snapshot_put_int(&snap, (g_ape->push.unix_server ? g_ape->push.unix_server : -1));
+	if (g_ape->push.unix_server) {
+		fds[nfds++] = g_ape->push.unix_server;
+	}
+	/* Cluster listener, the other nodes reconnect and subscribe again */
+	snapshot_put_int(&snap, (g_ape->cluster.server ? g_ape->cluster.server : -1));
+	if (g_ape->cluster.server) {
+		fds[nfds++] = g_ape->cluster.server;
+	}
+	/* Server.handoff_socket itself : its path is never unbound, even if the new instance fails */
+	snapshot_put_int(&snap, g_ape->handoff.listener);
+	if (g_ape->handoff.listener != -1) {
+		fds[nfds++] = g_ape->handoff.listener;
+	}
+
+	/* Listener sections, matched by name */
+	for (listener = g_ape->listeners, n = 0; listener != NULL; listener = listener->next) {
+		n += (listener->fd > 0);
+	}
+	snapshot_put_int(&snap, n);
+	for (listener = g_ape->listeners; listener != NULL; listener = listener->next) {
+		if (listener->fd > 0) {
+			snapshot_put_int(&snap, listener->fd);
+			snapshot_put_str(&snap, listener->name, strlen(listener->name));
+			fds[nfds++] = listener->fd;
+		}
+	}
+	nlisteners = nfds;
+
+	mark = snapshot_mark(&snap);
+	for (i = 0; i < g_ape->basemem; i++) {
+		if (handoff_keep(g_ape->co[i], i, g_ape)) {
+			handoff_dump_socket(&snap, g_ape->co[i], g_ape);
+			fds[nfds++] = i;
+		}
+	}
+	snapshot_set_int(&snap, mark, nfds - nlisteners);
+
+	handoff_dump_mux(&snap, g_ape);
+	snapshot_seal(&snap);
+
+	/* The file descriptors number in this process follow each batch */
+	for (i = 0; i < nfds; i += HANDOFF_MAX_FDS) {
+		int n = (nfds - i > HANDOFF_MAX_FDS ? HANDOFF_MAX_FDS : nfds - i);
+
+		if (handoff_send(fd, HANDOFF_FDS, &fds[i], n, (char *)&fds[i], sizeof(int) * n) == -1) {
+			goto out;
+		}
+	}
+
+	if (handoff_send(fd, HANDOFF_STATE, NULL, 0, snap.data, snap.len) == -1 ||
+		handoff_read(fd, &ack, 1) == -1 || ack != HANDOFF_ACK) {
+		goto out;
+	}
+
+	ape_log(APE_INFO, __FILE__, __LINE__, g_ape, "Handoff : %i connections and %i bytes of state handed over to the new instance", nfds - nlisteners, (int)snap.len);
+	ret = 0;
+
+out:
+	free(fds);
+	snapshot_free(&snap);
+
+	return ret;
+}
+
+static void handoff_take_over(ape_socket *co, acetables *g_ape)
+{
+	if (handoff_send_state(co->fd, g_ape) == 0) {
+		/* Stop right now, the sockets belong to the new instance */
+		g_ape->handoff.done = 1;
+		server_is_running = 0;
+		return;
+	}
+	ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Handoff : the new instance didn't take over (%s), still running", strerror(errno));
+
+	sockets_resume(g_ape);
+	close_socket(co->fd, g_ape);
+}
+
+/* Wait for the I/O in flight to be cancelled (ticked each ms until HANDOFF_QUIESCE_MS) */
+static void handoff_quiesce(acetables *g_ape, int *last)
+{
+	ape_socket *co = sock_from_handle(g_ape->handoff.request, g_ape);
+	int ready = events_quiesce(g_ape->events);
+
+	if (co == NULL) {
+		/* The new instance is gone */
+		sockets_resume(g_ape);
+	} else if (ready) {
+		handoff_take_over(co, g_ape);
+	} else if (*last) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Handoff : I/O still in flight after %i ms, still running", HANDOFF_QUIESCE_MS);
+		sockets_resume(g_ape);
+		close_socket(co->fd, g_ape);
+	} else {
+		return;
+	}
+	*last = 1;
+}
+
+static void handoff_request(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
+{
+	char req;
+	int n = read(co->fd, &req, 1);
+
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+
+	if (n == 1 && req == HANDOFF_REQUEST) {
+		if (events_quiesce(g_ape->events)) {
+			handoff_take_over(co, g_ape);
+		} else {
+			g_ape->handoff.request = sock_handle(co);
+			add_periodical(1, HANDOFF_QUIESCE_MS, handoff_quiesce, g_ape, g_ape);
+		}
+		return;
+	}
+
+	close_socket(co->fd, g_ape);
+}
+
+static void handoff_accept(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
+{
+	int fd;
+
+	while ((fd = accept(co->fd, NULL, NULL)) != -1) {
+		setnonblocking(fd);
+		prepare_ape_socket(fd, g_ape);
+
+		g_ape->co[fd]->fd = fd;
+		g_ape->co[fd]->state = STREAM_ONLINE;
+		g_ape->co[fd]->stream_type = STREAM_DELEGATE;
+		g_ape->co[fd]->callbacks.on_read = handoff_request;
+
+		events_add(g_ape->events, fd, EVENT_READ);
+	}
+}
+
+static void handoff_listen_fd(int fd, acetables *g_ape)
+{
+	setnonblocking(fd);
+	prepare_ape_socket(fd, g_ape);
+
+	g_ape->co[fd]->fd = fd;
+	g_ape->co[fd]->state = STREAM_ONLINE;
+	g_ape->co[fd]->stream_type = STREAM_DELEGATE;
+	g_ape->co[fd]->callbacks.on_read = handoff_accept;
+
+	events_add(g_ape->events, fd, EVENT_READ);
+
+	g_ape->handoff.listener = fd;
+}
+
+/* Is the listener handed over bound to Server.handoff_socket ? */
+static int handoff_same_path(int fd, acetables *g_ape)
+{
+	struct sockaddr_un addr, bound;
+	socklen_t len = sizeof(bound);
+
+	memset(&bound, 0, sizeof(bound));
+
+	return (handoff_addr(&addr, g_ape) && getsockname(fd, (struct sockaddr *)&bound, &len) == 0 &&
+		bound.sun_family == AF_UNIX && strcmp(bound.sun_path, addr.sun_path) == 0);
+}
+
+/*
+	Accept the next instance on Server.handoff_socket. Not called when
+	taking over : the running instance hands its listener over.
+*/
+void handoff_listen(acetables *g_ape)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!handoff_addr(&addr, g_ape)) {
+		return;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		return;
+	}
+
+	/* Left behind by an instance that is gone */
+	unlink(addr.sun_path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 4) == -1) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Handoff : cannot listen on %s : %s", addr.sun_path, strerror(errno));
+		close(fd);
+		return;
+	}
+	chmod(addr.sun_path, 0600);
+
+	handoff_listen_fd(fd, g_ape);
+}
+
+/* Is there a running instance to take over ? (called before servers_init()) */
+int handoff_connect(acetables *g_ape)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!handoff_addr(&addr, g_ape) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		return 0;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return 0;
+	}
+	handoff_blocking(fd);
+
+	g_ape->handoff.fd = fd;
+
+	return 1;
+}
+
+/* Receive the sockets and the state of the running instance, which exits once we've acknowledged */
+int handoff_takeover(acetables *g_ape)
+{
+	struct _handoff_frame frame;
+	snapshot snap;
+	int *oldfds = NULL, *newfds = NULL, *fdmap = NULL, *clients = NULL;
+	int nfds = 0, maxfd = 0, nusers, nsocks = 0, n, i, ret = -1;
+	char req = HANDOFF_REQUEST, ack = HANDOFF_ACK;
+
+	snapshot_init(&snap);
+
+	if (handoff_write(g_ape->handoff.fd, &req, 1) == -1) {
+		goto out;
+	}
+
+	while (1) {
+		int fds[HANDOFF_MAX_FDS], n;
+
+		if ((n = handoff_recv(g_ape->handoff.fd, &frame, fds)) == -1) {
+			goto out;
+		}
+
+		if (frame.type == HANDOFF_STATE) {
+			snap.data = xmalloc(frame.len + 1);
+			snap.size = snap.len = frame.len;
+
+			if (handoff_read(g_ape->handoff.fd, snap.data, frame.len) == -1) {
+				goto out;
+			}
+			break;
+		}
+
+		oldfds = xrealloc(oldfds, sizeof(int) * (nfds + n));
+		newfds = xrealloc(newfds, sizeof(int) * (nfds + n));
+
+		memcpy(&newfds[nfds], fds, sizeof(int) * n);
+
+		if (frame.type != HANDOFF_FDS || frame.len != sizeof(int) * n ||
+			handoff_read(g_ape->handoff.fd, (char *)&oldfds[nfds], frame.len) == -1) {
+			nfds += n;
+			goto out;
+		}
+		nfds += n;
+	}
+
+	if (!nfds) {
+		goto out;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		if (oldfds[i] > maxfd) {
+			maxfd = oldfds[i];
+		}
+	}
+	fdmap = xmalloc(sizeof(int) * (maxfd + 1));
+	memset(fdmap, -1, sizeof(int) * (maxfd + 1));
+
+	for (i = 0; i < nfds; i++) {
+		if (oldfds[i] >= 0) {
+			fdmap[oldfds[i]] = newfds[i];
+		}
+	}
+
+	if ((nusers = snapshot_restore(&snap, g_ape)) == -1) {
+		goto out;
+	}
+
+	/* Listeners, then the clients */
+	i = snapshot_get_int(&snap);
+
+	if (snap.error || i < 0 || i > maxfd || fdmap[i] == -1) {
+		goto out;
+	}
+	servers_init_fd(fdmap[i], g_ape);
+	fdmap[i] = -1;
+
+	/* Closed below if TLS is no longer configured */
+	i = snapshot_get_int(&snap);
+
+	if (i >= 0 && i <= maxfd && fdmap[i] != -1 && g_ape->tls.ctx != NULL) {
+		servers_init_tls_fd(fdmap[i], g_ape);
+		fdmap[i] = -1;
+	}
+
+	/* Same for the Push listeners (see push_init()) */
+	i = snapshot_get_int(&snap);
+
+	if (i >= 0 && i <= maxfd && fdmap[i] != -1 && atoi(CONFIG_VAL(Push, port, g_ape->srv)) > 0 && *g_ape->push.password != '\0') {
+		push_init_fd(fdmap[i], 0, g_ape);
+		fdmap[i] = -1;
+	}
+	i = snapshot_get_int(&snap);
+
+	if (i >= 0 && i <= maxfd && fdmap[i] != -1 && *CONFIG_VAL(Push, unix_socket, g_ape->srv) != '\0' && *g_ape->push.password != '\0') {
+		push_init_fd(fdmap[i], 1, g_ape);
+		fdmap[i] = -1;
+	}
+
+	i = snapshot_get_int(&snap);
+
+	if (i >= 0 && i <= maxfd && fdmap[i] != -1 && g_ape->cluster.node != NULL) {
+		cluster_init_fd(fdmap[i], g_ape);
+		fdmap[i] = -1;
+	}
+
+	/* Closed below if Server.handoff_socket has changed (entry.c binds the new one) */
+	i = snapshot_get_int(&snap);
+
+	if (i >= 0 && i <= maxfd && fdmap[i] != -1 && handoff_same_path(fdmap[i], g_ape)) {
+		handoff_listen_fd(fdmap[i], g_ape);
+		fdmap[i] = -1;
+	}
+
+	/* Closed below if no longer configured (see servers_config_listeners()) */
+	n = snapshot_get_count(&snap);
+	while (n-- > 0 && !snap.error) {
+		char *name;
+
+		i = snapshot_get_int(&snap);
+		name = snapshot_get_str(&snap, NULL);
+
+		if (name != NULL && i >= 0 && i <= maxfd && fdmap[i] != -1 && servers_init_listener_fd(fdmap[i], name, g_ape)) {
+			fdmap[i] = -1;
+		}
+	}
+
+	clients = xmalloc(sizeof(int) * (maxfd + 1));
+	memcpy(clients, fdmap, sizeof(int) * (maxfd + 1));
+
+	nsocks = snapshot_get_count(&snap);
+	for (i = 0; i < nsocks && !snap.error; i++) {
+		handoff_restore_socket(&snap, fdmap, maxfd, g_ape);
+	}
+	handoff_restore_mux(&snap, clients, fdmap, maxfd, g_ape);
+
+	if (snap.error || handoff_write(g_ape->handoff.fd, &ack, 1) == -1) {
+		goto out;
+	}
+
+	ape_log(APE_INFO, __FILE__, __LINE__, g_ape, "Handoff : took over %i users and %i connections", nusers, nsocks);
+	ret = 0;
+
+out:
+	/* Anything not adopted */
+	if (fdmap != NULL) {
+		for (i = 0; i <= maxfd; i++) {
+			if (fdmap[i] != -1) {
+				close(fdmap[i]);
+			}
+		}
+		free(fdmap);
+	} else {
+		for (i = 0; i < nfds; i++) {
+			close(newfds[i]);
+		}
+	}
+	free(clients);
+	free(oldfds);
+	free(newfds);
+	snapshot_free(&snap);
+
+	close(g_ape->handoff.fd);
+	g_ape->handoff.fd = -1;
+
+	return ret;
+}
+
+void handoff_free(acetables *g_ape)
+{
+	struct sockaddr_un addr;
+
+	/* The new instance is now listening on it */
+	if (!g_ape->handoff.done && handoff_addr(&addr, g_ape)) {
+		unlink(addr.sun_path);
+	}
+}
@@ -0,0 +1,39 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* handoff.h */
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include "main.h"
+
+#define HANDOFF_MAX_FDS 128 // File descriptors sent per message (SCM_MAX_FD is 253 on Linux)
+#define HANDOFF_TIMEOUT 30 // Seconds the running instance waits for the new one to restore the state
+#define HANDOFF_QUIESCE_MS 1000 // I/O in flight (io_uring) must be cancelled within this time
+
+#define HANDOFF_REQUEST 'H'
+#define HANDOFF_ACK 'K'
+
+int handoff_connect(acetables *g_ape);
+int handoff_takeover(acetables *g_ape);
+void handoff_listen(acetables *g_ape);
+void handoff_free(acetables *g_ape);
+
+#endif
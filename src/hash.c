@@ -25,6 +25,10 @@
 #include "hash.h"
 #include "users.h"
 #include "utils.h"
+#include "pool.h"
+
+/* Items of all the tables (aped is single threaded), see hashtbl_item() */
+static ape_pool htbl_items;
 
 static unsigned int hach_string(const char *str)
 {
@@ -39,6 +43,37 @@ static unsigned int hach_string(const char *str)
         return (hash & 0x7FFFFFFF)%(HACH_TABLE_MAX-1);
 }
 
+static HTBL_ITEM *hashtbl_item(const char *key, unsigned int key_len)
+{
+	HTBL_ITEM *item;
+	
+	if (htbl_items.size == 0) {
+		init_pool(&htbl_items, "hash", sizeof(HTBL_ITEM), POOL_SLAB_OBJECTS, 0);
+	}
+	item = pool_alloc(&htbl_items);
+	item->key = (key_len < HTBL_KEY_INLINE ? item->key_inline : xmalloc(sizeof(char) * (key_len+1)));
+	
+	memcpy(item->key, key, key_len+1);
+	
+	return item;
+}
+
+static void hashtbl_item_free(HTBL_ITEM *item)
+{
+	if (item->key != item->key_inline) {
+		free(item->key);
+	}
+	item->key = NULL;
+	
+	pool_free(&htbl_items, item);
+}
+
+/* Used by Ape.status() */
+ape_pool *hashtbl_pool()
+{
+	return &htbl_items;
+}
+
 HTBL *hashtbl_init()
 {
 	HTBL_ITEM **htbl_item;
@@ -66,9 +101,7 @@ void hashtbl_free(HTBL *htbl)
 		hTmp = htbl->table[i];
 		while (hTmp != 0) {
 			hNext = hTmp->next;
-			free(hTmp->key);
-			hTmp->key = NULL;
-			free(hTmp);
+			hashtbl_item_free(hTmp);
 			hTmp = hNext;
 		}
 	}
@@ -88,35 +121,22 @@ void hashtbl_append(HTBL *htbl, const char *key, void *structaddr)
 	key_len = strlen(key);
 	key_hash = hach_string(key);
 	
-	hTmp = (HTBL_ITEM *)xmalloc(sizeof(*hTmp));
+	for (hDbl = htbl->table[key_hash]; hDbl != NULL; hDbl = hDbl->next) {
+		if (strcasecmp(hDbl->key, key) == 0) {
+			hDbl->addrs = (void *)structaddr;
+			
+			return;
+		}
+	}
+	
+	hTmp = hashtbl_item(key, key_len);
 	
-	hTmp->next = NULL;
+	hTmp->next = htbl->table[key_hash];
 	hTmp->lnext = htbl->first;
 	hTmp->lprev = NULL;
-
-	hTmp->key = xmalloc(sizeof(char) * (key_len+1));
 	
 	hTmp->addrs = (void *)structaddr;
 	
-	memcpy(hTmp->key, key, key_len+1);
-	
-	if (htbl->table[key_hash] != NULL) {
-		hDbl = htbl->table[key_hash];
-		
-		while (hDbl != NULL) {
-			if (strcasecmp(hDbl->key, key) == 0) {
-				free(hTmp->key);
-				free(hTmp);
-				hDbl->addrs = (void *)structaddr;
-				
-				return;
-			} else {
-				hDbl = hDbl->next;
-			}
-		}
-		hTmp->next = htbl->table[key_hash];
-	}
-	
 	if (htbl->first != NULL) {
 		htbl->first->lprev = hTmp;
 	}
@@ -158,8 +178,7 @@ void hashtbl_erase(HTBL *htbl, const char *key)
 				hTmp->lnext->lprev = hTmp->lprev;
 			}
 			
-			free(hTmp->key);
-			free(hTmp);
+			hashtbl_item_free(hTmp);
 			return;
 		}
 		hPrev = hTmp;
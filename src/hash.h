@@ -21,6 +21,7 @@
 #define _LHTBL_H
 
 #define HACH_TABLE_MAX 5381
+#define HTBL_KEY_INLINE 40 // Keys up to this size ('\0' included) are stored in the item (pubids, sessids, most channel names)
 
 typedef struct HTBL
 {
@@ -38,6 +39,7 @@ typedef struct _htbl_item
 	struct _htbl_item *lnext;
 	struct _htbl_item *lprev;
 	
+	char key_inline[HTBL_KEY_INLINE];
 } HTBL_ITEM;
 
 HTBL *hashtbl_init();
@@ -46,5 +48,6 @@ void hashtbl_free(HTBL *htbl);
 void *hashtbl_seek(HTBL *htbl, const char *key);
 void hashtbl_erase(HTBL *htbl, const char *key);
 void hashtbl_append(HTBL *htbl, const char *key, void *structaddr);
+struct _ape_pool *hashtbl_pool();
 
 #endif
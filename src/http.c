@@ -27,6 +27,8 @@
 #include "utils.h"
 #include "dns.h"
 #include "log.h"
+#include "compress.h"
+#include "ticks.h"
 #include <stdlib.h> /* endian macros */
 #include <arpa/inet.h>
 
@@ -185,6 +187,10 @@ static void process_websocket_frame(ape_socket *co, acetables *g_ape)
                     websocket->frame_payload.extended_length = 0;
                     websocket->data_pos = 0;
                     websocket->key.pos = 0;
+                    
+                    /* The peer is alive */
+                    websocket->ping.last = ape_clock.sec;
+                    websocket->ping.sent = 0;
 
                     switch(websocket->frame_payload.start & 0x0F) {
                         case 0x8:
@@ -209,18 +215,34 @@ static void process_websocket_frame(ape_socket *co, acetables *g_ape)
                                 sendbin(co->fd, payload_head, 2, 1, g_ape);
                                 return;
                             }
-                            PACK_TCP(co->fd);
+                            PACK_TCP(co);
                             sendbin(co->fd, payload_head, 2, 0, g_ape);
                             if (body_length) {
                                 sendbin(co->fd, websocket->data, body_length, 0, g_ape);
                             }
-                            FLUSH_TCP(co->fd);
+                            FLUSH_TCP(co);
                             break;
                         }
-                        case 0xA: /* Never called as long as we never ask for pong */
+                        case 0xA: /* Answer to our ping (transport_websocket_ping()) */
                             break;
                         default:
                             /* Data frame */
+                            if (websocket->frame_payload.start & 0x40) {
+                                /* RSV1 : permessage-deflate compressed message */
+                                int inflated_len;
+                                char payload_head[2] = { 0x88, 0x00 };
+
+                                if (!websocket->deflate.bits || (websocket->data = ws_inflate(websocket->data,
+                                        &buffer->data[websocket->offset+1] - websocket->data, &inflated_len, g_ape)) == NULL) {
+
+                                    sendbin(co->fd, payload_head, 2, 1, g_ape);
+                                    return;
+                                }
+                                websocket->data_len = inflated_len;
+                                parser->onready(parser, g_ape);
+                                break;
+                            }
+                            websocket->data_len = &buffer->data[websocket->offset+1] - websocket->data;
                             saved = buffer->data[websocket->offset+1];
                             buffer->data[websocket->offset+1] = '\0';
                             parser->onready(parser, g_ape);
@@ -316,6 +338,9 @@ static void process_websocket_frame_06(ape_socket *co, acetables *g_ape)
                     websocket->frame_payload.extended_length = 0;
                     websocket->data_pos = 0;
                     
+                    websocket->ping.last = ape_clock.sec;
+                    websocket->ping.sent = 0;
+                    
                     switch(websocket->frame_payload.start & 0x0F) {
                         case 0x01:
                         {
@@ -339,15 +364,15 @@ static void process_websocket_frame_06(ape_socket *co, acetables *g_ape)
                                 sendbin(co->fd, payload_head, 2, 1, g_ape);
                                 return;
                             }
-                            PACK_TCP(co->fd);
+                            PACK_TCP(co);
                             sendbin(co->fd, payload_head, 2, 0, g_ape);
                             if (body_length) {
                                 sendbin(co->fd, websocket->data, body_length, 0, g_ape);
                             }
-                            FLUSH_TCP(co->fd);
+                            FLUSH_TCP(co);
                             break;
                         }
-                        case 0x03: /* Never called as long as we never ask for pong */
+                        case 0x03: /* Answer to our ping (transport_websocket_ping()) */
                             break;
                         default:
                             /* Data frame */
@@ -738,14 +763,27 @@ http_headers_set_field(headers, "Content-Length", 0, "100", 0);
 http_send_headers(headers, cget->client, g_ape);
 */
 
-int http_send_headers(http_headers_response *headers, const char *default_h, unsigned int default_len, ape_socket *client, acetables *g_ape)
+/* "extra" header lines (e.g. Content-Encoding) are added to the response, default_h must end with the empty line then */
+int http_send_headers(http_headers_response *headers, const char *default_h, unsigned int default_len, const char *extra, ape_socket *client, acetables *g_ape)
 {
 	char code[4];
 	int finish = 1;
 	struct _http_headers_fields *fields;
 	//HTTP/1.1 200 OK\r\n
 	
-	if (headers == NULL) {
+	if (headers == NULL && (extra != NULL || g_ape->cluster.header != NULL)) {
+		/* Some default headers are followed by the first bytes of the body */
+		unsigned int header_len = strstr(default_h, "\r\n\r\n") - default_h + 2;
+
+		finish &= sendbin(client->fd, (char *)default_h, header_len, 0, g_ape);
+		if (extra != NULL) {
+			finish &= sendbin(client->fd, extra, strlen(extra), 0, g_ape);
+		}
+		if (g_ape->cluster.header != NULL) {
+			finish &= sendbin(client->fd, g_ape->cluster.header, strlen(g_ape->cluster.header), 0, g_ape);
+		}
+		finish &= sendbin(client->fd, (char *)&default_h[header_len], default_len - header_len, 0, g_ape);
+	} else if (headers == NULL) {
 		finish &= sendbin(client->fd, (char *)default_h, default_len, 0, g_ape);
 	} else {
 		/* We have a lot of write syscall here. TODO : use of writev */
@@ -764,6 +802,12 @@ int http_send_headers(http_headers_response *headers, const char *default_h, uns
 		
 			fields = fields->next;
 		}
+		if (extra != NULL) {
+			finish &= sendbin(client->fd, extra, strlen(extra), 0, g_ape);
+		}
+		if (g_ape->cluster.header != NULL) {
+			finish &= sendbin(client->fd, g_ape->cluster.header, strlen(g_ape->cluster.header), 0, g_ape);
+		}
 	
 		finish &= sendbin(client->fd, "\r\n", 2, 0, g_ape);
 	}
@@ -265,7 +265,14 @@ struct jsontring *json_to_string(json_item *head, struct jsontring *string, int
 			}
 		}
 		
-		if (head->jval.vu.str.value != NULL) {
+		if (head->type == JSON_T_FRAGMENT) {
+			memcpy(string->jstring + string->len, head->jval.vu.str.value, head->jval.vu.str.length);
+			string->len += head->jval.vu.str.length;
+			
+			if (free_tree) {
+				free(head->jval.vu.str.value);
+			}
+		} else if (head->jval.vu.str.value != NULL) {
 
 			string->jstring[string->len++] = '"';
 			string->len += escape_json_string(head->jval.vu.str.value, string->jstring + string->len, head->jval.vu.str.length); /* TODO : Add a "escape" argument to json_to_string */	
@@ -462,6 +469,19 @@ json_item *json_new_array()
 	return obj;
 }
 
+json_item *json_new_fragment(const char *data, int len)
+{
+	json_item *obj = init_json_item();
+	
+	obj->jval.vu.str.value = xmalloc(sizeof(char) * (len + 1));
+	memcpy(obj->jval.vu.str.value, data, len);
+	obj->jval.vu.str.value[len] = '\0';
+	obj->jval.vu.str.length = len;
+	obj->type = JSON_T_FRAGMENT;
+	
+	return obj;
+}
+
 json_item *json_set_property_objN(json_item *obj, const char *key, int keylen, json_item *value)
 {
 	json_item *new_item = value;
@@ -863,6 +883,40 @@ json_item *init_json_parser(const char *json_string)
 	return jcx.head;	
 }
 
+/* "data" (not NUL terminated) is a JSON object, checked without building the tree */
+int json_is_object(const char *data, int len)
+{
+	JSON_config config;
+	struct JSON_parser_struct* jc;
+	int i, ret;
+
+	for (i = 0; i < len && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n'); i++);
+
+	if (i == len || data[i] != '{') {
+		return 0;
+	}
+	init_JSON_config(&config);
+
+	config.depth		= 15;
+	config.callback		= NULL;
+	config.allow_comments	= 0;
+	config.handle_floats_manually = 0;
+
+	jc = new_JSON_parser(&config);
+
+	for (; i < len; i++) {
+		if (!JSON_parser_char(jc, (unsigned char)data[i])) {
+			delete_JSON_parser(jc);
+			return 0;
+		}
+	}
+	ret = JSON_parser_done(jc);
+
+	delete_JSON_parser(jc);
+
+	return ret;
+}
+
 void json_aff(json_item *cx, int depth)
 {
 	while (cx != NULL) {
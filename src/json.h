@@ -28,6 +28,9 @@
 
 typedef char* jpath;
 
+/* Already serialized JSON, emitted verbatim by json_to_string() */
+#define JSON_T_FRAGMENT (JSON_T_MAX + 1)
+
 enum {
 	JSON_ARRAY = 0,
 	JSON_OBJECT
@@ -108,11 +111,13 @@ void json_attach(struct json *json_father, struct json *json_child, unsigned int
 void json_concat(struct json *json_father, struct json *json_child);
 void json_free(struct json *jbase);
 json_item *init_json_parser(const char *json_string);
+int json_is_object(const char *data, int len);
 json_item *json_lookup(json_item *head, char *path);
 void free_json_item(json_item *cx);
 
 json_item *json_new_object();
 json_item *json_new_array();
+json_item *json_new_fragment(const char *data, int len);
 
 json_item *json_set_property_objN(json_item *obj, const char *key, int keylen, json_item *value);
 void json_set_property_objZ(json_item *obj, const char *key, json_item *value);
@@ -163,6 +168,9 @@ void json_aff(json_item *cx, int depth);
 #define JINT(key) \
 	(int)(callbacki->param != NULL && (json_params = json_lookup(callbacki->param, #key)) != NULL ? json_params->jval.vu.integer_value : 0)
 	
+#define JLONG(key) \
+	(callbacki->param != NULL && (json_params = json_lookup(callbacki->param, #key)) != NULL ? json_params->jval.vu.integer_value : 0)
+	
 #define JFLOAT(key) \
 	(callbacki->param != NULL && (json_params = json_lookup(callbacki->param, #key)) != NULL ? json_params->jval.vu.float_value : 0.)
 	
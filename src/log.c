@@ -29,6 +29,7 @@
 #include "log.h"
 #include "main.h"
 #include "config.h"
+#include "ticks.h"
 
 
 void ape_log_init(acetables *g_ape)
@@ -127,12 +128,15 @@ void ape_log(ape_log_lvl_t lvl, const char *file, unsigned long int line, acetab
 			}
 			syslog(level, "%s:%li - %s", file, line, buff);
 		} else {
-			int datelen;
-			char date[32];
-			time_t log_ts;
-			log_ts = time(NULL);
-
-			datelen = strftime(date, 32, "%Y-%m-%d %H:%M:%S - ", localtime(&log_ts));
+			static int datelen = 0;
+			static char date[32];
+			static time_t log_ts = 0;
+			
+			/* Format the date only once per second */
+			if (log_ts != ape_clock.sec) {
+				log_ts = ape_clock.sec;
+				datelen = strftime(date, 32, "%Y-%m-%d %H:%M:%S - ", localtime(&log_ts));
+			}
 
 			write(g_ape->logs.fd, date, datelen);
 			if (g_ape->logs.lvl&APE_DEBUG) {
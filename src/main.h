@@ -62,6 +62,17 @@ struct _transport_properties {
 	} padding;
 };
 
+/*
+	Long-lived reference to a socket : co[] slots are reused as soon as
+	the fd is closed, sock_from_handle() returns NULL for a stale handle.
+*/
+typedef struct {
+	int fd;
+	unsigned int gen;
+} ape_sock_handle;
+
+#define SOCK_HANDLE_IS(handle, co) ((co)->fd == (handle).fd && (co)->gen == (handle).gen)
+
 struct _ape_transports {
 	struct {
 		struct _transport_properties properties;
@@ -81,7 +92,28 @@ struct _ape_transports {
 
 	struct {
 	    struct _transport_properties properties;
+	    int ping; /* seconds of silence before a ping (0 : never) */
+	    int pong_timeout;
+	    ape_sock_handle *sockets; /* connections to ping (see transport_websocket_watch()) */
+	    int nsockets;
+	    int size;
+	    ape_sock_handle *dead; /* shared connections whose sessions expire early (see transport_websocket_expire()) */
+	    int ndead;
+	    int dead_size;
 	} websocket_ietf;
+
+	struct {
+		struct _transport_properties properties;
+		int heartbeat; /* seconds between two comment lines on an idle stream */
+		int retry; /* reconnection delay (ms) sent to the browser, 0 : not sent */
+		int history; /* raws kept per subuser for Last-Event-ID */
+	} eventsource;
+
+	struct {
+		struct _transport_properties properties;
+		int heartbeat; /* seconds between two empty chunks on an idle stream */
+		unsigned int budget; /* bytes sent before the response is ended */
+	} chunked;
 };
 
 typedef struct _http_state http_state;
@@ -150,8 +182,32 @@ typedef struct _websocket_state
 	int data_pos;
 	int data_inkey;
 	int frame_pos;
+
+	struct {
+		int bits; /* permessage-deflate window (server_max_window_bits), 0 : not negotiated */
+		int takeover; /* the compression context is kept between messages */
+		void *stream; /* z_stream of a "takeover" connection */
+	} deflate;
+
+	int msgpack; /* "ape.msgpack" subprotocol : RAWs and commands are MessagePack (binary frames) */
+	int data_len; /* length of "data" (binary frames) */
+
+	struct {
+		int enabled; /* "ape.mux" subprotocol : several sessions share the connection, messages are tagged */
+		unsigned int tag; /* tag of the message being processed */
+	} mux;
+
+	struct {
+		time_t last; /* last frame received */
+		time_t sent; /* unanswered ping (0 : none) */
+	} ping;
 } websocket_state;
 
+/* Sec-WebSocket-Protocol understood by the server */
+#define WS_PROTOCOL_MSGPACK "ape.msgpack"
+#define WS_PROTOCOL_MUX "ape.mux"
+#define WS_PROTOCOL_MUX_MSGPACK "ape.mux.msgpack"
+
 typedef enum {
 	STREAM_IN,
 	STREAM_OUT,
@@ -164,6 +220,11 @@ typedef enum {
 	STREAM_PROGRESS
 } ape_socket_state_t;
 
+typedef enum {
+	LISTENER_HTTP, /* users : HTTP transports and WebSocket */
+	LISTENER_PUSH /* backends (see push.c) */
+} ape_listener_t;
+
 typedef struct _ape_buffer ape_buffer;
 struct _ape_buffer {
 	char *data;
@@ -190,8 +251,86 @@ typedef struct _acetables
 	struct {
 		struct _ticks_callback *timers;
 		unsigned int ntimers;
+		unsigned int rate; /* add_ticked() period (Server.ticks_rate) */
+		long long last; /* monotonic ms of the last process_ticks() */
 	} timers;
 
+	struct {
+		int *fds; /* sockets that still have data to read (budget exhausted) */
+		int nfds;
+		int size;
+		int budget; /* bytes read per socket and per loop iteration (Server.read_budget) */
+		int accept_budget; /* connections accepted per listener and per loop iteration (Server.accept_budget) */
+	} read;
+
+	struct {
+		unsigned int high_watermark; /* bytes queued before a socket is congested (Server.send_high_watermark) */
+		unsigned int low_watermark; /* on_drain is fired under this (Server.send_low_watermark) */
+		int notsent_lowat; /* TCP_NOTSENT_LOWAT (Server.tcp_notsent_lowat) */
+		int congested_timeout; /* seconds over the high watermark before the peer is dropped (Server.send_congested_timeout) */
+		int *fds; /* completion sockets with output to submit (see flush_sockets()) */
+		int nfds;
+		int size;
+		ape_sock_handle *congested; /* see drop_congested() */
+		int ncongested;
+		int congested_size;
+	} write;
+
+	struct {
+		unsigned long long iterations;
+		unsigned long long total_us; /* time spent processing events (poll() wait excluded) */
+		long long last_us;
+		long long max_us;
+	} loop;
+
+	struct {
+		int server; /* main listener (servers_init()) */
+		int fd; /* connection to the instance we are taking over (Server.handoff_socket) */
+		int listener; /* Server.handoff_socket, for the next instance */
+		int done; /* sockets and state handed over to a new instance */
+		ape_sock_handle request; /* next instance waiting for the I/O in flight to be cancelled */
+	} handoff;
+
+	struct {
+		char *file; /* Server.snapshot_file (NULL : disabled) */
+		pid_t child; /* writing the periodical snapshot */
+	} snapshot;
+
+	struct {
+		void *ctx; /* SSL_CTX (NULL : no TLS listener) */
+		int server; /* TLS listener */
+	} tls;
+
+	struct {
+		int server; /* Push listener (TCP), 0 : none */
+		int unix_server; /* Push.unix_socket, 0 : none */
+		char *password;
+		int validate; /* data is checked before being sent to the users */
+	} push;
+
+	struct {
+		char *node; /* Cluster.node, NULL : not clustered */
+		char *password;
+		int server; /* listener for the other nodes, 0 : none */
+		struct _cluster_peer *self; /* our own entry of Cluster.nodes */
+		struct _cluster_peer *peers;
+		char *header; /* "X-APE-Node: node\r\n", NULL : not clustered */
+	} cluster;
+
+	struct {
+		int websocket; /* permessage-deflate mode (Compression.websocket, see compress.h) */
+		int level;
+		int min_size; /* smaller messages are sent uncompressed */
+		int http; /* gzip for the HTTP transports (Compression.http) */
+		void *deflate[16]; /* z_stream per window size, reset for each message */
+		void *inflate; /* clients never keep their context (client_no_context_takeover) */
+		struct {
+			char *data;
+			unsigned int size;
+			unsigned int length;
+		} out, in; /* deflate and inflate output */
+	} compress;
+
 	struct {
 		unsigned int lvl;
 		unsigned int use_syslog;
@@ -213,12 +352,16 @@ typedef struct _acetables
 	struct _ace_plugins *plugins;
 	struct _fdevent *events;
 	struct _ape_socket **co;
+	struct _socks_block *co_blocks;
+	struct _ape_listener *listeners; /* Listener sections */
+	struct _ape_pools *pools;
 	struct _extend *properties;
 
 	const char *confs_path;
 
 	int is_daemon;
 	int basemem;
+	int members_page;
 	unsigned int nConnected;
 } acetables;
 
@@ -243,6 +386,7 @@ struct _ape_socket {
 		void (*on_read_lf)(struct _ape_socket *client, char *data, acetables *g_ape);
 		void (*on_data_completly_sent)(struct _ape_socket *client, acetables *g_ape);
 		void (*on_write)(struct _ape_socket *client, acetables *g_ape);
+		void (*on_drain)(struct _ape_socket *client, acetables *g_ape); /* output queue back under the low watermark */
 	} callbacks;
 
 	ape_parser parser;
@@ -256,12 +400,33 @@ struct _ape_socket {
 	void *data;
 
 	int fd;
+	unsigned int gen; /* bumped each time the fd is reused (see ape_sock_handle) */
 	int burn_after_writing;
+	int read_pending; /* listed in g_ape->read.fds */
+	int congested; /* output queue went over the high watermark */
+	long int congested_since;
+	int congested_listed; /* in g_ape->write.congested */
+	int completion; /* I/O done by the event backend (io_uring) instead of read()/write() */
+	int write_pending; /* listed in g_ape->write.fds */
+
+	void *tls; /* SSL_CTX of a TLS listener, SSL of its clients (see tls.c) */
+	struct _ape_listener *listener; /* Listener section of a listener and its clients (NULL : Server, TLS and Push sections) */
 
 	ape_socket_state_t state;
 	ape_socket_t stream_type;
 };
 
+typedef struct _ape_listener ape_listener;
+struct _ape_listener {
+	char *name; /* "ip:port" or UNIX socket path, matched on a handoff */
+	int fd; /* 0 : not listening yet */
+	int tls;
+	unsigned int transports; /* transport_t allowed (1 << transport), HTTP listeners */
+	ape_listener_t protocol;
+	struct apeconfig *conf; /* its section */
+	struct _ape_listener *next;
+};
+
 #define HEADER_DEFAULT "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: text/html\r\n\r\n"
 #define HEADER_DEFAULT_LEN 144
 
@@ -274,6 +439,16 @@ struct _ape_socket {
 #define HEADER_JSONP "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: application/javascript\r\n\r\n"
 #define HEADER_JSONP_LEN 157
 
+#define HEADER_EVENTSOURCE "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: text/event-stream\r\n\r\n"
+#define HEADER_EVENTSOURCE_LEN 152
+
+#define HEADER_CHUNKED "HTTP/1.1 200 OK\r\nPragma: no-cache\r\nCache-Control: no-cache, must-revalidate\r\nExpires: Thu, 27 Dec 1986 07:30:00 GMT\r\nContent-Type: application/x-ape-event-stream\r\nTransfer-Encoding: chunked\r\n\r\n"
+#define HEADER_CHUNKED_LEN 193
+
+#define HEADER_FORBIDDEN "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+#define HEADER_TRANSFER_CHUNKED "Transfer-Encoding: chunked\r\n"
+
 #define CONTENT_NOTFOUND "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\"><html><head><title>APE Server</title></head><body><h1>APE Server</h1><p>No command given.</p><hr><address>http://www.ape-project.org/ - Server "_VERSION" (Build "__DATE__" "__TIME__")</address></body></html>"
 
 /* http://tools.ietf.org/html/draft-hixie-thewebsocketprotocol-55 : The first three lines in each case are hard-coded (the exact case and order matters); */
@@ -0,0 +1,749 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* msgpack.c */
+
+/*
+	MessagePack for the WebSocket clients of the "ape.msgpack" subprotocol
+	(binary frames).
+	RAWs are JSON text (forge_raw()) : they are transcoded in a single pass,
+	without building a tree. Binary commands are decoded into the same
+	json_item tree as init_json_parser() gives.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "msgpack.h"
+#include "utils.h"
+
+#define MSGPACK_RESERVE 5 /* Largest str/array/map header */
+#define MSGPACK_JSON_DEPTH 64
+
+typedef enum {
+	MSGPACK_STR,
+	MSGPACK_ARRAY,
+	MSGPACK_MAP
+} msgpack_container_t;
+
+struct _msgpack_buffer {
+	char *data;
+	int len;
+	int size;
+};
+
+struct _json_reader {
+	const char *p;
+	const char *end;
+};
+
+static char *msgpack_grow(struct _msgpack_buffer *out, int len)
+{
+	if (out->len + len > out->size) {
+		out->size = (out->len + len) * 2;
+		out->data = xrealloc(out->data, out->size);
+	}
+	return &out->data[out->len];
+}
+
+static void msgpack_put(struct _msgpack_buffer *out, const char *data, int len)
+{
+	memcpy(msgpack_grow(out, len), data, len);
+	out->len += len;
+}
+
+/* "type" followed by the "n" low bytes of "val" (big endian) */
+static void msgpack_put_uint(struct _msgpack_buffer *out, unsigned char type, unsigned long long val, int n)
+{
+	unsigned char *p = (unsigned char *)msgpack_grow(out, n + 1);
+	int i;
+
+	p[0] = type;
+	for (i = n; i > 0; i--) {
+		p[i] = val & 0xFF;
+		val >>= 8;
+	}
+	out->len += n + 1;
+}
+
+static void msgpack_put_int(struct _msgpack_buffer *out, long long val)
+{
+	if (val >= 0) {
+		if (val < 128) {
+			*msgpack_grow(out, 1) = val;
+			out->len++;
+		} else if (val < 256) {
+			msgpack_put_uint(out, 0xcc, val, 1);
+		} else if (val < 65536) {
+			msgpack_put_uint(out, 0xcd, val, 2);
+		} else if (val <= 0xFFFFFFFFLL) {
+			msgpack_put_uint(out, 0xce, val, 4);
+		} else {
+			msgpack_put_uint(out, 0xcf, val, 8);
+		}
+	} else if (val >= -32) {
+		*msgpack_grow(out, 1) = (char)val;
+		out->len++;
+	} else if (val >= -128) {
+		msgpack_put_uint(out, 0xd0, val, 1);
+	} else if (val >= -32768) {
+		msgpack_put_uint(out, 0xd1, val, 2);
+	} else if (val >= -2147483648LL) {
+		msgpack_put_uint(out, 0xd2, val, 4);
+	} else {
+		msgpack_put_uint(out, 0xd3, val, 8);
+	}
+}
+
+static void msgpack_put_double(struct _msgpack_buffer *out, double val)
+{
+	union {
+		double d;
+		unsigned long long u;
+	} v;
+
+	v.d = val;
+	msgpack_put_uint(out, 0xcb, v.u, 8);
+}
+
+/*
+	The size of a str/array/map is known once its content is written :
+	MSGPACK_RESERVE bytes are left at "start" and the content is moved back
+	after the (smallest) header
+*/
+static void msgpack_close(struct _msgpack_buffer *out, int start, unsigned int n, msgpack_container_t type)
+{
+	unsigned char head[MSGPACK_RESERVE];
+	int len;
+
+	switch(type) {
+		case MSGPACK_STR:
+			if (n < 32) {
+				head[0] = 0xa0 | n;
+				len = 1;
+			} else if (n < 256) {
+				head[0] = 0xd9;
+				head[1] = n;
+				len = 2;
+			} else if (n < 65536) {
+				head[0] = 0xda;
+				len = 3;
+			} else {
+				head[0] = 0xdb;
+				len = 5;
+			}
+			break;
+		case MSGPACK_ARRAY:
+		case MSGPACK_MAP:
+		default:
+			if (n < 16) {
+				head[0] = (type == MSGPACK_ARRAY ? 0x90 : 0x80) | n;
+				len = 1;
+			} else if (n < 65536) {
+				head[0] = (type == MSGPACK_ARRAY ? 0xdc : 0xde);
+				len = 3;
+			} else {
+				head[0] = (type == MSGPACK_ARRAY ? 0xdd : 0xdf);
+				len = 5;
+			}
+			break;
+	}
+	if (len == 3) {
+		head[1] = n >> 8;
+		head[2] = n;
+	} else if (len == 5) {
+		head[1] = n >> 24;
+		head[2] = n >> 16;
+		head[3] = n >> 8;
+		head[4] = n;
+	}
+	memmove(&out->data[start + len], &out->data[start + MSGPACK_RESERVE], out->len - start - MSGPACK_RESERVE);
+	memcpy(&out->data[start], head, len);
+
+	out->len -= MSGPACK_RESERVE - len;
+}
+
+static int msgpack_open(struct _msgpack_buffer *out)
+{
+	int start = out->len;
+
+	msgpack_grow(out, MSGPACK_RESERVE);
+	out->len += MSGPACK_RESERVE;
+
+	return start;
+}
+
+static void json_skip(struct _json_reader *r)
+{
+	while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')) {
+		r->p++;
+	}
+}
+
+static int json_hex4(struct _json_reader *r)
+{
+	int i, val = 0;
+
+	if (r->end - r->p < 4) {
+		return -1;
+	}
+	for (i = 0; i < 4; i++, r->p++) {
+		val <<= 4;
+		if (*r->p >= '0' && *r->p <= '9') {
+			val |= *r->p - '0';
+		} else if ((*r->p | 0x20) >= 'a' && (*r->p | 0x20) <= 'f') {
+			val |= (*r->p | 0x20) - 'a' + 10;
+		} else {
+			return -1;
+		}
+	}
+	return val;
+}
+
+/* \uXXXX (and its low surrogate), r->p is after the 'u' */
+static int json_unicode(struct _json_reader *r, struct _msgpack_buffer *out)
+{
+	char utf8[4];
+	int code, low, len;
+
+	if ((code = json_hex4(r)) == -1) {
+		return 0;
+	}
+	if (code >= 0xD800 && code <= 0xDBFF) {
+		if (r->end - r->p < 2 || r->p[0] != '\\' || r->p[1] != 'u') {
+			return 0;
+		}
+		r->p += 2;
+		if ((low = json_hex4(r)) < 0xDC00 || low > 0xDFFF) {
+			return 0;
+		}
+		code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+	}
+	if (code < 0x80) {
+		utf8[0] = code;
+		len = 1;
+	} else if (code < 0x800) {
+		utf8[0] = 0xC0 | (code >> 6);
+		utf8[1] = 0x80 | (code & 0x3F);
+		len = 2;
+	} else if (code < 0x10000) {
+		utf8[0] = 0xE0 | (code >> 12);
+		utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+		utf8[2] = 0x80 | (code & 0x3F);
+		len = 3;
+	} else {
+		utf8[0] = 0xF0 | (code >> 18);
+		utf8[1] = 0x80 | ((code >> 12) & 0x3F);
+		utf8[2] = 0x80 | ((code >> 6) & 0x3F);
+		utf8[3] = 0x80 | (code & 0x3F);
+		len = 4;
+	}
+	msgpack_put(out, utf8, len);
+
+	return 1;
+}
+
+static int json_string(struct _json_reader *r, struct _msgpack_buffer *out)
+{
+	int start = msgpack_open(out);
+
+	for (r->p++; r->p < r->end && *r->p != '"'; r->p++) {
+		const char *run = r->p;
+		char c;
+
+		while (r->p < r->end && *r->p != '"' && *r->p != '\\') {
+			r->p++;
+		}
+		msgpack_put(out, run, r->p - run);
+
+		if (r->p == r->end || *r->p == '"') {
+			break;
+		}
+		if (++r->p == r->end) {
+			return 0;
+		}
+		switch(*r->p) {
+			case 'n':
+				c = '\n';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 'b':
+				c = '\b';
+				break;
+			case 'f':
+				c = '\f';
+				break;
+			case '"':
+			case '\\':
+			case '/':
+			case '\'': /* escape_json_string() */
+				c = *r->p;
+				break;
+			case 'u':
+				r->p++;
+				if (!json_unicode(r, out)) {
+					return 0;
+				}
+				r->p--;
+				continue;
+			default:
+				return 0;
+		}
+		msgpack_put(out, &c, 1);
+	}
+	if (r->p == r->end) {
+		return 0;
+	}
+	r->p++;
+
+	msgpack_close(out, start, out->len - start - MSGPACK_RESERVE, MSGPACK_STR);
+
+	return 1;
+}
+
+static int json_number(struct _json_reader *r, struct _msgpack_buffer *out)
+{
+	char num[64], *end;
+	int len = 0, real = 0;
+	long long val;
+
+	while (r->p < r->end && ((*r->p >= '0' && *r->p <= '9') || *r->p == '-' || *r->p == '+' || *r->p == '.' || *r->p == 'e' || *r->p == 'E')) {
+		if (len == sizeof(num) - 1) {
+			return 0;
+		}
+		if (*r->p == '.' || *r->p == 'e' || *r->p == 'E') {
+			real = 1;
+		}
+		num[len++] = *r->p++;
+	}
+	num[len] = '\0';
+
+	if (!len) {
+		return 0;
+	}
+	if (!real) {
+		errno = 0;
+		val = strtoll(num, &end, 10);
+
+		if (errno != ERANGE) {
+			msgpack_put_int(out, val);
+			return (*end == '\0');
+		}
+	}
+	msgpack_put_double(out, strtod(num, &end));
+
+	return (*end == '\0');
+}
+
+static int json_value(struct _json_reader *r, struct _msgpack_buffer *out, int depth)
+{
+	int start;
+	unsigned int n = 0;
+
+	json_skip(r);
+
+	if (r->p == r->end) {
+		return 0;
+	}
+	switch(*r->p) {
+		case '"':
+			return json_string(r, out);
+		case '[':
+		case '{':
+		{
+			int map = (*r->p == '{');
+			char close = (map ? '}' : ']');
+
+			if (depth == MSGPACK_JSON_DEPTH) {
+				return 0;
+			}
+			start = msgpack_open(out);
+			r->p++;
+			json_skip(r);
+
+			if (r->p < r->end && *r->p == close) {
+				r->p++;
+			} else {
+				while (1) {
+					if (map) {
+						json_skip(r);
+						if (r->p == r->end || *r->p != '"' || !json_string(r, out)) {
+							return 0;
+						}
+						json_skip(r);
+						if (r->p == r->end || *r->p++ != ':') {
+							return 0;
+						}
+					}
+					if (!json_value(r, out, depth + 1)) {
+						return 0;
+					}
+					n++;
+					json_skip(r);
+
+					if (r->p == r->end) {
+						return 0;
+					}
+					if (*r->p == ',') {
+						r->p++;
+					} else if (*r->p++ == close) {
+						break;
+					} else {
+						return 0;
+					}
+				}
+			}
+			msgpack_close(out, start, n, (map ? MSGPACK_MAP : MSGPACK_ARRAY));
+			return 1;
+		}
+		case 't':
+			if (r->end - r->p < 4 || strncmp(r->p, "true", 4) != 0) {
+				return 0;
+			}
+			r->p += 4;
+			msgpack_put(out, "\xc3", 1);
+			return 1;
+		case 'f':
+			if (r->end - r->p < 5 || strncmp(r->p, "false", 5) != 0) {
+				return 0;
+			}
+			r->p += 5;
+			msgpack_put(out, "\xc2", 1);
+			return 1;
+		case 'n':
+			if (r->end - r->p < 4 || strncmp(r->p, "null", 4) != 0) {
+				return 0;
+			}
+			r->p += 4;
+			msgpack_put(out, "\xc0", 1);
+			return 1;
+		default:
+			return json_number(r, out);
+	}
+}
+
+/* MessagePack of a JSON text (must be released), NULL if it's not valid */
+char *msgpack_from_json(const char *json, int len, int *outlen)
+{
+	struct _json_reader r = {json, json + len};
+	struct _msgpack_buffer out = {NULL, 0, 0};
+
+	msgpack_grow(&out, len);
+
+	if (!json_value(&r, &out, 0) || (json_skip(&r), r.p != r.end)) {
+		free(out.data);
+		return NULL;
+	}
+	*outlen = out.len;
+
+	return out.data;
+}
+
+/*
+	Binary commands
+*/
+
+typedef enum {
+	MSGPACK_T_NIL,
+	MSGPACK_T_BOOL,
+	MSGPACK_T_INT,
+	MSGPACK_T_FLOAT,
+	MSGPACK_T_STR,
+	MSGPACK_T_ARRAY,
+	MSGPACK_T_MAP
+} msgpack_type_t;
+
+struct _msgpack_reader {
+	unsigned char *p;
+	unsigned char *end;
+};
+
+struct _msgpack_value {
+	msgpack_type_t type;
+	long long integer; /* also the size of a str/array/map */
+	double real;
+	char *str;
+};
+
+static int msgpack_get_uint(struct _msgpack_reader *r, int n, unsigned long long *val)
+{
+	if (r->end - r->p < n) {
+		return 0;
+	}
+	for (*val = 0; n > 0; n--) {
+		*val = (*val << 8) | *r->p++;
+	}
+	return 1;
+}
+
+static int msgpack_get_value(struct _msgpack_reader *r, struct _msgpack_value *value)
+{
+	unsigned long long u;
+	unsigned char c;
+	int n = 0;
+
+	if (r->p == r->end) {
+		return 0;
+	}
+	c = *r->p++;
+
+	if (c <= 0x7f || c >= 0xe0) {
+		value->type = MSGPACK_T_INT;
+		value->integer = (signed char)c;
+		if (c <= 0x7f) {
+			value->integer = c;
+		}
+		return 1;
+	} else if (c <= 0x8f) {
+		value->type = MSGPACK_T_MAP;
+		value->integer = c & 0x0f;
+	} else if (c <= 0x9f) {
+		value->type = MSGPACK_T_ARRAY;
+		value->integer = c & 0x0f;
+	} else if (c <= 0xbf) {
+		value->type = MSGPACK_T_STR;
+		value->integer = c & 0x1f;
+	} else {
+		switch(c) {
+			case 0xc0:
+				value->type = MSGPACK_T_NIL;
+				return 1;
+			case 0xc2:
+			case 0xc3:
+				value->type = MSGPACK_T_BOOL;
+				value->integer = c & 1;
+				return 1;
+			case 0xc4: /* bin : a string for the modules */
+			case 0xc5:
+			case 0xc6:
+				n = 1 << (c - 0xc4);
+				value->type = MSGPACK_T_STR;
+				break;
+			case 0xd9:
+			case 0xda:
+			case 0xdb:
+				n = 1 << (c - 0xd9);
+				value->type = MSGPACK_T_STR;
+				break;
+			case 0xca:
+			{
+				union {
+					float f;
+					unsigned int u;
+				} v;
+
+				if (!msgpack_get_uint(r, 4, &u)) {
+					return 0;
+				}
+				v.u = u;
+				value->type = MSGPACK_T_FLOAT;
+				value->real = v.f;
+				return 1;
+			}
+			case 0xcb:
+			{
+				union {
+					double d;
+					unsigned long long u;
+				} v;
+
+				if (!msgpack_get_uint(r, 8, &v.u)) {
+					return 0;
+				}
+				value->type = MSGPACK_T_FLOAT;
+				value->real = v.d;
+				return 1;
+			}
+			case 0xcc:
+			case 0xcd:
+			case 0xce:
+			case 0xcf:
+				if (!msgpack_get_uint(r, 1 << (c - 0xcc), &u)) {
+					return 0;
+				}
+				value->type = MSGPACK_T_INT;
+				value->integer = u;
+				return 1;
+			case 0xd0:
+			case 0xd1:
+			case 0xd2:
+			case 0xd3:
+				n = 1 << (c - 0xd0);
+				if (!msgpack_get_uint(r, n, &u)) {
+					return 0;
+				}
+				/* sign extension */
+				value->type = MSGPACK_T_INT;
+				value->integer = (n == 8 ? (long long)u : (long long)(u << (64 - n * 8)) >> (64 - n * 8));
+				return 1;
+			case 0xdc:
+			case 0xdd:
+				n = (c == 0xdc ? 2 : 4);
+				value->type = MSGPACK_T_ARRAY;
+				break;
+			case 0xde:
+			case 0xdf:
+				n = (c == 0xde ? 2 : 4);
+				value->type = MSGPACK_T_MAP;
+				break;
+			default:
+				/* ext types */
+				return 0;
+		}
+		if (!msgpack_get_uint(r, n, &u)) {
+			return 0;
+		}
+		value->integer = u;
+	}
+	/* Each element takes at least one byte */
+	if (value->integer > r->end - r->p) {
+		return 0;
+	}
+	if (value->type == MSGPACK_T_STR) {
+		value->str = (char *)r->p;
+		r->p += value->integer;
+	}
+
+	return 1;
+}
+
+/*
+	The json_set_property_*() functions want NUL terminated keys and
+	values : the byte after them is saved and restored (private copy)
+*/
+static int msgpack_get_items(struct _msgpack_reader *r, json_item *father, long long n, int map, int depth)
+{
+	while (n-- > 0) {
+		struct _msgpack_value key, value;
+		char *k = NULL, ksaved = 0, vsaved;
+		int klen = 0;
+		json_item *item;
+
+		if (map) {
+			if (!msgpack_get_value(r, &key) || key.type != MSGPACK_T_STR) {
+				return 0;
+			}
+			k = key.str;
+			klen = key.integer;
+		}
+		if (!msgpack_get_value(r, &value)) {
+			return 0;
+		}
+		if (k != NULL) {
+			ksaved = k[klen];
+			k[klen] = '\0';
+		}
+		switch(value.type) {
+			case MSGPACK_T_NIL:
+				json_set_property_null(father, k, klen);
+				break;
+			case MSGPACK_T_BOOL:
+				item = json_set_property_boolean(father, k, klen, value.integer);
+				item->jval.vu.integer_value = value.integer; /* as init_json_parser() */
+				break;
+			case MSGPACK_T_INT:
+				json_set_property_intN(father, k, klen, value.integer);
+				break;
+			case MSGPACK_T_FLOAT:
+				json_set_property_floatN(father, k, klen, value.real);
+				break;
+			case MSGPACK_T_STR:
+				vsaved = value.str[value.integer];
+				value.str[value.integer] = '\0';
+				json_set_property_strN(father, k, klen, value.str, value.integer);
+				value.str[value.integer] = vsaved;
+				break;
+			case MSGPACK_T_ARRAY:
+			case MSGPACK_T_MAP:
+				item = (value.type == MSGPACK_T_MAP ? json_new_object() : json_new_array());
+				json_set_property_objN(father, k, klen, item);
+
+				if (k != NULL) {
+					k[klen] = ksaved;
+					k = NULL;
+				}
+				if (depth == MSGPACK_DEPTH || !msgpack_get_items(r, item, value.integer, (value.type == MSGPACK_T_MAP), depth + 1)) {
+					return 0;
+				}
+				break;
+		}
+		if (k != NULL) {
+			k[klen] = ksaved;
+		}
+	}
+	return 1;
+}
+
+/* Same tree as init_json_parser(), NULL if "data" isn't a valid array or map */
+json_item *init_msgpack_parser(const char *data, int len)
+{
+	struct _msgpack_reader r;
+	struct _msgpack_value value;
+	json_item *head = NULL;
+	char *copy = xmalloc(len + 1);
+
+	memcpy(copy, data, len);
+	r.p = (unsigned char *)copy;
+	r.end = r.p + len;
+
+	if (msgpack_get_value(&r, &value) && (value.type == MSGPACK_T_ARRAY || value.type == MSGPACK_T_MAP)) {
+		head = (value.type == MSGPACK_T_MAP ? json_new_object() : json_new_array());
+
+		if (!msgpack_get_items(&r, head, value.integer, (value.type == MSGPACK_T_MAP), 1) || r.p != r.end) {
+			free_json_item(head);
+			head = NULL;
+		}
+	}
+	free(copy);
+
+	return head;
+}
+
+/* Tag heading the messages of an "ape.mux" connection (at most MSGPACK_TAG_MAX bytes) */
+int msgpack_put_tag(char *out, unsigned int tag)
+{
+	struct _msgpack_buffer buf = {out, 0, MSGPACK_TAG_MAX};
+
+	msgpack_put_int(&buf, tag);
+
+	return buf.len;
+}
+
+/* Length of the tag heading "data", 0 if it doesn't start with a positive integer */
+int msgpack_get_tag(const char *data, int len, unsigned int *tag)
+{
+	struct _msgpack_reader r;
+	struct _msgpack_value value;
+
+	r.p = (unsigned char *)data;
+	r.end = r.p + len;
+
+	if (!msgpack_get_value(&r, &value) || value.type != MSGPACK_T_INT || value.integer < 0 || value.integer > 0xFFFFFFFFLL) {
+		return 0;
+	}
+	*tag = value.integer;
+
+	return (char *)r.p - data;
+}
@@ -0,0 +1,36 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* msgpack.h */
+
+#ifndef _MSGPACK_H
+#define _MSGPACK_H
+
+#include "json.h"
+
+#define MSGPACK_DEPTH 15 // Same limit as init_json_parser()
+#define MSGPACK_TAG_MAX 5 // uint32
+
+char *msgpack_from_json(const char *json, int len, int *outlen);
+json_item *init_msgpack_parser(const char *data, int len);
+
+int msgpack_put_tag(char *out, unsigned int tag);
+int msgpack_get_tag(const char *data, int len, unsigned int *tag);
+
+#endif
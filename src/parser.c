@@ -23,6 +23,8 @@
 #include "http.h"
 #include "utils.h"
 #include "handle_http.h"
+#include "compress.h"
+#include "ticks.h"
 
 static void parser_destroy_http(ape_parser *http_parser)
 {
@@ -92,6 +94,7 @@ static void parser_destroy_stream(ape_parser *stream_parser)
 	websocket_state *websocket = stream_parser->data;
 	
 	free_header_line(websocket->http->hlines);
+	ws_deflate_free(websocket);
 
 	stream_parser->data = NULL;
 	stream_parser->ready = 0;
@@ -123,6 +126,17 @@ ape_parser parser_init_stream(ape_socket *co)
 	websocket->data_pos = 0;
 	websocket->frame_pos = 0;
 
+	websocket->deflate.bits = 0;
+	websocket->deflate.takeover = 0;
+	websocket->deflate.stream = NULL;
+
+	websocket->msgpack = 0;
+	websocket->mux.enabled = 0;
+	websocket->mux.tag = 0;
+	websocket->ping.last = ape_clock.sec;
+	websocket->ping.sent = 0;
+	websocket->data_len = 0;
+
 	stream_parser.parser_func = process_websocket;
 	stream_parser.onready = parser_ready_websocket;
 	stream_parser.destroy = parser_destroy_stream;
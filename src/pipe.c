@@ -21,6 +21,8 @@
 
 #include "pipe.h"
 #include "utils.h"
+#include "pool.h"
+#include "cluster.h"
 
 
 const char basic_chars[16] = { 	'a', 'b', 'c', 'd', 'e', 'f', '0', '1',
@@ -28,7 +30,7 @@ const char basic_chars[16] = { 	'a', 'b', 'c', 'd', 'e', 'f', '0', '1',
 			};
 
 
-/* Generate a string (32 chars) used for sessid and pubid */
+/* Generate a string (32 chars) used for sessid and pubid, prefixed by the node in cluster mode */
 void gen_sessid_new(char *input, acetables *g_ape)
 {
 	unsigned int i;
@@ -38,6 +40,7 @@ void gen_sessid_new(char *input, acetables *g_ape)
 			input[i] = basic_chars[rand_n(15)];
 		}
 		input[32] = '\0';
+		cluster_id(input, g_ape);
 	} while(seek_user_id(input, g_ape) != NULL || get_pipe(input, g_ape) != NULL); // Colision verification
 }
 
@@ -46,13 +49,15 @@ transpipe *init_pipe(void *pipe, int type, acetables *g_ape)
 {
 	transpipe *npipe = NULL;
 	
-	npipe = xmalloc(sizeof(*npipe));
+	npipe = pool_alloc(&g_ape->pools->pipes);
 	npipe->pipe = pipe;
 	npipe->type = type;
 	npipe->link = NULL;
 	npipe->data = NULL;
 	npipe->on_send = NULL;
 	npipe->properties = NULL;
+	npipe->json_cache.data = NULL;
+	npipe->json_cache.len = 0;
 	
 	gen_sessid_new(npipe->pubid, g_ape);
 	hashtbl_append(g_ape->hPubid, npipe->pubid, (void *)npipe);
@@ -63,7 +68,8 @@ void destroy_pipe(transpipe *pipe, acetables *g_ape)
 {
 	unlink_all_pipe(pipe, g_ape);
 	hashtbl_erase(g_ape->hPubid, pipe->pubid);
-	free(pipe);
+	extend_cache_free(&pipe->json_cache);
+	pool_free(&g_ape->pools->pipes, pipe);
 }
 
 /* Link a pipe to another (e.g. user <=> proxy) */
@@ -195,3 +201,37 @@ json_item *get_json_object_pipe(transpipe *pipe)
 	}
 }
 
+/*
+	Same as get_json_object_pipe() but the object is serialized once and kept
+	until a public property of the pipe owner is added or removed.
+	The returned item is a JSON_T_FRAGMENT : it can only be attached to a tree
+	which is going to be serialized (forge_raw), never walked (e.g. JS objects).
+*/
+json_item *get_json_object_pipe_cache(transpipe *pipe)
+{
+	extend *properties;
+	
+	switch(pipe->type) {
+		case USER_PIPE:
+			properties = ((USERS *)pipe->pipe)->properties;
+			break;
+		case CHANNEL_PIPE:
+			properties = ((CHANNEL *)pipe->pipe)->properties;
+			break;
+		case CUSTOM_PIPE:
+			properties = pipe->properties;
+			break;
+		case PROXY_PIPE:
+		default:
+			return get_json_object_pipe(pipe);
+	}
+	
+	if (!extend_cache_isvalid(properties, &pipe->json_cache)) {
+		struct jsontring *string = json_to_string(get_json_object_pipe(pipe), NULL, 1);
+		
+		extend_cache_set(properties, &pipe->json_cache, string->jstring, string->len);
+		free(string);
+	}
+	
+	return json_new_fragment(pipe->json_cache.data, pipe->json_cache.len);
+}
@@ -25,6 +25,7 @@
 #include "main.h"
 #include "users.h"
 #include "json.h"
+#include "extend.h"
 
 enum {
 	CHANNEL_PIPE = 0,
@@ -49,6 +50,9 @@ struct _transpipe
 	
 	struct _pipe_link *link;
 	struct _extend *properties;
+	
+	/* Serialized get_json_object_pipe() (see get_json_object_pipe_cache()) */
+	extend_cache json_cache;
 
 	void (*on_send)(struct _transpipe *, struct USERS *, json_item *, acetables *);
 	
@@ -67,6 +71,7 @@ void post_json_custom(json_item *jstr, struct USERS *user, struct _transpipe *pi
 void gen_sessid_new(char *input, acetables *g_ape);
 void unlink_all_pipe(transpipe *origin, acetables *g_ape);
 json_item *get_json_object_pipe(transpipe *pipe);
+json_item *get_json_object_pipe_cache(transpipe *pipe);
 json_item *get_json_object_pipe_custom(transpipe *pipe);
 #endif
 
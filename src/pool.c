@@ -0,0 +1,256 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* pool.c */
+
+#include "pool.h"
+#include "utils.h"
+#include "users.h"
+#include "pipe.h"
+#include "raw.h"
+#include "config.h"
+
+/*
+	Free lists of fixed size objects.
+	Short-lived structs (users, subusers, pipes, raw queues, I/O buffers, hash
+	table items) are created and destroyed at a very high rate, reusing them
+	avoid malloc() contention and fragmentation. Objects allocated by slab are never given back to the system.
+*/
+void init_pool(ape_pool *pool, const char *name, size_t size, unsigned int nslab, unsigned int max_free)
+{
+	pool->free = NULL;
+	pool->slabs = NULL;
+	pool->name = name;
+	pool->size = (size < sizeof(void *) ? sizeof(void *) : size);
+	pool->nslab = (nslab ? nslab : 1);
+	pool->max_free = max_free;
+	pool->nused = 0;
+	pool->nfree = 0;
+	pool->nalloc = 0;
+}
+
+static void expend_pool(ape_pool *pool)
+{
+	char *objects;
+	unsigned int i;
+	
+	if (pool->nslab == 1) {
+		objects = xmalloc(pool->size);
+	} else {
+		struct _pool_slab *slab = xmalloc(sizeof(*slab) + pool->size * pool->nslab);
+		
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		
+		objects = (char *)(slab + 1);
+	}
+	
+	for (i = 0; i < pool->nslab; i++) {
+		*(void **)(objects + i * pool->size) = pool->free;
+		pool->free = objects + i * pool->size;
+	}
+	
+	pool->nfree += pool->nslab;
+	pool->nalloc++;
+}
+
+void *pool_alloc(ape_pool *pool)
+{
+	void *ptr;
+	
+	if (pool->free == NULL) {
+		expend_pool(pool);
+	}
+	
+	ptr = pool->free;
+	pool->free = *(void **)ptr;
+	
+	pool->nfree--;
+	pool->nused++;
+	
+	return ptr;
+}
+
+void pool_free(ape_pool *pool, void *ptr)
+{
+	pool->nused--;
+	
+	if (pool->nslab == 1 && pool->max_free && pool->nfree >= pool->max_free) {
+		free(ptr);
+		return;
+	}
+	
+	*(void **)ptr = pool->free;
+	pool->free = ptr;
+	pool->nfree++;
+}
+
+void destroy_pool(ape_pool *pool)
+{
+	struct _pool_slab *slab;
+	
+	if (pool->nslab == 1) {
+		while (pool->free != NULL) {
+			void *next = *(void **)pool->free;
+			free(pool->free);
+			pool->free = next;
+		}
+	}
+	
+	while (pool->slabs != NULL) {
+		slab = pool->slabs->next;
+		free(pool->slabs);
+		pool->slabs = slab;
+	}
+	
+	pool->free = NULL;
+	pool->nfree = 0;
+}
+
+void pools_init(acetables *g_ape)
+{
+	int i;
+	
+	g_ape->pools = xmalloc(sizeof(*g_ape->pools));
+	
+	g_ape->pools->buffers_size = 0;
+	g_ape->pools->buffers_limit = atol(CONFIG_VAL(Server, input_buffers_limit, g_ape->srv)) * 1024 * 1024;
+	g_ape->pools->nlarge = 0;
+	
+	init_pool(&g_ape->pools->users, "users", sizeof(USERS), POOL_SLAB_OBJECTS, 0);
+	init_pool(&g_ape->pools->subusers, "subusers", sizeof(subuser), POOL_SLAB_OBJECTS, 0);
+	init_pool(&g_ape->pools->pipes, "pipes", sizeof(transpipe), POOL_SLAB_OBJECTS, 0);
+	
+	/* Every subuser has a high and a low priority queue */
+	init_pool(&g_ape->pools->raws[0], "raws", sizeof(struct _raw_pool) * RAW_POOL_HIGH, POOL_SLAB_OBJECTS, 0);
+	init_pool(&g_ape->pools->raws[1], "raws", sizeof(struct _raw_pool) * RAW_POOL_GROW, POOL_SLAB_OBJECTS, 0);
+	init_pool(&g_ape->pools->raws[2], "raws", sizeof(struct _raw_pool) * RAW_POOL_LOW, POOL_SLAB_OBJECTS, 0);
+	
+	/* Keep less free buffers as they get bigger */
+	for (i = 0; i < POOL_BUFFER_CLASSES; i++) {
+		init_pool(&g_ape->pools->buffers[i], "buffers", (DEFAULT_BUFFER_SIZE << i) + 1, 1, POOL_BUFFER_MAX_FREE >> i);
+	}
+}
+
+void pools_free(acetables *g_ape)
+{
+	int i;
+	
+	destroy_pool(&g_ape->pools->users);
+	destroy_pool(&g_ape->pools->subusers);
+	destroy_pool(&g_ape->pools->pipes);
+	
+	for (i = 0; i < POOL_RAW_CLASSES; i++) {
+		destroy_pool(&g_ape->pools->raws[i]);
+	}
+	
+	for (i = 0; i < POOL_BUFFER_CLASSES; i++) {
+		destroy_pool(&g_ape->pools->buffers[i]);
+	}
+	
+	free(g_ape->pools);
+}
+
+/* Size class of a buffer (sizes are always DEFAULT_BUFFER_SIZE x 2^n), -1 if too big */
+static int buffer_class(unsigned int size)
+{
+	int i;
+	
+	for (i = 0; i < POOL_BUFFER_CLASSES; i++) {
+		if (size == (DEFAULT_BUFFER_SIZE << i)) {
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+/* Allocate size + 1 bytes (ending '\0') */
+void buffer_alloc(ape_buffer *buffer, unsigned int size, acetables *g_ape)
+{
+	int class = buffer_class(size);
+	
+	if (class != -1) {
+		buffer->data = pool_alloc(&g_ape->pools->buffers[class]);
+	} else {
+		buffer->data = xmalloc(sizeof(char) * (size + 1));
+	}
+	
+	buffer->size = size;
+	buffer->length = 0;
+	
+	g_ape->pools->buffers_size += size;
+	
+	if (size > DEFAULT_BUFFER_SIZE) {
+		g_ape->pools->nlarge++;
+	}
+}
+
+/* Double the size of the buffer, keeping its content. Returns 0 if the memory limit is reached */
+int buffer_grow(ape_buffer *buffer, acetables *g_ape)
+{
+	int class = buffer_class(buffer->size), nclass = buffer_class(buffer->size * 2);
+	
+	if (g_ape->pools->buffers_limit && g_ape->pools->buffers_size + buffer->size > g_ape->pools->buffers_limit) {
+		return 0;
+	}
+	
+	if (class == -1 && nclass == -1) {
+		g_ape->pools->buffers_size += buffer->size;
+		buffer->size *= 2;
+		buffer->data = xrealloc(buffer->data, sizeof(char) * (buffer->size + 1));
+	} else {
+		ape_buffer new_buffer;
+		unsigned int length = buffer->length;
+		
+		buffer_alloc(&new_buffer, buffer->size * 2, g_ape);
+		memcpy(new_buffer.data, buffer->data, length);
+		
+		buffer_free(buffer, g_ape);
+		
+		buffer->data = new_buffer.data;
+		buffer->size = new_buffer.size;
+		buffer->length = length;
+	}
+	
+	return 1;
+}
+
+void buffer_free(ape_buffer *buffer, acetables *g_ape)
+{
+	int class;
+	
+	if (buffer->data == NULL) {
+		return;
+	}
+	
+	if ((class = buffer_class(buffer->size)) != -1) {
+		pool_free(&g_ape->pools->buffers[class], buffer->data);
+	} else {
+		free(buffer->data);
+	}
+	
+	g_ape->pools->buffers_size -= buffer->size;
+	
+	if (buffer->size > DEFAULT_BUFFER_SIZE) {
+		g_ape->pools->nlarge--;
+	}
+	
+	buffer->data = NULL;
+}
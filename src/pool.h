@@ -0,0 +1,87 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* pool.h */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include "main.h"
+
+#define POOL_SLAB_OBJECTS 64
+
+/* Pooled I/O buffers size classes : DEFAULT_BUFFER_SIZE << [0..POOL_BUFFER_CLASSES-1] */
+#define POOL_BUFFER_CLASSES 6
+#define POOL_BUFFER_MAX_FREE 1024
+
+/* Raw queue chunks of the subusers : RAW_POOL_HIGH, RAW_POOL_GROW and RAW_POOL_LOW entries */
+#define POOL_RAW_CLASSES 3
+
+/* Grown input buffers are shrunk back to DEFAULT_BUFFER_SIZE after this delay (sec) without data */
+#define BUFFER_SHRINK_IDLE 5
+
+typedef struct _ape_pool ape_pool;
+struct _ape_pool
+{
+	void *free; /* free objects, linked through their first bytes */
+	struct _pool_slab *slabs;
+	
+	const char *name;
+	
+	size_t size;
+	unsigned int nslab; /* objects allocated at once, 1 : each object is malloc'ed */
+	unsigned int max_free; /* (nslab == 1) objects kept for reuse, 0 : no limit */
+	
+	unsigned int nused;
+	unsigned int nfree;
+	unsigned long nalloc; /* malloc calls */
+};
+
+struct _pool_slab
+{
+	struct _pool_slab *next;
+};
+
+struct _ape_pools
+{
+	ape_pool users;
+	ape_pool subusers;
+	ape_pool pipes;
+	ape_pool raws[POOL_RAW_CLASSES];
+	
+	ape_pool buffers[POOL_BUFFER_CLASSES];
+	
+	unsigned long buffers_size; /* memory used by I/O buffers */
+	unsigned long buffers_limit; /* Server.input_buffers_limit (0 : no limit) */
+	unsigned int nlarge; /* buffers bigger than DEFAULT_BUFFER_SIZE */
+};
+
+void init_pool(ape_pool *pool, const char *name, size_t size, unsigned int nslab, unsigned int max_free);
+void *pool_alloc(ape_pool *pool);
+void pool_free(ape_pool *pool, void *ptr);
+void destroy_pool(ape_pool *pool);
+
+void pools_init(acetables *g_ape);
+void pools_free(acetables *g_ape);
+
+void buffer_alloc(ape_buffer *buffer, unsigned int size, acetables *g_ape);
+int buffer_grow(ape_buffer *buffer, acetables *g_ape);
+void buffer_free(ape_buffer *buffer, acetables *g_ape);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* push.c */
+
+/*
+	Publish listener for the backends (Push section) : the raws are posted
+	straight to the channels and users, without HTTP, APE commands or
+	JavaScript ("inlinepush" command).
+	Each message is a length (32 bits) followed by the payload. The first
+	message of a connection is Push.password, then each message is a batch
+	of publications :
+
+		target type (8 bits, push_target_t)
+		target length (16 bits), channel name or pipe pubid
+		raw length (16 bits), raw name
+		data length (32 bits), data : a JSON object, sent as is to the users
+
+	Integers are big endian. Every message is answered by the number of
+	publications done and rejected (unknown target, invalid data) as two
+	32 bits integers (0 and 0 for the password).
+	A wrong password, a truncated publication or a message bigger than
+	PUSH_MAX_BATCH closes the connection.
+*/
+
+#include "push.h"
+#include "sock.h"
+#include "raw.h"
+#include "channel.h"
+#include "pipe.h"
+#include "json.h"
+#include "cluster.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+#define PUSH_NAME_MAX 64 // target and raw names
+
+struct _push_state {
+	int auth;
+	int error;
+};
+
+static unsigned int push_get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int push_get32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void push_put32(unsigned char *p, unsigned int val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static void push_reply(ape_socket *co, unsigned int done, unsigned int rejected, acetables *g_ape)
+{
+	unsigned char reply[8];
+
+	push_put32(reply, done);
+	push_put32(&reply[4], rejected);
+
+	sendbin(co->fd, (char *)reply, 8, 0, g_ape);
+}
+
+static void push_close(ape_socket *co, const char *why, acetables *g_ape)
+{
+	struct _push_state *push = co->parser.data;
+
+	ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "Push : %s (%s), closing the connection", why, co->ip_client);
+
+	push->error = 1;
+	shutdown(co->fd, 2);
+}
+
+static int push_publish(push_target_t type, const char *target, unsigned int target_len, const char *name, unsigned int name_len,
+	const char *data, unsigned int len, acetables *g_ape)
+{
+	char key[PUSH_NAME_MAX + 1], raw_name[PUSH_NAME_MAX + 1];
+	CHANNEL *chan = NULL;
+	transpipe *pipe = NULL;
+	RAW *raw;
+	int done = 1;
+
+	if (target_len > PUSH_NAME_MAX || name_len == 0 || name_len > PUSH_NAME_MAX) {
+		return 0;
+	}
+	memcpy(key, target, target_len);
+	key[target_len] = '\0';
+
+	switch(type) {
+		case PUSH_TARGET_CHANNEL:
+			chan = getchan(key, g_ape);
+			break;
+		case PUSH_TARGET_PIPE:
+			if ((pipe = get_pipe(key, g_ape)) != NULL && pipe->type == CHANNEL_PIPE) {
+				chan = pipe->pipe;
+				pipe = NULL;
+			}
+			break;
+	}
+	/* Unknown targets may be on other nodes (see cluster.c) */
+	if ((chan == NULL && pipe == NULL && g_ape->cluster.peers == NULL) || (g_ape->push.validate && !json_is_object(data, len))) {
+		return 0;
+	}
+	memcpy(raw_name, name, name_len);
+	raw_name[name_len] = '\0';
+
+	raw = forge_raw(raw_name, json_new_fragment(data, len));
+
+	/* Held until every recipient has its reference */
+	raw->refcount = 1;
+
+	if (chan != NULL) {
+		post_raw_channel(raw, chan, g_ape);
+	} else if (pipe != NULL) {
+		post_raw(raw, pipe->pipe, g_ape);
+	} else if (type == PUSH_TARGET_CHANNEL) {
+		done = (cluster_post_channel(raw, key, g_ape) > 0);
+	} else {
+		done = (cluster_post_pipe(raw, key, g_ape) > 0);
+	}
+	free_raw(raw);
+
+	return done;
+}
+
+/* Return 0 if the batch is malformed */
+static int push_batch(ape_socket *co, const unsigned char *data, unsigned int len, acetables *g_ape)
+{
+	unsigned int pos = 0, done = 0, rejected = 0;
+
+	while (pos < len) {
+		const unsigned char *target, *name;
+		unsigned int type, target_len, name_len, data_len;
+
+		if (len - pos < 3 || len - pos - 3 < (target_len = push_get16(&data[pos + 1])) + 2) {
+			return 0;
+		}
+		type = data[pos];
+		target = &data[pos + 3];
+		pos += 3 + target_len;
+
+		name_len = push_get16(&data[pos]);
+		if (len - pos - 2 < name_len + 4) {
+			return 0;
+		}
+		name = &data[pos + 2];
+		pos += 2 + name_len;
+
+		data_len = push_get32(&data[pos]);
+		pos += 4;
+		if (len - pos < data_len) {
+			return 0;
+		}
+
+		if (push_publish(type, (const char *)target, target_len, (const char *)name, name_len, (const char *)&data[pos], data_len, g_ape)) {
+			done++;
+		} else {
+			rejected++;
+		}
+		pos += data_len;
+	}
+	push_reply(co, done, rejected, g_ape);
+
+	return 1;
+}
+
+static void push_read(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
+{
+	struct _push_state *push = co->parser.data;
+	unsigned char *data = (unsigned char *)buffer->data;
+	unsigned int pos = 0, len;
+
+	while (!push->error && buffer->length - pos >= 4) {
+		if ((len = push_get32(&data[pos])) > PUSH_MAX_BATCH) {
+			push_close(co, "message too big", g_ape);
+			break;
+		}
+		if (buffer->length - pos - 4 < len) {
+			break;
+		}
+		pos += 4;
+
+		if (!push->auth) {
+			if (!secret_equal(g_ape->push.password, (const char *)&data[pos], len)) {
+				push_close(co, "wrong password", g_ape);
+				break;
+			}
+			push->auth = 1;
+			push_reply(co, 0, 0, g_ape);
+		} else if (!push_batch(co, &data[pos], len, g_ape)) {
+			push_close(co, "malformed batch", g_ape);
+			break;
+		}
+		pos += len;
+	}
+
+	if (push->error) {
+		buffer->length = 0;
+	} else if (pos) {
+		memmove(buffer->data, &buffer->data[pos], buffer->length - pos);
+		buffer->length -= pos;
+	}
+}
+
+static void push_destroy(ape_parser *parser)
+{
+	free(parser->data);
+
+	parser->data = NULL;
+	parser->destroy = NULL;
+	parser->socket = NULL;
+}
+
+static void push_accept(ape_socket *co, acetables *g_ape)
+{
+	struct _push_state *push = xmalloc(sizeof(*push));
+
+	push->auth = 0;
+	push->error = 0;
+
+	co->parser.parser_func = NULL;
+	co->parser.onready = NULL;
+	co->parser.destroy = push_destroy;
+	co->parser.data = push;
+	co->parser.socket = co;
+	co->parser.ready = 0;
+}
+
+/* Also used for the Listener sections with "protocol = push" (see servers.c) */
+void push_callbacks(ape_socket *server)
+{
+	server->callbacks.on_accept = push_accept;
+	server->callbacks.on_read = push_read;
+}
+
+static int push_setup(ape_socket *server, int is_unix, acetables *g_ape)
+{
+	push_callbacks(server);
+
+	if (is_unix) {
+		g_ape->push.unix_server = server->fd;
+	} else {
+		g_ape->push.server = server->fd;
+	}
+
+	return server->fd;
+}
+
+void push_config(acetables *g_ape)
+{
+	g_ape->push.server = 0;
+	g_ape->push.unix_server = 0;
+	g_ape->push.password = CONFIG_VAL(Push, password, g_ape->srv);
+	g_ape->push.validate = (strcmp(CONFIG_VAL(Push, validate, g_ape->srv), "no") != 0);
+}
+
+/* Listeners of the Push section not inherited from a previous instance, return their number */
+int push_init(acetables *g_ape)
+{
+	ape_socket *server;
+	int port = atoi(CONFIG_VAL(Push, port, g_ape->srv)), n = 0;
+	char *path = CONFIG_VAL(Push, unix_socket, g_ape->srv), *ip = CONFIG_VAL(Push, ip_listen, g_ape->srv);
+
+	if (port <= 0 && *path == '\0') {
+		return 0;
+	}
+	if (*g_ape->push.password == '\0') {
+		if (!g_ape->is_daemon) {
+			printf("[WARN] Push.password is empty, Push listener disabled\n");
+		}
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] Push.password is empty, Push listener disabled");
+		return 0;
+	}
+
+	if (port > 0 && !g_ape->push.server && (server = ape_listen(port, (*ip != '\0' ? ip : CONFIG_VAL(Server, ip_listen, g_ape->srv)), g_ape)) != NULL) {
+		push_setup(server, 0, g_ape);
+		n++;
+	}
+	if (*path != '\0' && !g_ape->push.unix_server && (server = ape_listen_unix(path, PUSH_SOCKET_MODE, LISTEN_BACKLOG, g_ape)) != NULL) {
+		push_setup(server, 1, g_ape);
+		n++;
+	}
+
+	return n;
+}
+
+/* Listener inherited from a previous instance (see handoff.c) */
+int push_init_fd(int fd, int is_unix, acetables *g_ape)
+{
+	return push_setup(ape_listen_fd(fd, g_ape), is_unix, g_ape);
+}
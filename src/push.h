@@ -0,0 +1,40 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* push.h */
+
+#ifndef _PUSH_H
+#define _PUSH_H
+
+#include "main.h"
+
+#define PUSH_MAX_BATCH 16777216 // Bigger messages close the connection (bytes)
+#define PUSH_SOCKET_MODE 0660 // Push.unix_socket permissions
+
+typedef enum {
+	PUSH_TARGET_CHANNEL, /* channel name */
+	PUSH_TARGET_PIPE /* pubid of a channel or an user */
+} push_target_t;
+
+void push_config(acetables *g_ape);
+int push_init(acetables *g_ape);
+int push_init_fd(int fd, int is_unix, acetables *g_ape);
+void push_callbacks(ape_socket *server);
+
+#endif
@@ -27,20 +27,22 @@
 #include "plugins.h"
 #include "pipe.h"
 #include "transports.h"
+#include "ticks.h"
+#include "compress.h"
+#include "msgpack.h"
+#include "cluster.h"
+#include "pool.h"
 
 RAW *forge_raw(const char *raw, json_item *jlist)
 {
 	RAW *new_raw;
-	char unixtime[16];
 	struct jsontring *string;
 	
 	json_item *jstruct = NULL;
-		
-	sprintf(unixtime, "%li", time(NULL));
 	
 	jstruct = json_new_object();
 	
-	json_set_property_strN(jstruct, "time", 4, unixtime, strlen(unixtime));
+	json_set_property_strN(jstruct, "time", 4, ape_clock.str, ape_clock.len);
 	json_set_property_strN(jstruct, "raw", 3, raw, strlen(raw));
 	json_set_property_objN(jstruct, "data", 4, jlist);
 
@@ -51,6 +53,8 @@ RAW *forge_raw(const char *raw, json_item *jlist)
 	new_raw->next = NULL;
 	new_raw->priority = RAW_PRI_LO;
 	new_raw->refcount = 0;
+	new_raw->deflated.data = NULL;
+	new_raw->msgpack.data = NULL;
 
 	new_raw->data = string->jstring;
 
@@ -62,6 +66,8 @@ RAW *forge_raw(const char *raw, json_item *jlist)
 int free_raw(RAW *fraw)
 {
 	if (--(fraw->refcount) <= 0) {
+		free(fraw->deflated.data);
+		free(fraw->msgpack.data);
 		free(fraw->data);
 		free(fraw);
 
@@ -79,6 +85,8 @@ RAW *copy_raw(RAW *input)
 	new_raw->next = input->next;
 	new_raw->priority = input->priority;
 	new_raw->refcount = 0;
+	new_raw->deflated.data = NULL;
+	new_raw->msgpack.data = NULL;
 	new_raw->data = xmalloc(sizeof(char) * (new_raw->len + 1));
 
 	memcpy(new_raw->data, input->data, new_raw->len + 1);	
@@ -86,6 +94,26 @@ RAW *copy_raw(RAW *input)
 	return new_raw;	
 }
 
+/* Raw already serialized (e.g. received from another node, see cluster.c) */
+RAW *copy_raw_data(const char *data, int len)
+{
+	RAW *new_raw;
+
+	new_raw = xmalloc(sizeof(*new_raw));
+	new_raw->len = len;
+	new_raw->next = NULL;
+	new_raw->priority = RAW_PRI_LO;
+	new_raw->refcount = 0;
+	new_raw->deflated.data = NULL;
+	new_raw->msgpack.data = NULL;
+	new_raw->data = xmalloc(sizeof(char) * (len + 1));
+
+	memcpy(new_raw->data, data, len);
+	new_raw->data[len] = '\0';
+
+	return new_raw;
+}
+
 RAW *copy_raw_z(RAW *input)
 {
 	(input->refcount)++;
@@ -101,12 +129,12 @@ void post_raw_sub(RAW *raw, subuser *sub, acetables *g_ape)
 {
 	FIRE_EVENT_NULL(post_raw_sub, raw, sub, g_ape);
 
-	int add_size = 16;
+	int add_size = RAW_POOL_GROW;
 	struct _raw_pool_user *pool = (raw->priority == RAW_PRI_LO ? &sub->raw_pools.low : &sub->raw_pools.high);
 
 	if (++pool->nraw == pool->size) {
 		pool->size += add_size;
-		expend_raw_pool(pool->rawfoot, add_size);
+		expend_raw_pool(pool->rawfoot, add_size, g_ape);
 	}
 	
 	pool->rawfoot->raw = raw;
@@ -144,12 +172,17 @@ void post_raw_restricted(RAW *raw, USERS *user, subuser *sub, acetables *g_ape)
 
 /************* Channels related functions ****************/
 
-/* Post raw to a channel and propagate it to all of it's users */
+/* Post raw to a channel and propagate it to all of it's users (and to the other nodes having members, see cluster.c) */
 void post_raw_channel(RAW *raw, struct CHANNEL *chan, acetables *g_ape)
 {
 	userslist *list;
 	
-	if (chan == NULL || raw == NULL || chan->head == NULL) {
+	if (chan == NULL || raw == NULL) {
+		return;
+	}
+	cluster_post_channel(raw, chan->name, g_ape);
+
+	if (chan->head == NULL) {
 		return;
 	}
 	list = chan->head;
@@ -165,7 +198,12 @@ void post_raw_channel_restricted(RAW *raw, struct CHANNEL *chan, USERS *ruser, a
 {
 	userslist *list;
 	
-	if (chan == NULL || raw == NULL || chan->head == NULL) {
+	if (chan == NULL || raw == NULL) {
+		return;
+	}
+	cluster_post_channel(raw, chan->name, g_ape);
+
+	if (chan->head == NULL) {
 		return;
 	}
 	list = chan->head;
@@ -214,7 +252,8 @@ int post_raw_pipe(RAW *raw, const char *pipe, acetables *g_ape)
 			return 1;
 		}
 	}
-	return 0;
+	/* Maybe on another node */
+	return (cluster_post_pipe(raw, pipe, g_ape) > 0);
 }
 
 int post_to_pipe(json_item *jlist, const char *rawname, const char *pipe, subuser *from, acetables *g_ape)
@@ -225,32 +264,51 @@ int post_to_pipe(json_item *jlist, const char *rawname, const char *pipe, subuse
 	RAW *newraw;
 	
 	if (sender != NULL) {
+		if (recver == NULL && get_pipe(pipe, g_ape) == NULL && g_ape->cluster.peers != NULL) {
+			/* Maybe an user of another node */
+			json_set_property_objN(jlist, "from", 4, get_json_object_user_cache(sender));
+			json_set_property_objN(jlist, "pipe", 4, get_json_object_user_cache(sender));
+			newraw = forge_raw(rawname, jlist);
+
+			newraw->refcount = 1;
+			if (!cluster_post_pipe(newraw, pipe, g_ape)) {
+				send_error(sender, "UNKNOWN_PIPE", "109", g_ape);
+			}
+			free_raw(newraw);
+
+			return 1;
+		}
 		if (recver == NULL) {
 			send_error(sender, "UNKNOWN_PIPE", "109", g_ape);
 			return 0;
 		}
-		json_set_property_objN(jlist, "from", 4, get_json_object_user(sender));
+		/* Custom pipes get the tree itself (see post_json_custom) */
+		json_set_property_objN(jlist, "from", 4, (recver->type == CUSTOM_PIPE ? get_json_object_user(sender) : get_json_object_user_cache(sender)));
 
 	}
 	
 	if (sender != NULL && sender->nsub > 1) {
 		jlist_copy = json_item_copy(jlist, NULL);
 	
-		json_set_property_objN(jlist_copy, "pipe", 4, get_json_object_pipe(recver));
+		json_set_property_objN(jlist_copy, "pipe", 4, get_json_object_pipe_cache(recver));
 		newraw = forge_raw(rawname, jlist_copy);
 		post_raw_restricted(newraw, sender, from, g_ape);
 	}	
 	switch(recver->type) {
 		case USER_PIPE:
-			json_set_property_objN(jlist, "pipe", 4, get_json_object_user(sender));
+			json_set_property_objN(jlist, "pipe", 4, get_json_object_user_cache(sender));
 			newraw = forge_raw(rawname, jlist);
 			post_raw(newraw, recver->pipe, g_ape);
 			break;
 		case CHANNEL_PIPE:
-			if (((CHANNEL*)recver->pipe)->head != NULL && ((CHANNEL*)recver->pipe)->head->next != NULL) {
-				json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(recver->pipe));
+			if ((((CHANNEL*)recver->pipe)->head != NULL && ((CHANNEL*)recver->pipe)->head->next != NULL) || cluster_subscribed(recver->pipe, g_ape)) {
+				json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(recver->pipe));
 				newraw = forge_raw(rawname, jlist);
+
+				/* The sender may be its only local member */
+				newraw->refcount = 1;
 				post_raw_channel_restricted(newraw, recver->pipe, sender, g_ape);
+				free_raw(newraw);
 			}
 			break;
 		case CUSTOM_PIPE:
@@ -265,78 +323,536 @@ int post_to_pipe(json_item *jlist, const char *rawname, const char *pipe, subuse
 }
 
 
+/* IETF frame header, "start" holds the FIN/RSV bits and the opcode */
+static int ws_send_head(ape_socket *client, unsigned char start, unsigned int payload_size, acetables *g_ape)
+{
+	char payload_head[10] = { start };
+	int payload_length = 0;
+
+	if (payload_size <= 125) {
+		payload_head[1] = (unsigned char)payload_size & 0x7F;
+		payload_length = 2;
+	} else if (payload_size <= 65535) {
+		unsigned short int s = htons(payload_size);
+		payload_head[1] = 126;
+
+		memcpy(&payload_head[2], &s, 2);
+
+		payload_length = 4;
+	} else {
+		unsigned int s = htonl(payload_size);
+
+		payload_head[1] = 127;
+		payload_head[2] = 0;
+		payload_head[3] = 0;
+		payload_head[4] = 0;
+		payload_head[5] = 0;
+
+		memcpy(&payload_head[6], &s, 4);
+
+		payload_length = 10;
+	}
+
+	return sendbin(client->fd, payload_head, payload_length, 0, g_ape);
+}
+
+/* Posted to more than one subuser (see copy_raw_z()) or already compressed */
+#define RAW_IS_SHARED(raw) ((raw)->refcount > 1 || (raw)->deflated.data != NULL)
+
+/*
+	Compressed form of the RAW (see deflate_segment()).
+	A channel broadcast posts the same RAW to each subuser : it's compressed
+	once and kept for the other recipients.
+*/
+static char *raw_segment(RAW *raw, int *len, acetables *g_ape)
+{
+	char *segment;
+
+	if (raw->deflated.data != NULL) {
+		*len = raw->deflated.len;
+		return raw->deflated.data;
+	}
+	if ((segment = deflate_segment(raw->data, raw->len, len, g_ape)) == NULL || raw->refcount <= 1) {
+		return segment;
+	}
+	raw->deflated.data = xmalloc(*len);
+	raw->deflated.len = *len;
+	memcpy(raw->deflated.data, segment, *len);
+
+	return raw->deflated.data;
+}
+
+/*
+	MessagePack form of the RAW, transcoded once for all the recipients.
+	NULL if the RAW isn't valid JSON (sent as text).
+*/
+static char *raw_msgpack(RAW *raw, int *len)
+{
+	if (raw->msgpack.data == NULL && (raw->msgpack.data = msgpack_from_json(raw->data, raw->len, &raw->msgpack.len)) == NULL) {
+		return NULL;
+	}
+	*len = raw->msgpack.len;
+
+	return raw->msgpack.data;
+}
+
+/* The RAW segment is only valid for a 15 bits window */
+#define RAW_DEFLATE_SHARED(websocket) (!(websocket)->deflate.takeover && (websocket)->deflate.bits == 15)
+
+/*
+	"ape.mux" : a message starts with the tag of its session, "<tag>:" in a text
+	message or a MessagePack integer in a binary one. Returns the prefix length.
+*/
+#define WS_MUX_PREFIX_MAX 16
+
+static int ws_mux_prefix(websocket_state *websocket, unsigned int tag, int binary, char *out)
+{
+	if (!websocket->mux.enabled) {
+		return 0;
+	}
+	if (binary) {
+		return msgpack_put_tag(out, tag);
+	}
+	return sprintf(out, "%u:", tag);
+}
+
+/* A RAW in its own message ("[raw]"), "tag" is the session of a shared connection */
+static int ws_send_raw(ape_socket *client, RAW *raw, unsigned int tag, acetables *g_ape)
+{
+	websocket_state *websocket = client->parser.data;
+	void *deflate;
+	char *deflated, *packed;
+	char prefix[WS_MUX_PREFIX_MAX];
+	int finish = 1, len, plen;
+
+	/* A binary message "[raw]" (fixarray of 1) */
+	if (websocket->msgpack && (packed = raw_msgpack(raw, &len)) != NULL) {
+		plen = ws_mux_prefix(websocket, tag, 1, prefix);
+
+		if (websocket->deflate.bits && len+1 >= g_ape->compress.min_size && (deflate = ws_deflate_start(websocket, g_ape)) != NULL) {
+			ws_deflate_write(deflate, prefix, plen, g_ape);
+			ws_deflate_write(deflate, "\x91", 1, g_ape);
+			ws_deflate_write(deflate, packed, len, g_ape);
+
+			deflated = ws_deflate_end(deflate, &len, g_ape);
+
+			finish &= ws_send_head(client, 0xC2, len, g_ape);
+			finish &= sendbin(client->fd, deflated, len, 0, g_ape);
+
+			return finish;
+		}
+		finish &= ws_send_head(client, 0x82, plen+len+1, g_ape);
+		finish &= sendbin(client->fd, prefix, plen, 0, g_ape);
+		finish &= sendbin(client->fd, "\x91", 1, 0, g_ape);
+		finish &= sendbin(client->fd, packed, len, 0, g_ape);
+
+		return finish;
+	}
+	plen = ws_mux_prefix(websocket, tag, 0, prefix);
+
+	if (websocket->deflate.bits && raw->len+2 >= g_ape->compress.min_size) {
+		if (RAW_DEFLATE_SHARED(websocket)) {
+			if ((deflated = raw_segment(raw, &len, g_ape)) != NULL) {
+				/* The prefix is a stored block ahead of the shared segment */
+				unsigned char stored[5] = {0x00, plen & 0xFF, 0x00, ~plen & 0xFF, 0xFF};
+
+				finish &= ws_send_head(client, 0xC1, (plen ? plen + 5 : 0) + len + 13, g_ape);
+				if (plen) {
+					finish &= sendbin(client->fd, (char *)stored, 5, 0, g_ape);
+					finish &= sendbin(client->fd, prefix, plen, 0, g_ape);
+				}
+				finish &= sendbin(client->fd, CONST_STR_LEN(DEFLATE_OPEN), 0, g_ape);
+				finish &= sendbin(client->fd, deflated, len, 0, g_ape);
+				finish &= sendbin(client->fd, CONST_STR_LEN(DEFLATE_CLOSE), 0, g_ape);
+				finish &= sendbin(client->fd, CONST_STR_LEN(DEFLATE_SYNC), 0, g_ape);
+
+				return finish;
+			}
+		} else if ((deflate = ws_deflate_start(websocket, g_ape)) != NULL) {
+			ws_deflate_write(deflate, prefix, plen, g_ape);
+			ws_deflate_write(deflate, "[", 1, g_ape);
+			ws_deflate_write(deflate, raw->data, raw->len, g_ape);
+			ws_deflate_write(deflate, "]", 1, g_ape);
+
+			deflated = ws_deflate_end(deflate, &len, g_ape);
+
+			finish &= ws_send_head(client, 0xC1, len, g_ape);
+			finish &= sendbin(client->fd, deflated, len, 0, g_ape);
+
+			return finish;
+		}
+	}
+	finish &= ws_send_head(client, (websocket->version == WS_IETF_06 ? 0x84 : 0x81), plen+raw->len+2, g_ape); /* TODO: fragmentation? */
+
+	finish &= sendbin(client->fd, prefix, plen, 0, g_ape);
+	finish &= sendbin(client->fd, "[", 1, 0, g_ape);
+	finish &= sendbin(client->fd, raw->data, raw->len, 0, g_ape);
+	finish &= sendbin(client->fd, "]", 1, 0, g_ape);
+
+	return finish;
+}
+
+/*
+	Response body : sent as is, compressed in a permessage-deflate message
+	(ws_deflate_start()) or in a gzip HTTP body.
+	The gzip body is a sequence of deflate segments : the cached segments
+	of the broadcast RAWs, and one segment for everything in between
+	(padding, separators, RAWs with a single recipient).
+	A chunked body is sent as a single chunk when it's complete, with one
+	writev() : the pieces point to the RAWs (held until then) or to a copy.
+*/
+struct _raw_piece {
+	const char *data; /* NULL : at "offset" in the copy */
+	size_t offset;
+	int len;
+};
+
+struct _raw_body {
+	ape_socket *client;
+	void *deflate;
+	int gzip;
+	int chunked;
+	unsigned long crc;
+	unsigned int size; /* uncompressed */
+	unsigned int length; /* written */
+
+	struct {
+		char *data;
+		int len;
+		int size;
+	} pending, copy;
+
+	struct {
+		struct _raw_piece *list;
+		int n;
+		int size;
+	} pieces;
+
+	struct {
+		RAW **list;
+		int n;
+		int size;
+	} hold;
+};
+
+static void body_init(struct _raw_body *body, ape_socket *client, int gzip, int chunked)
+{
+	body->client = client;
+	body->deflate = NULL;
+	body->gzip = gzip;
+	body->chunked = chunked;
+	body->crc = gzip_crc(0, NULL, 0);
+	body->size = 0;
+	body->length = 0;
+	body->pending.data = NULL;
+	body->pending.len = 0;
+	body->pending.size = 0;
+	body->copy.data = NULL;
+	body->copy.len = 0;
+	body->copy.size = 0;
+	body->pieces.list = NULL;
+	body->pieces.n = 0;
+	body->pieces.size = 0;
+	body->hold.list = NULL;
+	body->hold.n = 0;
+	body->hold.size = 0;
+}
+
+/* "copy" : data doesn't outlive the call */
+static int body_write(struct _raw_body *body, const char *data, int len, int copy, acetables *g_ape)
+{
+	struct _raw_piece *piece;
+
+	body->length += len;
+
+	if (!body->chunked) {
+		return sendbin(body->client->fd, data, len, 0, g_ape);
+	}
+	if (body->pieces.n == body->pieces.size) {
+		body->pieces.size += 16;
+		body->pieces.list = xrealloc(body->pieces.list, sizeof(*body->pieces.list) * body->pieces.size);
+	}
+	piece = &body->pieces.list[body->pieces.n++];
+	piece->len = len;
+
+	if (!copy) {
+		piece->data = data;
+		return 1;
+	}
+	if (body->copy.len + len > body->copy.size) {
+		body->copy.size = body->copy.len + len + 1024;
+		body->copy.data = xrealloc(body->copy.data, body->copy.size);
+	}
+	memcpy(&body->copy.data[body->copy.len], data, len);
+
+	piece->data = NULL;
+	piece->offset = body->copy.len;
+	body->copy.len += len;
+
+	return 1;
+}
+
+/* The RAW is referenced by the pieces until the chunk is sent */
+static void body_hold(struct _raw_body *body, RAW *raw)
+{
+	if (body->hold.n == body->hold.size) {
+		body->hold.size += 16;
+		body->hold.list = xrealloc(body->hold.list, sizeof(*body->hold.list) * body->hold.size);
+	}
+	/* Raws posted to a single subuser aren't counted */
+	if (raw->refcount == 0) {
+		raw->refcount = 1;
+	}
+	body->hold.list[body->hold.n++] = copy_raw_z(raw);
+}
+
+/* The body as one chunk, "last" : followed by the last chunk (end of the response) */
+static int body_send_chunk(struct _raw_body *body, int last, acetables *g_ape)
+{
+	struct iovec *iov = xmalloc(sizeof(*iov) * (body->pieces.n + 3));
+	char head[16];
+	int i, n = 0, finish;
+
+	if (body->length) {
+		iov[n].iov_base = head;
+		iov[n++].iov_len = sprintf(head, "%x\r\n", body->length);
+
+		for (i = 0; i < body->pieces.n; i++) {
+			struct _raw_piece *piece = &body->pieces.list[i];
+
+			iov[n].iov_base = (piece->data != NULL ? (char *)piece->data : &body->copy.data[piece->offset]);
+			iov[n++].iov_len = piece->len;
+		}
+		iov[n].iov_base = "\r\n";
+		iov[n++].iov_len = 2;
+	}
+	if (last) {
+		iov[n].iov_base = "0\r\n\r\n";
+		iov[n++].iov_len = 5;
+	}
+	finish = sendbinv(body->client->fd, iov, n, g_ape);
+
+	free(iov);
+	free(body->pieces.list);
+	free(body->copy.data);
+
+	for (i = 0; i < body->hold.n; i++) {
+		free_raw(body->hold.list[i]);
+	}
+	free(body->hold.list);
+
+	return finish;
+}
+
+static int body_flush(struct _raw_body *body, acetables *g_ape)
+{
+	char *segment;
+	int seglen;
+
+	if (!body->pending.len) {
+		return 1;
+	}
+	segment = deflate_segment(body->pending.data, body->pending.len, &seglen, g_ape);
+	body->pending.len = 0;
+
+	if (segment == NULL) {
+		return 0;
+	}
+	return body_write(body, segment, seglen, 1, g_ape);
+}
+
+/* Chunked : data must stay valid until body_end() */
+static int body_put(struct _raw_body *body, const char *data, int len, acetables *g_ape)
+{
+	if (body->deflate != NULL) {
+		ws_deflate_write(body->deflate, data, len, g_ape);
+		return 1;
+	} else if (!body->gzip) {
+		return body_write(body, data, len, 0, g_ape);
+	}
+	body->crc = gzip_crc(body->crc, data, len);
+	body->size += len;
+
+	if (body->pending.len + len > body->pending.size) {
+		body->pending.size = body->pending.len + len + 1024;
+		body->pending.data = xrealloc(body->pending.data, body->pending.size);
+	}
+	memcpy(&body->pending.data[body->pending.len], data, len);
+	body->pending.len += len;
+
+	return 1;
+}
+
+static int body_put_raw(struct _raw_body *body, RAW *raw, acetables *g_ape)
+{
+	char *segment;
+	int seglen, finish = 1;
+
+	if (body->chunked) {
+		body_hold(body, raw);
+	}
+	if (!body->gzip || !RAW_IS_SHARED(raw)) {
+		return body_put(body, raw->data, raw->len, g_ape);
+	}
+	finish &= body_flush(body, g_ape);
+
+	body->crc = gzip_crc(body->crc, raw->data, raw->len);
+	body->size += raw->len;
+
+	if ((segment = raw_segment(raw, &seglen, g_ape)) == NULL) {
+		return 0;
+	}
+	finish &= body_write(body, segment, seglen, (segment != raw->deflated.data), g_ape);
+
+	return finish;
+}
+
+/*
+	Send what's left of the body.
+	"last" : end of the response (streaming transports don't end their gzip body)
+*/
+static int body_end(struct _raw_body *body, int last, acetables *g_ape)
+{
+	char trailer[8];
+	int finish = 1;
+
+	if (body->gzip) {
+		finish &= body_flush(body, g_ape);
+		free(body->pending.data);
+		body->pending.data = NULL;
+
+		if (last) {
+			gzip_trailer(trailer, body->crc, body->size);
+
+			finish &= body_write(body, CONST_STR_LEN(DEFLATE_FINAL), 0, g_ape);
+			finish &= body_write(body, trailer, 8, 1, g_ape);
+		}
+	}
+	if (body->chunked) {
+		finish &= body_send_chunk(body, last, g_ape);
+	}
+
+	return finish;
+}
+
+static int raw_transport_stream(transport_t transport)
+{
+	switch(transport) {
+		case TRANSPORT_PERSISTANT:
+		case TRANSPORT_XHRSTREAMING:
+		case TRANSPORT_SSE_LONGPOLLING:
+		case TRANSPORT_EVENTSOURCE:
+		case TRANSPORT_CHUNKED:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+	gzip if Compression.http is set and the client accepts it.
+	Bodies smaller than Compression.min_size are sent as is, unless they
+	open a stream (the rest of the stream may be larger).
+*/
+static int raw_gzip(ape_socket *client, transport_t transport, unsigned int size, int stream, acetables *g_ape)
+{
+	http_state *http = client->parser.data;
+
+	if (!g_ape->compress.http || transport == TRANSPORT_WEBSOCKET || transport == TRANSPORT_WEBSOCKET_IETF || http == NULL) {
+		return 0;
+	}
+	if (!stream && size < g_ape->compress.min_size) {
+		return 0;
+	}
+
+	return gzip_accepted(get_header_line(http->hlines, "Accept-Encoding"));
+}
+
+static int body_send_headers(struct _raw_body *body, http_headers_response *headers, const char *default_h, unsigned int default_len, acetables *g_ape)
+{
+	unsigned int header_len;
+	int finish = 1;
+
+	/* HEADER_CHUNKED has it, not the headers set by the modules */
+	const char *chunked = (body->chunked && headers != NULL ? HEADER_TRANSFER_CHUNKED : NULL);
+
+	if (!body->gzip) {
+		return http_send_headers(headers, default_h, default_len, chunked, body->client, g_ape);
+	}
+
+	/* HEADER_XHR is followed by the first bytes of the body */
+	header_len = strstr(default_h, "\r\n\r\n") - default_h + 4;
+
+	finish &= http_send_headers(headers, default_h, header_len, (chunked != NULL ? GZIP_CONTENT_ENCODING HEADER_TRANSFER_CHUNKED : GZIP_CONTENT_ENCODING), body->client, g_ape);
+	finish &= body_write(body, CONST_STR_LEN(GZIP_HEADER), 0, g_ape);
+
+	if (headers == NULL && header_len < default_len) {
+		finish &= body_put(body, &default_h[header_len], default_len - header_len, g_ape);
+	}
+
+	return finish;
+}
+
 int send_raw_inline(ape_socket *client, transport_t transport, RAW *raw, acetables *g_ape)
 {
 	struct _transport_properties *properties;
+	struct _raw_body body;
 	int finish = 1;
 
 	properties = transport_get_properties(transport, g_ape);
 
+	if (transport == TRANSPORT_WEBSOCKET_IETF) {
+		websocket_state *websocket = client->parser.data;
+
+		/* Replies to the message being processed */
+		finish &= ws_send_raw(client, raw, websocket->mux.tag, g_ape);
+
+		free_raw(raw);
+
+		return finish;
+	}
+
+	/* The connection is closed right after */
+	body_init(&body, client, raw_gzip(client, transport, raw->len+2, 0, g_ape), (transport == TRANSPORT_CHUNKED));
+
 	switch(transport) {
 		case TRANSPORT_XHRSTREAMING:
-			finish &= http_send_headers(NULL, HEADER_XHR, HEADER_XHR_LEN, client, g_ape);
+			finish &= body_send_headers(&body, NULL, HEADER_XHR, HEADER_XHR_LEN, g_ape);
 			break;
 		case TRANSPORT_SSE_LONGPOLLING:
-			finish &= http_send_headers(NULL, HEADER_SSE, HEADER_SSE_LEN, client, g_ape);
+			finish &= body_send_headers(&body, NULL, HEADER_SSE, HEADER_SSE_LEN, g_ape);
 			break;
 		case TRANSPORT_JSONP:
-			finish &= http_send_headers(NULL, HEADER_JSONP, HEADER_JSONP_LEN, client, g_ape);
+			finish &= body_send_headers(&body, NULL, HEADER_JSONP, HEADER_JSONP_LEN, g_ape);
+			break;
+		case TRANSPORT_EVENTSOURCE:
+			finish &= body_send_headers(&body, NULL, HEADER_EVENTSOURCE, HEADER_EVENTSOURCE_LEN, g_ape);
+			break;
+		case TRANSPORT_CHUNKED:
+			finish &= body_send_headers(&body, NULL, HEADER_CHUNKED, HEADER_CHUNKED_LEN, g_ape);
 			break;
 		case TRANSPORT_WEBSOCKET:
-		case TRANSPORT_WEBSOCKET_IETF:
 			break;
 		default:
-			finish &= http_send_headers(NULL, HEADER_DEFAULT, HEADER_DEFAULT_LEN, client, g_ape);
+			finish &= body_send_headers(&body, NULL, HEADER_DEFAULT, HEADER_DEFAULT_LEN, g_ape);
 			break;
 	}
 	
 	if (properties != NULL && properties->padding.left.val != NULL) {
-		finish &= sendbin(client->fd, properties->padding.left.val, properties->padding.left.len, 0, g_ape);
+		finish &= body_put(&body, properties->padding.left.val, properties->padding.left.len, g_ape);
 	}	
-
-
-	if (transport == TRANSPORT_WEBSOCKET_IETF) {
-	    websocket_state *websocket = client->parser.data;
-	    char payload_head[32] = { websocket->version == WS_IETF_06 ? 0x84 : 0x81 };
-	    int payload_size = raw->len+2; /* TODO: fragmentation? */
-	    int payload_length = 0;
-	    
-	    if (payload_size <= 125) {
-	        payload_head[1] = (unsigned char)payload_size & 0x7F;
-	        payload_length = 2;
-	    } else if (payload_size <= 65535) {
-	        unsigned short int s = htons(payload_size);
-	        payload_head[1] = 126;
-	        
-	        memcpy(&payload_head[2], &s, 2);
-	        
-	        payload_length = 4;
-	    } else if (payload_size <= 0xFFFFFFFF) {
-	        unsigned int s = htonl(payload_size);
-	        
-	        payload_head[1] = 127;
-	        payload_head[2] = 0;
-	        payload_head[3] = 0;
-	        payload_head[4] = 0;
-	        payload_head[5] = 0;
-	        
-            memcpy(&payload_head[6], &s, 4);
-
-	        payload_length = 10;
-	    }
-        
-        finish &= sendbin(client->fd, payload_head, payload_length, 0, g_ape);        
-	}
 	
-	finish &= sendbin(client->fd, "[", 1, 0, g_ape);
+	finish &= body_put(&body, "[", 1, g_ape);
 	
-	finish &= sendbin(client->fd, raw->data, raw->len, 0, g_ape);
+	finish &= body_put_raw(&body, raw, g_ape);
 	
-	finish &= sendbin(client->fd, "]", 1, 0, g_ape);
+	finish &= body_put(&body, "]", 1, g_ape);
 	
 	if (properties != NULL && properties->padding.right.val != NULL) {
-		finish &= sendbin(client->fd, properties->padding.right.val, properties->padding.right.len, 0, g_ape);
+		finish &= body_put(&body, properties->padding.right.val, properties->padding.right.len, g_ape);
 	}
+
+	finish &= body_end(&body, 1, g_ape);
 	
 	free_raw(raw);
 	
@@ -379,48 +895,100 @@ static unsigned int raws_size(subuser *user)
     return size;
 }
 
-/*
-	Send queue to socket
-*/
-int send_raws(subuser *user, acetables *g_ape)
+/* The gzip trailer is computed over the whole response, not a single send_raws() */
+static void raws_body_init(subuser *user, ape_socket *client, transport_t transport, struct _raw_body *body)
 {
-	int finish = 1, state = 0;
-	struct _raw_pool *pool;
-	struct _transport_properties *properties;
+	body_init(body, client, user->headers.gzip, (transport == TRANSPORT_CHUNKED));
 
-	if (user->raw_pools.nraw == 0) {
-		return 1;
-	}
+	body->crc = user->stream.crc;
+	body->size = user->stream.size;
+}
+
+static int raws_body_end(subuser *user, struct _raw_body *body, int last, acetables *g_ape)
+{
+	int finish = body_end(body, last, g_ape);
+
+	user->stream.crc = body->crc;
+	user->stream.size = body->size;
+	user->stream.last = ape_clock.sec;
+
+	return finish;
+}
+
+/* Response headers, once per connection */
+static int raws_send_headers(subuser *user, ape_socket *client, transport_t transport, struct _raw_body *body, acetables *g_ape)
+{
+	int finish = 1;
 
-	PACK_TCP(user->client->fd); /* Activate TCP_CORK */
-	
-	properties = transport_get_properties(user->user->transport, g_ape);
-	
 	if (!user->headers.sent) {
 		user->headers.sent = 1;
+		/* A stream keeps the encoding of its first response */
+		user->headers.gzip = raw_gzip(client, transport, raws_size(user), raw_transport_stream(transport), g_ape);
+		user->stream.length = 0;
+		user->stream.crc = gzip_crc(0, NULL, 0);
+		user->stream.size = 0;
+		raws_body_init(user, client, transport, body);
 		
-		switch(user->user->transport) {
+		switch(transport) {
 			case TRANSPORT_XHRSTREAMING:
-				finish &= http_send_headers(user->headers.content, HEADER_XHR, HEADER_XHR_LEN, user->client, g_ape);
+				finish &= body_send_headers(body, user->headers.content, HEADER_XHR, HEADER_XHR_LEN, g_ape);
 				break;
 			case TRANSPORT_SSE_LONGPOLLING:
-				finish &= http_send_headers(user->headers.content, HEADER_SSE, HEADER_SSE_LEN, user->client, g_ape);
+				finish &= body_send_headers(body, user->headers.content, HEADER_SSE, HEADER_SSE_LEN, g_ape);
 				break;
 			case TRANSPORT_JSONP:
-				finish &= http_send_headers(user->headers.content, HEADER_JSONP, HEADER_JSONP_LEN, user->client, g_ape);
+				finish &= body_send_headers(body, user->headers.content, HEADER_JSONP, HEADER_JSONP_LEN, g_ape);
 			break;
+			case TRANSPORT_EVENTSOURCE:
+				finish &= body_send_headers(body, user->headers.content, HEADER_EVENTSOURCE, HEADER_EVENTSOURCE_LEN, g_ape);
+				break;
+			case TRANSPORT_CHUNKED:
+				finish &= body_send_headers(body, user->headers.content, HEADER_CHUNKED, HEADER_CHUNKED_LEN, g_ape);
+				break;
 			case TRANSPORT_WEBSOCKET:
 			case TRANSPORT_WEBSOCKET_IETF:
 				break;
 			default:
-				finish &= http_send_headers(user->headers.content, HEADER_DEFAULT, HEADER_DEFAULT_LEN, user->client, g_ape);
+				finish &= body_send_headers(body, user->headers.content, HEADER_DEFAULT, HEADER_DEFAULT_LEN, g_ape);
 				break;
 		}
+	} else {
+		raws_body_init(user, client, transport, body);
+	}
+
+	return finish;
+}
+
+/*
+	Send queue to socket
+*/
+int send_raws(subuser *user, acetables *g_ape)
+{
+	int finish = 1, state = 0, split = 0;
+	struct _raw_pool *pool;
+	struct _transport_properties *properties;
+	ape_socket *client = g_ape->co[user->client.fd]; /* checked by the caller */
+	transport_t transport = user->user->transport;
+	struct _raw_body body;
+
+	if (user->raw_pools.nraw == 0) {
+		return 1;
+	}
+
+	PACK_TCP(client); /* Activate TCP_CORK */
+	
+	properties = transport_get_properties(transport, g_ape);
+	
+	finish &= raws_send_headers(user, client, transport, &body, g_ape);
+	
+	if (transport == TRANSPORT_EVENTSOURCE) {
+		char id[32];
 		
+		finish &= body_put(&body, id, sprintf(id, "id: %u\n", ++user->eventsource.id), g_ape);
 	}
 	
 	if (properties != NULL && properties->padding.left.val != NULL) {
-		finish &= sendbin(user->client->fd, properties->padding.left.val, properties->padding.left.len, 0, g_ape);
+		finish &= body_put(&body, properties->padding.left.val, properties->padding.left.len, g_ape);
 	}
 
 	if (user->raw_pools.high.nraw) {
@@ -430,57 +998,56 @@ int send_raws(subuser *user, acetables *g_ape)
 		state = 1;
 	}
 	
-	if (user->user->transport == TRANSPORT_WEBSOCKET_IETF) {
-	    websocket_state *websocket = user->client->parser.data;
-	    char payload_head[32] = { websocket->version == WS_IETF_06 ? 0x84 : 0x81 };
-
-	    int payload_size = raws_size(user); /* TODO: fragmentation? */
-	    int payload_length = 0;
-	    
-	    if (payload_size <= 125) {
-	        payload_head[1] = (unsigned char)payload_size & 0x7F;
-	        payload_length = 2;
-	    } else if (payload_size <= 65535) {
-	        unsigned short int s = htons(payload_size);
-	        payload_head[1] = 126;
-	        
-	        memcpy(&payload_head[2], &s, 2);
-	        
-	        payload_length = 4;
-	    } else if (payload_size <= 0xFFFFFFFF) {
-	        unsigned int s = htonl(payload_size);
-	        
-	        payload_head[1] = 127;
-	        payload_head[2] = 0;
-	        payload_head[3] = 0;
-	        payload_head[4] = 0;
-	        payload_head[5] = 0;
-	        
-            memcpy(&payload_head[6], &s, 4);
-
-	        payload_length = 10;
-	    }
-        
-        finish &= sendbin(user->client->fd, payload_head, payload_length, 0, g_ape);
-
-	}
-	finish &= sendbin(user->client->fd, "[", 1, 0, g_ape);
+	if (transport == TRANSPORT_WEBSOCKET_IETF) {
+		websocket_state *websocket = client->parser.data;
+		int payload_size = raws_size(user); /* TODO: fragmentation? */
+
+		if (websocket->msgpack) {
+			/* One binary message per RAW, transcoded once for all the recipients */
+			split = 1;
+		} else if (websocket->deflate.bits && RAW_DEFLATE_SHARED(websocket)) {
+			/*
+				One message per RAW : a channel broadcast is compressed once
+				for all the recipients (instead of once per batch of RAWs)
+			*/
+			split = 1;
+		} else if (websocket->deflate.bits && payload_size >= g_ape->compress.min_size) {
+			body.deflate = ws_deflate_start(websocket, g_ape);
+		}
+		if (!split) {
+			char prefix[WS_MUX_PREFIX_MAX];
+			int plen = ws_mux_prefix(websocket, user->tag, 0, prefix);
+
+			if (body.deflate == NULL) {
+				finish &= ws_send_head(client, (websocket->version == WS_IETF_06 ? 0x84 : 0x81), plen+payload_size, g_ape);
+			}
+			finish &= body_put(&body, prefix, plen, g_ape);
+		}
+	}
+	if (!split) {
+		finish &= body_put(&body, "[", 1, g_ape);
+	}
 		
 	while (pool->raw != NULL) {
 		struct _raw_pool *pool_next = (state ? pool->next : pool->prev);
 
-		finish &= sendbin(user->client->fd, pool->raw->data, pool->raw->len, 0, g_ape);
-
-		if ((pool_next != NULL && pool_next->raw != NULL) || (!state && user->raw_pools.low.nraw)) {
-			finish &= sendbin(user->client->fd, ",", 1, 0, g_ape);
+		if (split) {
+			finish &= ws_send_raw(client, pool->raw, user->tag, g_ape);
+		} else if ((pool_next != NULL && pool_next->raw != NULL) || (!state && user->raw_pools.low.nraw)) {
+			finish &= body_put_raw(&body, pool->raw, g_ape);
+			finish &= body_put(&body, ",", 1, g_ape);
 		} else {
-			finish &= sendbin(user->client->fd, "]", 1, 0, g_ape);
+			finish &= body_put_raw(&body, pool->raw, g_ape);
+			finish &= body_put(&body, "]", 1, g_ape);
 			
 			if (properties != NULL && properties->padding.right.val != NULL) {
-				finish &= sendbin(user->client->fd, properties->padding.right.val, properties->padding.right.len, 0, g_ape);
+				finish &= body_put(&body, properties->padding.right.val, properties->padding.right.len, g_ape);
 			}
 		}
 		
+		if (transport == TRANSPORT_EVENTSOURCE) {
+			transport_eventsource_keep(user, pool->raw, g_ape);
+		}
 		free_raw(pool->raw);
 		pool->raw = NULL;
 		
@@ -492,6 +1059,27 @@ int send_raws(subuser *user, acetables *g_ape)
 		}
 	}
 	
+	if (body.deflate != NULL) {
+		char *deflated;
+		int len;
+
+		deflated = ws_deflate_end(body.deflate, &len, g_ape);
+
+		finish &= ws_send_head(client, 0xC1, len, g_ape);
+		finish &= sendbin(client->fd, deflated, len, 0, g_ape);
+	} else {
+		int last = !raw_transport_stream(transport);
+		
+		finish &= body_flush(&body, g_ape);
+		user->stream.length += body.length;
+		
+		/* Intermediaries may buffer the whole response : it's ended and the client reconnects */
+		if (transport == TRANSPORT_CHUNKED && user->stream.length >= g_ape->transports.chunked.budget) {
+			last = 1;
+		}
+		finish &= raws_body_end(user, &body, last, g_ape);
+	}
+	
 	user->raw_pools.high.nraw = 0;
 	user->raw_pools.low.nraw = 0;
 	user->raw_pools.nraw = 0;
@@ -499,29 +1087,143 @@ int send_raws(subuser *user, acetables *g_ape)
 	user->raw_pools.high.rawfoot = user->raw_pools.high.rawhead;
 	user->raw_pools.low.rawfoot = user->raw_pools.low.rawhead;
 	
-	FLUSH_TCP(user->client->fd);
+	FLUSH_TCP(client);
 	
 	return finish;
 }
 
-struct _raw_pool *init_raw_pool(int n)
+/*
+	The EventSource stream of "user" is attached : headers right away, then
+	the events the client missed when it reconnects ("Last-Event-ID").
+	Queued raws follow with the next ids (see send_raws()).
+*/
+int send_raws_resume(subuser *user, const char *last_event_id, acetables *g_ape)
+{
+	int finish = 1, i, len, size = g_ape->transports.eventsource.history;
+	struct _transport_properties *properties = transport_get_properties(TRANSPORT_EVENTSOURCE, g_ape);
+	ape_socket *client = sock_from_handle(user->client, g_ape);
+	struct _raw_body body;
+	char line[32];
+
+	if (client == NULL || user->headers.sent) {
+		return 1;
+	}
+
+	PACK_TCP(client);
+
+	finish &= raws_send_headers(user, client, TRANSPORT_EVENTSOURCE, &body, g_ape);
+
+	if (g_ape->transports.eventsource.retry > 0) {
+		len = sprintf(line, "retry: %d\n\n", g_ape->transports.eventsource.retry);
+		finish &= body_put(&body, line, len, g_ape);
+	}
+
+	if (last_event_id != NULL) {
+		unsigned long last = strtoul(last_event_id, NULL, 10);
+		int replay = 0;
+
+		/* History is in ids order, the ids of a previous session are ignored */
+		for (i = 0; i < user->eventsource.count && last < user->eventsource.id; i++) {
+			struct _eventsource_event *event = &user->eventsource.history[(user->eventsource.head + i) % size];
+
+			if (event->id <= last) {
+				continue;
+			}
+			if (!replay++) {
+				len = sprintf(line, "id: %u\n", user->eventsource.id);
+				finish &= body_put(&body, line, len, g_ape);
+				finish &= body_put(&body, properties->padding.left.val, properties->padding.left.len, g_ape);
+				finish &= body_put(&body, "[", 1, g_ape);
+			} else {
+				finish &= body_put(&body, ",", 1, g_ape);
+			}
+			finish &= body_put_raw(&body, event->raw, g_ape);
+		}
+		if (replay) {
+			finish &= body_put(&body, "]", 1, g_ape);
+			finish &= body_put(&body, properties->padding.right.val, properties->padding.right.len, g_ape);
+		}
+	}
+	finish &= raws_body_end(user, &body, 0, g_ape);
+
+	FLUSH_TCP(client);
+
+	return finish;
+}
+
+/*
+	Keep an idle stream open : a comment line (EventSource) or an empty
+	line in its own chunk (chunked)
+*/
+int send_raws_heartbeat(subuser *user, acetables *g_ape)
+{
+	ape_socket *client = sock_from_handle(user->client, g_ape);
+	transport_t transport = user->user->transport;
+	struct _raw_body body;
+	int finish = 1;
+
+	if (client == NULL) {
+		return 1;
+	}
+	raws_body_init(user, client, transport, &body);
+
+	if (transport == TRANSPORT_EVENTSOURCE) {
+		finish &= body_put(&body, CONST_STR_LEN(":\n\n"), g_ape);
+	} else {
+		finish &= body_put(&body, CONST_STR_LEN("\n"), g_ape);
+	}
+	finish &= body_flush(&body, g_ape);
+	user->stream.length += body.length;
+	finish &= raws_body_end(user, &body, 0, g_ape);
+
+	return finish;
+}
+
+/* Chunks of the usual sizes come from g_ape->pools->raws, NULL for the others */
+static ape_pool *raw_chunk_pool(int n, acetables *g_ape)
+{
+	switch(n) {
+		case RAW_POOL_HIGH:
+			return &g_ape->pools->raws[0];
+		case RAW_POOL_GROW:
+			return &g_ape->pools->raws[1];
+		case RAW_POOL_LOW:
+			return &g_ape->pools->raws[2];
+		default:
+			return NULL;
+	}
+}
+
+static void raw_chunk_free(struct _raw_pool *chunk, acetables *g_ape)
+{
+	ape_pool *chunks = raw_chunk_pool(chunk->start, g_ape);
+	
+	if (chunks != NULL) {
+		pool_free(chunks, chunk);
+	} else {
+		free(chunk);
+	}
+}
+
+struct _raw_pool *init_raw_pool(int n, acetables *g_ape)
 {
 	int i;
-	struct _raw_pool *pool = xmalloc(sizeof(*pool) * n);
+	ape_pool *chunks = raw_chunk_pool(n, g_ape);
+	struct _raw_pool *pool = (chunks != NULL ? pool_alloc(chunks) : xmalloc(sizeof(*pool) * n));
 	
 	for (i = 0; i < n; i++) {
 		pool[i].raw = NULL;
 		pool[i].next = (i == n-1 ? NULL : &pool[i+1]);
 		pool[i].prev = (i == 0 ? NULL : &pool[i-1]);
-		pool[i].start = (i == 0);
+		pool[i].start = (i == 0 ? n : 0);
 	}
 	
 	return pool;
 }
 
-struct _raw_pool *expend_raw_pool(struct _raw_pool *ptr, int n)
+struct _raw_pool *expend_raw_pool(struct _raw_pool *ptr, int n, acetables *g_ape)
 {
-	struct _raw_pool *pool = init_raw_pool(n);
+	struct _raw_pool *pool = init_raw_pool(n, g_ape);
 	
 	ptr->next = pool;
 	pool->prev = ptr;
@@ -529,7 +1231,7 @@ struct _raw_pool *expend_raw_pool(struct _raw_pool *ptr, int n)
 	return pool;
 }
 
-void destroy_raw_pool(struct _raw_pool *ptr)
+void destroy_raw_pool(struct _raw_pool *ptr, acetables *g_ape)
 {
 	struct _raw_pool *pool = ptr, *tpool = NULL;
 	
@@ -539,13 +1241,13 @@ void destroy_raw_pool(struct _raw_pool *ptr)
 		}
 		if (pool->start) {
 			if (tpool != NULL) {
-				free(tpool);
+				raw_chunk_free(tpool, g_ape);
 			}
 			tpool = pool;
 		}
 		pool = pool->next;
 	}
 	if (tpool != NULL) {
-		free(tpool);
+		raw_chunk_free(tpool, g_ape);
 	}
 }
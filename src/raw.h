@@ -29,6 +29,11 @@
 #include "transports.h"
 #include "sock.h"
 
+/* Entries of the raw queue chunks of the subusers (see init_raw_pool()) */
+#define RAW_POOL_HIGH 8 // first chunk of the high priority queue
+#define RAW_POOL_GROW 16 // added when a queue is full
+#define RAW_POOL_LOW 32 // first chunk of the low priority queue
+
 typedef enum {
 	RAW_PRI_LO,
 	RAW_PRI_HI
@@ -43,6 +48,16 @@ typedef struct RAW
 	
 	int len;
 	int refcount;
+
+	struct {
+		char *data; /* deflate segment of data, for all the recipients (see raw_segment()) */
+		int len;
+	} deflated;
+
+	struct {
+		char *data; /* MessagePack form of data (see raw_msgpack()) */
+		int len;
+	} msgpack;
 } RAW;
 
 
@@ -50,6 +65,7 @@ RAW *forge_raw(const char *raw, json_item *jlist);
 int free_raw(RAW *fraw);
 RAW *copy_raw(RAW *input);
 RAW *copy_raw_z(RAW *input);
+RAW *copy_raw_data(const char *data, int len);
 
 void post_raw(RAW *raw, USERS *user, acetables *g_ape);
 void post_raw_sub(RAW *raw, subuser *sub, acetables *g_ape);
@@ -62,9 +78,11 @@ int post_to_pipe(json_item *jlist, const char *rawname, const char *pipe, subuse
 
 int send_raw_inline(ape_socket *client, transport_t transport, RAW *raw, acetables *g_ape);
 int send_raws(subuser *user, acetables *g_ape);
+int send_raws_resume(subuser *user, const char *last_event_id, acetables *g_ape);
+int send_raws_heartbeat(subuser *user, acetables *g_ape);
 
-struct _raw_pool *init_raw_pool(int n);
-struct _raw_pool *expend_raw_pool(struct _raw_pool *ptr, int n);
-void destroy_raw_pool(struct _raw_pool *ptr);
+struct _raw_pool *init_raw_pool(int n, acetables *g_ape);
+struct _raw_pool *expend_raw_pool(struct _raw_pool *ptr, int n, acetables *g_ape);
+void destroy_raw_pool(struct _raw_pool *ptr, acetables *g_ape);
 
 #endif
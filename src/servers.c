@@ -27,6 +27,9 @@
 #include "handle_http.h"
 #include "transports.h"
 #include "parser.h"
+#include "pool.h"
+#include "push.h"
+#include "log.h"
 #include "main.h"
 
 static void ape_read(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
@@ -45,18 +48,24 @@ static void ape_sent(ape_socket *co, acetables *g_ape)
 	}
 }
 
+/* The peer caught up, what was held back by flush_raws() goes out now (the other subusers of a shared WebSocket on the next tick) */
+static void ape_drain(ape_socket *co, acetables *g_ape)
+{
+	subuser *sub = (subuser *)(co->attach);
+	
+	if (sub != NULL && SOCK_HANDLE_IS(sub->client, co) && !co->burn_after_writing &&
+		sub->state == ALIVE && sub->raw_pools.nraw && !sub->need_update && !sub->burn_after_writing) {
+		
+		flush_raws(sub, g_ape);
+	}
+}
+
 static void ape_disconnect(ape_socket *co, acetables *g_ape)
 {
 	subuser *sub = (subuser *)(co->attach);
 	if (sub != NULL) {
 		
-		if (sub->wait_for_free == 1) {
-			free(sub);
-			co->attach = NULL;
-			return;				
-		}
-		
-		if (co->fd == sub->client->fd) {
+		if (SOCK_HANDLE_IS(sub->client, co)) {
 			sub->headers.sent = 0;
 			sub->state = ADIED;
 			http_headers_free(sub->headers.content);
@@ -77,6 +86,37 @@ static void ape_onaccept(ape_socket *co, acetables *g_ape)
 	co->parser = parser_init_http(co);
 }
 
+static void servers_callbacks(ape_socket *server)
+{
+	server->callbacks.on_read = ape_read;
+	server->callbacks.on_disconnect = ape_disconnect;
+	server->callbacks.on_data_completly_sent = ape_sent;
+	server->callbacks.on_drain = ape_drain;
+	server->callbacks.on_accept = ape_onaccept;
+	
+	/* HTTP (and TLS) clients always speak first */
+	set_defer_accept(server->fd, DEFER_ACCEPT_TIMEOUT);
+}
+
+static int servers_setup(ape_socket *main_server, acetables *g_ape)
+{
+	servers_callbacks(main_server);
+	
+	g_ape->handoff.server = main_server->fd;
+	
+	return main_server->fd;
+}
+
+static int servers_setup_tls(ape_socket *tls_server, acetables *g_ape)
+{
+	servers_callbacks(tls_server);
+	
+	tls_server->tls = g_ape->tls.ctx;
+	g_ape->tls.server = tls_server->fd;
+	
+	return tls_server->fd;
+}
+
 int servers_init(acetables *g_ape)
 {
 	ape_socket *main_server;
@@ -84,11 +124,231 @@ int servers_init(acetables *g_ape)
 		return 0;
 	}
 
-	main_server->callbacks.on_read = ape_read;
-	main_server->callbacks.on_disconnect = ape_disconnect;
-	main_server->callbacks.on_data_completly_sent = ape_sent;
-	main_server->callbacks.on_accept = ape_onaccept;
+	return servers_setup(main_server, g_ape);
+}
+
+/* Main listener inherited from a previous instance (see handoff.c) */
+int servers_init_fd(int fd, acetables *g_ape)
+{
+	return servers_setup(ape_listen_fd(fd, g_ape), g_ape);
+}
+
+/* TLS listener (TLS section), 0 if disabled */
+int servers_init_tls(acetables *g_ape)
+{
+	ape_socket *tls_server;
 	
-	return main_server->fd;
+	if (g_ape->tls.ctx == NULL) {
+		return 0;
+	}
+	if ((tls_server = ape_listen(atoi(CONFIG_VAL(TLS, port, g_ape->srv)), CONFIG_VAL(Server, ip_listen, g_ape->srv), g_ape)) == NULL) {
+		return 0;
+	}
+	
+	return servers_setup_tls(tls_server, g_ape);
+}
+
+int servers_init_tls_fd(int fd, acetables *g_ape)
+{
+	return servers_setup_tls(ape_listen_fd(fd, g_ape), g_ape);
+}
+
+/* "0,1,6" : transports allowed on the listener (numbers of the URL, 6 : WebSocket), all if empty */
+static unsigned int servers_transports(char *list)
+{
+	unsigned int transports = 0;
+	char *p = list;
+
+	if (*list == '\0') {
+		return ~0U;
+	}
+	while (*p != '\0') {
+		if (*p >= '0' && *p <= '9') {
+			long int transport = strtol(p, &p, 10);
+
+			if (transport < 32) {
+				transports |= (1U << transport);
+			}
+		} else {
+			p++;
+		}
+	}
+
+	return transports;
+}
+
+static char *servers_listener_val(apeconfig *conf, const char *key)
+{
+	char *val = ape_config_get_key(conf, key);
+
+	return (val == NULL ? "" : val);
+}
+
+static void servers_listener_warn(const char *name, const char *why, acetables *g_ape)
+{
+	if (!g_ape->is_daemon) {
+		printf("[WARN] Listener %s : %s, ignored\n", name, why);
+	}
+	ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] Listener %s : %s, ignored", name, why);
 }
 
+/* Listener sections, in the order of the configuration file (opened by servers_init_listeners()) */
+void servers_config_listeners(acetables *g_ape)
+{
+	apeconfig *conf;
+	ape_listener *listener;
+
+	g_ape->listeners = NULL;
+
+	/* Sections are listed from the last one */
+	for (conf = g_ape->srv; conf != NULL; conf = conf->next) {
+		char *path, *ip, *protocol, name[128];
+		const char *error = NULL;
+		ape_listener_t type = LISTENER_HTTP;
+		int port, tls;
+
+		if (strcasecmp(conf->section, "Listener") != 0) {
+			continue;
+		}
+		path = servers_listener_val(conf, "unix_socket");
+		port = atoi(servers_listener_val(conf, "port"));
+		ip = servers_listener_val(conf, "ip_listen");
+		protocol = servers_listener_val(conf, "protocol");
+		tls = (strcasecmp(servers_listener_val(conf, "tls"), "yes") == 0);
+
+		if (*path != '\0') {
+			snprintf(name, sizeof(name), "%s", path);
+		} else {
+			snprintf(name, sizeof(name), "%s:%i", (*ip != '\0' ? ip : CONFIG_VAL(Server, ip_listen, g_ape->srv)), port);
+		}
+
+		if (strcasecmp(protocol, "push") == 0) {
+			type = LISTENER_PUSH;
+		}
+		if (*path == '\0' && port <= 0) {
+			error = "no port nor unix_socket";
+		} else if (type == LISTENER_HTTP && *protocol != '\0' && strcasecmp(protocol, "http") != 0) {
+			error = "unknown protocol";
+		} else if (tls && (type != LISTENER_HTTP || g_ape->tls.ctx == NULL)) {
+			error = "tls needs the http protocol and the TLS section";
+		} else if (type == LISTENER_PUSH && *g_ape->push.password == '\0') {
+			error = "Push.password is empty";
+		}
+		if (error != NULL) {
+			servers_listener_warn(name, error, g_ape);
+			continue;
+		}
+
+		listener = xmalloc(sizeof(*listener));
+		listener->name = xstrdup(name);
+		listener->fd = 0;
+		listener->tls = tls;
+		listener->transports = servers_transports(servers_listener_val(conf, "transports"));
+		listener->protocol = type;
+		listener->conf = conf;
+
+		listener->next = g_ape->listeners;
+		g_ape->listeners = listener;
+	}
+}
+
+static int servers_setup_listener(ape_listener *listener, ape_socket *server, acetables *g_ape)
+{
+	int sndbuf = atoi(servers_listener_val(listener->conf, "sndbuf"));
+	int rcvbuf = atoi(servers_listener_val(listener->conf, "rcvbuf"));
+
+	/* Inherited by the accepted sockets */
+	if (sndbuf > 0) {
+		setsockopt(server->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int));
+	}
+	if (rcvbuf > 0) {
+		setsockopt(server->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+	}
+
+	switch(listener->protocol) {
+		case LISTENER_HTTP:
+			servers_callbacks(server);
+			if (listener->tls) {
+				server->tls = g_ape->tls.ctx;
+			}
+			break;
+		case LISTENER_PUSH:
+			push_callbacks(server);
+			break;
+	}
+	server->listener = listener;
+	listener->fd = server->fd;
+
+	return server->fd;
+}
+
+/* Listener sections not inherited from a previous instance, return their number */
+int servers_init_listeners(acetables *g_ape)
+{
+	ape_listener *listener;
+	int n = 0;
+
+	for (listener = g_ape->listeners; listener != NULL; listener = listener->next) {
+		apeconfig *conf = listener->conf;
+		char *path = servers_listener_val(conf, "unix_socket"), *ip = servers_listener_val(conf, "ip_listen"), *mode = servers_listener_val(conf, "mode");
+		int backlog = atoi(servers_listener_val(conf, "backlog"));
+		ape_socket *server;
+
+		if (listener->fd) {
+			continue;
+		}
+		if (backlog <= 0) {
+			backlog = LISTEN_BACKLOG;
+		}
+
+		if (*path != '\0') {
+			server = ape_listen_unix(path, (*mode != '\0' ? strtol(mode, NULL, 8) : LISTENER_SOCKET_MODE), backlog, g_ape);
+		} else {
+			server = ape_listen_tcp(atoi(servers_listener_val(conf, "port")), (*ip != '\0' ? ip : CONFIG_VAL(Server, ip_listen, g_ape->srv)), backlog, g_ape);
+		}
+		if (server != NULL) {
+			servers_setup_listener(listener, server, g_ape);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* Listening socket of a Listener section (NULL : not configured or not listening) */
+ape_listener *servers_listener(const char *name, acetables *g_ape)
+{
+	ape_listener *listener;
+
+	for (listener = g_ape->listeners; listener != NULL; listener = listener->next) {
+		if (listener->fd > 0 && strcmp(listener->name, name) == 0) {
+			return listener;
+		}
+	}
+
+	return NULL;
+}
+
+/* Listener inherited from a previous instance (see handoff.c), 0 if no longer configured */
+int servers_init_listener_fd(int fd, const char *name, acetables *g_ape)
+{
+	ape_listener *listener;
+
+	for (listener = g_ape->listeners; listener != NULL; listener = listener->next) {
+		if (!listener->fd && strcmp(listener->name, name) == 0) {
+			return servers_setup_listener(listener, ape_listen_fd(fd, g_ape), g_ape);
+		}
+	}
+
+	return 0;
+}
+
+/* Set up the parser of an inherited client socket, accepted on "listener" (NULL : main listener) */
+ape_socket *servers_adopt(int fd, ape_listener *listener, acetables *g_ape)
+{
+	ape_socket *co = sock_adopt(fd, (listener != NULL ? listener->fd : g_ape->handoff.server), g_ape);
+	
+	ape_onaccept(co, g_ape);
+	
+	return co;
+}
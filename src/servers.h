@@ -24,6 +24,16 @@
 
 #include "main.h"
 
+#define LISTENER_SOCKET_MODE 0660 // Listener.mode of the UNIX sockets
+
 int servers_init(acetables *g_ape);
+int servers_init_fd(int fd, acetables *g_ape);
+int servers_init_tls(acetables *g_ape);
+int servers_init_tls_fd(int fd, acetables *g_ape);
+void servers_config_listeners(acetables *g_ape);
+int servers_init_listeners(acetables *g_ape);
+int servers_init_listener_fd(int fd, const char *name, acetables *g_ape);
+ape_listener *servers_listener(const char *name, acetables *g_ape);
+ape_socket *servers_adopt(int fd, ape_listener *listener, acetables *g_ape);
 
 #endif
@@ -0,0 +1,880 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* snapshot.c */
+
+/*
+	Serialization of the users (sessions, properties, subusers and the raws
+	still waiting to be sent) and channels (properties, members).
+	Restored objects keep their sessid/pubid so that clients carry on with
+	their session. Pointer properties (modules private data) aren't saved :
+	modules get their allocation callbacks (allocateuser, addsubuser, mkchan)
+	but no other event (adduser, join...) is fired during the restore.
+	The same format is used for Server.snapshot_file (warm start) and for
+	the restart handoff (see handoff.c). A checksum of the whole data is
+	checked before anything is restored, and counts are bounded by the data
+	left, so a damaged snapshot is rejected instead of being half restored.
+*/
+
+#include "snapshot.h"
+#include "users.h"
+#include "channel.h"
+#include "pipe.h"
+#include "raw.h"
+#include "extend.h"
+#include "hash.h"
+#include "json.h"
+#include "utils.h"
+#include "log.h"
+#include "config.h"
+#include "ticks.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+enum {
+	SNAPSHOT_JSON_STR = 1,
+	SNAPSHOT_JSON_FRAGMENT,
+	SNAPSHOT_JSON_INT,
+	SNAPSHOT_JSON_FLOAT,
+	SNAPSHOT_JSON_TRUE,
+	SNAPSHOT_JSON_FALSE,
+	SNAPSHOT_JSON_NULL,
+	SNAPSHOT_JSON_OBJECT,
+	SNAPSHOT_JSON_ARRAY
+};
+
+static void snapshot_reserve(snapshot *snap, size_t len)
+{
+	if (snap->len + len <= snap->size) {
+		return;
+	}
+	while (snap->len + len > snap->size) {
+		snap->size = (snap->size ? snap->size * 2 : 4096);
+	}
+	snap->data = xrealloc(snap->data, snap->size);
+}
+
+void snapshot_init(snapshot *snap)
+{
+	snap->data = NULL;
+	snap->len = 0;
+	snap->size = 0;
+	snap->pos = 0;
+	snap->error = 0;
+}
+
+void snapshot_free(snapshot *snap)
+{
+	if (snap->data != NULL) {
+		free(snap->data);
+	}
+	snapshot_init(snap);
+}
+
+void snapshot_put_int(snapshot *snap, long long val)
+{
+	snapshot_reserve(snap, sizeof(val));
+	memcpy(snap->data + snap->len, &val, sizeof(val));
+	snap->len += sizeof(val);
+}
+
+/* NULL is not the empty string : its length is -1 */
+void snapshot_put_str(snapshot *snap, const char *str, int len)
+{
+	if (str == NULL) {
+		snapshot_put_int(snap, -1);
+		return;
+	}
+	snapshot_put_int(snap, len);
+	snapshot_reserve(snap, len + 1);
+	memcpy(snap->data + snap->len, str, len);
+	snap->data[snap->len + len] = '\0';
+	snap->len += len + 1;
+}
+
+/* Reserve an integer (e.g. a count) to be set later with snapshot_set_int() */
+size_t snapshot_mark(snapshot *snap)
+{
+	size_t mark = snap->len;
+
+	snapshot_put_int(snap, 0);
+
+	return mark;
+}
+
+void snapshot_set_int(snapshot *snap, size_t mark, long long val)
+{
+	memcpy(snap->data + mark, &val, sizeof(val));
+}
+
+long long snapshot_get_int(snapshot *snap)
+{
+	long long val;
+
+	if (snap->error || snap->len - snap->pos < sizeof(val)) {
+		snap->error = 1;
+		return 0;
+	}
+	memcpy(&val, snap->data + snap->pos, sizeof(val));
+	snap->pos += sizeof(val);
+
+	return val;
+}
+
+/* A number of elements : each of them takes at least one integer of what is left */
+int snapshot_get_count(snapshot *snap)
+{
+	long long n = snapshot_get_int(snap);
+
+	if (n < 0 || (unsigned long long)n > (snap->len - snap->pos) / sizeof(long long)) {
+		snap->error = 1;
+		return 0;
+	}
+
+	return (int)n;
+}
+
+/* FNV-1a */
+static unsigned long long snapshot_checksum(const char *data, size_t len)
+{
+	unsigned long long sum = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum ^= (unsigned char)data[i];
+		sum *= 0x100000001b3ULL;
+	}
+
+	return sum;
+}
+
+/* Checksum of everything after the header (see snapshot_dump()), once nothing else will be added */
+void snapshot_seal(snapshot *snap)
+{
+	snapshot_set_int(snap, SNAPSHOT_SUM_POS, (long long)snapshot_checksum(snap->data + SNAPSHOT_SUM_POS + sizeof(long long), snap->len - SNAPSHOT_SUM_POS - sizeof(long long)));
+}
+
+/* The returned string points into the snapshot (NUL terminated) */
+char *snapshot_get_str(snapshot *snap, int *len)
+{
+	long long slen = snapshot_get_int(snap);
+	char *str;
+
+	if (len != NULL) {
+		*len = 0;
+	}
+	if (snap->error || slen == -1) {
+		return NULL;
+	}
+	if (slen < 0 || snap->len - snap->pos < (size_t)slen + 1 || snap->data[snap->pos + slen] != '\0') {
+		snap->error = 1;
+		return NULL;
+	}
+	str = snap->data + snap->pos;
+	snap->pos += slen + 1;
+
+	if (len != NULL) {
+		*len = (int)slen;
+	}
+
+	return str;
+}
+
+static void snapshot_put_json(snapshot *snap, json_item *item)
+{
+	for (; item != NULL; item = item->next) {
+		snapshot_put_int(snap, 1);
+		snapshot_put_str(snap, item->key.val, item->key.len);
+
+		if (item->type == JSON_T_FRAGMENT) {
+			snapshot_put_int(snap, SNAPSHOT_JSON_FRAGMENT);
+			snapshot_put_str(snap, item->jval.vu.str.value, item->jval.vu.str.length);
+		} else if (item->jval.vu.str.value != NULL) {
+			snapshot_put_int(snap, SNAPSHOT_JSON_STR);
+			snapshot_put_str(snap, item->jval.vu.str.value, item->jval.vu.str.length);
+		} else if (item->type == JSON_T_INTEGER || item->jval.vu.integer_value) {
+			snapshot_put_int(snap, SNAPSHOT_JSON_INT);
+			snapshot_put_int(snap, item->jval.vu.integer_value);
+		} else if (item->type == JSON_T_FLOAT || item->jval.vu.float_value) {
+			char fstr[32];
+
+			snapshot_put_int(snap, SNAPSHOT_JSON_FLOAT);
+			snapshot_put_str(snap, fstr, snprintf(fstr, sizeof(fstr), "%.17g", item->jval.vu.float_value));
+		} else if (item->type == JSON_T_TRUE) {
+			snapshot_put_int(snap, SNAPSHOT_JSON_TRUE);
+		} else if (item->type == JSON_T_FALSE) {
+			snapshot_put_int(snap, SNAPSHOT_JSON_FALSE);
+		} else if (item->type == JSON_T_NULL) {
+			snapshot_put_int(snap, SNAPSHOT_JSON_NULL);
+		} else {
+			snapshot_put_int(snap, (item->jchild.type == JSON_C_T_ARR ? SNAPSHOT_JSON_ARRAY : SNAPSHOT_JSON_OBJECT));
+			snapshot_put_json(snap, item->jchild.child);
+		}
+	}
+	snapshot_put_int(snap, 0);
+}
+
+/* Append the items written by snapshot_put_json() to "father" */
+static void snapshot_get_json(snapshot *snap, json_item *father)
+{
+	while (snapshot_get_int(snap) == 1) {
+		int keylen, len, type;
+		char *key = snapshot_get_str(snap, &keylen), *val;
+		json_item *child;
+
+		switch((type = snapshot_get_int(snap))) {
+			case SNAPSHOT_JSON_STR:
+				if ((val = snapshot_get_str(snap, &len)) != NULL) {
+					json_set_property_strN(father, key, keylen, val, len);
+				}
+				break;
+			case SNAPSHOT_JSON_FRAGMENT:
+				if ((val = snapshot_get_str(snap, &len)) != NULL) {
+					json_set_property_objN(father, key, keylen, json_new_fragment(val, len));
+				}
+				break;
+			case SNAPSHOT_JSON_INT:
+				json_set_property_intN(father, key, keylen, snapshot_get_int(snap));
+				break;
+			case SNAPSHOT_JSON_FLOAT:
+				if ((val = snapshot_get_str(snap, NULL)) != NULL) {
+					json_set_property_floatN(father, key, keylen, strtod(val, NULL));
+				}
+				break;
+			case SNAPSHOT_JSON_TRUE:
+			case SNAPSHOT_JSON_FALSE:
+				json_set_property_boolean(father, key, keylen, (type == SNAPSHOT_JSON_TRUE));
+				break;
+			case SNAPSHOT_JSON_NULL:
+				json_set_property_null(father, key, keylen);
+				break;
+			case SNAPSHOT_JSON_OBJECT:
+			case SNAPSHOT_JSON_ARRAY:
+				child = (type == SNAPSHOT_JSON_ARRAY ? json_new_array() : json_new_object());
+				json_set_property_objN(father, key, keylen, child);
+				snapshot_get_json(snap, child);
+				break;
+			default:
+				snap->error = 1;
+				return;
+		}
+		if (snap->error) {
+			return;
+		}
+	}
+}
+
+static void snapshot_put_properties(snapshot *snap, extend *entry)
+{
+	size_t mark = snapshot_mark(snap);
+	int n = 0;
+
+	for (; entry != NULL; entry = entry->next) {
+		/* Modules private data, they have to rebuild it */
+		if (entry->type == EXTEND_POINTER) {
+			continue;
+		}
+		snapshot_put_str(snap, entry->key, strlen(entry->key));
+		snapshot_put_int(snap, entry->type);
+		snapshot_put_int(snap, entry->visibility);
+
+		if (entry->type == EXTEND_STR) {
+			snapshot_put_str(snap, entry->val, strlen(entry->val));
+		} else {
+			snapshot_put_json(snap, entry->val);
+		}
+		n++;
+	}
+	snapshot_set_int(snap, mark, n);
+}
+
+/* Properties are skipped if entry is NULL */
+static void snapshot_get_properties(snapshot *snap, extend **entry)
+{
+	int n = snapshot_get_count(snap);
+
+	while (n-- > 0 && !snap->error) {
+		char *key = snapshot_get_str(snap, NULL), *val;
+		EXTEND_TYPE type = snapshot_get_int(snap);
+		EXTEND_PUBLIC visibility = snapshot_get_int(snap);
+
+		if (type == EXTEND_STR) {
+			if ((val = snapshot_get_str(snap, NULL)) != NULL && key != NULL && entry != NULL) {
+				add_property(entry, key, val, EXTEND_STR, visibility);
+			}
+		} else {
+			json_item *head = json_new_object(), *jval;
+
+			snapshot_get_json(snap, head);
+
+			jval = head->jchild.child;
+			head->jchild.child = NULL;
+			free_json_item(head);
+
+			if (jval == NULL) {
+				continue;
+			}
+			jval->father = NULL;
+
+			if (key == NULL || entry == NULL || snap->error || add_property(entry, key, jval, EXTEND_JSON, visibility) == NULL) {
+				free_json_item(jval);
+			}
+		}
+	}
+}
+
+static void snapshot_put_raws(snapshot *snap, struct _raw_pool_user *pool)
+{
+	struct _raw_pool *rTmp;
+
+	snapshot_put_int(snap, pool->nraw);
+
+	if (!pool->nraw) {
+		return;
+	}
+	for (rTmp = pool->rawhead; rTmp->raw != NULL; rTmp = rTmp->next) {
+		snapshot_put_int(snap, rTmp->raw->priority);
+		snapshot_put_str(snap, rTmp->raw->data, rTmp->raw->len);
+	}
+}
+
+static void snapshot_get_raws(snapshot *snap, subuser *sub, acetables *g_ape)
+{
+	int n = snapshot_get_count(snap);
+
+	while (n-- > 0 && !snap->error) {
+		RAW raw;
+
+		raw.priority = snapshot_get_int(snap);
+		raw.next = NULL;
+		raw.refcount = 0;
+
+		if ((raw.data = snapshot_get_str(snap, &raw.len)) != NULL && sub != NULL) {
+			post_raw_sub(copy_raw(&raw), sub, g_ape);
+		}
+	}
+}
+
+/* EventSource ids and history (Last-Event-ID) */
+static void snapshot_put_eventsource(snapshot *snap, subuser *sub, acetables *g_ape)
+{
+	int i;
+
+	snapshot_put_int(snap, sub->eventsource.id);
+	snapshot_put_int(snap, sub->eventsource.count);
+
+	for (i = 0; i < sub->eventsource.count; i++) {
+		struct _eventsource_event *event = &sub->eventsource.history[(sub->eventsource.head + i) % g_ape->transports.eventsource.history];
+
+		snapshot_put_int(snap, event->id);
+		snapshot_put_str(snap, event->raw->data, event->raw->len);
+	}
+}
+
+static void snapshot_get_eventsource(snapshot *snap, subuser *sub, acetables *g_ape)
+{
+	unsigned int id = snapshot_get_int(snap);
+	int n = snapshot_get_count(snap);
+
+	while (n-- > 0 && !snap->error) {
+		RAW raw, *copy;
+
+		raw.priority = RAW_PRI_LO;
+		raw.next = NULL;
+		raw.refcount = 0;
+
+		if (sub != NULL) {
+			sub->eventsource.id = snapshot_get_int(snap);
+		} else {
+			snapshot_get_int(snap);
+		}
+		if ((raw.data = snapshot_get_str(snap, &raw.len)) != NULL && sub != NULL) {
+			copy = copy_raw(&raw);
+			transport_eventsource_keep(sub, copy, g_ape);
+			free_raw(copy);
+		}
+	}
+	if (sub != NULL) {
+		sub->eventsource.id = id;
+	}
+}
+
+/* Keep the pubid known by the clients */
+static void snapshot_set_pubid(transpipe *pipe, const char *pubid, acetables *g_ape)
+{
+	if (pubid == NULL || strlen(pubid) != 32 || get_pipe(pubid, g_ape) != NULL) {
+		return;
+	}
+	hashtbl_erase(g_ape->hPubid, pipe->pubid);
+	memcpy(pipe->pubid, pubid, 33);
+	hashtbl_append(g_ape->hPubid, pipe->pubid, (void *)pipe);
+
+	extend_cache_free(&pipe->json_cache);
+}
+
+static void snapshot_dump_user(snapshot *snap, USERS *user, acetables *g_ape)
+{
+	session *sess;
+	subuser *sub;
+	size_t mark;
+	int n;
+
+	snapshot_put_str(snap, user->sessid, strlen(user->sessid));
+	snapshot_put_str(snap, user->pipe->pubid, strlen(user->pipe->pubid));
+	snapshot_put_str(snap, user->ip, strlen(user->ip));
+	snapshot_put_str(snap, user->lastping, strlen(user->lastping));
+	snapshot_put_int(snap, user->transport);
+	snapshot_put_int(snap, user->flags);
+	snapshot_put_int(snap, user->idle);
+
+	snapshot_put_properties(snap, user->properties);
+
+	mark = snapshot_mark(snap);
+	for (n = 0, sess = user->sessions.data; sess != NULL; sess = sess->next, n++) {
+		snapshot_put_str(snap, sess->key, strlen(sess->key));
+		snapshot_put_str(snap, sess->val, strlen(sess->val));
+	}
+	snapshot_set_int(snap, mark, n);
+
+	/* Subusers are all created before their raws are queued (see addsubuser()) */
+	snapshot_put_int(snap, user->nsub);
+	for (sub = user->subuser; sub != NULL; sub = sub->next) {
+		snapshot_put_str(snap, sub->channel, strlen(sub->channel));
+		snapshot_put_int(snap, sub->idle);
+		snapshot_put_int(snap, sub->current_chl);
+		snapshot_put_int(snap, sub->need_update);
+
+		snapshot_put_properties(snap, sub->properties);
+	}
+	for (sub = user->subuser; sub != NULL; sub = sub->next) {
+		snapshot_put_raws(snap, &sub->raw_pools.high);
+		snapshot_put_raws(snap, &sub->raw_pools.low);
+		snapshot_put_eventsource(snap, sub, g_ape);
+	}
+}
+
+static USERS *snapshot_restore_user(snapshot *snap, acetables *g_ape)
+{
+	char *sessid = snapshot_get_str(snap, NULL);
+	char *pubid = snapshot_get_str(snap, NULL);
+	char *ip = snapshot_get_str(snap, NULL);
+	char *lastping = snapshot_get_str(snap, NULL);
+	int transport = snapshot_get_int(snap);
+	unsigned int flags = snapshot_get_int(snap);
+	time_t idle = snapshot_get_int(snap);
+
+	size_t props = snap->pos, end;
+
+	USERS *user = NULL;
+	subuser **subs;
+	int i, n, skip;
+
+	/* Properties and sessions are read again once the user exists */
+	snapshot_get_properties(snap, NULL);
+
+	n = snapshot_get_count(snap);
+	for (i = 0; i < n && !snap->error; i++) {
+		snapshot_get_str(snap, NULL);
+		snapshot_get_str(snap, NULL);
+	}
+
+	/* The record is read to the end even if the user is skipped */
+	skip = (sessid == NULL || strlen(sessid) != 32 || seek_user_id(sessid, g_ape) != NULL);
+
+	n = snapshot_get_count(snap);
+	if (snap->error) {
+		return NULL;
+	}
+	subs = xmalloc(sizeof(*subs) * (n + 1));
+
+	for (i = 0; i < n && !snap->error; i++) {
+		char *channel = snapshot_get_str(snap, NULL);
+		time_t sidle = snapshot_get_int(snap);
+		int current_chl = snapshot_get_int(snap);
+		int need_update = snapshot_get_int(snap);
+
+		subs[i] = NULL;
+
+		if (skip || channel == NULL) {
+		} else if (user == NULL) {
+			/* Go through the modules so that they attach their data to the user */
+			if ((user = adduser(NULL, channel, (ip != NULL ? ip : ""), NULL, g_ape)) != NULL) {
+				subs[i] = user->subuser;
+			}
+		} else {
+			subs[i] = addsubuser(NULL, channel, user, g_ape);
+		}
+
+		if (subs[i] != NULL) {
+			subs[i]->idle = sidle;
+			subs[i]->current_chl = current_chl;
+			subs[i]->need_update = need_update;
+			snapshot_get_properties(snap, &subs[i]->properties);
+		} else {
+			snapshot_get_properties(snap, NULL);
+		}
+	}
+
+	for (i = 0; i < n && !snap->error; i++) {
+		snapshot_get_raws(snap, subs[i], g_ape);
+		snapshot_get_raws(snap, subs[i], g_ape);
+		snapshot_get_eventsource(snap, subs[i], g_ape);
+	}
+	free(subs);
+
+	if (user == NULL) {
+		return NULL;
+	}
+
+	hashtbl_erase(g_ape->hSessid, user->sessid);
+	memcpy(user->sessid, sessid, 33);
+	hashtbl_append(g_ape->hSessid, user->sessid, (void *)user);
+
+	snapshot_set_pubid(user->pipe, pubid, g_ape);
+
+	if (lastping != NULL) {
+		strncpy(user->lastping, lastping, sizeof(user->lastping) - 1);
+		user->lastping[sizeof(user->lastping) - 1] = '\0';
+	}
+	user->transport = transport;
+	user->flags = flags;
+	user->idle = idle;
+	user->type = HUMAN;
+	user->istmp = 0;
+
+	g_ape->nConnected++;
+
+	end = snap->pos;
+	snap->pos = props;
+
+	snapshot_get_properties(snap, &user->properties);
+
+	n = snapshot_get_count(snap);
+	while (n-- > 0 && !snap->error) {
+		char *key = snapshot_get_str(snap, NULL), *val = snapshot_get_str(snap, NULL);
+
+		if (key != NULL && val != NULL) {
+			set_session(user, key, val, 0, g_ape);
+		}
+	}
+	snap->pos = end;
+
+	return user;
+}
+
+static void snapshot_dump_channel(snapshot *snap, CHANNEL *chan)
+{
+	userslist *ulist;
+
+	snapshot_put_str(snap, chan->name, strlen(chan->name));
+	snapshot_put_str(snap, chan->pipe->pubid, strlen(chan->pipe->pubid));
+	snapshot_put_int(snap, chan->flags);
+	snapshot_put_int(snap, chan->lastseq);
+
+	snapshot_put_properties(snap, chan->properties);
+
+	/* Members are kept in the join order (see set_members_page()) */
+	snapshot_put_int(snap, chan->nusers);
+	for (ulist = chan->head; ulist != NULL; ulist = ulist->next) {
+		snapshot_put_str(snap, ulist->userinfo->sessid, strlen(ulist->userinfo->sessid));
+		snapshot_put_int(snap, ulist->level);
+		snapshot_put_int(snap, ulist->seq);
+	}
+}
+
+static void snapshot_restore_channel(snapshot *snap, acetables *g_ape)
+{
+	char *name = snapshot_get_str(snap, NULL);
+	char *pubid = snapshot_get_str(snap, NULL);
+	int flags = snapshot_get_int(snap);
+	unsigned long lastseq = snapshot_get_int(snap);
+
+	CHANNEL *chan = NULL;
+	userslist **tail;
+	int n;
+
+	if (name != NULL && !snap->error && (chan = getchan(name, g_ape)) == NULL) {
+		chan = mkchan(name, flags, g_ape);
+	}
+
+	if (chan == NULL) {
+		extend *properties = NULL;
+
+		snapshot_get_properties(snap, &properties);
+		clear_properties(&properties);
+	} else {
+		snapshot_get_properties(snap, &chan->properties);
+		snapshot_set_pubid(chan->pipe, pubid, g_ape);
+
+		chan->flags = flags;
+		if (lastseq > chan->lastseq) {
+			chan->lastseq = lastseq;
+		}
+	}
+
+	for (tail = (chan != NULL ? &chan->head : NULL); tail != NULL && *tail != NULL; tail = &(*tail)->next);
+
+	n = snapshot_get_count(snap);
+	while (n-- > 0 && !snap->error) {
+		char *sessid = snapshot_get_str(snap, NULL);
+		unsigned int level = snapshot_get_int(snap);
+		unsigned long seq = snapshot_get_int(snap);
+
+		USERS *user;
+		userslist *list;
+		CHANLIST *chanl;
+
+		if (chan == NULL || sessid == NULL || (user = seek_user_id(sessid, g_ape)) == NULL || isonchannel(user, chan)) {
+			continue;
+		}
+
+		/* Same as join() without the raws */
+		list = xmalloc(sizeof(*list));
+		list->userinfo = user;
+		list->level = level;
+		list->seq = seq;
+		list->next = NULL;
+
+		*tail = list;
+		tail = &list->next;
+
+		chan->nusers++;
+
+		chanl = xmalloc(sizeof(*chanl));
+		chanl->chaninfo = chan;
+		chanl->next = user->chan_foot;
+
+		user->chan_foot = chanl;
+	}
+	
+	if (chan != NULL) {
+		members_rebuild(chan);
+	}
+}
+
+void snapshot_dump(snapshot *snap, acetables *g_ape)
+{
+	HTBL_ITEM *item;
+	USERS *user;
+	size_t mark;
+	int n;
+
+	snapshot_put_str(snap, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+	snapshot_put_int(snap, SNAPSHOT_VERSION);
+	snapshot_mark(snap); /* set by snapshot_seal() */
+
+	/* Users first, channels refer to them by sessid */
+	mark = snapshot_mark(snap);
+	for (n = 0, user = g_ape->uHead; user != NULL; user = user->next) {
+		/* Not logged in yet, or a bot (re-created by its module) */
+		if (user->istmp || user->type != HUMAN || user->subuser == NULL) {
+			continue;
+		}
+		snapshot_dump_user(snap, user, g_ape);
+		n++;
+	}
+	snapshot_set_int(snap, mark, n);
+
+	mark = snapshot_mark(snap);
+	for (n = 0, item = g_ape->hLusers->first; item != NULL; item = item->lnext, n++) {
+		snapshot_dump_channel(snap, (CHANNEL *)item->addrs);
+	}
+	snapshot_set_int(snap, mark, n);
+}
+
+/* Return the number of users restored, -1 if the snapshot is invalid */
+int snapshot_restore(snapshot *snap, acetables *g_ape)
+{
+	char *magic = snapshot_get_str(snap, NULL);
+	int n, nusers = 0;
+
+	if (magic == NULL || strcmp(magic, SNAPSHOT_MAGIC) != 0 || snapshot_get_int(snap) != SNAPSHOT_VERSION) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Snapshot : invalid header");
+		return -1;
+	}
+
+	/* Nothing is created from a damaged snapshot */
+	if ((unsigned long long)snapshot_get_int(snap) != snapshot_checksum(snap->data + snap->pos, snap->len - snap->pos) || snap->error) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Snapshot : truncated or corrupted data (checksum mismatch)");
+		return -1;
+	}
+
+	n = snapshot_get_count(snap);
+	while (n-- > 0 && !snap->error) {
+		if (snapshot_restore_user(snap, g_ape) != NULL) {
+			nusers++;
+		}
+	}
+
+	n = snapshot_get_count(snap);
+	while (n-- > 0 && !snap->error) {
+		snapshot_restore_channel(snap, g_ape);
+	}
+
+	if (snap->error) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Snapshot : truncated or corrupted data (%i users restored)", nusers);
+		return -1;
+	}
+
+	return nusers;
+}
+
+static int snapshot_write(const char *path, snapshot *snap)
+{
+	char tmp[1024];
+	size_t written = 0;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		return -1;
+	}
+	while (written < snap->len) {
+		ssize_t n = write(fd, snap->data + written, snap->len - written);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		written += n;
+	}
+	close(fd);
+
+	/* Never leave a partial file behind */
+	return rename(tmp, path);
+}
+
+/* Write the snapshot to Server.snapshot_file */
+int snapshot_save(acetables *g_ape)
+{
+	snapshot snap;
+	int ret;
+
+	if (g_ape->snapshot.file == NULL) {
+		return 0;
+	}
+	/* Both would use the same temporary file */
+	if (g_ape->snapshot.child) {
+		waitpid(g_ape->snapshot.child, NULL, 0);
+		g_ape->snapshot.child = 0;
+	}
+	snapshot_init(&snap);
+	snapshot_dump(&snap, g_ape);
+	snapshot_seal(&snap);
+
+	if ((ret = snapshot_write(g_ape->snapshot.file, &snap)) == -1) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Snapshot : cannot write %s : %s", g_ape->snapshot.file, strerror(errno));
+	}
+	snapshot_free(&snap);
+
+	return ret;
+}
+
+/*
+	Periodical snapshot : written by a child process (copy-on-write view of
+	the memory) so that the event loop isn't stalled by a large dump.
+*/
+static void snapshot_periodical(acetables *g_ape, int *last)
+{
+	pid_t pid;
+
+	if (g_ape->snapshot.child) {
+		/* Previous one still running */
+		if (waitpid(g_ape->snapshot.child, NULL, WNOHANG) == 0) {
+			return;
+		}
+		g_ape->snapshot.child = 0;
+	}
+
+	switch ((pid = fork())) {
+		case -1:
+			snapshot_save(g_ape);
+			break;
+		case 0:
+			_exit(snapshot_save(g_ape) == -1);
+		default:
+			g_ape->snapshot.child = pid;
+			break;
+	}
+}
+
+/* Warm start from Server.snapshot_file. Return the number of users restored, -1 on error */
+int snapshot_load(acetables *g_ape)
+{
+	struct stat st;
+	snapshot snap;
+	USERS *user;
+	subuser *sub;
+	int fd, nusers;
+
+	if (g_ape->snapshot.file == NULL || (fd = open(g_ape->snapshot.file, O_RDONLY)) == -1) {
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	snapshot_init(&snap);
+
+	/* Private mapping : strings are returned in place and may be modified by the restore */
+	if ((snap.data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "Snapshot : cannot map %s : %s", g_ape->snapshot.file, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	snap.len = snap.size = st.st_size;
+
+	nusers = snapshot_restore(&snap, g_ape);
+
+	munmap(snap.data, st.st_size);
+
+	/* Clients get the whole timeout to come back */
+	for (user = g_ape->uHead; user != NULL; user = user->next) {
+		if (user->type != HUMAN) {
+			continue;
+		}
+		user->idle = ape_clock.sec;
+
+		for (sub = user->subuser; sub != NULL; sub = sub->next) {
+			sub->idle = ape_clock.sec;
+		}
+	}
+
+	return nusers;
+}
+
+void snapshot_start(acetables *g_ape)
+{
+	int interval = atoi(CONFIG_VAL(Server, snapshot_interval, g_ape->srv));
+
+	if (g_ape->snapshot.file != NULL && interval > 0) {
+		add_periodical(interval * 1000, 0, snapshot_periodical, g_ape, g_ape);
+	}
+}
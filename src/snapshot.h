@@ -0,0 +1,65 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* snapshot.h */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "main.h"
+
+#define SNAPSHOT_MAGIC "APESNAP"
+#define SNAPSHOT_VERSION 3
+
+/* Magic and version, followed by the checksum of the rest of the data (see snapshot_seal()) */
+#define SNAPSHOT_SUM_POS (sizeof(long long) + sizeof(SNAPSHOT_MAGIC) + sizeof(long long))
+
+/* Binary (host endianness) dump of users, channels and queued raws */
+typedef struct _snapshot snapshot;
+struct _snapshot
+{
+	char *data;
+
+	size_t len;
+	size_t size;
+	size_t pos; /* read cursor */
+
+	int error; /* truncated or malformed input */
+};
+
+void snapshot_init(snapshot *snap);
+void snapshot_free(snapshot *snap);
+
+void snapshot_put_int(snapshot *snap, long long val);
+void snapshot_put_str(snapshot *snap, const char *str, int len);
+size_t snapshot_mark(snapshot *snap);
+void snapshot_set_int(snapshot *snap, size_t mark, long long val);
+long long snapshot_get_int(snapshot *snap);
+char *snapshot_get_str(snapshot *snap, int *len);
+int snapshot_get_count(snapshot *snap);
+void snapshot_seal(snapshot *snap);
+
+void snapshot_dump(snapshot *snap, acetables *g_ape);
+int snapshot_restore(snapshot *snap, acetables *g_ape);
+
+int snapshot_save(acetables *g_ape);
+int snapshot_load(acetables *g_ape);
+void snapshot_start(acetables *g_ape);
+
+#endif
@@ -19,10 +19,17 @@
 
 /* sock.c */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* accept4() */
+#endif
+
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "sock.h"
 #include "http.h"
@@ -39,6 +46,8 @@
 #include "dns.h"
 #include "log.h"
 #include "parser.h"
+#include "pool.h"
+#include "tls.h"
 
 // These error codes may have the same value, but POSIX allows them to be different
 #if  (EAGAIN == EWOULDBLOCK)
@@ -50,21 +59,113 @@
 static int sendqueue(int sock, acetables *g_ape);
 
 
-static void growup(int *basemem, ape_socket ***conn_ptr, struct _fdevent *ev, struct _socks_bufout **bufout)
+/*
+	ape_socket structs for the fds [from, to) are stored in one contiguous block.
+	Blocks are never moved, so that ape_socket pointers stay valid when the table grows.
+*/
+static void sockets_block(int from, int to, acetables *g_ape)
+{
+	struct _socks_block *block = xmalloc(sizeof(*block));
+	int i;
+	
+	block->socks = xmalloc(sizeof(ape_socket) * (to - from));
+	memset(block->socks, 0, sizeof(ape_socket) * (to - from));
+	
+	block->next = g_ape->co_blocks;
+	g_ape->co_blocks = block;
+	
+	for (i = from; i < to; i++) {
+		g_ape->co[i] = &block->socks[i - from];
+	}
+}
+
+static void growup(acetables *g_ape)
+{
+	int old_basemem = g_ape->basemem;
+	g_ape->basemem *= 2;
+
+	events_growup(g_ape->events);
+
+	g_ape->co = xrealloc(g_ape->co, sizeof(*g_ape->co) * g_ape->basemem);
+	sockets_block(old_basemem, g_ape->basemem, g_ape);
+
+	g_ape->bufout = xrealloc(g_ape->bufout, sizeof(struct _socks_bufout) * g_ape->basemem);
+	memset(&g_ape->bufout[old_basemem], 0, sizeof(struct _socks_bufout) * (g_ape->basemem - old_basemem));
+}
+
+void sockets_init(acetables *g_ape)
+{
+	g_ape->co = xmalloc(sizeof(*g_ape->co) * g_ape->basemem);
+	g_ape->co_blocks = NULL;
+	sockets_block(0, g_ape->basemem, g_ape);
+	
+	g_ape->bufout = xmalloc(sizeof(struct _socks_bufout) * g_ape->basemem);
+	memset(g_ape->bufout, 0, sizeof(struct _socks_bufout) * g_ape->basemem);
+}
+
+void sockets_free(acetables *g_ape)
+{
+	struct _socks_block *block, *next;
+	
+	for (block = g_ape->co_blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block->socks);
+		free(block);
+	}
+	free(g_ape->co);
+	free(g_ape->bufout);
+}
+
+/* Only wake up the loop once the client has sent its request (Linux) */
+void set_defer_accept(int fd, int seconds)
+{
+#ifdef TCP_DEFER_ACCEPT
+	setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(int));
+#endif
+}
+
+/* Don't let the kernel hold more unsent data than needed, so that our own watermarks stay meaningful */
+static void set_notsent_lowat(int fd, acetables *g_ape)
 {
-	int old_basemem = *basemem;
-	*basemem *= 2;
+#ifdef TCP_NOTSENT_LOWAT
+	if (g_ape->write.notsent_lowat > 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &g_ape->write.notsent_lowat, sizeof(int));
+	}
+#endif
+}
 
-	events_growup(ev);
+/* read()/write() on a client socket, through TLS for the clients of a TLS listener */
+static ssize_t sock_read(ape_socket *co, char *buf, size_t len)
+{
+	if (co->tls != NULL) {
+		return tls_read(co, buf, len);
+	}
+	return read(co->fd, buf, len);
+}
 
-	*conn_ptr = xrealloc(*conn_ptr,	sizeof(ape_socket) * (*basemem));
-	memset(&((*conn_ptr)[*basemem - old_basemem]), 0, sizeof(**conn_ptr) * (*basemem - old_basemem));
+static ssize_t sock_write(ape_socket *co, const char *buf, size_t len)
+{
+	if (co->tls != NULL) {
+		return tls_write(co, buf, len);
+	}
+	return write(co->fd, buf, len);
+}
 
-	*bufout = xrealloc(*bufout, sizeof(struct _socks_bufout) * (*basemem));
-	memset(&((*bufout)[*basemem - old_basemem]), 0, sizeof(**bufout) * (*basemem - old_basemem));
+/* Output has been flushed, close the connection (TLS : close_notify first) */
+static void sock_shutdown(ape_socket *co)
+{
+	if (co->tls != NULL) {
+		tls_shutdown(co);
+	}
+	shutdown(co->fd, 2);
 }
 
 ape_socket *ape_listen(unsigned int port, char *listen_ip, acetables *g_ape)
+{
+	return ape_listen_tcp(port, listen_ip, LISTEN_BACKLOG, g_ape);
+}
+
+ape_socket *ape_listen_tcp(unsigned int port, char *listen_ip, int backlog, acetables *g_ape)
 {
 	int sock;
 	struct sockaddr_in addr;
@@ -95,13 +196,54 @@ ape_socket *ape_listen(unsigned int port, char *listen_ip, acetables *g_ape)
 		return NULL;
 	}
 
-	if (listen(sock, 2048) == -1)
+	if (listen(sock, backlog) == -1)
 	{
 		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, 
 			"ape_listen() - listen()");
 		return NULL;
 	}
 
+	return ape_listen_fd(sock, g_ape);
+}
+
+/* Listening UNIX socket at "path", a stale one (previous run) is replaced */
+ape_socket *ape_listen_unix(const char *path, int mode, int backlog, acetables *g_ape)
+{
+	int sock;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, 
+			"ape_listen_unix() - path too long : %s", path);
+		return NULL;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, 
+			"ape_listen_unix() - socket()");
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, backlog) == -1) {
+		ape_log(APE_ERR, __FILE__, __LINE__, g_ape, 
+			"ape_listen_unix() - bind() : %s", strerror(errno));
+		printf("Error: cannot listen on %s; %s\n", path, strerror(errno));
+		close(sock);
+		return NULL;
+	}
+	chmod(path, mode);
+
+	return ape_listen_fd(sock, g_ape);
+}
+
+/* Serve an already listening socket (e.g. inherited from a previous instance) */
+ape_socket *ape_listen_fd(int sock, acetables *g_ape)
+{
 	setnonblocking(sock);
 
 	prepare_ape_socket(sock, g_ape);
@@ -110,7 +252,7 @@ ape_socket *ape_listen(unsigned int port, char *listen_ip, acetables *g_ape)
 	g_ape->co[sock]->state = STREAM_ONLINE;
 	g_ape->co[sock]->stream_type = STREAM_SERVER;
 
-	events_add(g_ape->events, sock, EVENT_READ);
+	events_add(g_ape->events, sock, EVENT_READ|EVENT_ACCEPT);
 
 	return g_ape->co[sock];
 }
@@ -139,8 +281,7 @@ ape_socket *ape_connect(char *ip, int port, acetables *g_ape)
 
 	prepare_ape_socket(sock, g_ape);
 
-	g_ape->co[sock]->buffer_in.data = xmalloc(sizeof(char) * (DEFAULT_BUFFER_SIZE + 1));
-	g_ape->co[sock]->buffer_in.size = DEFAULT_BUFFER_SIZE;
+	buffer_alloc(&g_ape->co[sock]->buffer_in, DEFAULT_BUFFER_SIZE, g_ape);
 
 	g_ape->co[sock]->fd = sock;
 	g_ape->co[sock]->state = STREAM_PROGRESS;
@@ -151,6 +292,8 @@ ape_socket *ape_connect(char *ip, int port, acetables *g_ape)
 	g_ape->bufout[sock].buflen = 0;
 	g_ape->bufout[sock].allocsize = 0;
 
+	set_notsent_lowat(sock, g_ape);
+
 	ret = events_add(g_ape->events, sock, EVENT_READ|EVENT_WRITE);
 
 	return g_ape->co[sock];
@@ -173,6 +316,7 @@ static void ape_connect_name_cb(char *ip, void *data, acetables *g_ape)
 			sock->callbacks.on_read_lf = asca->sock->callbacks.on_read_lf;
 			sock->callbacks.on_data_completly_sent = asca->sock->callbacks.on_data_completly_sent;
 			sock->callbacks.on_write = asca->sock->callbacks.on_write;
+			sock->callbacks.on_drain = asca->sock->callbacks.on_drain;
 		}
 	
 		free(ip);
@@ -224,37 +368,140 @@ void close_socket(int fd, acetables *g_ape)
 		g_ape->bufout[fd].buf = NULL;
 		g_ape->bufout[fd].allocsize = 0;
 	}
+	/* A send in flight is given back (and freed) once cancelled */
+	g_ape->bufout[fd].inflight = 0;
+	g_ape->bufout[fd].linked_shutdown = 0;
 
-	if (co->buffer_in.data != NULL) {
-		free(co->buffer_in.data);
-		co->buffer_in.data = NULL;
-	}
+	/* Give the buffer back to the pool */
+	buffer_free(&co->buffer_in, g_ape);
 
 	if (co->parser.data != NULL) {
 		parser_destroy(&co->parser);
 	}
 
+	/* A listener only refers to the shared SSL_CTX */
+	if (co->tls != NULL && co->stream_type != STREAM_SERVER) {
+		tls_close(co);
+	}
+
 	events_remove(g_ape->events, fd);
 
 	close(fd);
 
 	co->fd = 0;
 	co->attach = NULL;
+	co->read_pending = 0;
+	co->write_pending = 0;
+	co->congested = 0;
+	co->congested_listed = 0;
+	co->completion = 0;
 }
 
 /* Create socket struct if not exists */
 void prepare_ape_socket(int fd, acetables *g_ape)
 {
+	unsigned int gen;
+	
 	while (fd >= g_ape->basemem) {
 		/* Increase connection & events size */
-		growup(&g_ape->basemem, &g_ape->co, g_ape->events, &g_ape->bufout);
+		growup(g_ape);
 	}
 
-	if (g_ape->co[fd] == NULL) {
-		g_ape->co[fd] = xmalloc(sizeof(*g_ape->co[fd]));
-	}
+	/* Handles on the previous socket using this fd become stale */
+	gen = g_ape->co[fd]->gen + 1;
 
 	memset(g_ape->co[fd], 0, sizeof(*g_ape->co[fd]));
+	
+	g_ape->co[fd]->gen = gen;
+}
+
+ape_sock_handle sock_handle(ape_socket *co)
+{
+	ape_sock_handle handle = {0, 0};
+	
+	if (co != NULL) {
+		handle.fd = co->fd;
+		handle.gen = co->gen;
+	}
+	
+	return handle;
+}
+
+/* NULL if the socket has been closed (and maybe reused) since the handle was taken */
+ape_socket *sock_from_handle(ape_sock_handle handle, acetables *g_ape)
+{
+	ape_socket *co;
+	
+	if (handle.fd <= 0 || handle.fd >= g_ape->basemem) {
+		return NULL;
+	}
+	co = g_ape->co[handle.fd];
+	
+	return (SOCK_HANDLE_IS(handle, co) ? co : NULL);
+}
+
+/* Give back the memory of grown input buffers once their data has been consumed */
+static void shrink_buffers(acetables *g_ape, int *last)
+{
+	int i;
+	
+	if (!g_ape->pools->nlarge) {
+		return;
+	}
+	
+	for (i = 0; i < g_ape->basemem; i++) {
+		ape_socket *co = g_ape->co[i];
+		
+		if (co == NULL || co->buffer_in.data == NULL || co->buffer_in.size == DEFAULT_BUFFER_SIZE) {
+			continue;
+		}
+		
+		if (co->buffer_in.length == 0 && co->idle + BUFFER_SHRINK_IDLE <= ape_clock.sec) {
+			buffer_free(&co->buffer_in, g_ape);
+			buffer_alloc(&co->buffer_in, DEFAULT_BUFFER_SIZE, g_ape);
+		}
+	}
+}
+
+/* Peers that stay over the high watermark are disconnected, what's queued for them is dropped */
+static void drop_congested(acetables *g_ape, int *last)
+{
+	int i;
+	
+	/* Only the sockets listed by set_congested() */
+	for (i = 0; i < g_ape->write.ncongested; i++) {
+		ape_socket *co = sock_from_handle(g_ape->write.congested[i], g_ape);
+		int fd;
+		
+		if (co != NULL && co->congested && co->congested_since + g_ape->write.congested_timeout > ape_clock.sec) {
+			continue;
+		}
+		
+		/* Closed, drained or timed out : off the list */
+		g_ape->write.congested[i--] = g_ape->write.congested[--g_ape->write.ncongested];
+		
+		if (co == NULL) {
+			continue;
+		}
+		co->congested_listed = 0;
+		
+		if (!co->congested) {
+			continue;
+		}
+		fd = co->fd;
+		
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape,
+		        "Dropping %s : %i bytes still queued after %i seconds", co->ip_client, g_ape->bufout[fd].buflen + g_ape->bufout[fd].inflight, g_ape->write.congested_timeout);
+		
+		free(g_ape->bufout[fd].buf);
+		g_ape->bufout[fd].buf = NULL;
+		g_ape->bufout[fd].buflen = 0;
+		g_ape->bufout[fd].allocsize = 0;
+		co->congested = 0;
+		
+		/* on_disconnect and close_socket() follow from the event loop */
+		shutdown(fd, 2);
+	}
 }
 
 #if 0
@@ -275,15 +522,466 @@ static void check_idle(struct _socks_list *sl)
 }
 #endif
 
+/* Socket has been left with unread data, put it on the "still readable" list */
+static void set_readable(int fd, acetables *g_ape)
+{
+	if (g_ape->co[fd]->read_pending) {
+		return;
+	}
+	if (g_ape->read.nfds == g_ape->read.size) {
+		g_ape->read.size = (g_ape->read.size ? g_ape->read.size * 2 : 32);
+		g_ape->read.fds = xrealloc(g_ape->read.fds, sizeof(int) * g_ape->read.size);
+	}
+	g_ape->co[fd]->read_pending = 1;
+	g_ape->read.fds[g_ape->read.nfds++] = fd;
+}
+
+/* Completion socket has output to submit, see flush_sockets() */
+static void set_flushable(int fd, acetables *g_ape)
+{
+	if (g_ape->co[fd]->write_pending) {
+		return;
+	}
+	if (g_ape->write.nfds == g_ape->write.size) {
+		g_ape->write.size = (g_ape->write.size ? g_ape->write.size * 2 : 32);
+		g_ape->write.fds = xrealloc(g_ape->write.fds, sizeof(int) * g_ape->write.size);
+	}
+	g_ape->co[fd]->write_pending = 1;
+	g_ape->write.fds[g_ape->write.nfds++] = fd;
+}
+
+/* Output queue went over the high watermark, see drop_congested() */
+static void set_congested(int fd, acetables *g_ape)
+{
+	ape_socket *co = g_ape->co[fd];
+	
+	co->congested = 1;
+	co->congested_since = ape_clock.sec;
+	
+	if (co->congested_listed || !g_ape->write.congested_timeout) {
+		return;
+	}
+	if (g_ape->write.ncongested == g_ape->write.congested_size) {
+		g_ape->write.congested_size = (g_ape->write.congested_size ? g_ape->write.congested_size * 2 : 32);
+		g_ape->write.congested = xrealloc(g_ape->write.congested, sizeof(*g_ape->write.congested) * g_ape->write.congested_size);
+	}
+	co->congested_listed = 1;
+	g_ape->write.congested[g_ape->write.ncongested++] = sock_handle(co);
+}
+
+/* "readb" bytes have been appended to the input buffer, 0 if the socket has been closed */
+static int read_done(int fd, int readb, int *tfd, acetables *g_ape)
+{
+	g_ape->co[fd]->buffer_in.length += readb;
+	g_ape->co[fd]->idle = ape_clock.sec;
+
+	/* realloc the buffer for the next read (x2) */
+	if (g_ape->co[fd]->buffer_in.length == g_ape->co[fd]->buffer_in.size &&
+		!buffer_grow(&g_ape->co[fd]->buffer_in, g_ape)) {
+
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape,
+			"Input buffers memory limit reached, closing connection from %s", g_ape->co[fd]->ip_client);
+
+		if (g_ape->co[fd]->callbacks.on_disconnect != NULL) {
+			g_ape->co[fd]->callbacks.on_disconnect(g_ape->co[fd], g_ape);
+		}
+
+		close_socket(fd, g_ape);
+		(*tfd)--;
+
+		return 0;
+	}
+	if (g_ape->co[fd]->callbacks.on_read_lf != NULL) {
+		unsigned int eol, *len = &g_ape->co[fd]->buffer_in.length;
+		char *pBuf = g_ape->co[fd]->buffer_in.data;
+
+		while ((eol = sneof(pBuf, *len, 4096)) != -1) {
+			pBuf[eol-1] = '\0';
+			g_ape->co[fd]->callbacks.on_read_lf(g_ape->co[fd], pBuf, g_ape);
+			pBuf = &pBuf[eol];
+			*len -= eol;
+		}
+		if (*len > 4096 || !*len) {
+			g_ape->co[fd]->buffer_in.length = 0;
+		} else if (*len && pBuf != g_ape->co[fd]->buffer_in.data) {
+
+			memmove(g_ape->co[fd]->buffer_in.data,
+				pBuf,
+				*len);
+
+		}
+
+	}
+
+	/* on_read can't get along with on_read_lf */
+	if (g_ape->co[fd]->callbacks.on_read != NULL && g_ape->co[fd]->callbacks.on_read_lf == NULL) {
+		g_ape->co[fd]->callbacks.on_read(g_ape->co[fd], &g_ape->co[fd]->buffer_in, g_ape->co[fd]->buffer_in.length - readb, g_ape);
+	}
+
+	return 1;
+}
+
+/*
+	Read a socket until EAGAIN or until Server.read_budget bytes are read.
+	In the latter case, as we are edge-triggered, the socket is put on the
+	"still readable" list processed on the next loop iteration.
+*/
+static void read_socket(int fd, int *tfd, acetables *g_ape)
+{
+	int readb = 0, nread = 0;
+	
+	do {
+		/*
+			TODO : Check if maximum data read can improve perf
+			Huge data may attempt to increase third parameter
+		*/
+		readb = sock_read(g_ape->co[fd],
+					g_ape->co[fd]->buffer_in.data + g_ape->co[fd]->buffer_in.length,
+					g_ape->co[fd]->buffer_in.size - g_ape->co[fd]->buffer_in.length);
+
+		if ((readb == -1) && BLOCKING(errno)) {
+
+			if (g_ape->co[fd]->stream_type == STREAM_OUT) {
+
+					//proxy_process_eol(&co[fd], g_ape);
+					//co[fd].buffer_in.length = 0;
+			} else {
+			//	co[fd].buffer_in.data[co[fd].buffer_in.length] = '\0';
+			}
+			break;
+		} else {
+			if (readb < 1) {
+
+				if (g_ape->co[fd]->callbacks.on_disconnect != NULL) {
+					g_ape->co[fd]->callbacks.on_disconnect(g_ape->co[fd], g_ape);
+				}
+
+				close_socket(fd, g_ape);
+				(*tfd)--;
+
+				break;
+			} else {
+				if (!read_done(fd, readb, tfd, g_ape)) {
+					break;
+				}
+				
+				/* Don't starve other sockets, come back on the next iteration */
+				if (g_ape->read.budget && (nread += readb) >= g_ape->read.budget && g_ape->co[fd]->fd == fd) {
+					set_readable(fd, g_ape);
+					break;
+				}
+			}
+		}
+	} while(readb >= 0);
+}
+
+/* Data received by the event backend (completion sockets), the buffer is given back on the next poll */
+static void recv_socket(int fd, const char *data, int len, int *tfd, acetables *g_ape)
+{
+	ape_buffer *buffer = &g_ape->co[fd]->buffer_in;
+	
+	while (len > 0) {
+		int n = (len < buffer->size - buffer->length ? len : buffer->size - buffer->length);
+		
+		memcpy(buffer->data + buffer->length, data, n);
+		
+		/* The buffer is grown once full */
+		if (!read_done(fd, n, tfd, g_ape)) {
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/* Set up a (non-blocking) client socket of the "server" listener */
+ape_socket *sock_adopt(int fd, int server, acetables *g_ape)
+{
+	prepare_ape_socket(fd, g_ape);
+
+	buffer_alloc(&g_ape->co[fd]->buffer_in, DEFAULT_BUFFER_SIZE, g_ape);
+
+	g_ape->co[fd]->idle = ape_clock.sec;
+	g_ape->co[fd]->fd = fd;
+
+	g_ape->co[fd]->state = STREAM_ONLINE;
+	g_ape->co[fd]->stream_type = STREAM_IN;
+
+	g_ape->bufout[fd].fd = fd;
+	g_ape->bufout[fd].buf = NULL;
+	g_ape->bufout[fd].buflen = 0;
+	g_ape->bufout[fd].allocsize = 0;
+
+	g_ape->co[fd]->callbacks.on_disconnect = g_ape->co[server]->callbacks.on_disconnect;
+	g_ape->co[fd]->callbacks.on_read = g_ape->co[server]->callbacks.on_read;
+	g_ape->co[fd]->callbacks.on_read_lf = g_ape->co[server]->callbacks.on_read_lf;
+	g_ape->co[fd]->callbacks.on_data_completly_sent = g_ape->co[server]->callbacks.on_data_completly_sent;
+	g_ape->co[fd]->callbacks.on_write = g_ape->co[server]->callbacks.on_write;
+	g_ape->co[fd]->callbacks.on_drain = g_ape->co[server]->callbacks.on_drain;
+
+	g_ape->co[fd]->attach = g_ape->co[server]->attach;
+	g_ape->co[fd]->listener = g_ape->co[server]->listener;
+
+	if (g_ape->co[server]->tls != NULL) {
+		tls_attach(g_ape->co[fd], g_ape->co[server]);
+	}
+
+	set_notsent_lowat(fd, g_ape);
+
+	/* TLS records are read and written by OpenSSL */
+	if (g_ape->co[fd]->tls == NULL && events_completion(g_ape->events)) {
+		g_ape->co[fd]->completion = 1;
+		events_add(g_ape->events, fd, EVENT_RECV);
+	} else {
+		events_add(g_ape->events, fd, EVENT_READ|EVENT_WRITE);
+	}
+
+	return g_ape->co[fd];
+}
+
+static void accept_client(int fd, int new_fd, struct sockaddr_in *their_addr, int *tfd, acetables *g_ape)
+{
+	sock_adopt(new_fd, fd, g_ape);
+
+	if (their_addr->sin_family == AF_INET) {
+		inet_ntop(AF_INET, &their_addr->sin_addr, g_ape->co[new_fd]->ip_client, sizeof(g_ape->co[new_fd]->ip_client));
+	} else {
+		/* UNIX socket */
+		strcpy(g_ape->co[new_fd]->ip_client, "127.0.0.1");
+	}
+
+	(*tfd)++;
+
+	if (g_ape->co[fd]->callbacks.on_accept != NULL) {
+		g_ape->co[fd]->callbacks.on_accept(g_ape->co[new_fd], g_ape);
+	}
+}
+
+/*
+	Accept up to Server.accept_budget connections, the listener is put on the
+	"still readable" list if the backlog may not be empty.
+*/
+static void accept_socket(int fd, int *tfd, acetables *g_ape)
+{
+	int new_fd, naccept = 0;
+	struct sockaddr_in their_addr;
+	socklen_t sin_size;
+
+	while (1) {
+		sin_size = sizeof(their_addr);
+		
+	#ifdef SOCK_NONBLOCK
+		new_fd = accept4(fd,
+			(struct sockaddr *)&their_addr,
+			&sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	#else
+		new_fd = accept(fd,
+			(struct sockaddr *)&their_addr,
+			&sin_size);
+	#endif
+		if (new_fd == -1) {
+			break;
+		}
+
+	#ifndef SOCK_NONBLOCK
+		setnonblocking(new_fd);
+	#endif
+		accept_client(fd, new_fd, &their_addr, tfd, g_ape);
+		
+		/* Don't let a reconnection storm hold the loop */
+		if (g_ape->read.accept_budget && ++naccept == g_ape->read.accept_budget) {
+			set_readable(fd, g_ape);
+			break;
+		}
+	}
+}
+
+/* Resume sockets which exhausted their budget during the previous iteration */
+static void process_readable(int *tfd, acetables *g_ape)
+{
+	int i, n = g_ape->read.nfds;
+	
+	for (i = 0; i < n; i++) {
+		int fd = g_ape->read.fds[i];
+		
+		/* Closed (or reused) in the meantime */
+		if (!g_ape->co[fd]->read_pending) {
+			continue;
+		}
+		g_ape->co[fd]->read_pending = 0;
+		
+		if (g_ape->co[fd]->stream_type == STREAM_SERVER) {
+			accept_socket(fd, tfd, g_ape);
+		} else {
+			read_socket(fd, tfd, g_ape);
+		}
+	}
+	
+	/* Keep the sockets listed again by read_socket() */
+	g_ape->read.nfds -= n;
+	memmove(g_ape->read.fds, g_ape->read.fds + n, sizeof(int) * g_ape->read.nfds);
+}
+
+/* Submit the output queued for the completion sockets, a single send per socket in flight */
+static void flush_sockets(acetables *g_ape)
+{
+	int i;
+	
+	for (i = 0; i < g_ape->write.nfds; i++) {
+		int fd = g_ape->write.fds[i], shut;
+		struct _socks_bufout *bufout = &g_ape->bufout[fd];
+		
+		/* Closed (or listed twice) in the meantime */
+		if (!g_ape->co[fd]->write_pending) {
+			continue;
+		}
+		g_ape->co[fd]->write_pending = 0;
+		
+		/* send_done() lists it again */
+		if (bufout->buf == NULL || bufout->inflight) {
+			continue;
+		}
+		
+		shut = (g_ape->co[fd]->burn_after_writing != 0);
+		
+		/* Not now (quiescing, see sockets_resume()) */
+		if (!events_send(g_ape->events, fd, bufout->buf, bufout->buflen, shut)) {
+			continue;
+		}
+		bufout->inflight = bufout->buflen;
+		bufout->linked_shutdown = shut;
+		
+		bufout->buf = NULL;
+		bufout->buflen = 0;
+		bufout->allocsize = 0;
+	}
+	g_ape->write.nfds = 0;
+}
+
+/* A send submitted by flush_sockets() has completed ("res" bytes sent) */
+static void send_done(int fd, int res, char *buf, acetables *g_ape)
+{
+	ape_socket *co = g_ape->co[fd];
+	struct _socks_bufout *bufout = &g_ape->bufout[fd];
+	int len = bufout->inflight;
+	
+	bufout->inflight = 0;
+	
+	/* Not sent, queued again below */
+	if (res < 0 && (BLOCKING(-res) || res == -EINTR)) {
+		res = 0;
+	}
+	
+	/* Peer is gone (EPIPE, ECONNRESET...) : nothing more will be sent */
+	if (res < 0) {
+		ape_log(APE_DEBUG, __FILE__, __LINE__, g_ape,
+		        "send_done() - send(): %s", strerror(-res));
+		free(buf);
+		
+		free(bufout->buf);
+		bufout->buf = NULL;
+		bufout->buflen = 0;
+		bufout->allocsize = 0;
+		bufout->linked_shutdown = 0;
+		co->congested = 0;
+		
+		/* on_disconnect and close_socket() follow from the recv completion */
+		shutdown(fd, 2);
+		return;
+	}
+	
+	/* Socket buffer full or cancelled (see events_quiesce()), the rest goes before what has been queued since */
+	if (res < len) {
+		char *rest;
+		
+		bufout->allocsize = (len - res + bufout->buflen + 0x07ff) & (~0x07ff);
+		rest = xmalloc(sizeof(char) * bufout->allocsize);
+		
+		memcpy(rest, buf + res, len - res);
+		if (bufout->buf != NULL) {
+			memcpy(rest + len - res, bufout->buf, bufout->buflen);
+			free(bufout->buf);
+		}
+		bufout->buf = rest;
+		bufout->buflen += len - res;
+		bufout->linked_shutdown = 0;
+		
+		free(buf);
+		set_flushable(fd, g_ape);
+		
+		return;
+	}
+	free(buf);
+	
+	if (bufout->buf != NULL) {
+		set_flushable(fd, g_ape);
+	} else {
+		if (co->callbacks.on_data_completly_sent != NULL) {
+			co->callbacks.on_data_completly_sent(co, g_ape);
+		}
+		if (co->burn_after_writing && !bufout->linked_shutdown) {
+			sock_shutdown(co);
+		}
+	}
+	
+	/* Producers can resume */
+	if (co->congested && bufout->buflen <= g_ape->write.low_watermark) {
+		co->congested = 0;
+		
+		if (co->callbacks.on_drain != NULL) {
+			co->callbacks.on_drain(co, g_ape);
+		}
+	}
+}
+
+/* I/O done by the event backend (see events_completion()) */
+static void process_completion(int fd, int i, int *tfd, acetables *g_ape)
+{
+	int bitev = events_revent(g_ape->events, i), res = events_result(g_ape->events, i);
+	
+	if (bitev & EVENT_ACCEPT) {
+		struct sockaddr_in their_addr;
+		socklen_t sin_size = sizeof(their_addr);
+		
+		if (getpeername(res, (struct sockaddr *)&their_addr, &sin_size) == -1) {
+			their_addr.sin_family = AF_UNSPEC;
+		}
+		accept_client(fd, res, &their_addr, tfd, g_ape);
+	} else if (bitev & EVENT_SEND) {
+		send_done(fd, res, events_data(g_ape->events, i), g_ape);
+	} else if (res > 0) {
+		recv_socket(fd, events_data(g_ape->events, i), res, tfd, g_ape);
+	} else {
+		/* EOF or error */
+		if (g_ape->co[fd]->callbacks.on_disconnect != NULL) {
+			g_ape->co[fd]->callbacks.on_disconnect(g_ape->co[fd], g_ape);
+		}
+		close_socket(fd, g_ape);
+		(*tfd)--;
+	}
+}
+
+/* The I/O held back by events_quiesce() goes on (a handoff didn't happen) */
+void sockets_resume(acetables *g_ape)
+{
+	int i;
+	
+	events_resume(g_ape->events);
+	
+	for (i = 0; i < g_ape->basemem; i++) {
+		if (g_ape->co[i]->completion && g_ape->co[i]->fd == i && g_ape->bufout[i].buf != NULL) {
+			set_flushable(i, g_ape);
+		}
+	}
+}
+
 unsigned int sockroutine(acetables *g_ape)
 {
 	struct _socks_list sl;
 
-	int new_fd, nfds, sin_size = sizeof(struct sockaddr_in), i, tfd = 0;
+	int nfds, i, tfd = 0;
 
-	struct timeval t_start, t_end;
-	long int ticks = 0, uticks = 0, lticks = 0;
-	struct sockaddr_in their_addr;
+	long long nticks;
 
 	//sl.co = co;
 	sl.tfd = &tfd;
@@ -291,23 +989,62 @@ unsigned int sockroutine(acetables *g_ape)
 	#if 0
 	add_periodical(5, 0, check_idle, &sl, g_ape);
 	#endif
-	gettimeofday(&t_start, NULL);
+	update_clock();
+	ticks_init(g_ape);
+	
+	add_periodical(1000, 0, shrink_buffers, g_ape, g_ape);
+	add_periodical(1000, 0, drop_congested, g_ape, g_ape);
+	
 	while (server_is_running) {
-		/* Linux 2.6.25 provides a fd-driven timer system. It could be usefull to implement */
 		int timeout_to_hang = get_first_timer_ms(g_ape);
+		
+		/* Let the tick source wake us up on the next timer (if any) */
+		if (events_timer_arm(g_ape->events, (timeout_to_hang == -1 ? -1 : g_ape->timers.last + timeout_to_hang))) {
+			timeout_to_hang = -1;
+		}
+		
+		/* Some sockets still have data to read, don't wait */
+		if (g_ape->read.nfds) {
+			timeout_to_hang = 0;
+		}
+		
+		/* Submitted along with the wait */
+		if (g_ape->write.nfds) {
+			flush_sockets(g_ape);
+		}
 		nfds = events_poll(g_ape->events, timeout_to_hang);
+		
+		update_clock();
 
 		if (nfds < 0) {
 			ape_log(APE_ERR, __FILE__, __LINE__, g_ape, 
 				"events_poll() : %s", strerror(errno));
 			continue;
 		}
+		
+		/* Sockets listed during the previous iteration go first */
+		if (g_ape->read.nfds) {
+			process_readable(&tfd, g_ape);
+		}
 
 		if (nfds > 0) {
-			for (i = 0; i < nfds; i++) {
+			/* server_is_running is cleared once the sockets are handed over (see handoff.c) */
+			for (i = 0; i < nfds && server_is_running; i++) {
 
 				int active_fd = events_get_current_fd(g_ape->events, i);
 
+				/* Closed by a previous event of this poll (completion backends) */
+				if (active_fd == -1) {
+					if (events_revent(g_ape->events, i) & EVENT_SEND) {
+						free(events_data(g_ape->events, i));
+					}
+					continue;
+				}
+				if (events_revent(g_ape->events, i) & (EVENT_ACCEPT | EVENT_RECV | EVENT_SEND)) {
+					process_completion(active_fd, i, &tfd, g_ape);
+					continue;
+				}
+
 				if (g_ape->co[active_fd]->stream_type == STREAM_SERVER) {
 					int bitev = events_revent(g_ape->events, i);
 
@@ -317,58 +1054,11 @@ unsigned int sockroutine(acetables *g_ape)
 						continue;
 					}
 
-					while (1) {
-
-						//http_state http = {NULL, 0, -1, 0, 0, HTTP_NULL, 0, 0};
-
-						new_fd = accept(active_fd,
-							(struct sockaddr *)&their_addr,
-							(unsigned int *)&sin_size);
-
-						if (new_fd == -1) {
-							break;
-						}
-
-						prepare_ape_socket(new_fd, g_ape);
-
-						strncpy(g_ape->co[new_fd]->ip_client, inet_ntoa(their_addr.sin_addr), 16);
-
-						g_ape->co[new_fd]->buffer_in.data = xmalloc(sizeof(char) * (DEFAULT_BUFFER_SIZE + 1));
-						g_ape->co[new_fd]->buffer_in.size = DEFAULT_BUFFER_SIZE;
-
-						g_ape->co[new_fd]->idle = time(NULL);
-						g_ape->co[new_fd]->fd = new_fd;
-
-						g_ape->co[new_fd]->state = STREAM_ONLINE;
-						g_ape->co[new_fd]->stream_type = STREAM_IN;
-
-						g_ape->bufout[new_fd].fd = new_fd;
-						g_ape->bufout[new_fd].buf = NULL;
-						g_ape->bufout[new_fd].buflen = 0;
-						g_ape->bufout[new_fd].allocsize = 0;
-
-						g_ape->co[new_fd]->callbacks.on_disconnect = g_ape->co[active_fd]->callbacks.on_disconnect;
-						g_ape->co[new_fd]->callbacks.on_read = g_ape->co[active_fd]->callbacks.on_read;
-						g_ape->co[new_fd]->callbacks.on_read_lf = g_ape->co[active_fd]->callbacks.on_read_lf;
-						g_ape->co[new_fd]->callbacks.on_data_completly_sent = g_ape->co[active_fd]->callbacks.on_data_completly_sent;
-						g_ape->co[new_fd]->callbacks.on_write = g_ape->co[active_fd]->callbacks.on_write;
-
-						g_ape->co[new_fd]->attach = g_ape->co[active_fd]->attach;
-
-						setnonblocking(new_fd);
-
-						events_add(g_ape->events, new_fd, EVENT_READ|EVENT_WRITE);
-
-						tfd++;
-
-						if (g_ape->co[active_fd]->callbacks.on_accept != NULL) {
-							g_ape->co[active_fd]->callbacks.on_accept(g_ape->co[new_fd], g_ape);
-						}
-
+					if (!g_ape->co[active_fd]->read_pending) {
+						accept_socket(active_fd, &tfd, g_ape);
 					}
 					continue;
 				} else {
-					int readb = 0;
 					int bitev = events_revent(g_ape->events, i);
 
 					if (bitev & EVENT_WRITE) {
@@ -406,11 +1096,20 @@ unsigned int sockroutine(acetables *g_ape)
 								}
 
 								if (g_ape->co[active_fd]->burn_after_writing) {
-									shutdown(active_fd, 2);
+									sock_shutdown(g_ape->co[active_fd]);
 									//g_ape->co[active_fd]->burn_after_writing = 0;
 								}
 
 							}
+							
+							/* Producers can resume */
+							if (g_ape->co[active_fd]->congested && g_ape->bufout[active_fd].buflen <= g_ape->write.low_watermark) {
+								g_ape->co[active_fd]->congested = 0;
+								
+								if (g_ape->co[active_fd]->callbacks.on_drain != NULL) {
+									g_ape->co[active_fd]->callbacks.on_drain(g_ape->co[active_fd], g_ape);
+								}
+							}
 						} else if (g_ape->co[active_fd]->stream_type == STREAM_DELEGATE) {
 							if (g_ape->co[active_fd]->callbacks.on_write != NULL) {
 								g_ape->co[active_fd]->callbacks.on_write(g_ape->co[active_fd], g_ape);
@@ -427,95 +1126,31 @@ unsigned int sockroutine(acetables *g_ape)
 								continue;
 							}
 						}
-						do {
-							/*
-								TODO : Check if maximum data read can improve perf
-								Huge data may attempt to increase third parameter
-							*/
-							readb = read(active_fd,
-										g_ape->co[active_fd]->buffer_in.data + g_ape->co[active_fd]->buffer_in.length,
-										g_ape->co[active_fd]->buffer_in.size - g_ape->co[active_fd]->buffer_in.length);
-
-							if ((readb == -1) && BLOCKING(errno)) {
-
-								if (g_ape->co[active_fd]->stream_type == STREAM_OUT) {
-
-										//proxy_process_eol(&co[active_fd], g_ape);
-										//co[active_fd].buffer_in.length = 0;
-								} else {
-								//	co[active_fd].buffer_in.data[co[active_fd].buffer_in.length] = '\0';
-								}
-								break;
-							} else {
-								if (readb < 1) {
-
-									if (g_ape->co[active_fd]->callbacks.on_disconnect != NULL) {
-										g_ape->co[active_fd]->callbacks.on_disconnect(g_ape->co[active_fd], g_ape);
-									}
-
-									close_socket(active_fd, g_ape);
-									tfd--;
-
-									break;
-								} else {
-
-									g_ape->co[active_fd]->buffer_in.length += readb;
-
-									/* realloc the buffer for the next read (x2) */
-									if (g_ape->co[active_fd]->buffer_in.length == g_ape->co[active_fd]->buffer_in.size) {
-										g_ape->co[active_fd]->buffer_in.size *= 2;
-
-										g_ape->co[active_fd]->buffer_in.data = xrealloc(g_ape->co[active_fd]->buffer_in.data,
-																sizeof(char) * (g_ape->co[active_fd]->buffer_in.size + 1));
-
-									}
-									if (g_ape->co[active_fd]->callbacks.on_read_lf != NULL) {
-										unsigned int eol, *len = &g_ape->co[active_fd]->buffer_in.length;
-										char *pBuf = g_ape->co[active_fd]->buffer_in.data;
-
-										while ((eol = sneof(pBuf, *len, 4096)) != -1) {
-											pBuf[eol-1] = '\0';
-											g_ape->co[active_fd]->callbacks.on_read_lf(g_ape->co[active_fd], pBuf, g_ape);
-											pBuf = &pBuf[eol];
-											*len -= eol;
-										}
-										if (*len > 4096 || !*len) {
-											g_ape->co[active_fd]->buffer_in.length = 0;
-										} else if (*len && pBuf != g_ape->co[active_fd]->buffer_in.data) {
-
-											memmove(g_ape->co[active_fd]->buffer_in.data,
-												pBuf,
-												*len);
-
-										}
-
-									}
-
-									/* on_read can't get along with on_read_lf */
-									if (g_ape->co[active_fd]->callbacks.on_read != NULL && g_ape->co[active_fd]->callbacks.on_read_lf == NULL) {
-										g_ape->co[active_fd]->callbacks.on_read(g_ape->co[active_fd], &g_ape->co[active_fd]->buffer_in, g_ape->co[active_fd]->buffer_in.length - readb, g_ape);
-									}
-								}
-							}
-						} while(readb >= 0);
+						/* Already listed, don't let it read twice during this iteration */
+						if (!g_ape->co[active_fd]->read_pending) {
+							read_socket(active_fd, &tfd, g_ape);
+						}
 					}
 				}
 			}
 		}
 
-		gettimeofday(&t_end, NULL);
-
-		ticks = 0;
+		if (!server_is_running) {
+			break;
+		}
 
-		uticks = 1000000L * (t_end.tv_sec - t_start.tv_sec);
-		uticks += (t_end.tv_usec - t_start.tv_usec);
-		t_start = t_end;
-		lticks += uticks;
 		/* Tic tac, tic tac */
-
-		while (lticks >= 1000) {
-			lticks -= 1000;
-			process_tick(g_ape);
+		if ((nticks = ape_clock.ms - g_ape->timers.last) > 0) {
+			g_ape->timers.last = ape_clock.ms;
+			process_ticks(g_ape, nticks);
+		}
+		
+		g_ape->loop.last_us = monotonic_usec() - ape_clock.usec;
+		g_ape->loop.total_us += g_ape->loop.last_us;
+		g_ape->loop.iterations++;
+		
+		if (g_ape->loop.last_us > g_ape->loop.max_us) {
+			g_ape->loop.max_us = g_ape->loop.last_us;
 		}
 	}
 
@@ -553,7 +1188,7 @@ static int sendqueue(int sock, acetables *g_ape)
 	r_bytes = bufout->buflen;
 
 	while(t_bytes < bufout->buflen) {
-		n = write(sock, bufout->buf + t_bytes, r_bytes);
+		n = sock_write(g_ape->co[sock], bufout->buf + t_bytes, r_bytes);
 		if (n < 0) {
 			if (BLOCKING(errno) && (r_bytes > 0)) {
 				/* Still not complete */
@@ -581,7 +1216,11 @@ static int sendqueue(int sock, acetables *g_ape)
 	return 1;
 }
 
-/* TODO : add "nowrite" flag to avoid write syscall when calling several time sendbin() */
+/*
+	TODO : add "nowrite" flag to avoid write syscall when calling several time sendbin()
+	Completion sockets : everything is queued and sent in order by flush_sockets(), a
+	shutdown() (burn_after_writing) is linked to the last send.
+*/
 int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after_writing, acetables *g_ape)
 {
 	int t_bytes = 0, r_bytes, n = 0;
@@ -590,8 +1229,8 @@ int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after
 
 	if (sock != 0) {
 		while(t_bytes < len) {
-			if (g_ape->bufout[sock].buf == NULL) {
-				n = write(sock, bin + t_bytes, r_bytes);
+			if (g_ape->bufout[sock].buf == NULL && !g_ape->co[sock]->completion) {
+				n = sock_write(g_ape->co[sock], bin + t_bytes, r_bytes);
 			} else {
 				n = -2;
 			}
@@ -610,10 +1249,20 @@ int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after
 					}
 
 					memcpy(g_ape->bufout[sock].buf + (g_ape->bufout[sock].buflen - r_bytes), bin + t_bytes, r_bytes);
+					
+					/* Peer is too slow, producers should wait for on_drain */
+					if (g_ape->write.high_watermark && g_ape->bufout[sock].buflen + g_ape->bufout[sock].inflight >= g_ape->write.high_watermark && !g_ape->co[sock]->congested) {
+						set_congested(sock, g_ape);
+					}
 
 					if (burn_after_writing) {
 						g_ape->co[sock]->burn_after_writing = 1;
 					}
+					
+					if (g_ape->co[sock]->completion) {
+						set_flushable(sock, g_ape);
+						return 1;
+					}
 				} else {
 					ape_log(APE_ERR, __FILE__, __LINE__, g_ape,
 					        "sendbin() - write(): %s", strerror(errno));
@@ -627,17 +1276,58 @@ int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after
 		}
 	}
 
-	if (burn_after_writing) {
-		shutdown(sock, 2);
+	/* Nothing may be queued (a completion socket, len == 0) */
+	if (burn_after_writing && sock != 0) {
+		safe_shutdown(sock, g_ape);
 	}
 
 	return 1;
 }
 
+/*
+	sendbin() of several buffers : a single writev() when nothing is queued
+	(TLS records are written by sendbin()), the rest is queued
+*/
+int sendbinv(int sock, const struct iovec *iov, int iovcnt, acetables *g_ape)
+{
+	ssize_t n = 0;
+	int i, finish = 1;
+
+	if (sock == 0 || iovcnt <= 0) {
+		return 1;
+	}
+	if (g_ape->bufout[sock].buf == NULL && g_ape->co[sock]->tls == NULL && !g_ape->co[sock]->completion) {
+		if ((n = writev(sock, iov, (iovcnt > IOV_MAX ? IOV_MAX : iovcnt))) < 0) {
+			if (!BLOCKING(errno)) {
+				ape_log(APE_ERR, __FILE__, __LINE__, g_ape,
+				        "sendbinv() - writev(): %s", strerror(errno));
+				return 0;
+			}
+			n = 0;
+		}
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if ((size_t)n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			continue;
+		}
+		finish &= sendbin(sock, (char *)iov[i].iov_base + n, iov[i].iov_len - n, 0, g_ape);
+		n = 0;
+	}
+
+	return finish;
+}
+
+/* 0 if the output queue is over the high watermark (wait for on_drain before sending more) */
+int sock_writable(int sock, acetables *g_ape)
+{
+	return (sock != 0 && !g_ape->co[sock]->congested);
+}
+
 void safe_shutdown(int sock, acetables *g_ape)
 {
-	if (g_ape->bufout[sock].buf == NULL) {
-		shutdown(sock, 2);
+	if (g_ape->bufout[sock].buf == NULL && !g_ape->bufout[sock].inflight) {
+		sock_shutdown(g_ape->co[sock]);
 	} else {
 		g_ape->co[sock]->burn_after_writing = 2;
 	}
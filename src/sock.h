@@ -29,10 +29,14 @@
 #include <sys/wait.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "main.h"
 
 #define TCP_TIMEOUT 20 // ~Timeout if the socket is not identified to APE
+#define DEFER_ACCEPT_TIMEOUT 5 // Seconds the kernel waits for the first bytes before handing a connection to accept()
+#define PRESIZE_MAX_FDS 65536 // Connection tables are sized from rlimit_nofile up to this value
+#define LISTEN_BACKLOG 2048 // Accept queue of the listeners (see Listener.backlog)
 
 
 struct _socks_bufout
@@ -41,6 +45,14 @@ struct _socks_bufout
 	int fd;
 	int buflen;
 	int allocsize;
+	int inflight; /* bytes submitted to the event backend, not completed yet (completion sockets) */
+	int linked_shutdown; /* shutdown() follows them */
+};
+
+struct _socks_block
+{
+	ape_socket *socks;
+	struct _socks_block *next;
 };
 
 struct _socks_list
@@ -56,13 +68,26 @@ struct _ape_sock_connect_async
 };
 
 ape_socket *ape_listen(unsigned int port, char *listen_ip, acetables *g_ape);
+ape_socket *ape_listen_tcp(unsigned int port, char *listen_ip, int backlog, acetables *g_ape);
+ape_socket *ape_listen_unix(const char *path, int mode, int backlog, acetables *g_ape);
+ape_socket *ape_listen_fd(int sock, acetables *g_ape);
+ape_socket *sock_adopt(int fd, int server, acetables *g_ape);
 ape_socket *ape_connect(char *ip, int port, acetables *g_ape);
 void ape_connect_name(char *name, int port, ape_socket *pattern, acetables *g_ape);
 void prepare_ape_socket(int fd, acetables *g_ape);
 void setnonblocking(int fd);
 int sendf(int sock, acetables *g_ape, char *buf, ...);
 int sendbin(int sock, const char *bin, unsigned int len, unsigned int burn_after_writing, acetables *g_ape);
+int sendbinv(int sock, const struct iovec *iov, int iovcnt, acetables *g_ape);
 void safe_shutdown(int sock, acetables *g_ape);
+void close_socket(int fd, acetables *g_ape);
+int sock_writable(int sock, acetables *g_ape);
+void sockets_init(acetables *g_ape);
+void sockets_resume(acetables *g_ape);
+void sockets_free(acetables *g_ape);
+ape_sock_handle sock_handle(ape_socket *co);
+ape_socket *sock_from_handle(ape_sock_handle handle, acetables *g_ape);
+void set_defer_accept(int fd, int seconds);
 unsigned int sockroutine(acetables *g_ape);
 
 
@@ -75,21 +100,22 @@ unsigned int sockroutine(acetables *g_ape);
 	sendbin(x, HEADER_DEFAULT, HEADER_DEFAULT_LEN, 0, g_ape);\
 	sendbin(x, "QUIT", 4, 0, g_ape)
 	
+/* Output of completion sockets is already coalesced into a single send (see flush_sockets()) */
 #ifdef TCP_CORK
-	#define PACK_TCP(fd) \
+	#define PACK_TCP(co) \
 		do { \
 			int __state = 1; \
-			setsockopt(fd, IPPROTO_TCP, TCP_CORK, &__state, sizeof(__state)); \
+			if (!(co)->completion) setsockopt((co)->fd, IPPROTO_TCP, TCP_CORK, &__state, sizeof(__state)); \
 		} while(0)
 
-	#define FLUSH_TCP(fd) \
+	#define FLUSH_TCP(co) \
 	do { \
 		int __state = 0; \
-		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &__state, sizeof(__state)); \
+		if (!(co)->completion) setsockopt((co)->fd, IPPROTO_TCP, TCP_CORK, &__state, sizeof(__state)); \
 	} while(0)
 #else
-	#define PACK_TCP(fd)
-	#define FLUSH_TCP(fd)
+	#define PACK_TCP(co)
+	#define FLUSH_TCP(co)
 #endif
 
 #endif
@@ -22,15 +22,87 @@
 
 #include "ticks.h"
 #include "utils.h"
+#include "events.h"
+#include "sock.h"
 
 #include <sys/time.h>
 #include <time.h>
+#include <stdint.h>
+#include <unistd.h>
 
-inline void process_tick(acetables *g_ape)
+struct _ape_clock ape_clock;
+
+long long monotonic_usec()
 {
-	struct _ticks_callback *timers = g_ape->timers.timers;
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Avoid time() and friends on hot paths (raws timestamp, idle, logs) */
+void update_clock()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	
+	if (ts.tv_sec != ape_clock.sec) {
+		ape_clock.sec = ts.tv_sec;
+		ape_clock.len = sprintf(ape_clock.str, "%li", (long int)ape_clock.sec);
+	}
+	
+	ape_clock.usec = monotonic_usec();
+	ape_clock.ms = ape_clock.usec / 1000;
+}
+
+static void ticks_read(ape_socket *co, ape_buffer *buffer, size_t offset, acetables *g_ape)
+{
+	uint64_t expirations;
+	
+	/* Timers are processed at the end of the loop iteration (see sockroutine()) */
+	while (read(co->fd, &expirations, sizeof(expirations)) > 0);
+}
+
+/* Register the kernel tick source (if any) in the event loop */
+void ticks_init(acetables *g_ape)
+{
+	int fd;
+	
+	g_ape->timers.last = ape_clock.ms;
+	
+	if ((fd = events_timer_init(g_ape->events)) == -1) {
+		return;
+	}
+	
+	prepare_ape_socket(fd, g_ape);
 	
-	while (timers != NULL && --timers->delta <= 0) {
+	g_ape->co[fd]->fd = fd;
+	g_ape->co[fd]->stream_type = STREAM_DELEGATE;
+	g_ape->co[fd]->callbacks.on_read = ticks_read;
+	
+	events_add(g_ape->events, fd, EVENT_READ);
+}
+
+/* Fire the timers expired in the last "nticks" ms */
+void process_ticks(acetables *g_ape, int nticks)
+{
+	struct _ticks_callback *timers;
+	
+	/* Elapsed time is applied before any callback runs, so that timers added by a callback are relative to now */
+	for (timers = g_ape->timers.timers; timers != NULL && timers->delta <= nticks; timers = timers->next) {
+		nticks -= timers->delta;
+		timers->delta = 0;
+		timers->late = nticks;
+	}
+	
+	if (timers != NULL) {
+		timers->delta -= nticks;
+	}
+	
+	/* Only the timers marked above are fired (see add_timeout() for the ordering) */
+	while ((timers = g_ape->timers.timers) != NULL && timers->late != -1) {
 		int lastcall = (timers->times > 0 && --timers->times == 0);
 		void (*func_timer)(void *param, int *) = timers->func;
 		
@@ -39,19 +111,17 @@ inline void process_tick(acetables *g_ape)
 		g_ape->timers.timers = timers->next;
 
 		if (!lastcall) {
-			struct _ticks_callback *new_timer = add_timeout(timers->ticks_need, timers->func, timers->params, g_ape);
+			/* Periodicals catch up on the time they were fired late */
+			struct _ticks_callback *new_timer = add_timeout((timers->late < timers->ticks_need ? timers->ticks_need - timers->late : 0), timers->func, timers->params, g_ape);
 			
 			g_ape->timers.ntimers--;
 			new_timer->identifier = timers->identifier;
 			new_timer->times = timers->times;
 			new_timer->protect = timers->protect;
+			new_timer->ticks_need = timers->ticks_need;
 		}
 
 		free(timers);
-
-		if ((timers = g_ape->timers.timers) != NULL) {
-			timers->delta++;
-		}
 	}
 }
 
@@ -70,10 +140,12 @@ struct _ticks_callback *add_timeout(unsigned int msec, void *callback, void *par
 	new_timer->protect = 1;
 	new_timer->func = callback;
 	new_timer->params = params;
+	new_timer->late = -1;
 	new_timer->next = NULL;
 
+	/* After the timers due at the same time (and after the ones being fired by process_ticks()) */
 	while (timers != NULL) {
-		if (new_timer->delta <= timers->delta) {
+		if (new_timer->delta < timers->delta) {
 			new_timer->next = timers;
 			timers->delta -= new_timer->delta;
 			break;
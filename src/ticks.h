@@ -23,13 +23,28 @@
 #define _TICKS_H
 
 #include "main.h"
+#include <time.h>
 
-#define VTICKS_RATE 50 // 50 ms
+#define VTICKS_RATE 50 // 50 ms (default Server.ticks_rate)
+
+/* Refreshed once per event loop iteration (see update_clock()) */
+struct _ape_clock
+{
+	time_t sec; /* unix time */
+	char str[24]; /* sec as a decimal string */
+	int len;
+	
+	long long usec; /* monotonic */
+	long long ms; /* monotonic */
+};
+
+extern struct _ape_clock ape_clock;
 
 struct _ticks_callback
 {
 	int ticks_need;
 	int delta;
+	int late; /* ms past due when fired by process_ticks(), -1 otherwise */
 	int times;
 	unsigned int identifier;
 	unsigned int protect;
@@ -40,7 +55,10 @@ struct _ticks_callback
 	struct _ticks_callback *next;
 };
 
-void process_tick(acetables *g_ape);
+long long monotonic_usec();
+void update_clock();
+void ticks_init(acetables *g_ape);
+void process_ticks(acetables *g_ape, int nticks);
 struct _ticks_callback *add_timeout(unsigned int msec, void *callback, void *params, acetables *g_ape);
 struct _ticks_callback *add_periodical(unsigned int msec, int times, void *callback, void *params, acetables *g_ape);
 void del_timer_identifier(unsigned int identifier, acetables *g_ape);
@@ -48,7 +66,7 @@ struct _ticks_callback *get_timer_identifier(unsigned int identifier, acetables
 int get_first_timer_ms(acetables *g_ape);
 void timers_free(acetables *g_ape);
 
-#define add_ticked(x, y) add_periodical(VTICKS_RATE, 0, x, y, g_ape)
+#define add_ticked(x, y) add_periodical(g_ape->timers.rate, 0, x, y, g_ape)
 
 #endif
 
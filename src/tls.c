@@ -0,0 +1,256 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* tls.c */
+
+/*
+	TLS termination (OpenSSL) for the clients of the TLS listener (TLS section).
+	tls_read()/tls_write() behave like read()/write() on a non-blocking
+	socket (-1 and EAGAIN when the handshake or a record isn't complete)
+	so that sock.c keeps a single code path. The handshake is driven by
+	the first reads.
+	Reconnecting clients resume their session from the server-side cache
+	or from a session ticket. With kernel TLS (TLS.ktls), records are
+	encrypted by the kernel : SSL_write() hands the data straight to the
+	socket, without the user-space copy.
+*/
+
+#include "tls.h"
+#include "config.h"
+#include "utils.h"
+#include "log.h"
+
+#include <errno.h>
+
+#ifdef _USE_SSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static void tls_log_error(const char *what, acetables *g_ape)
+{
+	char err[256];
+
+	ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+
+	if (!g_ape->is_daemon) {
+		printf("[ERR] TLS : %s : %s\n", what, err);
+	}
+	ape_log(APE_ERR, __FILE__, __LINE__, g_ape, "TLS : %s : %s", what, err);
+}
+
+/* Return 1 if the TLS listener has to be started, -1 on error */
+int tls_init(acetables *g_ape)
+{
+	SSL_CTX *ctx;
+	int cache;
+
+	g_ape->tls.ctx = NULL;
+	g_ape->tls.server = 0;
+
+	if (atoi(CONFIG_VAL(TLS, port, g_ape->srv)) <= 0) {
+		return 0;
+	}
+
+	if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+		tls_log_error("SSL_CTX_new()", g_ape);
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, CONFIG_VAL(TLS, certificate, g_ape->srv)) != 1 ||
+		SSL_CTX_use_PrivateKey_file(ctx, CONFIG_VAL(TLS, private_key, g_ape->srv), SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(ctx) != 1) {
+
+		tls_log_error("cannot load the certificate", g_ape);
+		SSL_CTX_free(ctx);
+		return -1;
+	}
+
+	/*
+		Output is queued by sock.c when a write would block and the same bytes
+		(maybe more) are given back from another buffer.
+		Idle connections (long polling) don't keep their record buffers.
+	*/
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+	/* Resumption : long polling clients reconnect all the time */
+	if ((cache = atoi(CONFIG_VAL(TLS, session_cache, g_ape->srv))) <= 0) {
+		cache = TLS_SESSION_CACHE;
+	}
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"aped", 4);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, cache);
+
+	if (strcmp(CONFIG_VAL(TLS, session_tickets, g_ape->srv), "no") == 0) {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	}
+
+	if (strcmp(CONFIG_VAL(TLS, ktls, g_ape->srv), "yes") == 0) {
+	#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	#else
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "TLS : kernel TLS isn't supported by this OpenSSL version");
+	#endif
+	}
+
+	g_ape->tls.ctx = ctx;
+
+	return 1;
+}
+
+void tls_free(acetables *g_ape)
+{
+	if (g_ape->tls.ctx != NULL) {
+		SSL_CTX_free(g_ape->tls.ctx);
+		g_ape->tls.ctx = NULL;
+	}
+}
+
+/* New client of the TLS listener "server" */
+void tls_attach(ape_socket *co, ape_socket *server)
+{
+	SSL *ssl = SSL_new(server->tls);
+
+	if (ssl == NULL) {
+		return;
+	}
+	SSL_set_fd(ssl, co->fd);
+	SSL_set_accept_state(ssl);
+
+	co->tls = ssl;
+}
+
+void tls_close(ape_socket *co)
+{
+	SSL_free(co->tls);
+	co->tls = NULL;
+}
+
+/* Send close_notify (best effort, the socket is about to be shut down) */
+void tls_shutdown(ape_socket *co)
+{
+	if (SSL_is_init_finished((SSL *)co->tls)) {
+		SSL_shutdown(co->tls);
+	}
+}
+
+static ssize_t tls_error(ape_socket *co, int ret)
+{
+	switch (SSL_get_error(co->tls, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			/* close_notify */
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if (ret == 0 || errno == 0) {
+				return 0;
+			}
+			return -1;
+		default:
+			/* Handshake failure, bad record... */
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+ssize_t tls_read(ape_socket *co, char *buf, size_t len)
+{
+	int ret;
+
+	ERR_clear_error();
+
+	if ((ret = SSL_read(co->tls, buf, len)) > 0) {
+		return ret;
+	}
+
+	return tls_error(co, ret);
+}
+
+ssize_t tls_write(ape_socket *co, const char *buf, size_t len)
+{
+	int ret;
+
+	ERR_clear_error();
+
+	if ((ret = SSL_write(co->tls, buf, len)) > 0) {
+		return ret;
+	}
+
+	ret = tls_error(co, ret);
+
+	/* write() doesn't return 0 */
+	if (ret == 0) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	return ret;
+}
+
+#else
+int tls_init(acetables *g_ape)
+{
+	g_ape->tls.ctx = NULL;
+	g_ape->tls.server = 0;
+
+	if (atoi(CONFIG_VAL(TLS, port, g_ape->srv)) > 0) {
+		if (!g_ape->is_daemon) {
+			printf("[WARN] APE compiled without TLS support, TLS listener disabled\n");
+		}
+		ape_log(APE_WARN, __FILE__, __LINE__, g_ape, "[WARN] APE compiled without TLS support, TLS listener disabled");
+	}
+
+	return 0;
+}
+
+void tls_free(acetables *g_ape)
+{
+
+}
+
+void tls_attach(ape_socket *co, ape_socket *server)
+{
+
+}
+
+void tls_close(ape_socket *co)
+{
+
+}
+
+void tls_shutdown(ape_socket *co)
+{
+
+}
+
+ssize_t tls_read(ape_socket *co, char *buf, size_t len)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+ssize_t tls_write(ape_socket *co, const char *buf, size_t len)
+{
+	errno = EPROTO;
+	return -1;
+}
+#endif
@@ -0,0 +1,40 @@
+/*
+  Copyright (C) 2006, 2007, 2008, 2009, 2010  Anthony Catel <a.catel@weelya.com>
+
+  This file is part of APE Server.
+  APE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  APE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with APE ; if not, write to the Free Software Foundation,
+  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* tls.h */
+
+#ifndef _TLS_H
+#define _TLS_H
+
+#include "main.h"
+#include "configure.h"
+
+#define TLS_SESSION_CACHE 20480 // Default TLS.session_cache
+
+int tls_init(acetables *g_ape);
+void tls_free(acetables *g_ape);
+
+void tls_attach(ape_socket *co, ape_socket *server);
+void tls_close(ape_socket *co);
+void tls_shutdown(ape_socket *co);
+
+ssize_t tls_read(ape_socket *co, char *buf, size_t len);
+ssize_t tls_write(ape_socket *co, const char *buf, size_t len);
+
+#endif
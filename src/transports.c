@@ -22,10 +22,46 @@
 #include "transports.h"
 #include "config.h"
 #include "utils.h"
+#include "sock.h"
+#include "http.h"
+#include "raw.h"
+#include "ticks.h"
 
-struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_socket *client, transport_t transport)
+/* EventSource opens its stream with "Accept: text/event-stream" */
+static int transport_eventsource_stream(ape_socket *client)
+{
+	http_state *http = client->parser.data;
+	char *accept;
+
+	if (http == NULL || (accept = get_header_line(http->hlines, "Accept")) == NULL) {
+		return 0;
+	}
+
+	return (strstr(accept, "text/event-stream") != NULL);
+}
+
+/* The WebSocket "client" is shared by several sessions ("ape.mux"), NULL otherwise */
+websocket_state *transport_mux(ape_socket *client)
+{
+	websocket_state *websocket;
+
+	if (client == NULL || client->parser.parser_func != process_websocket) {
+		return NULL;
+	}
+	websocket = client->parser.data;
+
+	return (websocket->mux.enabled ? websocket : NULL);
+}
+
+struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_socket *client, transport_t transport, acetables *g_ape)
 {
 	struct _transport_open_same_host_p ret;
+	ape_socket *current = sock_from_handle(sub->client, g_ape);
+	
+	/* A reconnecting EventSource replaces its previous stream, commands are sent through other requests */
+	if (transport == TRANSPORT_EVENTSOURCE && transport_eventsource_stream(client)) {
+		transport = TRANSPORT_LONGPOLLING;
+	}
 	
 	switch(transport) {
 		case TRANSPORT_LONGPOLLING:
@@ -33,7 +69,7 @@ struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_so
 		case TRANSPORT_WEBSOCKET:
 		case TRANSPORT_WEBSOCKET_IETF:
 		default:
-			ret.client_close = sub->client;
+			ret.client_close = current;
 			ret.client_listener = client;
 			ret.substate = ADIED;
 			ret.attach = 1;
@@ -41,13 +77,20 @@ struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_so
 		case TRANSPORT_PERSISTANT:
 		case TRANSPORT_XHRSTREAMING:
 		case TRANSPORT_SSE_LONGPOLLING:
+		case TRANSPORT_EVENTSOURCE:
+		case TRANSPORT_CHUNKED:
 			ret.client_close = client;
-			ret.client_listener = sub->client;
+			ret.client_listener = current;
 			ret.substate = ALIVE;
 			ret.attach = 0;
 			break;
 	}
 	
+	/* The other sessions of a shared WebSocket keep it */
+	if (ret.client_close != NULL && transport_mux(ret.client_close) != NULL) {
+		ret.client_close = NULL;
+	}
+	
 	return ret;
 }
 
@@ -64,6 +107,13 @@ void transport_data_completly_sent(subuser *sub, transport_t transport, acetable
 		case TRANSPORT_SSE_LONGPOLLING:
 		case TRANSPORT_WEBSOCKET:
 		case TRANSPORT_WEBSOCKET_IETF:
+		case TRANSPORT_EVENTSOURCE:
+			break;
+		case TRANSPORT_CHUNKED:
+			/* The last chunk was sent : the client opens a new response */
+			if (sub->stream.length >= g_ape->transports.chunked.budget) {
+				do_died(sub, g_ape);
+			}
 			break;
 	}	
 }
@@ -85,10 +135,179 @@ struct _transport_properties *transport_get_properties(transport_t transport, ac
 			return &(g_ape->transports.websocket.properties);
 	    case TRANSPORT_WEBSOCKET_IETF:
 	        return &(g_ape->transports.websocket_ietf.properties);
+		case TRANSPORT_EVENTSOURCE:
+			return &(g_ape->transports.eventsource.properties);
+		case TRANSPORT_CHUNKED:
+			return &(g_ape->transports.chunked.properties);
 	}	
 	return NULL;
 }
 
+/*
+	Keep a raw sent on the EventSource stream of "sub" (current event id),
+	the oldest one is dropped when the history is full
+*/
+void transport_eventsource_keep(subuser *sub, RAW *raw, acetables *g_ape)
+{
+	struct _eventsource_event *event;
+	int size = g_ape->transports.eventsource.history;
+
+	if (size <= 0) {
+		return;
+	}
+	if (sub->eventsource.history == NULL) {
+		sub->eventsource.history = xmalloc(sizeof(*sub->eventsource.history) * size);
+	}
+	if (sub->eventsource.count == size) {
+		event = &sub->eventsource.history[sub->eventsource.head];
+		free_raw(event->raw);
+		sub->eventsource.head = (sub->eventsource.head + 1) % size;
+		sub->eventsource.count--;
+	}
+	event = &sub->eventsource.history[(sub->eventsource.head + sub->eventsource.count) % size];
+
+	/* Raws posted to a single subuser aren't counted */
+	if (raw->refcount == 0) {
+		raw->refcount = 1;
+	}
+	event->raw = copy_raw_z(raw);
+	event->id = sub->eventsource.id;
+
+	sub->eventsource.count++;
+}
+
+void transport_eventsource_free(subuser *sub, acetables *g_ape)
+{
+	while (sub->eventsource.count > 0) {
+		free_raw(sub->eventsource.history[sub->eventsource.head].raw);
+		sub->eventsource.head = (sub->eventsource.head + 1) % g_ape->transports.eventsource.history;
+		sub->eventsource.count--;
+	}
+	free(sub->eventsource.history);
+	sub->eventsource.history = NULL;
+	sub->eventsource.head = 0;
+}
+
+/* Heartbeat on the idle EventSource and chunked streams : proxies close silent connections */
+static void transport_stream_heartbeat(acetables *g_ape, int *last)
+{
+	USERS *user;
+	subuser *sub;
+	int heartbeat;
+
+	for (user = g_ape->uHead; user != NULL; user = user->next) {
+		switch(user->transport) {
+			case TRANSPORT_EVENTSOURCE:
+				heartbeat = g_ape->transports.eventsource.heartbeat;
+				break;
+			case TRANSPORT_CHUNKED:
+				heartbeat = g_ape->transports.chunked.heartbeat;
+				break;
+			default:
+				continue;
+		}
+		for (sub = user->subuser; sub != NULL; sub = sub->next) {
+			if (sub->state == ALIVE && sub->headers.sent && !sub->burn_after_writing &&
+				ape_clock.sec - sub->stream.last >= heartbeat) {
+
+				send_raws_heartbeat(sub, g_ape);
+			}
+		}
+	}
+}
+
+/* Pinged by transport_websocket_ping() (IETF protocols only) */
+void transport_websocket_watch(ape_socket *co, acetables *g_ape)
+{
+	websocket_state *websocket = co->parser.data;
+
+	if (g_ape->transports.websocket_ietf.ping <= 0 || (websocket->version != WS_IETF_06 && websocket->version != WS_IETF_07)) {
+		return;
+	}
+	if (g_ape->transports.websocket_ietf.nsockets == g_ape->transports.websocket_ietf.size) {
+		g_ape->transports.websocket_ietf.size = (g_ape->transports.websocket_ietf.size ? g_ape->transports.websocket_ietf.size * 2 : 32);
+		g_ape->transports.websocket_ietf.sockets = xrealloc(g_ape->transports.websocket_ietf.sockets, sizeof(ape_sock_handle) * g_ape->transports.websocket_ietf.size);
+	}
+	g_ape->transports.websocket_ietf.sockets[g_ape->transports.websocket_ietf.nsockets++] = sock_handle(co);
+}
+
+/*
+	The subusers of a dead WebSocket peer expire WebSocket.pong_timeout seconds
+	later instead of TIMEOUT_SEC, unless the client reconnects in the meantime :
+	raws stop being queued for them.
+*/
+static void transport_websocket_reclaim(ape_socket *co, acetables *g_ape)
+{
+	time_t expire = ape_clock.sec - TIMEOUT_SEC + g_ape->transports.websocket_ietf.pong_timeout;
+	subuser *sub = co->attach;
+
+	if (transport_mux(co) == NULL) {
+		if (sub != NULL && SOCK_HANDLE_IS(sub->client, co) && sub->idle > expire) {
+			sub->idle = expire;
+		}
+		return;
+	}
+	/* The sessions of a shared connection are found by the next check_timeout() walk */
+	if (g_ape->transports.websocket_ietf.ndead == g_ape->transports.websocket_ietf.dead_size) {
+		g_ape->transports.websocket_ietf.dead_size = (g_ape->transports.websocket_ietf.dead_size ? g_ape->transports.websocket_ietf.dead_size * 2 : 8);
+		g_ape->transports.websocket_ietf.dead = xrealloc(g_ape->transports.websocket_ietf.dead, sizeof(ape_sock_handle) * g_ape->transports.websocket_ietf.dead_size);
+	}
+	g_ape->transports.websocket_ietf.dead[g_ape->transports.websocket_ietf.ndead++] = sock_handle(co);
+}
+
+/* Called by check_timeout() on each subuser while shared connections are waiting to be reclaimed */
+void transport_websocket_expire(subuser *sub, acetables *g_ape)
+{
+	time_t expire = ape_clock.sec - TIMEOUT_SEC + g_ape->transports.websocket_ietf.pong_timeout;
+	int i;
+
+	for (i = 0; i < g_ape->transports.websocket_ietf.ndead; i++) {
+		ape_sock_handle dead = g_ape->transports.websocket_ietf.dead[i];
+
+		if (sub->client.fd == dead.fd && sub->client.gen == dead.gen && sub->idle > expire) {
+			sub->idle = expire;
+		}
+	}
+}
+
+/* Ping the silent WebSocket connections (IETF protocols), close those which don't answer */
+static void transport_websocket_ping(acetables *g_ape, int *last)
+{
+	/* Not an empty payload : the pong is a frame of the same length */
+	char ping[2 + sizeof(WEBSOCKET_PING_PAYLOAD) - 1] = {0x89, sizeof(WEBSOCKET_PING_PAYLOAD) - 1};
+	int i;
+
+	memcpy(&ping[2], WEBSOCKET_PING_PAYLOAD, sizeof(WEBSOCKET_PING_PAYLOAD) - 1);
+
+	/* Only the connections listed by transport_websocket_watch() */
+	for (i = 0; i < g_ape->transports.websocket_ietf.nsockets; i++) {
+		ape_socket *co = sock_from_handle(g_ape->transports.websocket_ietf.sockets[i], g_ape);
+		websocket_state *websocket;
+
+		if (co == NULL || co->parser.parser_func != process_websocket) {
+			/* Closed since */
+			g_ape->transports.websocket_ietf.sockets[i--] = g_ape->transports.websocket_ietf.sockets[--g_ape->transports.websocket_ietf.nsockets];
+			continue;
+		}
+		websocket = co->parser.data;
+
+		if (websocket->error) {
+			continue;
+		}
+		if (websocket->ping.sent) {
+			if (ape_clock.sec - websocket->ping.sent >= g_ape->transports.websocket_ietf.pong_timeout) {
+				websocket->error = 1;
+				transport_websocket_reclaim(co, g_ape);
+				shutdown(co->fd, 2);
+			}
+		} else if (ape_clock.sec - websocket->ping.last >= g_ape->transports.websocket_ietf.ping) {
+			ping[0] = (websocket->version == WS_IETF_06 ? 0x82 : 0x89);
+			sendbin(co->fd, ping, sizeof(ping), 0, g_ape);
+			websocket->ping.sent = ape_clock.sec;
+		}
+	}
+}
+
 void transport_start(acetables *g_ape)
 {
 	char *eval_func = CONFIG_VAL(JSONP, eval_func, g_ape->srv);
@@ -131,6 +350,61 @@ void transport_start(acetables *g_ape)
 	g_ape->transports.websocket_ietf.properties.padding.right.val = NULL;
 	g_ape->transports.websocket_ietf.properties.padding.right.len = 0;		
 	
+	/* "id: n\n" comes first (see send_raws()) */
+	g_ape->transports.eventsource.properties.padding.left.val = xstrdup("data: ");
+	g_ape->transports.eventsource.properties.padding.left.len = 6;
+	
+	g_ape->transports.eventsource.properties.padding.right.val = xstrdup("\n\n");
+	g_ape->transports.eventsource.properties.padding.right.len = 2;
+	
+	g_ape->transports.eventsource.heartbeat = atoi(CONFIG_VAL(EventSource, heartbeat, g_ape->srv));
+	g_ape->transports.eventsource.retry = atoi(CONFIG_VAL(EventSource, retry, g_ape->srv));
+	
+	if (*CONFIG_VAL(EventSource, history, g_ape->srv) != '\0') {
+		g_ape->transports.eventsource.history = atoi(CONFIG_VAL(EventSource, history, g_ape->srv));
+	} else {
+		g_ape->transports.eventsource.history = EVENTSOURCE_HISTORY;
+	}
+	if (g_ape->transports.eventsource.heartbeat <= 0) {
+		g_ape->transports.eventsource.heartbeat = EVENTSOURCE_HEARTBEAT;
+	}
+	
+	/* One JSON array per line, no padding : each send_raws() is a chunk */
+	g_ape->transports.chunked.properties.padding.left.val = NULL;
+	g_ape->transports.chunked.properties.padding.left.len = 0;
+	
+	g_ape->transports.chunked.properties.padding.right.val = xstrdup("\n");
+	g_ape->transports.chunked.properties.padding.right.len = 1;
+	
+	if ((g_ape->transports.chunked.heartbeat = atoi(CONFIG_VAL(Chunked, heartbeat, g_ape->srv))) <= 0) {
+		g_ape->transports.chunked.heartbeat = CHUNKED_HEARTBEAT;
+	}
+	if (atoi(CONFIG_VAL(Chunked, budget, g_ape->srv)) > 0) {
+		g_ape->transports.chunked.budget = atoi(CONFIG_VAL(Chunked, budget, g_ape->srv));
+	} else {
+		g_ape->transports.chunked.budget = CHUNKED_BUDGET;
+	}
+	
+	add_periodical(1000, 0, transport_stream_heartbeat, g_ape, g_ape);
+	
+	if (*CONFIG_VAL(WebSocket, ping, g_ape->srv) != '\0') {
+		g_ape->transports.websocket_ietf.ping = atoi(CONFIG_VAL(WebSocket, ping, g_ape->srv));
+	} else {
+		g_ape->transports.websocket_ietf.ping = WEBSOCKET_PING;
+	}
+	if ((g_ape->transports.websocket_ietf.pong_timeout = atoi(CONFIG_VAL(WebSocket, pong_timeout, g_ape->srv))) <= 0) {
+		g_ape->transports.websocket_ietf.pong_timeout = WEBSOCKET_PONG_TIMEOUT;
+	}
+	g_ape->transports.websocket_ietf.sockets = NULL;
+	g_ape->transports.websocket_ietf.nsockets = 0;
+	g_ape->transports.websocket_ietf.size = 0;
+	g_ape->transports.websocket_ietf.dead = NULL;
+	g_ape->transports.websocket_ietf.ndead = 0;
+	g_ape->transports.websocket_ietf.dead_size = 0;
+	if (g_ape->transports.websocket_ietf.ping > 0) {
+		add_periodical(1000, 0, transport_websocket_ping, g_ape, g_ape);
+	}
+	
 }
 
 void transport_free(acetables *g_ape)
@@ -140,6 +414,11 @@ void transport_free(acetables *g_ape)
 	free(g_ape->transports.sse.properties.padding.right.val);
 	free(g_ape->transports.sse.properties.padding.left.val);
 	free(g_ape->transports.xhrstreaming.properties.padding.right.val);
+	free(g_ape->transports.eventsource.properties.padding.right.val);
+	free(g_ape->transports.eventsource.properties.padding.left.val);
+	free(g_ape->transports.chunked.properties.padding.right.val);
+	free(g_ape->transports.websocket_ietf.sockets);
+	free(g_ape->transports.websocket_ietf.dead);
 
 	if (g_ape->transports.jsonp.properties.padding.left.val != NULL) {
 		free(g_ape->transports.jsonp.properties.padding.left.val);
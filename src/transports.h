@@ -41,14 +41,32 @@ typedef enum {
 	TRANSPORT_SSE_LONGPOLLING,
 	TRANSPORT_SSE_JSONP,
     TRANSPORT_WEBSOCKET,
-    TRANSPORT_WEBSOCKET_IETF
+    TRANSPORT_WEBSOCKET_IETF,
+	TRANSPORT_EVENTSOURCE,
+	TRANSPORT_CHUNKED
 } transport_t;
 
 
-struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_socket *client, transport_t transport);
+#define EVENTSOURCE_HEARTBEAT 15 // Default EventSource.heartbeat (seconds)
+#define EVENTSOURCE_HISTORY 64 // Default EventSource.history
+
+#define CHUNKED_HEARTBEAT 15 // Default Chunked.heartbeat (seconds)
+#define CHUNKED_BUDGET 1048576 // Default Chunked.budget (bytes)
+
+#define WEBSOCKET_PING 20 // Default WebSocket.ping (seconds)
+#define WEBSOCKET_PONG_TIMEOUT 10 // Default WebSocket.pong_timeout (seconds)
+#define WEBSOCKET_PING_PAYLOAD "ape"
+
+websocket_state *transport_mux(ape_socket *client);
+void transport_websocket_watch(ape_socket *co, acetables *g_ape);
+void transport_websocket_expire(subuser *sub, acetables *g_ape);
+struct _transport_open_same_host_p transport_open_same_host(subuser *sub, ape_socket *client, transport_t transport, acetables *g_ape);
 void transport_data_completly_sent(subuser *sub, transport_t transport, acetables *g_ape);
 void transport_start(acetables *g_ape);
 void transport_free(acetables *g_ape);
 struct _transport_properties *transport_get_properties(transport_t transport, acetables *g_ape);
 
+void transport_eventsource_keep(subuser *sub, struct RAW *raw, acetables *g_ape);
+void transport_eventsource_free(subuser *sub, acetables *g_ape);
+
 #endif
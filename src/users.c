@@ -35,6 +35,8 @@
 #include "plugins.h"
 #include "pipe.h"
 #include "raw.h"
+#include "ticks.h"
+#include "pool.h"
 
 #include "utils.h"
 #include "transports.h"
@@ -115,9 +117,9 @@ USERS *init_user(acetables *g_ape)
 {
 	USERS *nuser;
 	
-	nuser = xmalloc(sizeof(*nuser));
+	nuser = pool_alloc(&g_ape->pools->users);
 
-	nuser->idle = time(NULL);
+	nuser->idle = ape_clock.sec;
 	nuser->next = g_ape->uHead;
 	nuser->prev = NULL;
 	nuser->nraw = 0;
@@ -219,26 +221,49 @@ void deluser(USERS *user, acetables *g_ape)
 	destroy_pipe(user->pipe, g_ape);
 	
 	/* TODO Add Event */
-	free(user);
+	pool_free(&g_ape->pools->users, user);
 
 }
 
 void do_died(subuser *sub, acetables *g_ape)
 {
+	ape_socket *client;
+	
 	if (sub->state == ALIVE) {
 		sub->state = ADIED;
 		sub->headers.sent = 0;
 		http_headers_free(sub->headers.content);
 		sub->headers.content = NULL;
 		
-		safe_shutdown(sub->client->fd, g_ape);
+		if ((client = sock_from_handle(sub->client, g_ape)) != NULL) {
+			safe_shutdown(client->fd, g_ape);
+		}
+	}
+}
+
+/* Send the raws queued for "sub", they stay queued while its connection is congested (see ape_drain()) */
+void flush_raws(subuser *sub, acetables *g_ape)
+{
+	ape_socket *client = sock_from_handle(sub->client, g_ape);
+
+	if (client == NULL) {
+		/* Connection is gone, raws are kept for the next one */
+		sub->state = ADIED;
+	} else if (!sock_writable(client->fd, g_ape)) {
+		return;
+	} else if (send_raws(sub, g_ape)) {
+		/* Data completetly sent => closed */
+		transport_data_completly_sent(sub, sub->user->transport, g_ape); // todo : hook
+	} else if (transport_mux(client) == NULL) {
+		/* ape_sent() resumes the subuser attached to the socket, a shared one just queues */
+		sub->burn_after_writing = 1;
 	}
 }
 
 void check_timeout(acetables *g_ape, int *last)
 {
 	USERS *list, *wait;
-	long int ctime = time(NULL);
+	long int ctime = ape_clock.sec;
 	
 	list = g_ape->uHead;
 	
@@ -251,19 +276,15 @@ void check_timeout(acetables *g_ape, int *last)
 		} else if (list->type == HUMAN) {
 			subuser **n = &(list->subuser);
 			while (*n != NULL) {
+				if (g_ape->transports.websocket_ietf.ndead) {
+					transport_websocket_expire(*n, g_ape);
+				}
 				if ((ctime - (*n)->idle) >= TIMEOUT_SEC) {
 					delsubuser(n, g_ape);
 					continue;
 				}
 				if ((*n)->state == ALIVE && (*n)->raw_pools.nraw && !(*n)->need_update && !(*n)->burn_after_writing) {
-
-					/* Data completetly sent => closed */
-					if (send_raws(*n, g_ape)) {
-						transport_data_completly_sent(*n, (*n)->user->transport, g_ape); // todo : hook
-					} else {
-
-						(*n)->burn_after_writing = 1;
-					}
+					flush_raws(*n, g_ape);
 				} else {
 					FIRE_EVENT_NONSTOP(tickuser, *n, g_ape);
 				}
@@ -273,7 +294,8 @@ void check_timeout(acetables *g_ape, int *last)
 		
 		list = wait;
 	}
-
+	/* Dead shared connections have been reclaimed */
+	g_ape->transports.websocket_ietf.ndead = 0;
 }
 
 void send_error(USERS *user, const char *msg, const char *code, acetables *g_ape)
@@ -433,8 +455,8 @@ subuser *addsubuser(ape_socket *client, const char *channel, USERS *user, acetab
 		return NULL;
 	}
 
-	sub = xmalloc(sizeof(*sub));
-	sub->client = client;
+	sub = pool_alloc(&g_ape->pools->subusers);
+	sub->client = sock_handle(client);
 	sub->state = ADIED;
 	sub->user = user;
 	
@@ -442,16 +464,27 @@ subuser *addsubuser(ape_socket *client, const char *channel, USERS *user, acetab
 	sub->next = user->subuser;
 	
 	sub->nraw = 0;
-	sub->wait_for_free = 0;
 	
 	sub->properties = NULL;
 	
 	sub->headers.sent = 0;
+	sub->headers.gzip = 0;
 	sub->headers.content = NULL;
+
+	sub->stream.last = 0;
+	sub->stream.length = 0;
+	sub->stream.crc = 0;
+	sub->stream.size = 0;
+	
+	sub->eventsource.id = 0;
+	sub->eventsource.history = NULL;
+	sub->eventsource.head = 0;
+	sub->eventsource.count = 0;
 	
 	sub->burn_after_writing = 0;
+	sub->tag = 0;
 	
-	sub->idle = time(NULL);
+	sub->idle = ape_clock.sec;
 	sub->need_update = 0;
 	sub->current_chl = 0;
 
@@ -461,14 +494,14 @@ subuser *addsubuser(ape_socket *client, const char *channel, USERS *user, acetab
 	
 	/* Low priority raws */
 	sub->raw_pools.low.nraw = 0;
-	sub->raw_pools.low.size = 32;
-	sub->raw_pools.low.rawhead = init_raw_pool(sub->raw_pools.low.size);
+	sub->raw_pools.low.size = RAW_POOL_LOW;
+	sub->raw_pools.low.rawhead = init_raw_pool(sub->raw_pools.low.size, g_ape);
 	sub->raw_pools.low.rawfoot = sub->raw_pools.low.rawhead;
 	
 	/* High priority raws */
 	sub->raw_pools.high.nraw = 0;
-	sub->raw_pools.high.size = 8;
-	sub->raw_pools.high.rawhead = init_raw_pool(sub->raw_pools.high.size);
+	sub->raw_pools.high.size = RAW_POOL_HIGH;
+	sub->raw_pools.high.rawhead = init_raw_pool(sub->raw_pools.high.size, g_ape);
 	sub->raw_pools.high.rawfoot = sub->raw_pools.high.rawhead;
 	
 	(user->nsub)++;
@@ -500,7 +533,6 @@ void subuser_restor(subuser *sub, acetables *g_ape)
 	json_item *jlist;
 	RAW *newraw;
 	USERS *user = sub->user;
-	userslist *ulist;
 
 	chanl = user->chan_foot;
 
@@ -510,28 +542,9 @@ void subuser_restor(subuser *sub, acetables *g_ape)
 		chan = chanl->chaninfo;
 		
 		if (!(chan->flags & CHANNEL_NONINTERACTIVE) && chan->head != NULL) {
-			json_item *user_list = json_new_array();
-			
-			ulist = chan->head;
-			
-			while (ulist != NULL) {
-	
-				json_item *juser = get_json_object_user(ulist->userinfo);
-		
-				if (ulist->userinfo != user) {
-					//make_link(user, ulist->userinfo);
-				}
-				
-				json_set_property_intN(juser, "level", 5, ulist->level);
-				
-				json_set_element_obj(user_list, juser);
-
-				ulist = ulist->next;
-			}
-			
-			json_set_property_objN(jlist, "users", 5, user_list);
+			set_members_page(jlist, chan, 0, g_ape);
 		}
-		json_set_property_objN(jlist, "pipe", 4, get_json_object_channel(chan));
+		json_set_property_objN(jlist, "pipe", 4, get_json_object_channel_cache(chan));
 
 		newraw = forge_raw(RAW_CHANNEL, jlist);
 		newraw->priority = RAW_PRI_HI;
@@ -540,7 +553,7 @@ void subuser_restor(subuser *sub, acetables *g_ape)
 	}
 
 	jlist = json_new_object();
-	json_set_property_objN(jlist, "user", 4, get_json_object_user(user));	
+	json_set_property_objN(jlist, "user", 4, get_json_object_user_cache(user));	
 	
 	newraw = forge_raw("IDENT", jlist);
 	newraw->priority = RAW_PRI_HI;
@@ -566,25 +579,29 @@ subuser *getsubuser(USERS *user, const char *channel)
 void delsubuser(subuser **current, acetables *g_ape)
 {
 	subuser *del = *current;
+	ape_socket *client;
 	
 	FIRE_EVENT_NONSTOP(delsubuser, del, g_ape);
 	((*current)->user->nsub)--;
 	
 	*current = (*current)->next;	
 	
-	destroy_raw_pool(del->raw_pools.low.rawhead);
-	destroy_raw_pool(del->raw_pools.high.rawhead);
+	destroy_raw_pool(del->raw_pools.low.rawhead, g_ape);
+	destroy_raw_pool(del->raw_pools.high.rawhead, g_ape);
+	
+	transport_eventsource_free(del, g_ape);
 	
 	clear_properties(&del->properties);
 	
 	del->user = NULL;
-
-	if (del->state == ALIVE) {
-		del->wait_for_free = 1;
-		do_died(del, g_ape);
-	} else {
-		free(del);
+	
+	/* The connection may outlive the subuser */
+	if ((client = sock_from_handle(del->client, g_ape)) != NULL && client->attach == del) {
+		client->attach = NULL;
 	}
+	do_died(del, g_ape);
+	
+	pool_free(&g_ape->pools->subusers, del);
 	
 }
 
@@ -724,3 +741,12 @@ json_item *get_json_object_user(USERS *user)
 	return jstr;
 }
 
+json_item *get_json_object_user_cache(USERS *user)
+{
+	if (user == NULL) {
+		return get_json_object_user(NULL);
+	}
+	
+	return get_json_object_pipe_cache(user->pipe);
+}
+
@@ -47,7 +47,7 @@ struct _raw_pool {
 	struct RAW *raw;
 	struct _raw_pool *next;
 	struct _raw_pool *prev;
-	int start;
+	int start; /* first entry of a chunk : number of entries of the chunk, 0 otherwise */
 };
 
 typedef struct USERS
@@ -87,6 +87,12 @@ typedef struct USERS
 } USERS;
 
 
+/* Raw sent on an EventSource stream, replayed to a client reconnecting with an older Last-Event-ID */
+struct _eventsource_event {
+	struct RAW *raw;
+	unsigned int id;
+};
+
 struct _raw_pool_user {
 	int nraw;
 	int size;
@@ -107,20 +113,35 @@ struct _subuser
 	struct {
 		struct _http_headers_response *content;
 		int sent;
+		int gzip; /* The body is gzip'ed (Compression.http) */
 	} headers;
 
+	struct {
+		time_t last; /* last write (heartbeat) */
+		unsigned int length; /* bytes sent on the current response (Chunked.budget) */
+		unsigned long crc; /* gzip trailer of the current response */
+		unsigned int size;
+	} stream;
+
+	struct {
+		unsigned int id; /* last event id */
+		struct _eventsource_event *history; /* ring of EventSource.history raws */
+		int head;
+		int count;
+	} eventsource;
+
 	struct _extend *properties;
 	struct _subuser *next;
-	ape_socket *client;
+	ape_sock_handle client; /* sock_from_handle() */
 	USERS *user;
 	time_t idle;
 
 	int state;
 	int need_update;
-	int wait_for_free;
 	int nraw;
 	int burn_after_writing;
 	int current_chl;
+	unsigned int tag; /* session tag on a shared WebSocket ("ape.mux") */
 	char channel[MAX_HOST_LENGTH+1];
 };
 
@@ -154,6 +175,8 @@ typedef struct userslist
 	struct userslist *next;
 
 	unsigned int level;
+	/* Join order on the channel, used as a cursor by MEMBERS */
+	unsigned long seq;
 	/* TODO: it can be interesting to extend this */
 } userslist;
 
@@ -202,6 +225,7 @@ enum {
 #define RAW_USER 		"USER"
 #define RAW_ERR 		"ERR"
 #define RAW_CHANNEL		"CHANNEL"
+#define RAW_MEMBERS		"MEMBERS"
 #define RAW_KICK		"KICKED"
 #define RAW_BAN			"BANNED"
 #define RAW_PROXY		"PROXY"
@@ -218,6 +242,7 @@ void deluser(USERS *user, acetables *g_ape);
 
 void do_died(subuser *user, acetables *g_ape);
 
+void flush_raws(subuser *sub, acetables *g_ape);
 void check_timeout(acetables *g_ape, int *last);
 void grant_aceop(USERS *user);
 
@@ -229,6 +254,7 @@ void send_msg_channel(struct CHANNEL *chan, const char *msg, const char *type, a
 unsigned int isonchannel(USERS *user, struct CHANNEL *chan);
 
 json_item *get_json_object_user(USERS *user);
+json_item *get_json_object_user_cache(USERS *user);
 
 session *get_session(USERS *user, const char *key);
 session *set_session(USERS *user, const char *key, const char *val, int update, acetables *g_ape);
@@ -261,4 +261,19 @@ int urldecode(char *string)
 	return 1;
 }
 
+/* Is data the (non empty) secret ? Same time whatever the number of matching bytes */
+int secret_equal(const char *secret, const char *data, unsigned int len)
+{
+	unsigned int i, slen = strlen(secret);
+	unsigned char diff = (len != slen);
+
+	if (slen == 0) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		diff |= (unsigned char)data[i] ^ (unsigned char)secret[i % slen];
+	}
+
+	return (diff == 0);
+}
 
@@ -41,6 +41,7 @@ int urldecode(char *string);
 int rand_n(int n);
 void s_tolower(char *upper, unsigned int len);
 char *get_path(const char *full_path);
+int secret_equal(const char *secret, const char *data, unsigned int len);
 
 /* CONST_STR_LEN from lighttpd */
 #define CONST_STR_LEN(x) x, x ? sizeof(x) - 1 : 0